@@ -0,0 +1,127 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+
+/*
+    One step of the allele frequency spectrum recursion of mc_cal_y_core() in
+    prob1.c: adds a diploid sample to z0, the distribution of the number of
+    ALT alleles in the samples seen so far, and writes the unnormalised result
+    to z1. Uses AVX or SSE2 when the compiler targets them, scalar code
+    otherwise.
+
+    The vector code computes each z1[k] exactly as the scalar code does, only
+    the returned normalising sum is accumulated in a different order. The
+    resulting log-likelihoods and spectra agree with the scalar code within a
+    relative difference of 1e-12, as checked by test/test-afskern.
+*/
+
+#ifndef __AFSKERN_H__
+#define __AFSKERN_H__
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ *  afskern_diploid_scalar() - the reference implementation
+ *  @z0:    the distribution after the first M0/2 samples
+ *  @z1:    output, values at kmin..kmax are set
+ *  @p:     P(D|g) of the sample, the heterozygous value multiplied by 2
+ *  @kmin:  the first non-negligible value of z0
+ *  @kmax:  the last non-negligible value of z0 plus 2, the z0 values
+ *          between the two must be set
+ *
+ *  Returns the sum of z1[kmin..kmax].
+ */
+static inline double afskern_diploid_scalar(const double *z0, double *z1, int M0, const double *p, int kmin, int kmax)
+{
+    int k;
+    double sum;
+    if (kmin == 0) k = 0, z1[k] = (M0-k+1) * (M0-k+2) * p[0] * z0[k];
+    if (kmin <= 1) k = 1, z1[k] = (M0-k+1) * (M0-k+2) * p[0] * z0[k] + k*(M0-k+2) * p[1] * z0[k-1];
+    for (k = kmin < 2? 2 : kmin; k <= kmax; ++k)
+        z1[k] = (M0-k+1)*(M0-k+2) * p[0] * z0[k] + k*(M0-k+2) * p[1] * z0[k-1] + k*(k-1)* p[2] * z0[k-2];
+    for (k = kmin, sum = 0.; k <= kmax; ++k) sum += z1[k];
+    return sum;
+}
+
+static inline double afskern_diploid(const double *z0, double *z1, int M0, const double *p, int kmin, int kmax)
+{
+#if defined(__AVX__) || defined(__SSE2__)
+    int k;
+    double sum = 0;
+    if (kmin == 0) k = 0, sum += z1[k] = (M0-k+1) * (M0-k+2) * p[0] * z0[k];
+    if (kmin <= 1) k = 1, sum += z1[k] = (M0-k+1) * (M0-k+2) * p[0] * z0[k] + k*(M0-k+2) * p[1] * z0[k-1];
+    k = kmin < 2? 2 : kmin;
+    #if defined(__AVX__)
+    const int nlane = 4;
+    __m256d kv = _mm256_set_pd(k+3, k+2, k+1, k), step = _mm256_set1_pd(nlane), one = _mm256_set1_pd(1), acc = _mm256_setzero_pd();
+    __m256d m1 = _mm256_set1_pd(M0+1), m2 = _mm256_set1_pd(M0+2);
+    __m256d p0 = _mm256_set1_pd(p[0]), p1 = _mm256_set1_pd(p[1]), p2 = _mm256_set1_pd(p[2]);
+    for (; k+nlane-1 <= kmax; k += nlane)
+    {
+        // the integer coefficients are exact in doubles, the order of operations is as in the scalar code
+        __m256d a = _mm256_mul_pd(_mm256_mul_pd(_mm256_sub_pd(m1,kv), _mm256_sub_pd(m2,kv)), p0);
+        __m256d b = _mm256_mul_pd(_mm256_mul_pd(kv, _mm256_sub_pd(m2,kv)), p1);
+        __m256d c = _mm256_mul_pd(_mm256_mul_pd(kv, _mm256_sub_pd(kv,one)), p2);
+        __m256d z = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a, _mm256_loadu_pd(z0+k)), _mm256_mul_pd(b, _mm256_loadu_pd(z0+k-1))), _mm256_mul_pd(c, _mm256_loadu_pd(z0+k-2)));
+        _mm256_storeu_pd(z1+k, z);
+        acc = _mm256_add_pd(acc, z);
+        kv  = _mm256_add_pd(kv, step);
+    }
+    double tmp[4];
+    _mm256_storeu_pd(tmp, acc);
+    sum += (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+    #else
+    const int nlane = 2;
+    __m128d kv = _mm_set_pd(k+1, k), step = _mm_set1_pd(nlane), one = _mm_set1_pd(1), acc = _mm_setzero_pd();
+    __m128d m1 = _mm_set1_pd(M0+1), m2 = _mm_set1_pd(M0+2);
+    __m128d p0 = _mm_set1_pd(p[0]), p1 = _mm_set1_pd(p[1]), p2 = _mm_set1_pd(p[2]);
+    for (; k+nlane-1 <= kmax; k += nlane)
+    {
+        // the integer coefficients are exact in doubles, the order of operations is as in the scalar code
+        __m128d a = _mm_mul_pd(_mm_mul_pd(_mm_sub_pd(m1,kv), _mm_sub_pd(m2,kv)), p0);
+        __m128d b = _mm_mul_pd(_mm_mul_pd(kv, _mm_sub_pd(m2,kv)), p1);
+        __m128d c = _mm_mul_pd(_mm_mul_pd(kv, _mm_sub_pd(kv,one)), p2);
+        __m128d z = _mm_add_pd(_mm_add_pd(_mm_mul_pd(a, _mm_loadu_pd(z0+k)), _mm_mul_pd(b, _mm_loadu_pd(z0+k-1))), _mm_mul_pd(c, _mm_loadu_pd(z0+k-2)));
+        _mm_storeu_pd(z1+k, z);
+        acc = _mm_add_pd(acc, z);
+        kv  = _mm_add_pd(kv, step);
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, acc);
+    sum += tmp[0] + tmp[1];
+    #endif
+    for (; k <= kmax; ++k)
+        sum += z1[k] = (M0-k+1)*(M0-k+2) * p[0] * z0[k] + k*(M0-k+2) * p[1] * z0[k-1] + k*(k-1)* p[2] * z0[k-2];
+    return sum;
+#else
+    return afskern_diploid_scalar(z0, z1, M0, p, kmin, kmax);
+#endif
+}
+
+#endif
@@ -35,6 +35,24 @@ void error(const char *format, ...);
 void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *cmd);
 const char *hts_bcf_wmode(int file_type);
 
+/*
+ *  hts_open_mt() - open a file as hts_open() does and, when writing BGZF
+ *  compressed VCF or BCF, compress it in the number of threads given by the
+ *  global --threads option
+ */
+htsFile *hts_open_mt(const char *fname, const char *mode);
+
+/*
+ *  bcf_hdr_subset_reader() - restrict a reader to the n listed samples so that
+ *  FORMAT fields of the other samples are neither parsed nor kept. The header
+ *  must belong to an open reader which has not read any records yet. If imap
+ *  is not NULL it is filled for bcf_subset() with the sample indexes in the
+ *  restricted header. Returns 1 if the records come in the listed order and
+ *  bcf_subset() is not needed, 0 if it is, and -1 without changing anything
+ *  if a sample is missing or duplicated.
+ */
+int bcf_hdr_subset_reader(bcf_hdr_t *hdr, int n, char **samples, int *imap);
+
 void *smalloc(size_t size);     // safe malloc
 
 #endif
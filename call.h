@@ -36,6 +36,14 @@
 #define CALL_CONSTR_ALLELES (1<<3)
 #define CALL_CHR_X          (1<<4)
 #define CALL_CHR_Y          (1<<5)
+#define CALL_TIMING         (1<<6)
+
+// Stages of mcall() timed with CALL_TIMING
+#define MCALL_T_PDG     0   // reading PLs and QS, conversion to P(D|G)
+#define MCALL_T_ALLELES 1   // selection of the most likely alleles
+#define MCALL_T_GTS     2   // genotype calling
+#define MCALL_T_TRIM    3   // trimming of PLs to the called alleles
+#define MCALL_NT        4
 
 #define FATHER 0
 #define MOTHER 1
@@ -48,7 +56,14 @@ typedef struct
 }
 family_t;
 
+typedef struct
+{
+    int type, beg, end;     // family type and the range in fam_order
+}
+fam_chunk_t;
+
 typedef struct _ccall_t ccall_t;
+typedef struct _mcall_pool_t mcall_pool_t;
 typedef struct
 {
     // mcall only
@@ -69,7 +84,21 @@ typedef struct
     int n_itmp;
     vcmp_t *vcmp;
     double trio_Pm_SNPs, trio_Pm_del, trio_Pm_ins;      // P(mendelian) for trio calling, see mcall_call_trio_genotypes()
+    double trio_lpen[9], trio_lpen_uc;  // log transmission penalties at the current site indexed by 2/Pkij, and of a non-mendelian trio
+    int *fam_order;         // families grouped by type
+    fam_chunk_t *fam_chunks;    // blocks of families of the same type evaluated together
+    int nfam_chunks;
+    int fam_chunk;          // families per chunk if smaller than FAM_CHUNK, for testing
+    int *fam_itr;           // the best trio genotype combination of each family
+    int trio_nthreads;      // evaluate the family chunks in this many threads
+    int smpl_nthreads;      // split the per-sample loops of large cohorts between this many threads
+    int smpl_chunk;         // samples per chunk and the minimum to split if set, SMPL_CHUNK and SMPL_PAR_MIN otherwise, for testing
+    mcall_pool_t *pool;     // threads of trio_nthreads and smpl_nthreads
     int32_t *ugts, *cgts;   // unconstraind and constrained GTs
+    double *lnorm;          // per-sample log of the P(D|G) normalization, HUGE_VAL with no data
+    double pl2lp[256];      // PL to log(10^(-PL/10)) table
+    double timing[MCALL_NT];    // seconds spent in each MCALL_T_* stage with CALL_TIMING
+    uint64_t nals_pruned;   // allele combinations skipped by mcall_find_best_alleles()
 
     // ccall only
     double indel_frac, theta, min_lrt, min_perm_p; 
@@ -114,6 +143,18 @@ void mcall_destroy(call_t *call);
 void ccall_destroy(call_t *call);
 void qcall_destroy(call_t *call);
 
+/*
+ *  *call_init_worker() - initialize a context for a worker thread from a fully
+ *      initialized master context. Read-only tables (pl2p, trio, fams, ploidy)
+ *      and the header are shared with the master, temporary arrays are private.
+ *      Must be destroyed with the corresponding *call_destroy_worker().
+ */
+void mcall_init_worker(call_t *dst, call_t *src);
+void ccall_init_worker(call_t *dst, call_t *src);
+
+void mcall_destroy_worker(call_t *call);
+void ccall_destroy_worker(call_t *call);
+
 void call_init_pl2p(call_t *call);
 uint32_t *call_trio_prep(int is_x, int is_son);
 
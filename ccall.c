@@ -71,6 +71,23 @@ void ccall_destroy(call_t *call)
     return; 
 }
 
+void ccall_init_worker(call_t *dst, call_t *src)
+{
+    // The header and ploidy are shared with the master context, the
+    // bcf_p1aux_t holds temporary arrays and must be private
+    *dst = *src;
+    dst->cdat = (ccall_t*) calloc(1,sizeof(ccall_t));
+    dst->cdat->p1 = bcf_p1_init(bcf_hdr_nsamples(dst->hdr), dst->ploidy);
+    dst->gts = (int*) calloc(bcf_hdr_nsamples(dst->hdr)*2,sizeof(int));
+    dst->anno16 = NULL; dst->n16 = 0;
+    dst->PLs = NULL; dst->nPLs = dst->mPLs = 0;
+    dst->pdg = NULL; dst->npdg = 0;
+}
+void ccall_destroy_worker(call_t *call)
+{
+    ccall_destroy(call);
+}
+
 // Inits P(D|G): convert PLs from log space, only two alleles (three PLs) are used.
 // NB: The original samtools calling code uses pdgs in reverse order (AA comes
 // first, RR last), while the -m calling model uses the canonical order.
@@ -27,9 +27,18 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <math.h>
+#include <inttypes.h>
 #include "filter.h"
 #include "bcftools.h"
 
+// Stages of demand-driven record unpacking, the statistics are collected per stage
+#define FLT_STAGE_SHR   0   // QUAL and fields up to ALT
+#define FLT_STAGE_FLT   1   // the FILTER column
+#define FLT_STAGE_INFO  2   // the INFO column
+#define FLT_STAGE_FMT   3   // FORMAT fields
+#define FLT_NSTAGES     4
+static const char *flt_stage_names[] = {"shared","FILTER","INFO","FORMAT"};
+
 typedef struct _token_t
 {
     // read-only values, same for all VCF lines
@@ -42,6 +51,14 @@ typedef struct _token_t
     void (*setter)(filter_t *, bcf1_t *, struct _token_t *);
     int (*comparator)(struct _token_t *, struct _token_t *, int op_type, bcf1_t *);
 
+    // set by filter_compile(), same for all VCF lines
+    void (*op_func)(filter_t *, struct _token_t *, struct _token_t *, bcf1_t *);    // operators: evaluate atok OP btok, the result goes to atok
+    const char *op_name;    // for debugging only, the name of op_func
+    int is_vec;             // the (sub)expression ending with this token can evaluate to per-sample values
+    int jump;               // if >0, this token starts the right operand of the logical operator at index jump
+    int unpack;             // BCF_UN_* parts of the record the token needs, unpacked on demand
+    int stage;              // one of the FLT_STAGE_* below, the deepest part of the record the token needs
+
     // modified on filter evaluation at each VCF line
     float *values;      // In case str_value is set, values[0] is one sample's string length
     char *str_value;    //  and values[0]*nvalues gives the total length;
@@ -61,6 +78,8 @@ struct _filter_t
     token_t *filters, **flt_stack;  // filtering input tokens (in RPN) and evaluation stack
     int32_t *tmpi;
     int max_unpack, mtmpi, nsamples;
+    uint64_t ndecided[FLT_NSTAGES][2];  // number of records evaluated false/true after unpacking up to the given stage
+    int short_circuit;                  // skip the right operands of decided logical operators
 };
 
 
@@ -685,6 +704,92 @@ static int cmp_vector_strings(token_t *atok, token_t *btok, int logic)    // log
     return pass_site;
 }
 
+// Operator handlers selected by filter_compile(). The result is stored in atok,
+// the caller pops btok from the stack.
+static void op_or(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    atok->pass_site = vector_logic_or(atok, btok, TOK_OR);
+}
+static void op_or_vec(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    atok->pass_site = vector_logic_or(atok, btok, TOK_OR_VEC);
+}
+static void op_and(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    atok->pass_site = vector_logic_and(atok, btok);
+}
+static void op_add(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) VECTOR_ARITHMETICS(atok,btok,+)
+static void op_sub(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) VECTOR_ARITHMETICS(atok,btok,-)
+static void op_mult(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) VECTOR_ARITHMETICS(atok,btok,*)
+static void op_div(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) VECTOR_ARITHMETICS(atok,btok,/)
+
+// Scalar arithmetics, both operands are known to be site-level values
+#define SCALAR_ARITHMETICS(atok,btok,AOP) \
+{ \
+    if ( !(atok)->nvalues || !(btok)->nvalues || bcf_float_is_missing((atok)->values[0]) || bcf_float_is_missing((btok)->values[0]) ) \
+        (atok)->nvalues = 0; \
+    else \
+        (atok)->values[0] = (atok)->values[0] AOP (btok)->values[0]; \
+}
+static void op_add_scalar(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) SCALAR_ARITHMETICS(atok,btok,+)
+static void op_sub_scalar(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) SCALAR_ARITHMETICS(atok,btok,-)
+static void op_mult_scalar(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) SCALAR_ARITHMETICS(atok,btok,*)
+static void op_div_scalar(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) SCALAR_ARITHMETICS(atok,btok,/)
+
+static void op_eq_comparator(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    if ( !atok->nvalues || !btok->nvalues ) { atok->nvalues = atok->nsamples = 0; atok->pass_site = 0; return; }
+    if ( btok->comparator )
+        atok->pass_site = btok->comparator(btok,atok,TOK_EQ,line);
+    else
+        atok->pass_site = atok->comparator(atok,btok,TOK_EQ,line);
+}
+static void op_ne_comparator(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    if ( !atok->nvalues || !btok->nvalues ) { atok->nvalues = atok->nsamples = 0; atok->pass_site = 0; return; }
+    if ( btok->comparator )
+        atok->pass_site = btok->comparator(btok,atok,TOK_NE,line);
+    else
+        atok->pass_site = atok->comparator(atok,btok,TOK_NE,line);
+}
+static void op_eq_str(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    if ( !atok->nvalues || !btok->nvalues ) { atok->nvalues = atok->nsamples = 0; atok->pass_site = 0; return; }
+    atok->pass_site = cmp_vector_strings(atok,btok,TOK_EQ);
+}
+static void op_ne_str(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line)
+{
+    if ( !atok->nvalues || !btok->nvalues ) { atok->nvalues = atok->nsamples = 0; atok->pass_site = 0; return; }
+    atok->pass_site = cmp_vector_strings(atok,btok,TOK_NE);
+}
+
+// Numeric comparisons: the generic version for per-sample values and a fast
+// version for two site-level values
+#define CMP_FUNCS(name,CMP_OP) \
+static void op_##name(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) \
+{ \
+    int is_true = 0; \
+    CMP_VECTORS(atok,btok,CMP_OP,is_true); \
+    atok->pass_site = is_true; \
+} \
+static void op_##name##_scalar(filter_t *flt, token_t *atok, token_t *btok, bcf1_t *line) \
+{ \
+    if ( !atok->nvalues || !btok->nvalues || bcf_float_is_missing(atok->values[0]) || bcf_float_is_missing(btok->values[0]) ) \
+    { \
+        atok->nvalues = 0; \
+        atok->pass_site = 0; \
+        return; \
+    } \
+    atok->pass_site = atok->values[0] CMP_OP btok->values[0] ? 1 : 0; \
+}
+CMP_FUNCS(eq,==)
+CMP_FUNCS(ne,!=)
+CMP_FUNCS(le,<=)
+CMP_FUNCS(lt,<)
+CMP_FUNCS(bt,>)
+CMP_FUNCS(be,>=)
+#undef CMP_FUNCS
+
 static int filters_init1(filter_t *filter, char *str, int len, int inside_func, token_t *tok)
 {
     tok->tok_type  = TOK_VAL;
@@ -827,27 +932,182 @@ static int filters_init1(filter_t *filter, char *str, int len, int inside_func,
 }
 
 
-static void filter_debug_print(token_t *toks, token_t **tok_ptrs, int ntoks)
+static void filter_debug_print(FILE *fp, token_t *toks, token_t **tok_ptrs, int ntoks)
 {
     int i;
     for (i=0; i<ntoks; i++)
     {
         token_t *tok = toks ? &toks[i] : tok_ptrs[i];
+        fprintf(fp,"%3d\t", i);
         if ( tok->tok_type==TOK_VAL )
         {
             if ( tok->key )
-                fprintf(stderr,"%s", tok->key);
+                fprintf(fp,"\"%s\"", tok->key);
             else if ( tok->tag )
-                fprintf(stderr,"%s", tok->tag);
+                fprintf(fp,"%s", tok->tag);
             else
-                fprintf(stderr,"%e", tok->threshold);
+                fprintf(fp,"%e", tok->threshold);
         }
         else
-            fprintf(stderr,"%c", TOKEN_STRING[tok->tok_type]);
-        if ( tok->setter ) fprintf(stderr,"\t[setter %p]", tok->setter);
-        fprintf(stderr,"\n");
+            fprintf(fp,"%c", TOKEN_STRING[tok->tok_type]);
+        fprintf(fp,"\t%s", tok->is_vec ? "vector" : "scalar");
+        if ( tok->op_name ) fprintf(fp,"\t%s", tok->op_name);
+        else if ( tok->setter ) fprintf(fp,"\t[setter %p]", tok->setter);
+        else if ( tok->comparator ) fprintf(fp,"\t[comparator]");
+        else fprintf(fp,"\t[constant]");
+        if ( tok->jump ) fprintf(fp,"\t[skip to %d if decided]", tok->jump+1);
+        if ( tok->unpack ) fprintf(fp,"\t[unpack %s]", flt_stage_names[tok->stage]);
+        fprintf(fp,"\n");
+    }
+}
+
+void filter_debug(filter_t *filter, FILE *fp)
+{
+    fprintf(fp,"# Compiled filter: %s\n", filter->str);
+    filter_debug_print(fp, filter->filters, NULL, filter->nfilters);
+}
+
+static inline int is_numeric_const(token_t *tok)
+{
+    return tok->tok_type==TOK_VAL && !tok->setter && !tok->comparator && !tok->key && !tok->tag;
+}
+
+#define SET_OP(tok,func) { (tok)->op_func = func; (tok)->op_name = #func; }
+
+/*
+ *  filter_compile() - turn the RPN token list into the program executed by filter_test()
+ *
+ *  Numeric subexpressions with constant operands are folded, the value types are checked
+ *  so that each operator can be assigned a specialised handler (string, per-sample or
+ *  site-level numeric comparison) and the right operands of logical operators are marked
+ *  for skipping when the site-level result is already decided by the left operand.
+ */
+static void filter_compile(filter_t *filter, token_t *toks, int *ntoks)
+{
+    typedef struct { int start, is_str, is_bool; } operand_t;
+    operand_t *stack = (operand_t*) malloc(sizeof(operand_t)*(*ntoks));
+    int i, nstack = 0, nout = 0;
+    for (i=0; i<*ntoks; i++)
+    {
+        token_t *tok = &toks[i];
+        if ( tok->tok_type==TOK_VAL )
+        {
+            toks[nout] = *tok;
+            tok = &toks[nout];
+            tok->is_vec = tok->setter==filters_set_format_int || tok->setter==filters_set_format_float || tok->setter==filters_set_format_string ? 1 : 0;
+            if ( tok->is_vec ) { tok->unpack = BCF_UN_FMT; tok->stage = FLT_STAGE_FMT; }
+            else if ( tok->setter==filters_set_info || tok->setter==filters_set_info_int || tok->setter==filters_set_info_float || tok->setter==filters_set_info_flag ) 
+                { tok->unpack = BCF_UN_INFO; tok->stage = FLT_STAGE_INFO; }
+            else if ( tok->comparator ) { tok->unpack = BCF_UN_FLT; tok->stage = FLT_STAGE_FLT; }
+            else if ( tok->setter==filters_set_type ) tok->unpack = BCF_UN_STR;
+            stack[nstack].start   = nout;
+            stack[nstack].is_str  = tok->is_str;
+            stack[nstack].is_bool = 0;
+            nstack++;
+            nout++;
+            continue;
+        }
+        if ( tok->tok_type==TOK_FUNC )  // all functions take one argument and produce a site-level value
+        {
+            if ( !nstack ) error("Could not parse the expression: %s\n", filter->str);
+            toks[nout] = *tok;
+            toks[nout].is_vec = 0;
+            nout++;
+            continue;
+        }
+        if ( nstack<2 ) error("Error occurred while processing the filter \"%s\" (1:%d)\n", filter->str,nstack);
+
+        operand_t *aop = &stack[nstack-2], *bop = &stack[nstack-1];
+        token_t *atok = &toks[bop->start-1], *btok = &toks[nout-1];  // the last tokens of the operands
+        int is_vec = atok->is_vec || btok->is_vec ? 1 : 0;
+        int is_arith = tok->tok_type==TOK_ADD || tok->tok_type==TOK_SUB || tok->tok_type==TOK_MULT || tok->tok_type==TOK_DIV;
+
+        // constant folding, both operands are single numeric constants
+        if ( is_arith && aop->start==nout-2 && bop->start==nout-1 && is_numeric_const(atok) && is_numeric_const(btok) )
+        {
+            if ( tok->tok_type==TOK_ADD ) atok->threshold += btok->threshold;
+            else if ( tok->tok_type==TOK_SUB ) atok->threshold -= btok->threshold;
+            else if ( tok->tok_type==TOK_MULT ) atok->threshold *= btok->threshold;
+            else atok->threshold /= btok->threshold;
+            free(btok->values);
+            free(btok->pass_samples);
+            free(tok->values);
+            free(tok->pass_samples);
+            nout--;
+            nstack--;
+            continue;
+        }
+
+        toks[nout] = *tok;
+        tok = &toks[nout];
+        tok->is_vec = is_vec;
+        int is_str = aop->is_str + bop->is_str;
+        int has_comparator = atok->comparator || btok->comparator ? 1 : 0;
+        switch (tok->tok_type)
+        {
+            case TOK_OR:
+            case TOK_OR_VEC:
+            case TOK_AND:
+            case TOK_AND_VEC:
+                if ( !aop->is_bool || !bop->is_bool ) 
+                    error("Error occurred while processing the filter \"%s\": logical operator applied to a value\n", filter->str);
+                if ( tok->tok_type==TOK_OR ) SET_OP(tok,op_or)
+                else if ( tok->tok_type==TOK_OR_VEC ) SET_OP(tok,op_or_vec)
+                else SET_OP(tok,op_and)
+
+                // The right operand can be skipped if the left operand is a site-level value
+                // which decides the result: false for AND, true for OR. In the latter case the
+                // samples must not be restricted by a per-sample right operand.
+                if ( !atok->is_vec && (tok->tok_type!=TOK_OR || !btok->is_vec) )
+                    toks[bop->start].jump = nout;
+                break;
+            case TOK_ADD: if ( is_vec ) SET_OP(tok,op_add) else SET_OP(tok,op_add_scalar) break;
+            case TOK_SUB: if ( is_vec ) SET_OP(tok,op_sub) else SET_OP(tok,op_sub_scalar) break;
+            case TOK_MULT: if ( is_vec ) SET_OP(tok,op_mult) else SET_OP(tok,op_mult_scalar) break;
+            case TOK_DIV: if ( is_vec ) SET_OP(tok,op_div) else SET_OP(tok,op_div_scalar) break;
+            case TOK_EQ:
+            case TOK_NE:
+                if ( has_comparator )
+                {
+                    if ( tok->tok_type==TOK_EQ ) SET_OP(tok,op_eq_comparator) else SET_OP(tok,op_ne_comparator)
+                }
+                else if ( is_str==2 )
+                {
+                    if ( tok->tok_type==TOK_EQ ) SET_OP(tok,op_eq_str) else SET_OP(tok,op_ne_str)
+                }
+                else if ( is_str==1 )
+                    error("Comparing string to numeric value: %s\n", filter->str);
+                else if ( tok->tok_type==TOK_EQ ) 
+                {
+                    if ( is_vec ) SET_OP(tok,op_eq) else SET_OP(tok,op_eq_scalar)
+                }
+                else
+                {
+                    if ( is_vec ) SET_OP(tok,op_ne) else SET_OP(tok,op_ne_scalar)
+                }
+                break;
+            case TOK_LE:
+            case TOK_LT:
+            case TOK_BT:
+            case TOK_BE:
+                if ( is_str>0 ) error("Wrong operator in string comparison: %s\n", filter->str);
+                if ( tok->tok_type==TOK_LE ) { if ( is_vec ) SET_OP(tok,op_le) else SET_OP(tok,op_le_scalar) }
+                else if ( tok->tok_type==TOK_LT ) { if ( is_vec ) SET_OP(tok,op_lt) else SET_OP(tok,op_lt_scalar) }
+                else if ( tok->tok_type==TOK_BT ) { if ( is_vec ) SET_OP(tok,op_bt) else SET_OP(tok,op_bt_scalar) }
+                else { if ( is_vec ) SET_OP(tok,op_be) else SET_OP(tok,op_be_scalar) }
+                break;
+            default:
+                error("FIXME: did not expect this .. tok_type %d = %d\n", i, tok->tok_type);
+        }
+        aop->is_str  = 0;
+        aop->is_bool = is_arith ? 0 : 1;
+        nstack--;
+        nout++;
     }
+    free(stack);
+    *ntoks = nout;
 }
+#undef SET_OP
 
 // Parse filter expression and convert to reverse polish notation. Dijkstra's shunting-yard algorithm
 filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
@@ -856,6 +1116,7 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
     filter->str = strdup(str);
     filter->hdr = hdr;
     filter->max_unpack |= BCF_UN_STR;
+    filter->short_circuit = 1;
 
     int nops = 0, mops = 0, *ops = NULL;    // operators stack
     int nout = 0, mout = 0;                 // filter tokens, RPN
@@ -1004,7 +1265,8 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
         }
     }
 
-    if (0) filter_debug_print(out, NULL, nout);
+    filter_compile(filter, out, &nout);
+    if (0) filter_debug_print(stderr, out, NULL, nout);
 
     if ( mops ) free(ops);
     filter->filters   = out;
@@ -1032,134 +1294,59 @@ void filter_destroy(filter_t *filter)
 
 int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
 {
-    bcf_unpack(line, filter->max_unpack);
-
-    int i, nstack = 0;
+    int i, nstack = 0, stage = FLT_STAGE_SHR;
     for (i=0; i<filter->nfilters; i++)
     {
-        filter->filters[i].nsamples  = 0;
-        filter->filters[i].nvalues   = 0;
-        filter->filters[i].pass_site = -1;
+        token_t *tok = &filter->filters[i];
 
-        if ( filter->filters[i].tok_type == TOK_VAL )
+        // short-circuit: skip the right operand of a logical operator if the site-level result is already known
+        if ( tok->jump && filter->short_circuit )
         {
-            if ( filter->filters[i].setter )    // variable, query the VCF line
-                filter->filters[i].setter(filter, line, &filter->filters[i]);
-            else if ( filter->filters[i].key )  // string constant
+            token_t *atok = filter->flt_stack[nstack-1];
+            int op = filter->filters[tok->jump].tok_type;
+            if ( !atok->nsamples && ( ((op==TOK_AND || op==TOK_AND_VEC) && !atok->pass_site) || ((op==TOK_OR || op==TOK_OR_VEC) && atok->pass_site>0 && atok->nvalues) ) )
             {
-                filter->filters[i].str_value = filter->filters[i].key;
-                filter->filters[i].values[0] = filter->filters[i].values[0];
-                filter->filters[i].nvalues   = 1;
+                i = tok->jump;
+                continue;
             }
-            else    // numeric constant
-            {
-                filter->filters[i].values[0] = filter->filters[i].threshold;
-                filter->filters[i].nvalues   = 1;
-            }
-
-            filter->flt_stack[nstack++] = &filter->filters[i];
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_FUNC ) // all functions take only one argument
-        {
-            filter->filters[i].setter(filter, line, filter->flt_stack[nstack-1]);
-            continue;
         }
-        if ( nstack<2 ) 
-            error("Error occurred while processing the filter \"%s\" (1:%d)\n", filter->str,nstack);  // too few values left on the stack
 
-        int is_str  = filter->flt_stack[nstack-1]->is_str + filter->flt_stack[nstack-2]->is_str;
+        tok->nsamples  = 0;
+        tok->nvalues   = 0;
+        tok->pass_site = -1;
 
-        if ( filter->filters[i].tok_type == TOK_OR || filter->filters[i].tok_type == TOK_OR_VEC )
-        {
-            if ( filter->flt_stack[nstack-1]->pass_site<0 || filter->flt_stack[nstack-2]->pass_site<0 ) 
-                error("Error occurred while processing the filter \"%s\" (%d %d OR)\n", filter->str,filter->flt_stack[nstack-2]->pass_site,filter->flt_stack[nstack-1]->pass_site);
-            filter->flt_stack[nstack-2]->pass_site = vector_logic_or(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1], filter->filters[i].tok_type);
-            nstack--;
-            continue;
-        }
-        if ( filter->filters[i].tok_type == TOK_AND || filter->filters[i].tok_type == TOK_AND_VEC )
+        if ( tok->tok_type == TOK_VAL )
         {
-            if ( filter->flt_stack[nstack-1]->pass_site<0 || filter->flt_stack[nstack-2]->pass_site<0 ) 
-                error("Error occurred while processing the filter \"%s\" (%d %d AND)\n", filter->str,filter->flt_stack[nstack-2]->pass_site,filter->flt_stack[nstack-1]->pass_site);
-            filter->flt_stack[nstack-2]->pass_site = vector_logic_and(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1]);
-            nstack--;
-            continue;
-        }
+            // unpack only the parts of the record needed by this token
+            if ( (line->unpacked & tok->unpack) != tok->unpack ) bcf_unpack(line, tok->unpack);
+            if ( stage < tok->stage ) stage = tok->stage;
 
-        if ( filter->filters[i].tok_type == TOK_ADD )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],+);
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_SUB )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],-);
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_MULT )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],*);
-            nstack--;
+            if ( tok->setter )    // variable, query the VCF line
+                tok->setter(filter, line, tok);
+            else if ( tok->key )  // string constant
+            {
+                tok->str_value = tok->key;
+                tok->nvalues   = 1;
+            }
+            else    // numeric constant
+            {
+                tok->values[0] = tok->threshold;
+                tok->nvalues   = 1;
+            }
+
+            filter->flt_stack[nstack++] = tok;
             continue;
         }
-        else if ( filter->filters[i].tok_type == TOK_DIV )
+        else if ( tok->tok_type == TOK_FUNC ) // all functions take only one argument
         {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],/);
-            nstack--;
+            tok->setter(filter, line, filter->flt_stack[nstack-1]);
             continue;
         }
-
-        int is_true = 0;
-        if ( !filter->flt_stack[nstack-1]->nvalues || !filter->flt_stack[nstack-2]->nvalues )
-        {
-            filter->flt_stack[nstack-2]->nvalues = filter->flt_stack[nstack-2]->nsamples = 0;
-        }
-        else if ( filter->filters[i].tok_type == TOK_EQ )
-        {
-            if ( filter->flt_stack[nstack-1]->comparator )
-                is_true = filter->flt_stack[nstack-1]->comparator(filter->flt_stack[nstack-1],filter->flt_stack[nstack-2],TOK_EQ,line);
-            else if ( filter->flt_stack[nstack-2]->comparator )
-                is_true = filter->flt_stack[nstack-2]->comparator(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_EQ,line);
-            else if ( is_str==2 )   // both are strings
-                is_true = cmp_vector_strings(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_EQ);
-            else if ( is_str==1 ) 
-                error("Comparing string to numeric value: %s\n", filter->str);
-            else
-                CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],==,is_true);
-        }
-        else if ( filter->filters[i].tok_type == TOK_NE )
-        {
-            if ( filter->flt_stack[nstack-1]->comparator ) 
-                is_true = filter->flt_stack[nstack-1]->comparator(filter->flt_stack[nstack-1],filter->flt_stack[nstack-2],TOK_NE,line);
-            else if ( filter->flt_stack[nstack-2]->comparator )
-                is_true = filter->flt_stack[nstack-2]->comparator(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_NE,line);
-            else if ( is_str==2 )
-                is_true = cmp_vector_strings(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],TOK_NE);
-            else if ( is_str==1 )
-                error("Comparing string to numeric value: %s\n", filter->str);
-            else
-                CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],!=,is_true);
-        }
-        else if ( is_str>0 )
-            error("Wrong operator in string comparison: %s [%s,%s]\n", filter->str, filter->flt_stack[nstack-1]->str_value, filter->flt_stack[nstack-2]->str_value);
-        else if ( filter->filters[i].tok_type == TOK_LE )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],<=,is_true)
-        else if ( filter->filters[i].tok_type == TOK_LT )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],<,is_true)
-        else if ( filter->filters[i].tok_type == TOK_BT )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],>,is_true)
-        else if ( filter->filters[i].tok_type == TOK_BE )
-            CMP_VECTORS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],>=,is_true)
-        else
-            error("FIXME: did not expect this .. tok_type %d = %d\n", i, filter->filters[i].tok_type);
-
-        filter->flt_stack[nstack-2]->pass_site = is_true;
+        tok->op_func(filter, filter->flt_stack[nstack-2], filter->flt_stack[nstack-1], line);
         nstack--;
     }
     if ( nstack>1 ) error("Error occurred while processing the filter \"%s\" (2:%d)\n", filter->str,nstack);    // too few values left on the stack
+    filter->ndecided[stage][filter->flt_stack[0]->pass_site>0 ? 1 : 0]++;
     if ( samples ) 
     {
         *samples = filter->max_unpack&BCF_UN_FMT ? filter->flt_stack[0]->pass_samples : NULL;
@@ -1172,6 +1359,20 @@ int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
     return filter->flt_stack[0]->pass_site;
 }
 
+void filter_set_short_circuit(filter_t *filter, int enable)
+{
+    filter->short_circuit = enable;
+}
+
+void filter_stats(filter_t *filter, FILE *fp)
+{
+    int i;
+    fprintf(fp,"# Filter evaluation by the deepest unpacked stage: %s\n", filter->str);
+    fprintf(fp,"# [1]stage\t[2]false\t[3]true\n");
+    for (i=0; i<FLT_NSTAGES; i++)
+        fprintf(fp,"%s\t%"PRIu64"\t%"PRIu64"\n", flt_stage_names[i], filter->ndecided[i][0], filter->ndecided[i][1]);
+}
+
 void filter_expression_info(FILE *fp)
 {
     fprintf(fp, "Filter expressions may contain:\n");
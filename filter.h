@@ -49,4 +49,23 @@ int filter_test(filter_t *filter, bcf1_t *rec, const uint8_t **samples);
 
 void filter_expression_info(FILE *fp);
 
+/**
+  *  filter_debug() - print the compiled filtering program, for debugging
+  */
+void filter_debug(filter_t *filter, FILE *fp);
+
+/**
+  *  filter_stats() - print the number of records evaluated as false and true,
+  *  broken down by the deepest part of the record (shared fields, FILTER,
+  *  INFO or FORMAT) that had to be unpacked to reach the decision
+  */
+void filter_stats(filter_t *filter, FILE *fp);
+
+/**
+  *  filter_set_short_circuit() - enable (the default) or disable skipping the
+  *  right operand of a logical operator whose result is decided by the left
+  *  operand. The results must be the same either way.
+  */
+void filter_set_short_circuit(filter_t *filter, int enable);
+
 #endif
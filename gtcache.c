@@ -0,0 +1,297 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "gtcache.h"
+
+/*
+    File layout:
+        header      64 bytes, see gtcache_hdr_t
+        records     nsites x rec_size bytes, gtcache_rec_t followed by
+                    uint16_t DP[nsmpl], 2-bit GT[nsmpl] and uint8_t PL[3*nsmpl]
+        index       for each sequence: uint64_t beg, n; uint32_t len; char name[len]
+                    for each sample: uint32_t len; char name[len]
+*/
+
+#define GTCACHE_MAGIC "GTCACHE\3"
+#define GTCACHE_HDR_SIZE 64
+
+typedef struct
+{
+    char magic[8];
+    uint32_t flags, nsmpl, nseq, pad;
+    uint64_t nsites, index_offset;
+    uint64_t src_size;  // size and modification time of the VCF the cache was built from
+    int64_t src_mtime;
+    uint32_t nskipped, ncapped;     // sites left out and sites with PLs capped, see gtcache_t
+}
+gtcache_hdr_t;
+
+static void src_stat(const char *src_fname, uint64_t *size, int64_t *mtime)
+{
+    struct stat st;
+    if ( !strcmp(src_fname,"-") || stat(src_fname, &st) ) error("The genotype cache requires a VCF/BCF file, cannot stat %s\n", src_fname);
+    *size  = st.st_size;
+    *mtime = st.st_mtime;
+}
+
+static void set_layout(gtcache_t *cache)
+{
+    cache->idp = sizeof(gtcache_rec_t);
+    cache->igt = cache->idp + (cache->flags & GTCACHE_DP ? 2*cache->nsmpl : 0);
+    cache->ipl = cache->igt + (cache->nsmpl+3)/4;
+    cache->rec_size = cache->ipl + (cache->flags & GTCACHE_PL ? 3*cache->nsmpl : 0);
+    cache->rec_size = (cache->rec_size + 3) & ~3;
+}
+
+static void write_str(FILE *fp, const char *str)
+{
+    uint32_t len = strlen(str);
+    fwrite(&len, sizeof(len), 1, fp);
+    fwrite(str, 1, len, fp);
+}
+
+uint64_t gtcache_build(const char *fname, bcf_srs_t *files)
+{
+    bcf_hdr_t *hdr = files->readers[0].header;
+    gtcache_t cache;
+    memset(&cache, 0, sizeof(cache));
+    cache.nsmpl = bcf_hdr_nsamples(hdr);
+    if ( bcf_hdr_id2int(hdr, BCF_DT_ID, "PL")>=0 ) cache.flags |= GTCACHE_PL;
+    if ( bcf_hdr_id2int(hdr, BCF_DT_ID, "DP")>=0 ) cache.flags |= GTCACHE_DP;
+    set_layout(&cache);
+
+    // written to a temporary file and renamed when complete, so that an
+    // interrupted build or a concurrent one cannot leave a truncated cache
+    kstring_t tmp = {0,0,0};
+    ksprintf(&tmp, "%s.XXXXXX", fname);
+    int fd = mkstemp(tmp.s);
+    FILE *fp = fd<0 ? NULL : fdopen(fd, "w");
+    if ( !fp ) error("Failed to create %s\n", tmp.s);
+    uint8_t *buf = (uint8_t*) calloc(GTCACHE_HDR_SIZE > cache.rec_size ? GTCACHE_HDR_SIZE : cache.rec_size, 1);
+    fwrite(buf, 1, GTCACHE_HDR_SIZE, fp);   // the header is written at the end
+
+    int32_t *arr = NULL, *ac = NULL, *an = NULL;
+    int i, narr = 0, nac = 0, nan = 0, n = cache.nsmpl, mseq = 0;
+    while ( bcf_sr_next_line(files) )
+    {
+        bcf1_t *line = files->readers[0].buffer[0];
+        if ( line->n_allele!=2 ) { cache.nskipped++; continue; }
+
+        if ( !cache.nseq || cache.seq[cache.nseq-1].rid!=line->rid )
+        {
+            for (i=0; i<cache.nseq; i++)
+                if ( cache.seq[i].rid==line->rid ) error("The input is not sorted, %s appears in two blocks\n", bcf_seqname(hdr,line));
+            cache.nseq++;
+            hts_expand0(gtcache_seq_t, cache.nseq, mseq, cache.seq);
+            cache.seq[cache.nseq-1].rid  = line->rid;
+            cache.seq[cache.nseq-1].name = strdup(bcf_seqname(hdr,line));
+            cache.seq[cache.nseq-1].beg  = cache.nsites;
+        }
+        cache.seq[cache.nseq-1].n++;
+        cache.nsites++;
+
+        memset(buf, 0, cache.rec_size);
+        gtcache_rec_t *rec = (gtcache_rec_t*) buf;
+        rec->pos = line->pos;
+        if ( bcf_is_snp(line) ) rec->flags |= GTCREC_SNP;
+        if ( bcf_get_info_int32(hdr, line, "AN", &an, &nan)==1 && bcf_get_info_int32(hdr, line, "AC", &ac, &nac)==1 )
+        {
+            // the same as set_AF() in vcfroh.c
+            rec->af[0] = (float) (an[0] - ac[0])/an[0];
+            rec->af[1] = (double)ac[0] / an[0];
+            rec->flags |= GTCREC_AF;
+        }
+
+        uint8_t *gt = buf + cache.igt;
+        if ( bcf_get_genotypes(hdr, line, &arr, &narr)==2*n )
+        {
+            rec->flags |= GTCREC_GT;
+            for (i=0; i<n; i++)
+            {
+                int32_t *ptr = arr + 2*i;
+                int val = GTCACHE_GT_MISSING;
+                if ( ptr[0]!=bcf_int32_vector_end && ptr[1]!=bcf_int32_vector_end && !bcf_gt_is_missing(ptr[0]) && !bcf_gt_is_missing(ptr[1]) )
+                    val = (bcf_gt_allele(ptr[0])>0) + (bcf_gt_allele(ptr[1])>0);
+                gt[i>>2] |= val << ((i&3)<<1);
+            }
+        }
+        else
+            for (i=0; i<(n+3)/4; i++) gt[i] = 0xff;
+
+        if ( (cache.flags & GTCACHE_PL) && bcf_get_format_int32(hdr, line, "PL", &arr, &narr)==3*n )
+        {
+            rec->flags |= GTCREC_PL;
+            uint8_t *pl = buf + cache.ipl;
+            int capped = 0;
+            for (i=0; i<3*n; i++)
+            {
+                if ( arr[i]==bcf_int32_missing || arr[i]==bcf_int32_vector_end ) pl[i] = GTCACHE_PL_MISSING;
+                else if ( arr[i] >= GTCACHE_PL_MISSING ) { pl[i] = GTCACHE_PL_MISSING-1; capped = 1; }
+                else pl[i] = arr[i]<0 ? 0 : arr[i];
+            }
+            cache.ncapped += capped;
+        }
+        if ( (cache.flags & GTCACHE_DP) && bcf_get_format_int32(hdr, line, "DP", &arr, &narr)==n )
+        {
+            rec->flags |= GTCREC_DP;
+            uint16_t *dp = (uint16_t*) (buf + cache.idp);
+            for (i=0; i<n; i++)
+            {
+                if ( arr[i]==bcf_int32_missing || arr[i]<0 ) dp[i] = 0;
+                else dp[i] = arr[i] < 65535 ? arr[i] : 65535;
+            }
+        }
+        if ( fwrite(buf, 1, cache.rec_size, fp)!=cache.rec_size ) error("Failed to write %s\n", fname);
+    }
+
+    gtcache_hdr_t fhdr;
+    memset(&fhdr, 0, sizeof(fhdr));
+    memcpy(fhdr.magic, GTCACHE_MAGIC, 8);
+    fhdr.flags  = cache.flags;
+    fhdr.nsmpl  = cache.nsmpl;
+    fhdr.nseq   = cache.nseq;
+    fhdr.nsites = cache.nsites;
+    fhdr.nskipped = cache.nskipped;
+    fhdr.ncapped  = cache.ncapped;
+    fhdr.index_offset = GTCACHE_HDR_SIZE + cache.nsites*cache.rec_size;
+    src_stat(files->readers[0].fname, &fhdr.src_size, &fhdr.src_mtime);
+    for (i=0; i<cache.nseq; i++)
+    {
+        fwrite(&cache.seq[i].beg, sizeof(uint64_t), 1, fp);
+        fwrite(&cache.seq[i].n, sizeof(uint64_t), 1, fp);
+        write_str(fp, cache.seq[i].name);
+        free(cache.seq[i].name);
+    }
+    for (i=0; i<n; i++) write_str(fp, hdr->samples[i]);
+    if ( fseek(fp, 0, SEEK_SET) || fwrite(&fhdr, sizeof(fhdr), 1, fp)!=1 ) error("Failed to write %s\n", tmp.s);
+    if ( fclose(fp) ) error("Failed to close %s\n", tmp.s);
+    if ( rename(tmp.s, fname) ) error("Failed to rename %s to %s\n", tmp.s, fname);
+    free(tmp.s);
+
+    free(cache.seq);
+    free(buf);
+    free(arr);
+    free(ac);
+    free(an);
+    return cache.nsites;
+}
+
+static const uint8_t *read_str(gtcache_t *cache, const uint8_t *ptr, char **str)
+{
+    const uint8_t *end = cache->map + cache->map_size;
+    uint32_t len;
+    if ( ptr + sizeof(len) > end ) return NULL;
+    memcpy(&len, ptr, sizeof(len));
+    ptr += sizeof(len);
+    if ( ptr + len > end ) return NULL;
+    *str = (char*) malloc(len+1);
+    memcpy(*str, ptr, len);
+    (*str)[len] = 0;
+    return ptr + len;
+}
+
+gtcache_t *gtcache_open(const char *fname, const char *src_fname, bcf_hdr_t *hdr)
+{
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return NULL;
+    struct stat st;
+    if ( fstat(fd, &st) ) error("Failed to stat %s\n", fname);
+    if ( st.st_size < GTCACHE_HDR_SIZE ) error("Not a genotype cache: %s\n", fname);
+
+    gtcache_t *cache = (gtcache_t*) calloc(1, sizeof(gtcache_t));
+    cache->map_size = st.st_size;
+    cache->map = (uint8_t*) mmap(NULL, cache->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( cache->map==MAP_FAILED ) error("Failed to map %s\n", fname);
+
+    gtcache_hdr_t fhdr;
+    memcpy(&fhdr, cache->map, sizeof(fhdr));
+    if ( memcmp(fhdr.magic, GTCACHE_MAGIC, 8) ) error("Not a genotype cache or created by an older version: %s\n", fname);
+    uint64_t src_size;
+    int64_t src_mtime;
+    src_stat(src_fname, &src_size, &src_mtime);
+    if ( src_size!=fhdr.src_size || src_mtime!=fhdr.src_mtime )
+        error("The genotype cache %s was built from a different version of %s, please remove it\n", fname, src_fname);
+    cache->flags  = fhdr.flags;
+    cache->nsmpl  = fhdr.nsmpl;
+    cache->nseq   = fhdr.nseq;
+    cache->nsites = fhdr.nsites;
+    cache->nskipped = fhdr.nskipped;
+    cache->ncapped  = fhdr.ncapped;
+    cache->recs   = cache->map + GTCACHE_HDR_SIZE;
+    set_layout(cache);
+    if ( fhdr.index_offset != GTCACHE_HDR_SIZE + cache->nsites*cache->rec_size || fhdr.index_offset > cache->map_size )
+        error("The genotype cache is truncated or corrupted: %s\n", fname);
+
+    int i;
+    const uint8_t *ptr = cache->map + fhdr.index_offset;
+    cache->seq = (gtcache_seq_t*) calloc(cache->nseq, sizeof(gtcache_seq_t));
+    for (i=0; i<cache->nseq; i++)
+    {
+        gtcache_seq_t *seq = &cache->seq[i];
+        if ( ptr + 2*sizeof(uint64_t) > cache->map + cache->map_size ) error("The genotype cache is truncated or corrupted: %s\n", fname);
+        memcpy(&seq->beg, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+        memcpy(&seq->n, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+        if ( !(ptr = read_str(cache, ptr, &seq->name)) ) error("The genotype cache is truncated or corrupted: %s\n", fname);
+        seq->rid = bcf_hdr_name2id(hdr, seq->name);
+    }
+
+    if ( cache->nsmpl != bcf_hdr_nsamples(hdr) )
+        error("The genotype cache %s has %d samples, but the VCF has %d\n", fname, cache->nsmpl, bcf_hdr_nsamples(hdr));
+    cache->samples = (char**) calloc(cache->nsmpl, sizeof(char*));
+    for (i=0; i<cache->nsmpl; i++)
+    {
+        if ( !(ptr = read_str(cache, ptr, &cache->samples[i])) ) error("The genotype cache is truncated or corrupted: %s\n", fname);
+        if ( strcmp(cache->samples[i], hdr->samples[i]) )
+            error("The samples in the genotype cache %s do not match the VCF: %s vs %s\n", fname, cache->samples[i], hdr->samples[i]);
+    }
+    if ( cache->nskipped || cache->ncapped )
+        fprintf(stderr,"Warning: The genotype cache %s leaves out %"PRIu64" sites which are not bi-allelic and caps the PLs at %d at %"PRIu64" sites,\n"
+            "         the results can differ from a run without --cache\n", fname, cache->nskipped, GTCACHE_PL_MISSING-1, cache->ncapped);
+    return cache;
+}
+
+void gtcache_destroy(gtcache_t *cache)
+{
+    int i;
+    for (i=0; i<cache->nseq; i++) free(cache->seq[i].name);
+    for (i=0; i<cache->nsmpl; i++) free(cache->samples[i]);
+    free(cache->seq);
+    free(cache->samples);
+    munmap(cache->map, cache->map_size);
+    free(cache);
+}
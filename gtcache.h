@@ -0,0 +1,120 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Genotype cache for repeated runs of gtcheck and roh on the same data: a
+    memory-mapped matrix of bi-allelic sites with 2-bit diploid genotypes and,
+    when present in the VCF, PLs quantised to a byte and DPs capped at 65535.
+    The sites are stored in blocks by chromosome, the file is in the native
+    byte order of the machine which created it.
+*/
+
+#ifndef __GTCACHE_H__
+#define __GTCACHE_H__
+
+#include <stdint.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+
+// what is stored in the cache
+#define GTCACHE_PL  1
+#define GTCACHE_DP  2
+
+// per-site flags
+#define GTCREC_SNP  1
+#define GTCREC_GT   2       // diploid GT present
+#define GTCREC_PL   4
+#define GTCREC_DP   8
+#define GTCREC_AF   16      // INFO/AC and INFO/AN present
+
+#define GTCACHE_GT_MISSING  3   // genotype codes are the number of ALT alleles or missing
+#define GTCACHE_PL_MISSING  255 // real PLs are capped at 254
+
+typedef struct
+{
+    int32_t pos;
+    float af[2];        // REF and ALT frequency from INFO/AC and INFO/AN
+    uint8_t flags, pad[3];
+}
+gtcache_rec_t;
+
+typedef struct
+{
+    char *name;
+    int rid;            // in the header given to gtcache_open(), -1 if not present
+    uint64_t beg, n;    // index of the first site and the number of sites
+}
+gtcache_seq_t;
+
+typedef struct
+{
+    int nsmpl, nseq, flags;
+    uint64_t nsites;
+    uint64_t nskipped, ncapped;     // sites which are not bi-allelic and are left out, sites with PLs above 254
+    char **samples;
+    gtcache_seq_t *seq;
+    size_t rec_size, idp, igt, ipl;     // record size and offsets of the DP, GT and PL arrays
+    uint8_t *map;
+    size_t map_size;
+    const uint8_t *recs;
+}
+gtcache_t;
+
+/**
+ *  gtcache_build() - read all sites from the first reader and write the cache
+ *  Sites which are not bi-allelic are not stored and PLs are capped at 254,
+ *  gtcache_open() warns when this happened. Returns the number of sites written.
+ */
+uint64_t gtcache_build(const char *fname, bcf_srs_t *files);
+
+/**
+ *  gtcache_open() - map the cache, NULL if the file does not exist
+ *  @src_fname: the VCF the cache was built from, its size and modification
+ *              time must be the same as when the cache was built
+ *  @hdr:       the header of the VCF, it must have the same samples in the
+ *              same order
+ */
+gtcache_t *gtcache_open(const char *fname, const char *src_fname, bcf_hdr_t *hdr);
+void gtcache_destroy(gtcache_t *cache);
+
+static inline const gtcache_rec_t *gtcache_rec(gtcache_t *cache, uint64_t isite)
+{
+    return (const gtcache_rec_t*) (cache->recs + isite*cache->rec_size);
+}
+static inline int gtcache_gt(gtcache_t *cache, const gtcache_rec_t *rec, int ismpl)
+{
+    const uint8_t *gt = (const uint8_t*)rec + cache->igt;
+    return (gt[ismpl>>2] >> ((ismpl&3)<<1)) & 3;
+}
+static inline const uint8_t *gtcache_pl(gtcache_t *cache, const gtcache_rec_t *rec)
+{
+    return (const uint8_t*)rec + cache->ipl;
+}
+static inline const uint16_t *gtcache_dp(gtcache_t *cache, const gtcache_rec_t *rec)
+{
+    return (const uint16_t*) ((const uint8_t*)rec + cache->idp);
+}
+
+#endif
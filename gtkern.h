@@ -0,0 +1,172 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Classification of a whole row of diploid BCF_BT_INT8 genotypes at once,
+    giving the same result as calling bcf_gt_type() for each sample. Uses
+    AVX2 or SSE2 when the compiler targets them, scalar code otherwise.
+
+    Each genotype is first turned into a 5-bit key: bits 0-1 describe the
+    first allele and bits 2-3 the second (0: vector_end, 1: missing, 2: ref,
+    3: alt), bit 4 is set when both alleles are the same. The key is then
+    translated to GT_* type by a lookup table.
+
+    Only int8 rows are handled. Rows stored as BCF_BT_INT16, which happens
+    with more than 63 alleles, and non-diploid rows are left to the callers'
+    per-sample bcf_gt_type() loop.
+*/
+
+#ifndef __GTKERN_H__
+#define __GTKERN_H__
+
+#include <stdint.h>
+#include <htslib/vcf.h>
+#include <htslib/vcfutils.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const uint8_t gtkern_key2type[32] =
+{
+    GT_UNKN, GT_UNKN, GT_HAPL_R, GT_HAPL_A, GT_UNKN, GT_UNKN, GT_HAPL_R, GT_HAPL_A,
+    GT_UNKN, GT_HAPL_R, GT_HOM_RR, GT_HET_RA, GT_UNKN, GT_HAPL_A, GT_HET_RA, GT_HET_AA,
+    GT_UNKN, GT_UNKN, GT_HAPL_R, GT_HAPL_A, GT_UNKN, GT_UNKN, GT_HAPL_R, GT_HAPL_A,
+    GT_UNKN, GT_HAPL_R, GT_HOM_RR, GT_HET_RA, GT_UNKN, GT_HAPL_A, GT_HET_RA, GT_HOM_AA
+};
+
+static inline int gtkern_allele_state(int8_t p)
+{
+    if ( p==bcf_int8_vector_end ) return 0;
+    if ( !p || p==bcf_int8_missing ) return 1;
+    return p>3 ? 3 : 2;     // as in bcf_gt_type(), anything but alt counts as ref
+}
+
+static inline void gtkern_classify1(const int8_t *p, uint8_t *type, uint8_t *ial)
+{
+    int key = gtkern_allele_state(p[0]) | gtkern_allele_state(p[1])<<2 | (((p[0]^p[1])&0xfe) ? 0 : 16);
+    int ia  = p[0]>3 ? p[0]>>1 : 0x7f;
+    int ib  = p[1]>3 ? p[1]>>1 : 0x7f;
+    *type = gtkern_key2type[key];
+    *ial  = (ia<ib ? ia : ib) - 1;
+}
+
+#if defined(__AVX2__)
+
+// Keys and first-alt indexes of 16 samples held in v, returned in 16-bit lanes
+static inline __m256i gtkern_key16(__m256i v, __m256i *ial)
+{
+    const __m256i one = _mm256_set1_epi8(1), lo = _mm256_set1_epi16(0xff);
+    __m256i is_vend = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(bcf_int8_vector_end));
+    __m256i is_miss = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(bcf_int8_missing)), _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    __m256i is_alt  = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(3));
+    __m256i st = _mm256_andnot_si256(is_vend, _mm256_set1_epi8(2));
+    st = _mm256_sub_epi8(st, _mm256_and_si256(is_miss, one));
+    st = _mm256_add_epi8(st, _mm256_and_si256(is_alt, one));
+
+    __m256i same = _mm256_and_si256(_mm256_xor_si256(v, _mm256_srli_epi16(v, 8)), _mm256_set1_epi16(0xfe));
+    same = _mm256_and_si256(_mm256_cmpeq_epi16(same, _mm256_setzero_si256()), _mm256_set1_epi16(16));
+    __m256i key = _mm256_or_si256(_mm256_and_si256(st, lo), _mm256_slli_epi16(_mm256_srli_epi16(st, 8), 2));
+    key = _mm256_or_si256(key, same);
+
+    __m256i idx = _mm256_and_si256(_mm256_srli_epi16(v, 1), _mm256_set1_epi8(0x7f));
+    idx = _mm256_or_si256(_mm256_and_si256(is_alt, idx), _mm256_andnot_si256(is_alt, _mm256_set1_epi8(0x7f)));
+    idx = _mm256_min_epi16(_mm256_and_si256(idx, lo), _mm256_srli_epi16(idx, 8));
+    *ial = _mm256_sub_epi16(idx, _mm256_set1_epi16(1));
+    return key;
+}
+
+#elif defined(__SSE2__)
+
+// Keys and first-alt indexes of 8 samples held in v, returned in 16-bit lanes
+static inline __m128i gtkern_key8(__m128i v, __m128i *ial)
+{
+    const __m128i one = _mm_set1_epi8(1), lo = _mm_set1_epi16(0xff);
+    __m128i is_vend = _mm_cmpeq_epi8(v, _mm_set1_epi8(bcf_int8_vector_end));
+    __m128i is_miss = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(bcf_int8_missing)), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    __m128i is_alt  = _mm_cmpgt_epi8(v, _mm_set1_epi8(3));
+    __m128i st = _mm_andnot_si128(is_vend, _mm_set1_epi8(2));
+    st = _mm_sub_epi8(st, _mm_and_si128(is_miss, one));
+    st = _mm_add_epi8(st, _mm_and_si128(is_alt, one));
+
+    __m128i same = _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi16(v, 8)), _mm_set1_epi16(0xfe));
+    same = _mm_and_si128(_mm_cmpeq_epi16(same, _mm_setzero_si128()), _mm_set1_epi16(16));
+    __m128i key = _mm_or_si128(_mm_and_si128(st, lo), _mm_slli_epi16(_mm_srli_epi16(st, 8), 2));
+    key = _mm_or_si128(key, same);
+
+    __m128i idx = _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(0x7f));
+    idx = _mm_or_si128(_mm_and_si128(is_alt, idx), _mm_andnot_si128(is_alt, _mm_set1_epi8(0x7f)));
+    idx = _mm_min_epi16(_mm_and_si128(idx, lo), _mm_srli_epi16(idx, 8));
+    *ial = _mm_sub_epi16(idx, _mm_set1_epi16(1));
+    return key;
+}
+
+#endif
+
+/**
+ *  gtkern_classify_diploid8() - classify a row of diploid int8 genotypes
+ *  @gts:    2*nsmpl GT values as stored in bcf_fmt_t.p
+ *  @nsmpl:  number of samples
+ *  @type:   output, GT_* type of each sample, see bcf_gt_type()
+ *  @ial:    output, allele index of the lowest ALT allele of each sample
+ *           (1 for the first ALT) as returned by bcf_gt_type(), undefined
+ *           for GT_HOM_RR, GT_HAPL_R and GT_UNKN
+ */
+static inline void gtkern_classify_diploid8(const int8_t *gts, int nsmpl, uint8_t *type, uint8_t *ial)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i+32<=nsmpl; i+=32)
+    {
+        __m256i ial0, ial1;
+        __m256i key0 = gtkern_key16(_mm256_loadu_si256((const __m256i*)(gts+2*i)), &ial0);
+        __m256i key1 = gtkern_key16(_mm256_loadu_si256((const __m256i*)(gts+2*i+32)), &ial1);
+        // packus works within 128-bit lanes, restore the sample order
+        __m256i keys = _mm256_permute4x64_epi64(_mm256_packus_epi16(key0, key1), 0xd8);
+        __m256i ials = _mm256_permute4x64_epi64(_mm256_packus_epi16(ial0, ial1), 0xd8);
+        uint8_t tmp[32];
+        int j;
+        _mm256_storeu_si256((__m256i*)tmp, keys);
+        _mm256_storeu_si256((__m256i*)(ial+i), ials);
+        for (j=0; j<32; j++) type[i+j] = gtkern_key2type[tmp[j]];
+    }
+#elif defined(__SSE2__)
+    for (; i+16<=nsmpl; i+=16)
+    {
+        __m128i ial0, ial1;
+        __m128i key0 = gtkern_key8(_mm_loadu_si128((const __m128i*)(gts+2*i)), &ial0);
+        __m128i key1 = gtkern_key8(_mm_loadu_si128((const __m128i*)(gts+2*i+16)), &ial1);
+        uint8_t tmp[16];
+        int j;
+        _mm_storeu_si128((__m128i*)tmp, _mm_packus_epi16(key0, key1));
+        _mm_storeu_si128((__m128i*)(ial+i), _mm_packus_epi16(ial0, ial1));
+        for (j=0; j<16; j++) type[i+j] = gtkern_key2type[tmp[j]];
+    }
+#endif
+    for (; i<nsmpl; i++) gtkern_classify1(gts+2*i, type+i, ial+i);
+}
+
+#endif
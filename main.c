@@ -28,8 +28,18 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <htslib/hts.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
 #include "bcftools.h"
+#include "profile.h"
+#include "pipe.h"
+
+static int nthreads = 0;    // the global --threads option
+
+int profile_enabled = 0;    // the global --profile option
+profile_stage_t profile_stages[PROF_NSTAGES];
 
 void error(const char *format, ...)
 {
@@ -55,11 +65,13 @@ int main_vcfcall(int argc, char *argv[]);
 int main_vcfannotate(int argc, char *argv[]);
 int main_vcfroh(int argc, char *argv[]);
 int main_vcfconcat(int argc, char *argv[]);
+int main_vcfpipe(int argc, char *argv[]);
 
 typedef struct
 {
     int (*func)(int, char*[]);
     const char *alias, *help;
+    int pipe;   // PIPE_STAGE and PIPE_SHARD flags, see pipe.h
 }
 cmd_t;
 
@@ -86,6 +98,7 @@ static cmd_t cmds[] =
     { .func  = main_vcfannotate,  
       .alias = "annotate", 
       .help  = "annotate and edit VCF/BCF files",
+      .pipe  = PIPE_STAGE|PIPE_SHARD
     },
     { .func  = main_vcfconcat,  
       .alias = "concat", 
@@ -101,7 +114,12 @@ static cmd_t cmds[] =
     },
     { .func  = main_vcfnorm, 
       .alias = "norm",
-      .help  = "left-align and normalize indels"
+      .help  = "left-align and normalize indels",
+      .pipe  = PIPE_STAGE
+    },
+    { .func  = main_vcfpipe, 
+      .alias = "pipe",
+      .help  = "run several commands in one process"
     },
     { .func  = main_vcfquery, 
       .alias = "query",
@@ -109,7 +127,8 @@ static cmd_t cmds[] =
     },
     { .func  = main_vcfview,  
       .alias = "view", 
-      .help  = "VCF/BCF conversion, view, subset and filter VCF/BCF files"
+      .help  = "VCF/BCF conversion, view, subset and filter VCF/BCF files",
+      .pipe  = PIPE_STAGE|PIPE_SHARD
     },
 
     { .func  = NULL, 
@@ -119,11 +138,13 @@ static cmd_t cmds[] =
 
     { .func  = main_vcfcall,  
       .alias = "call", 
-      .help  = "SNP/indel calling"
+      .help  = "SNP/indel calling",
+      .pipe  = PIPE_STAGE
     },
     { .func  = main_vcffilter, 
       .alias = "filter",
-      .help  = "filter VCF/BCF files using fixed thresholds"
+      .help  = "filter VCF/BCF files using fixed thresholds",
+      .pipe  = PIPE_STAGE|PIPE_SHARD
     },
     { .func  = main_vcfgtcheck, 
       .alias = "gtcheck",
@@ -148,18 +169,95 @@ static cmd_t cmds[] =
     }
 };
 
+pipe_cmd_f pipe_stage_cmd(const char *alias, int *flags)
+{
+    int i;
+    for (i=0; cmds[i].alias; i++)
+        if ( cmds[i].func && cmds[i].pipe && !strcmp(alias,cmds[i].alias) )
+        {
+            *flags = cmds[i].pipe;
+            return cmds[i].func;
+        }
+    return NULL;
+}
+
 char *bcftools_version(void)
 {
     return BCFTOOLS_VERSION;
 }
 
+htsFile *hts_open_mt(const char *fname, const char *mode)
+{
+    htsFile *fp = hts_open(fname, mode);
+    if ( !fp || nthreads<=0 || !strchr(mode,'w') || strchr(mode,'u') ) return fp;
+    if ( strchr(mode,'b') || strchr(mode,'z') ) bgzf_mt(fp->fp.bgzf, nthreads, 256);
+    return fp;
+}
+
+int bcf_hdr_subset_reader(bcf_hdr_t *hdr, int n, char **samples, int *imap)
+{
+    int i, j;
+    for (i=0; i<n; i++)
+    {
+        if ( strchr(samples[i],',') || bcf_hdr_id2int(hdr, BCF_DT_SAMPLE, samples[i])<0 ) return -1;
+        for (j=0; j<i; j++)
+            if ( !strcmp(samples[i],samples[j]) ) return -1;
+    }
+
+    kstring_t str = {0,0,0};
+    for (i=0; i<n; i++)
+    {
+        if ( i ) kputc(',', &str);
+        kputs(samples[i], &str);
+    }
+    int ret = bcf_hdr_set_samples(hdr, str.s, 0);
+    free(str.s);
+    if ( ret ) error("Could not restrict the samples of the reader\n");
+
+    // bcf_hdr_set_samples() keeps the order of the file
+    int in_order = 1;
+    for (i=0; i<n; i++)
+    {
+        int idx = bcf_hdr_id2int(hdr, BCF_DT_SAMPLE, samples[i]);
+        if ( idx!=i ) in_order = 0;
+        if ( imap ) imap[i] = idx;
+    }
+    return in_order;
+}
+
+void profile_report(FILE *fp)
+{
+    static const char *names[PROF_NSTAGES] = { "read", "unpack", "filter", "call", "merge", "annotate", "subset", "format", "write" };
+    double wall = 0, cpu = 0;
+    int i;
+    for (i=0; i<PROF_NSTAGES; i++)
+    {
+        wall += profile_stages[i].wall;
+        cpu  += profile_stages[i].cpu;
+    }
+    fprintf(fp, "[profile] stage\twall_s\tcpu_s\twall_%%\trecords\tns/record\n");
+    for (i=0; i<PROF_NSTAGES; i++)
+    {
+        profile_stage_t *st = &profile_stages[i];
+        if ( !st->nrec && !st->wall ) continue;
+        fprintf(fp, "[profile] %s\t%.3f\t%.3f\t%.1f\t%"PRIu64"\t", names[i], st->wall, st->cpu, wall ? 100*st->wall/wall : 0, st->nrec);
+        if ( st->nrec ) fprintf(fp, "%.0f\n", st->wall*1e9/st->nrec);
+        else fprintf(fp, ".\n");
+    }
+    fprintf(fp, "[profile] total\t%.3f\t%.3f\t100.0\t.\t.\n", wall, cpu);
+}
+
 static void usage(FILE *fp)
 {
     fprintf(fp, "\n");
     fprintf(fp, "Program: bcftools (Tools for variant calling and manipulating VCFs and BCFs)\n");
     fprintf(fp, "Version: %s (using htslib %s)\n", bcftools_version(), hts_version());
     fprintf(fp, "\n");
-    fprintf(fp, "Usage:   bcftools <command> <argument>\n");
+    fprintf(fp, "Usage:   bcftools [--threads <int>] [--profile] <command> <argument>\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "    --threads <int>  compress BGZF output in <int> threads, input is read in one thread\n");
+    fprintf(fp, "    --profile        print time spent in the stages of the main loop to stderr at exit\n");
     fprintf(fp, "\n");
     fprintf(fp, "Commands:\n");
 
@@ -187,6 +285,25 @@ static void usage(FILE *fp)
 
 int main(int argc, char *argv[])
 {
+    // Global options preceding the command, commands which have their own
+    // --threads option are not affected
+    while (argc > 1 && (!strncmp(argv[1], "--threads", 9) || !strcmp(argv[1], "--profile")))
+    {
+        if (!strcmp(argv[1], "--profile"))
+        {
+            profile_enabled = 1;
+            argv++; argc--;
+            continue;
+        }
+        char *val = NULL, *end;
+        if (argv[1][9] == '=') val = argv[1] + 10;
+        else if (!argv[1][9] && argc > 2) { val = argv[2]; argv++; argc--; }
+        if (!val) break;
+        nthreads = strtol(val, &end, 10);
+        if (*end || nthreads < 0) error("Could not parse: --threads %s\n", val);
+        argv++; argc--;
+    }
+
     if (argc < 2) { usage(stderr); return 1; }
 
     if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
@@ -211,7 +328,9 @@ int main(int argc, char *argv[])
     {
         if (cmds[i].func && strcmp(argv[1],cmds[i].alias)==0)
         {
-            return cmds[i].func(argc-1,argv+1);
+            int ret = cmds[i].func(argc-1,argv+1);
+            if (profile_enabled) profile_report(stderr);
+            return ret;
         }
         i++;
     }
@@ -24,6 +24,8 @@
  */
 
 #include <math.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include <htslib/kfunc.h>
 #include "call.h"
 
@@ -41,7 +43,10 @@ void call_init_pl2p(call_t *call)
 {
     int i;
     for (i=0; i<256; i++)
-        call->pl2p[i] = pow(10., -i/10.);
+    {
+        call->pl2p[i]  = pow(10., -i/10.);
+        call->pl2lp[i] = log(call->pl2p[i]);
+    }
 }
 
 // Macros for accessing call->trio and call->ntrio
@@ -53,6 +58,12 @@ void call_init_pl2p(call_t *call)
 
 #define GT_SKIP 0xf     // empty genotype (chrY in females)
 
+#define FAM_CHUNK 32    // families of the same type evaluated together
+
+#define SMPL_CHUNK   4096   // samples handed out to a thread at a time by the per-sample loops
+#define SMPL_PAR_MIN 16384  // the per-sample loops are split between threads only with this many samples
+#define GTS_NCNT     6      // genotype counts of mcall_call_genotypes(): AC of four alleles, nhets, ndiploid
+
 #define IS_POW2(x) (!((x) & ((x) - 1)))    // zero is permitted
 #define IS_HOM(x)  IS_POW2(x)
 
@@ -180,9 +191,6 @@ static void mcall_init_trios(call_t *call)
         assert( n==call->ntrio[FTYPE_100][nals] );
 
     }
-    call->GLs = (double*) calloc(bcf_hdr_nsamples(call->hdr)*10,sizeof(double));
-    call->GQs = (float*) malloc(sizeof(float)*bcf_hdr_nsamples(call->hdr));
-
     int i, j;
     for (i=0; i<call->nfams; i++)
     {
@@ -213,6 +221,26 @@ static void mcall_init_trios(call_t *call)
             fam->type = ploidy[CHILD]==0 ? FTYPE_100 : FTYPE_101;   // a girl or a boy
         }
     }
+
+    // Group the families by type and split them into chunks so that the
+    // trio genotype combinations can be scanned for many families at once
+    int n = 0, nchunk = call->fam_chunk > 0 && call->fam_chunk < FAM_CHUNK ? call->fam_chunk : FAM_CHUNK;
+    call->fam_order  = (int*) malloc(sizeof(int)*call->nfams);
+    call->fam_chunks = (fam_chunk_t*) malloc(sizeof(fam_chunk_t)*(call->nfams/nchunk + 5));
+    call->nfam_chunks = 0;
+    for (itype=0; itype<=4; itype++)
+    {
+        int beg = n;
+        for (i=0; i<call->nfams; i++)
+            if ( call->fams[i].type==itype ) call->fam_order[n++] = i;
+        for (; beg<n; beg+=nchunk)
+        {
+            fam_chunk_t *chunk = &call->fam_chunks[call->nfam_chunks++];
+            chunk->type = itype;
+            chunk->beg  = beg;
+            chunk->end  = beg+nchunk < n ? beg+nchunk : n;
+        }
+    }
 }
 static void mcall_destroy_trios(call_t *call)
 {
@@ -220,12 +248,245 @@ static void mcall_destroy_trios(call_t *call)
     for (i=2; i<=4; i++) 
         for (j=0; j<=4; j++) 
             free(call->trio[j][i]);
+    free(call->fam_order);
+    free(call->fam_chunks);
 }
 
-void mcall_init(call_t *call) 
-{ 
-    call_init_pl2p(call);
+/*
+ *  Find the most likely trio genotype combination of a chunk of families,
+ *  see mcall_call_trio_genotypes(). The genotype likelihoods are laid out
+ *  by family member, genotype and family, so that for each combination the
+ *  whole chunk is evaluated in a loop the compiler can vectorise. Missing
+ *  samples and GT_SKIP have zero log-likelihoods. The penalty is applied
+ *  only when all three members are present, otherwise Pkij=1 and the
+ *  penalty is log(1)=0, the results are the same as adding the terms one
+ *  by one.
+ */
+static void mcall_trio_chunk(call_t *call, fam_chunk_t *chunk, int ngts, int nout_als)
+{
+    double gl[3][16][FAM_CHUNK], c_lk[FAM_CHUNK], uc_lk[FAM_CHUNK], has3[FAM_CHUNK];
+    int c_itr[FAM_CHUNK], uc_itr[FAM_CHUNK], uc_is_mendelian[FAM_CHUNK];
+    int i, j, f, itr, n = chunk->end - chunk->beg;
+    int ntrio = call->ntrio[chunk->type][nout_als];
+    uint16_t *trio = call->trio[chunk->type][nout_als];
+
+    for (f=0; f<n; f++)
+    {
+        family_t *fam = &call->fams[ call->fam_order[chunk->beg + f] ];
+        int npresent = 0;
+        uc_itr[f] = 0;
+        uc_lk[f]  = 0;
+        for (i=0; i<3; i++)     // for father, mother, child
+        {
+            double *src = call->GLs + ngts*fam->sample[i];
+            gl[i][GT_SKIP][f] = 0;
+            if ( src[0]==1 )
+            {
+                for (j=0; j<ngts; j++) gl[i][j][f] = 0;
+                continue;
+            }
+            npresent++;
+
+            // Unconstrained likelihood
+            int jmax = 0;
+            double max = src[0];
+            for (j=0; j<ngts; j++)
+            {
+                gl[i][j][f] = src[j];
+                if ( max < src[j] ) { max = src[j]; jmax = j; }
+            }
+            uc_lk[f] += max;
+            uc_itr[f] |= jmax << ((2-i)*4);
+        }
+        has3[f] = npresent==3 && chunk->type!=FTYPE_101 && chunk->type!=FTYPE_100 ? 1 : 0;
+        c_lk[f]  = -HUGE_VAL;
+        c_itr[f] = -1;
+        uc_is_mendelian[f] = 0;
+    }
+
+    // Best constrained likelihood
+    for (itr=0; itr<ntrio; itr++)   // for each trio genotype combination
+    {
+        int tr = trio[itr];
+        const double *gf = gl[FATHER][tr>>8 & 0xf], *gm = gl[MOTHER][tr>>4 & 0xf], *gk = gl[CHILD][tr & 0xf];
+        double lpen = call->trio_lpen[tr>>12];
+        for (f=0; f<n; f++)
+        {
+            double lk = gf[f] + gm[f] + gk[f] + has3[f]*lpen;
+            if ( c_lk[f] < lk ) { c_lk[f] = lk; c_itr[f] = tr; }
+            uc_is_mendelian[f] |= uc_itr[f]==tr;
+        }
+    }
+
+    for (f=0; f<n; f++)
+    {
+        if ( !uc_is_mendelian[f] )
+        {
+            uc_lk[f] += call->trio_lpen_uc;
+            if ( c_lk[f] < uc_lk[f] ) { c_lk[f] = uc_lk[f]; c_itr[f] = uc_itr[f]; }
+        }
+        call->fam_itr[ call->fam_order[chunk->beg + f] ] = c_itr[f];
+    }
+}
+
+/*
+ *  Threads working on one record: the family chunks of trio calling and the
+ *  sample chunks of the per-sample loops. The calling thread takes part,
+ *  chunks are handed out one at a time.
+ */
+typedef void (*pool_job_f)(call_t *call, void *data, int ichunk);
+struct _mcall_pool_t
+{
+    call_t *call;
+    int nthreads, quit;
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int job, nchunks, ichunk_next, nchunks_done;     // job is incremented for each run
+    pool_job_f run;
+    void *data;
+
+    // per-sample loops, only with smpl_nthreads>1 and at least SMPL_PAR_MIN samples
+    int nsmpl_chunks, smpl_chunk;
+    double *lk_terms;       // per-sample log-likelihood terms of an allele combination, HUGE_VAL if not set
+    int *gts_cnts;          // per-chunk genotype counts of mcall_call_genotypes()
+};
+
+// Called and returns with the lock held
+static void mcall_pool_run_chunks(mcall_pool_t *pool)
+{
+    while ( pool->ichunk_next < pool->nchunks )
+    {
+        int ichunk = pool->ichunk_next++;
+        pool_job_f run = pool->run;
+        void *data = pool->data;
+        pthread_mutex_unlock(&pool->lock);
+        run(pool->call, data, ichunk);
+        pthread_mutex_lock(&pool->lock);
+        if ( ++pool->nchunks_done == pool->nchunks ) pthread_cond_signal(&pool->done);
+    }
+}
+
+static void *mcall_pool_worker(void *data)
+{
+    mcall_pool_t *pool = (mcall_pool_t*) data;
+    int job = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while ( pool->job==job && !pool->quit ) pthread_cond_wait(&pool->work, &pool->lock);
+        if ( pool->quit ) break;
+        job = pool->job;
+        mcall_pool_run_chunks(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void mcall_pool_init(call_t *call)
+{
+    int nsmpl = bcf_hdr_nsamples(call->hdr);
+    int use_trio = call->trio_nthreads > 1 && call->nfam_chunks > 1;
+    int smpl_chunk = call->smpl_chunk > 0 ? call->smpl_chunk : SMPL_CHUNK;
+    int smpl_par_min = call->smpl_chunk > 0 ? call->smpl_chunk : SMPL_PAR_MIN;
+    int use_smpl = call->smpl_nthreads > 1 && nsmpl >= smpl_par_min;
+    if ( !use_trio && !use_smpl ) return;
+
+    mcall_pool_t *pool = (mcall_pool_t*) calloc(1, sizeof(mcall_pool_t));
+    pool->call = call;
+    pool->nthreads = (call->trio_nthreads > call->smpl_nthreads ? call->trio_nthreads : call->smpl_nthreads) - 1;  // the calling thread is one of them
+    if ( use_smpl )
+    {
+        pool->smpl_chunk = smpl_chunk;
+        pool->nsmpl_chunks = (nsmpl + smpl_chunk - 1) / smpl_chunk;
+        pool->lk_terms = (double*) malloc(sizeof(double)*nsmpl);
+        pool->gts_cnts = (int*) malloc(sizeof(int)*GTS_NCNT*pool->nsmpl_chunks);
+    }
+    pool->tids = (pthread_t*) malloc(sizeof(pthread_t)*pool->nthreads);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    int i;
+    for (i=0; i<pool->nthreads; i++)
+        if ( pthread_create(&pool->tids[i], NULL, mcall_pool_worker, pool) ) error("Failed to create a thread\n");
+    call->pool = pool;
+}
+
+static void mcall_pool_destroy(mcall_pool_t *pool)
+{
+    if ( !pool ) return;
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<pool->nthreads; i++) pthread_join(pool->tids[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->lk_terms);
+    free(pool->gts_cnts);
+    free(pool->tids);
+    free(pool);
+}
+
+// Runs the job on chunks 0..nchunks-1 and returns when all are done
+static void mcall_pool_run(call_t *call, pool_job_f run, void *data, int nchunks)
+{
+    mcall_pool_t *pool = call->pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->data = data;
+    pool->nchunks = nchunks;
+    pool->ichunk_next = 0;
+    pool->nchunks_done = 0;
+    pool->job++;
+    pthread_cond_broadcast(&pool->work);
+    mcall_pool_run_chunks(pool);
+    while ( pool->nchunks_done < nchunks ) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// The per-sample loops are split between threads
+#define SMPL_POOL(call) ((call)->pool && (call)->pool->nsmpl_chunks)
+
+static inline void smpl_chunk_range(call_t *call, int ichunk, int *beg, int *end)
+{
+    int nsmpl = bcf_hdr_nsamples(call->hdr);
+    int n = call->pool->smpl_chunk;
+    *beg = ichunk * n;
+    *end = *beg + n < nsmpl ? *beg + n : nsmpl;
+}
+
+typedef struct
+{
+    int ngts, nout_als;
+}
+trio_job_t;
+
+static void trio_job(call_t *call, void *data, int ichunk)
+{
+    trio_job_t *job = (trio_job_t*) data;
+    mcall_trio_chunk(call, &call->fam_chunks[ichunk], job->ngts, job->nout_als);
+}
 
+// Fill fam_itr with the most likely genotype combination of all families
+static void mcall_trio_families(call_t *call, int ngts, int nout_als)
+{
+    int i;
+    if ( !call->pool || call->trio_nthreads<2 || call->nfam_chunks<2 )
+    {
+        for (i=0; i<call->nfam_chunks; i++) mcall_trio_chunk(call, &call->fam_chunks[i], ngts, nout_als);
+        return;
+    }
+    trio_job_t job = { ngts, nout_als };
+    mcall_pool_run(call, trio_job, &job, call->nfam_chunks);
+}
+
+// Allocate temporary arrays which are modified during calling. These are
+// private to each call_t context, including the per-thread copies.
+static void mcall_init_tmp(call_t *call)
+{
     call->nqsum = 5;
     call->qsum  = (float*) malloc(sizeof(float)*call->nqsum); 
     call->nals_map = 5;
@@ -233,16 +494,47 @@ void mcall_init(call_t *call)
     call->npl_map  = 5*(5+1)/2;
     call->pl_map   = (int*) malloc(sizeof(int)*call->npl_map);
     call->gts  = (int32_t*) calloc(bcf_hdr_nsamples(call->hdr)*2,sizeof(int32_t));   // assuming at most diploid everywhere
+    call->lnorm = (double*) malloc(sizeof(double)*bcf_hdr_nsamples(call->hdr));
 
     if ( call->flag & CALL_CONSTR_TRIO ) 
     {
         call->cgts = (int32_t*) calloc(bcf_hdr_nsamples(call->hdr),sizeof(int32_t));
         call->ugts = (int32_t*) calloc(bcf_hdr_nsamples(call->hdr),sizeof(int32_t));
+        call->GLs  = (double*) calloc(bcf_hdr_nsamples(call->hdr)*10,sizeof(double));
+        call->GQs  = (float*) malloc(sizeof(float)*bcf_hdr_nsamples(call->hdr));
+        call->fam_itr = (int*) malloc(sizeof(int)*(call->nfams+1));
+    }
+    if ( call->flag & CALL_CONSTR_ALLELES ) call->vcmp = vcmp_init();
+}
+static void mcall_destroy_tmp(call_t *call)
+{
+    if (call->vcmp) vcmp_destroy(call->vcmp);
+    free(call->itmp);
+    free(call->GLs);
+    free(call->GQs);
+    free(call->fam_itr);
+    free(call->anno16);
+    free(call->PLs);
+    free(call->qsum);
+    free(call->als_map);
+    free(call->pl_map);
+    free(call->gts); free(call->cgts); free(call->ugts);
+    free(call->pdg);
+    free(call->lnorm);
+    free(call->als);
+}
+
+void mcall_init(call_t *call) 
+{ 
+    call_init_pl2p(call);
+    mcall_init_tmp(call);
+
+    if ( call->flag & CALL_CONSTR_TRIO ) 
+    {
         mcall_init_trios(call);
         bcf_hdr_append(call->hdr,"##FORMAT=<ID=CGT,Number=1,Type=Integer,Description=\"Constrained Genotype (0-based index to Number=G ordering).\">");
         bcf_hdr_append(call->hdr,"##FORMAT=<ID=UGT,Number=1,Type=Integer,Description=\"Unconstrained Genotype (0-based index to Number=G ordering).\">");
     }
-    if ( call->flag & CALL_CONSTR_ALLELES ) call->vcmp = vcmp_init();
 
     bcf_hdr_append(call->hdr,"##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
     bcf_hdr_append(call->hdr,"##FORMAT=<ID=GQ,Number=1,Type=Float,Description=\"Genotype Quality\">");
@@ -253,36 +545,54 @@ void mcall_init(call_t *call)
     bcf_hdr_append(call->hdr,"##INFO=<ID=DP4,Number=4,Type=Integer,Description=\"Number of high-quality ref-forward , ref-reverse, alt-forward and alt-reverse bases\">");
     bcf_hdr_append(call->hdr,"##INFO=<ID=MQ,Number=1,Type=Integer,Description=\"Average mapping quality\">");
 
+    mcall_pool_init(call);
     return; 
 }
 
 void mcall_destroy(call_t *call) 
 { 
-    if (call->vcmp) vcmp_destroy(call->vcmp);
-    free(call->itmp);
+    mcall_pool_destroy(call->pool);
+    mcall_destroy_tmp(call);
     mcall_destroy_trios(call);
-    free(call->GLs);
-    free(call->GQs);
-    free(call->anno16);
-    free(call->PLs);
-    free(call->qsum);
-    free(call->als_map);
-    free(call->pl_map);
-    free(call->gts); free(call->cgts); free(call->ugts);
-    free(call->pdg);
-    free(call->als);
     return; 
 }
 
+void mcall_init_worker(call_t *dst, call_t *src)
+{
+    // The struct copy shares the header, ploidy, families and trio tables
+    // with the master context, these are never modified during calling.
+    *dst = *src;
+    dst->itmp = NULL; dst->n_itmp = 0;
+    dst->GLs  = NULL; dst->GQs = NULL;
+    dst->anno16 = NULL; dst->n16 = 0;
+    dst->PLs  = NULL; dst->nPLs = dst->mPLs = 0;
+    dst->pdg  = NULL; dst->npdg = 0;
+    dst->als  = NULL; dst->nals = 0;
+    dst->cgts = dst->ugts = NULL;
+    dst->fam_itr = NULL;
+    dst->pool = NULL;   // the families and samples of worker contexts are evaluated serially
+    dst->vcmp = NULL;
+    memset(dst->timing, 0, sizeof(dst->timing));
+    dst->nals_pruned = 0;
+    mcall_init_tmp(dst);
+}
+
+void mcall_destroy_worker(call_t *call)
+{
+    mcall_destroy_tmp(call);
+}
+
 
 // Inits P(D|G): convert PLs from log space and normalize. In case of zero
 // depth, missing PLs are all zero. In this case, pdg's are set to 0
 // so that the corresponding genotypes can be set as missing and the
-// qual calculation is not affected.
+// qual calculation is not affected. The log of the normalization is saved
+// in lnorm so that log(pdg) can be obtained as pl2lp[PL]-lnorm without
+// going through exp and log again; it is HUGE_VAL for samples with no data.
 // NB: While the -m callig model uses the pdgs in canonical order, 
 // the original samtools -c calling code uses pdgs in reverse order (AA comes
 // first, RR last).
-void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt)
+void set_pdg(double *pl2p, int *PLs, double *pdg, double *lnorm, int n_smpl, int n_gt)
 {
     int i, j;
     for (i=0; i<n_smpl; i++)
@@ -296,15 +606,28 @@ void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt)
         }
         // Normalize: sum_i pdg_i = 1
         if ( sum!=n_gt )
+        {
             for (j=0; j<n_gt; j++) pdg[j] /= sum;
+            lnorm[i] = log(sum);
+        }
         else
+        {
             for (j=0; j<n_gt; j++) pdg[j] = 0;
+            lnorm[i] = HUGE_VAL;
+        }
 
         PLs += n_gt;
         pdg += n_gt;
     }
 }
 
+static void pdg_job(call_t *call, void *data, int ichunk)
+{
+    int beg, end, ngts = *((int*)data);
+    smpl_chunk_range(call, ichunk, &beg, &end);
+    set_pdg(call->pl2p, call->PLs + beg*ngts, call->pdg + beg*ngts, call->lnorm + beg, end - beg, ngts);
+}
+
 // Create mapping between old and new (trimmed) alleles
 void init_allele_trimming_maps(call_t *call, int als, int nals)
 {
@@ -416,6 +739,95 @@ static inline double logsumexp2(double a, double b)
 
 #define SWAP(type_t,x,y) {type_t tmp; tmp = x; x = y; y = tmp; }
 
+/*
+ *  Returns 1 if a combination of alleles cannot change the outcome of
+ *  mcall_find_best_alleles() and can be skipped. The likelihood of each
+ *  sample is a weighted mean of the P(D|G) of the genotypes gts, so it is
+ *  bounded by the largest of them, which is given directly by the smallest
+ *  PL. If the bounded total is below the second best likelihood so far, the
+ *  combination cannot be selected, and if it is also more than 37 below
+ *  lk_sum, exp() of the difference is lost in 1+exp() in logsumexp2() and
+ *  lk_sum would not change either. The result is therefore the same as
+ *  with the full calculation.
+ */
+static int mcall_prune_alleles(call_t *call, int ngts, int *gts, int ngt, double max_lk2, double lk_sum)
+{
+    if ( lk_sum==-HUGE_VAL ) return 0;
+    int i, isample, nsmpl = bcf_hdr_nsamples(call->hdr);
+    double bound = 0;
+    int *pl = call->PLs;
+    for (isample=0; isample<nsmpl; isample++, pl+=ngts)
+    {
+        if ( call->lnorm[isample]==HUGE_VAL ) continue;
+        if ( call->ploidy && !call->ploidy[isample] ) continue;
+        int min = pl[gts[0]];
+        for (i=1; i<ngt; i++) if ( min > pl[gts[i]] ) min = pl[gts[i]];
+        bound += call->pl2lp[min] - call->lnorm[isample];
+    }
+    bound += 1e-6;  // rounding errors of the two sums
+    return bound < max_lk2 && bound < lk_sum - 37 ? 1 : 0;
+}
+
+typedef struct
+{
+    int ngts, nhom, ngt, *gts;
+    double *f;
+}
+lk_job_t;
+
+// The per-sample likelihood terms of an allele combination, see mcall_lk_combination()
+static void lk_job(call_t *call, void *data, int ichunk)
+{
+    lk_job_t *job = (lk_job_t*) data;
+    int beg, end, i, isample;
+    smpl_chunk_range(call, ichunk, &beg, &end);
+    double *pdg = call->pdg + beg*job->ngts;
+    for (isample=beg; isample<end; isample++)
+    {
+        int n = 0;
+        if ( !call->ploidy || call->ploidy[isample]==2 ) n = job->ngt;
+        else if ( call->ploidy && call->ploidy[isample]==1 ) n = job->nhom;
+        double val = 0;
+        for (i=0; i<n; i++) val += job->f[i]*pdg[job->gts[i]];
+        call->pool->lk_terms[isample] = val ? log(val) : HUGE_VAL;
+        pdg += job->ngts;
+    }
+}
+
+/*
+ *  The log-likelihood of an allele combination: the sum over samples of the
+ *  log of the weighted P(D|G) of the genotypes gts with the frequencies f.
+ *  Haploid samples use only the first nhom, homozygous, genotypes. With the
+ *  sample threads, the logs are calculated in parallel and added up in the
+ *  order of samples, so that the result does not depend on the threads.
+ */
+static double mcall_lk_combination(call_t *call, int ngts, int nhom, int ngt, int *gts, double *f, int *lk_tot_set)
+{
+    int i, isample, nsmpl = bcf_hdr_nsamples(call->hdr);
+    double lk_tot = 0;
+    if ( SMPL_POOL(call) )
+    {
+        lk_job_t job = { ngts, nhom, ngt, gts, f };
+        mcall_pool_run(call, lk_job, &job, call->pool->nsmpl_chunks);
+        double *terms = call->pool->lk_terms;
+        for (isample=0; isample<nsmpl; isample++)
+            if ( terms[isample]!=HUGE_VAL ) { lk_tot += terms[isample]; *lk_tot_set = 1; }
+        return lk_tot;
+    }
+    double *pdg = call->pdg;
+    for (isample=0; isample<nsmpl; isample++)
+    {
+        int n = 0;
+        if ( !call->ploidy || call->ploidy[isample]==2 ) n = ngt;
+        else if ( call->ploidy && call->ploidy[isample]==1 ) n = nhom;
+        double val = 0;
+        for (i=0; i<n; i++) val += f[i]*pdg[gts[i]];
+        if ( val ) { lk_tot += log(val); *lk_tot_set = 1; }
+        pdg += ngts;
+    }
+    return lk_tot;
+}
+
 // Determine the most likely combination of alleles. In this implementation,
 // at most tri-allelic sites are considered. Returns the number of alleles.
 static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
@@ -434,11 +846,11 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
         int lk_tot_set = 0;
         int iaa = (ia+1)*(ia+2)/2-1;    // index in PL which corresponds to the homozygous "ia/ia" genotype
         int isample;
-        double *pdg = call->pdg + iaa;
+        int *pl = call->PLs + iaa;
         for (isample=0; isample<nsmpl; isample++)
         {
-            if ( *pdg ) { lk_tot += log(*pdg); lk_tot_set = 1; }
-            pdg += ngts;
+            if ( call->lnorm[isample]!=HUGE_VAL ) { lk_tot += call->pl2lp[*pl] - call->lnorm[isample]; lk_tot_set = 1; }
+            pl += ngts;
         }
         if ( ia==0 ) ref_lk = lk_tot;   // likelihood of 0/0 for all samples
         UPDATE_MAX_LKs(1<<ia);
@@ -454,23 +866,15 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
             for (ib=0; ib<ia; ib++)
             {
                 if ( call->qsum[ib]==0 ) continue;
-                double lk_tot  = 0;
+                int ibb = (ib+1)*(ib+2)/2-1, iab = iaa - ia + ib;
+                int gts[3] = { iaa, ibb, iab };
+                if ( mcall_prune_alleles(call, ngts, gts, 3, max_lk2, lk_sum) ) { call->nals_pruned++; continue; }
                 int lk_tot_set = 0;
                 double fa  = call->qsum[ia]/(call->qsum[ia]+call->qsum[ib]);
                 double fb  = call->qsum[ib]/(call->qsum[ia]+call->qsum[ib]);
                 double fab = 2*fa*fb; fa *= fa; fb *= fb;
-                int isample, ibb = (ib+1)*(ib+2)/2-1, iab = iaa - ia + ib;
-                double *pdg  = call->pdg;
-                for (isample=0; isample<nsmpl; isample++)
-                {
-                    double val = 0;
-                    if ( !call->ploidy || call->ploidy[isample]==2 )
-                        val = fa*pdg[iaa] + fb*pdg[ibb] + fab*pdg[iab];
-                    else if ( call->ploidy && call->ploidy[isample]==1 )
-                        val = fa*pdg[iaa] + fb*pdg[ibb];
-                    if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
-                    pdg += ngts;
-                }
+                double f[3] = { fa, fb, fab };
+                double lk_tot = mcall_lk_combination(call, ngts, 2, 3, gts, f, &lk_tot_set);
                 UPDATE_MAX_LKs(1<<ia|1<<ib);
             }
         }
@@ -491,25 +895,17 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                 for (ic=0; ic<ib; ic++)
                 {
                     if ( call->qsum[ic]==0 ) continue;
-                    double lk_tot  = 0;
+                    int icc = (ic+1)*(ic+2)/2-1;
+                    int iac = iaa - ia + ic, ibc = ibb - ib + ic;
+                    int gts[6] = { iaa, ibb, icc, iab, iac, ibc };
+                    if ( mcall_prune_alleles(call, ngts, gts, 6, max_lk2, lk_sum) ) { call->nals_pruned++; continue; }
                     int lk_tot_set = 1;
                     double fa  = call->qsum[ia]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fb  = call->qsum[ib]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fc  = call->qsum[ic]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fab = 2*fa*fb, fac = 2*fa*fc, fbc = 2*fb*fc; fa *= fa; fb *= fb; fc *= fc;
-                    int isample, icc = (ic+1)*(ic+2)/2-1;
-                    int iac = iaa - ia + ic, ibc = ibb - ib + ic;
-                    double *pdg = call->pdg;
-                    for (isample=0; isample<nsmpl; isample++)
-                    {
-                        double val = 0;
-                        if ( !call->ploidy || call->ploidy[isample]==2 )
-                            val = fa*pdg[iaa] + fb*pdg[ibb] + fc*pdg[icc] + fab*pdg[iab] + fac*pdg[iac] + fbc*pdg[ibc];
-                        else if ( call->ploidy && call->ploidy[isample]==1 )
-                            val = fa*pdg[iaa] + fb*pdg[ibb] + fc*pdg[icc];
-                        if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
-                        pdg += ngts;
-                    }
+                    double f[6] = { fa, fb, fc, fab, fac, fbc };
+                    double lk_tot = mcall_lk_combination(call, ngts, 3, 6, gts, f, &lk_tot_set);
                     UPDATE_MAX_LKs(1<<ia|1<<ib|1<<ic);
                 }
             }
@@ -576,21 +972,24 @@ static void mcall_set_ref_genotypes(call_t *call, int nals)
     }
 }
 
-static void mcall_call_genotypes(call_t *call, int nals, int nout_als, int out_als)
+// The homozygous and heterozygous genotypes of the selected alleles, so
+// that out_als does not have to be scanned again for each sample
+typedef struct
 {
-    int ia, ib, i;
-    int ngts  = nals*(nals+1)/2;
-    int nsmpl = bcf_hdr_nsamples(call->hdr);
-
-    for (i=0; i<4; i++) call->ac[i] = 0;
-    call->nhets = 0;
-    call->ndiploid = 0;
+    int ngts, nhom, nhet, hom_gt[5], hom_al[5], het_gt[10], het_al[10], het_bl[10];
+    float hom_q[5], het_qa[10], het_qb[10];
+    int *cnts;      // per sample chunk: ac[4], nhets, ndiploid
+}
+gts_job_t;
 
-    double *pdg  = call->pdg - ngts;
-    int *gts  = call->gts - 2;
+static void mcall_call_genotypes_range(call_t *call, gts_job_t *job, int beg, int end, int *cnt)
+{
+    int i, ngts = job->ngts;
+    double *pdg  = call->pdg + (beg-1)*ngts;
+    int *gts  = call->gts + (beg-1)*2;
 
     int isample;
-    for (isample = 0; isample < nsmpl; isample++) 
+    for (isample = beg; isample < end; isample++) 
     {
         int ploidy = call->ploidy ? call->ploidy[isample] : 2;
 
@@ -606,7 +1005,7 @@ static void mcall_call_genotypes(call_t *call, int nals, int nout_als, int out_a
         }
         else
         {
-            if ( ploidy==2 ) call->ndiploid++;
+            if ( ploidy==2 ) cnt[5]++;
 
             // Default fallback for the case all LKs are the same
             gts[0] = bcf_gt_unphased(0);
@@ -614,46 +1013,91 @@ static void mcall_call_genotypes(call_t *call, int nals, int nout_als, int out_a
 
             // Non-zero depth, determine the most likely genotype
             double best_lk = 0;
-            for (ia=0; ia<nals; ia++)
+            for (i=0; i<job->nhom; i++)
             {
-                if ( !(out_als & 1<<ia) ) continue;     // ia-th allele not in the final selection, skip
-                int iaa = (ia+1)*(ia+2)/2-1;            // PL index of the ia/ia genotype
-                double lk = pdg[iaa]*call->qsum[ia]*call->qsum[ia];
+                double lk = pdg[job->hom_gt[i]]*job->hom_q[i]*job->hom_q[i];
                 if ( best_lk < lk ) 
                 { 
                     best_lk = lk; 
-                    gts[0] = bcf_gt_unphased(call->als_map[ia]); 
+                    gts[0] = bcf_gt_unphased(job->hom_al[i]); 
                 }
             }
             if ( ploidy==2 ) 
             {
                 gts[1] = gts[0];
-                for (ia=0; ia<nals; ia++)
+                for (i=0; i<job->nhet; i++)
                 {
-                    if ( !(out_als & 1<<ia) ) continue;
-                    int iaa = (ia+1)*(ia+2)/2-1;
-                    for (ib=0; ib<ia; ib++)
-                    {
-                        if ( !(out_als & 1<<ib) ) continue;
-                        int iab = iaa - ia + ib;
-                        double lk = 2*pdg[iab]*call->qsum[ia]*call->qsum[ib];
-                        if ( best_lk < lk ) 
-                        { 
-                            best_lk = lk; 
-                            gts[0] = bcf_gt_unphased(call->als_map[ib]); 
-                            gts[1] = bcf_gt_unphased(call->als_map[ia]); 
-                        }
+                    double lk = 2*pdg[job->het_gt[i]]*job->het_qa[i]*job->het_qb[i];
+                    if ( best_lk < lk ) 
+                    { 
+                        best_lk = lk; 
+                        gts[0] = bcf_gt_unphased(job->het_al[i]); 
+                        gts[1] = bcf_gt_unphased(job->het_bl[i]); 
                     }
                 }
-                if ( gts[0] != gts[1] ) call->nhets++;
+                if ( gts[0] != gts[1] ) cnt[4]++;
             }
             else
                 gts[1] = bcf_int32_vector_end;
 
-            call->ac[ bcf_gt_allele(gts[0]) ]++;
-            if ( gts[1]!=bcf_int32_vector_end ) call->ac[ bcf_gt_allele(gts[1]) ]++;
+            cnt[ bcf_gt_allele(gts[0]) ]++;
+            if ( gts[1]!=bcf_int32_vector_end ) cnt[ bcf_gt_allele(gts[1]) ]++;
+        }
+    }
+}
+
+static void gts_job(call_t *call, void *data, int ichunk)
+{
+    gts_job_t *job = (gts_job_t*) data;
+    int beg, end;
+    smpl_chunk_range(call, ichunk, &beg, &end);
+    int *cnt = job->cnts + ichunk*GTS_NCNT;
+    memset(cnt, 0, sizeof(int)*GTS_NCNT);
+    mcall_call_genotypes_range(call, job, beg, end, cnt);
+}
+
+static void mcall_call_genotypes(call_t *call, int nals, int nout_als, int out_als)
+{
+    int ia, ib, i;
+    int nsmpl = bcf_hdr_nsamples(call->hdr);
+
+    gts_job_t job;
+    job.ngts = nals*(nals+1)/2;
+    job.nhom = job.nhet = 0;
+    for (ia=0; ia<nals; ia++)
+    {
+        if ( !(out_als & 1<<ia) ) continue;     // ia-th allele not in the final selection, skip
+        int iaa = (ia+1)*(ia+2)/2-1;            // PL index of the ia/ia genotype
+        job.hom_gt[job.nhom] = iaa;
+        job.hom_al[job.nhom] = call->als_map[ia];
+        job.hom_q[job.nhom++] = call->qsum[ia];
+        for (ib=0; ib<ia; ib++)
+        {
+            if ( !(out_als & 1<<ib) ) continue;
+            job.het_gt[job.nhet] = iaa - ia + ib;
+            job.het_al[job.nhet] = call->als_map[ib];
+            job.het_bl[job.nhet] = call->als_map[ia];
+            job.het_qa[job.nhet] = call->qsum[ia];
+            job.het_qb[job.nhet++] = call->qsum[ib];
         }
     }
+
+    // The counts are integers, adding up the chunks gives the same result
+    int cnt[GTS_NCNT] = {0,0,0,0,0,0};
+    if ( SMPL_POOL(call) )
+    {
+        int j, nchunks = call->pool->nsmpl_chunks;
+        job.cnts = call->pool->gts_cnts;
+        mcall_pool_run(call, gts_job, &job, nchunks);
+        for (i=0; i<nchunks; i++)
+            for (j=0; j<GTS_NCNT; j++) cnt[j] += job.cnts[i*GTS_NCNT + j];
+    }
+    else
+        mcall_call_genotypes_range(call, &job, 0, nsmpl, cnt);
+
+    for (i=0; i<4; i++) call->ac[i] = cnt[i];
+    call->nhets = cnt[4];
+    call->ndiploid = cnt[5];
 }
 
 
@@ -767,64 +1211,18 @@ static void mcall_call_trio_genotypes(call_t *call, bcf1_t *rec, int nals, int n
         }
     }
 
+    // Log transmission penalties log(1 - Pm*(1-Pkij)), the trio tables store 2/Pkij
+    int k;
+    for (k=1; k<=8; k<<=1) call->trio_lpen[k] = log(1 - trio_Pm * (1 - (double)2/k));
+    call->trio_lpen_uc = log(1 - trio_Pm);
+
     // Calculate constrained likelihoods and determine genotypes
+    mcall_trio_families(call, ngts, nout_als);
     int ifm;
     for (ifm=0; ifm<call->nfams; ifm++)
     {
         family_t *fam = &call->fams[ifm];
-        int ntrio = call->ntrio[fam->type][nout_als];
-        uint16_t *trio = call->trio[fam->type][nout_als];
-
-        // Unconstrained likelihood
-        int uc_itr = 0;
-        double uc_lk = 0;
-        for (i=0; i<3; i++)     // for father, mother, child
-        {
-            int ismpl = fam->sample[i];
-            double *gl = call->GLs + ngts*ismpl;
-            if ( gl[0]==1 ) continue;
-            int j, jmax = 0;
-            double max  = gl[0];
-            for (j=1; j<ngts; j++)
-                if ( max < gl[j] ) { max = gl[j]; jmax = j; }
-            uc_lk += max;
-            uc_itr |= jmax << ((2-i)*4);
-        }
-
-        // Best constrained likelihood
-        int c_itr = -1, itr, uc_is_mendelian = 0;
-        double c_lk = -HUGE_VAL;
-        for (itr=0; itr<ntrio; itr++)   // for each trio genotype combination
-        {
-            double lk = 0;
-            int npresent = 0;
-            for (i=0; i<3; i++)     // for father, mother, child
-            {
-                int ismpl = fam->sample[i];
-                double *gl = call->GLs + ngts*ismpl;
-                if ( gl[0]==1 ) continue;
-                int igt = trio[itr]>>((2-i)*4) & 0xf;
-                assert( !call->ploidy || call->ploidy[ismpl]>0 );
-                if ( igt==GT_SKIP ) continue;
-                lk += gl[igt];
-                npresent++;
-                // fprintf(stderr," %e", gl[igt]);
-            }
-            // fprintf(stderr,"\t\t");
-            double Pkij = npresent==3 ? (double)2/(trio[itr]>>12) : 1;  // with missing genotypes Pkij's are different
-            lk += log(1 - trio_Pm * (1 - Pkij));
-            // fprintf(stderr,"%d%d%d\t%e\t%.2f\n", trio[itr]>>8&0xf,trio[itr]>>4&0xf,trio[itr]&0xf, lk, Pkij);
-            if ( c_lk < lk ) { c_lk = lk; c_itr = trio[itr]; }
-            if ( uc_itr==trio[itr] ) uc_is_mendelian = 1;
-        }
-
-        if ( !uc_is_mendelian )
-        {
-            uc_lk += log(1 - trio_Pm);
-            //fprintf(stderr,"c_lk=%e uc_lk=%e c_itr=%d%d%d uc_itr=%d%d%d\n", c_lk,uc_lk,c_itr>>8&0xf,c_itr>>4&0xf,c_itr&0xf,uc_itr>>8&0xf,uc_itr>>4&0xf,uc_itr&0xf);
-            if ( c_lk < uc_lk ) { c_lk = uc_lk; c_itr = uc_itr; }
-        }
-        //fprintf(stderr,"best_lk=%e best_itr=%d%d%d uc_itr=%d%d%d\n", c_lk,c_itr>>8&0xf,c_itr>>4&0xf,c_itr&0xf,uc_itr>>8&0xf,uc_itr>>4&0xf,uc_itr&0xf);
+        int c_itr = call->fam_itr[ifm];
 
         // Set genotypes for father, mother, child and calculate genotype qualities
         for (i=0; i<3; i++)
@@ -922,17 +1320,19 @@ static void mcall_call_trio_genotypes(call_t *call, bcf1_t *rec, int nals, int n
     }
 }
 
-static void mcall_trim_PLs(call_t *call, bcf1_t *rec, int nals, int nout_als, int out_als)
+typedef struct
 {
-    int ngts  = nals*(nals+1)/2;
-    int npls_src = ngts, npls_dst = nout_als*(nout_als+1)/2;     // number of PL values in diploid samples, ori and new
-    if ( call->all_diploid && npls_src == npls_dst ) return;
-
-    int *pls_src = call->PLs, *pls_dst = call->PLs;
+    int npls_src, npls_dst, nout_als;
+    int32_t *dst;
+}
+trim_job_t;
 
-    int nsmpl = bcf_hdr_nsamples(call->hdr);
+static void mcall_trim_PLs_range(call_t *call, trim_job_t *job, int beg, int end)
+{
+    int npls_src = job->npls_src, npls_dst = job->npls_dst, nout_als = job->nout_als;
+    int *pls_src = call->PLs + beg*npls_src, *pls_dst = job->dst + beg*npls_dst;
     int isample, ia;
-    for (isample = 0; isample < nsmpl; isample++) 
+    for (isample = beg; isample < end; isample++) 
     {
         int ploidy = call->ploidy ? call->ploidy[isample] : 2;
         if ( ploidy==2 )
@@ -955,7 +1355,33 @@ static void mcall_trim_PLs(call_t *call, bcf1_t *rec, int nals, int nout_als, in
         pls_src += npls_src;
         pls_dst += npls_dst;
     }
-    bcf_update_format_int32(call->hdr, rec, "PL", call->PLs, npls_dst*nsmpl);
+}
+
+static void trim_job(call_t *call, void *data, int ichunk)
+{
+    int beg, end;
+    smpl_chunk_range(call, ichunk, &beg, &end);
+    mcall_trim_PLs_range(call, (trim_job_t*) data, beg, end);
+}
+
+static void mcall_trim_PLs(call_t *call, bcf1_t *rec, int nals, int nout_als, int out_als)
+{
+    int ngts  = nals*(nals+1)/2;
+    int npls_src = ngts, npls_dst = nout_als*(nout_als+1)/2;     // number of PL values in diploid samples, ori and new
+    if ( call->all_diploid && npls_src == npls_dst ) return;
+
+    int nsmpl = bcf_hdr_nsamples(call->hdr);
+    trim_job_t job = { npls_src, npls_dst, nout_als, call->PLs };
+    if ( SMPL_POOL(call) )
+    {
+        // the chunks cannot be trimmed in place independently, a chunk would overwrite the next one
+        hts_expand(int32_t, npls_dst*nsmpl, call->n_itmp, call->itmp);
+        job.dst = call->itmp;
+        mcall_pool_run(call, trim_job, &job, call->pool->nsmpl_chunks);
+    }
+    else
+        mcall_trim_PLs_range(call, &job, 0, nsmpl);
+    bcf_update_format_int32(call->hdr, rec, "PL", job.dst, npls_dst*nsmpl);
 }
 
 static void mcall_constrain_alleles(call_t *call, bcf1_t *rec)
@@ -1036,6 +1462,17 @@ static void mcall_constrain_alleles(call_t *call, bcf1_t *rec)
 }
 
 
+static inline double mcall_clock(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+// Add the time since the last call to the given MCALL_T_* stage
+#define MCALL_TIMER(stage) \
+    if ( call->flag & CALL_TIMING ) { double t = mcall_clock(); call->timing[stage] += t - tstart; tstart = t; }
+
 /**
   *  This function implements the multiallelic calling model. It has two major parts:
   *   1) determine the most likely set of alleles and calculate the quality of ref/non-ref site
@@ -1044,6 +1481,8 @@ static void mcall_constrain_alleles(call_t *call, bcf1_t *rec)
   */
 int mcall(call_t *call, bcf1_t *rec)
 {
+    double tstart = call->flag & CALL_TIMING ? mcall_clock() : 0;
+
     // Force alleles when calling genotypes given alleles was requested
     if ( call->flag & CALL_CONSTR_ALLELES ) mcall_constrain_alleles(call, rec);
 
@@ -1060,15 +1499,20 @@ int mcall(call_t *call, bcf1_t *rec)
     // Convert PLs to probabilities
     int ngts = nals*(nals+1)/2;
     hts_expand(double, call->nPLs, call->npdg, call->pdg);
-    set_pdg(call->pl2p, call->PLs, call->pdg, nsmpl, ngts);
+    if ( SMPL_POOL(call) )
+        mcall_pool_run(call, pdg_job, &ngts, call->pool->nsmpl_chunks);
+    else
+        set_pdg(call->pl2p, call->PLs, call->pdg, call->lnorm, nsmpl, ngts);
 
     // Get sum of qualities
     int i, nqs = bcf_get_info_float(call->hdr, rec, "QS", &call->qsum, &call->nqsum);
     assert( nals<=call->nqsum );
     for (i=nqs; i<nals; i++) call->qsum[i] = 0;
+    MCALL_TIMER(MCALL_T_PDG);
 
     // Find the best combination of alleles
     int out_als, nout =  mcall_find_best_alleles(call, nals, &out_als);
+    MCALL_TIMER(MCALL_T_ALLELES);
 
     // With -A, keep all ALTs except X
     if ( call->flag & CALL_KEEPALT )
@@ -1090,7 +1534,9 @@ int mcall(call_t *call, bcf1_t *rec)
     { 
         init_allele_trimming_maps(call, 1, nals);
         mcall_set_ref_genotypes(call,nals);
+        MCALL_TIMER(MCALL_T_GTS);
         bcf_update_format_int32(call->hdr, rec, "PL", NULL, 0);    // remove PL, useless now
+        MCALL_TIMER(MCALL_T_TRIM);
     }
     else
     {
@@ -1104,11 +1550,13 @@ int mcall(call_t *call, bcf1_t *rec)
         }
         else
             mcall_call_genotypes(call,nals,nout,out_als);
+        MCALL_TIMER(MCALL_T_GTS);
 
         // Skip the site if all samples are 0/0. This can happen occasionally.
         nAC = call->ac[1] + call->ac[2] + call->ac[3];
         if ( !nAC && call->flag & CALL_VARONLY ) return 0;
         mcall_trim_PLs(call, rec, nals, nout, out_als);
+        MCALL_TIMER(MCALL_T_TRIM);
     }
 
     // Set QUAL and calculate HWE-related annotations
@@ -1158,3 +1606,4 @@ int mcall(call_t *call, bcf1_t *rec)
     return nout;
 }
 
+#undef MCALL_TIMER
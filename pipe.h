@@ -0,0 +1,86 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Stages of "bcftools pipe". The pipe calls the main function of a command
+    with the stage's arguments; the command parses its options as usual and,
+    when pipe_stage_init() returns a stage, sets up the stage instead of
+    opening the input and output files.
+
+    Records are passed as bcf1_t** so that a stage which keeps records, such
+    as norm's sorting buffer, can swap the record for one of its own instead
+    of copying it. After pipe_emit() returns, *rec is a valid record with
+    undefined content which the stage can reuse.
+
+    With "bcftools pipe --threads" each thread sets up its own stages and
+    runs them on region shards, calling flush() at the end of each shard;
+    the stage must then accept the records of the next shard. Commands opt
+    in with the PIPE_SHARD flag in main.c's command table.
+*/
+
+#ifndef __PIPE_H__
+#define __PIPE_H__
+
+#include <htslib/vcf.h>
+
+typedef struct _pipe_stage_t pipe_stage_t;
+struct _pipe_stage_t
+{
+    bcf_hdr_t *hdr;     // on input the header of the preceding stage, to be set to the stage's output header
+    void *data;         // the command's args_t
+    void (*process)(pipe_stage_t *stage, bcf1_t **rec);    // passes records on with pipe_emit()
+    void (*flush)(pipe_stage_t *stage);                    // end of input: emit the buffered records, can be NULL
+    void (*destroy)(pipe_stage_t *stage);
+    int no_shards;      // set when the options need the records of neighbouring regions, such as filter -g
+
+    // set by the pipe
+    void (*emit)(pipe_stage_t *stage, bcf1_t **rec);
+    void *pipe;
+    int istage;
+};
+
+#define PIPE_STAGE  1   // the command can be a stage of bcftools pipe
+#define PIPE_SHARD  2   // the records can be processed in independent region shards
+
+typedef int (*pipe_cmd_f)(int argc, char *argv[]);
+
+/*
+ *  pipe_stage_cmd() - the main function of a command registered with the
+ *  PIPE_STAGE flag and its flags, NULL if there is no such command
+ */
+pipe_cmd_f pipe_stage_cmd(const char *alias, int *flags);
+
+/*
+ *  pipe_stage_init() - the stage being set up when the command was called by
+ *  "bcftools pipe", NULL otherwise
+ */
+pipe_stage_t *pipe_stage_init(void);
+
+static inline void pipe_emit(pipe_stage_t *stage, bcf1_t **rec)
+{
+    stage->emit(stage, rec);
+}
+
+#endif
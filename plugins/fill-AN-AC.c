@@ -19,20 +19,39 @@ void init(bcf_hdr_t *h)
     bcf_hdr_append(hdr, "##INFO=<ID=AN,Number=1,Type=Integer,Description=\"Total number of alleles in called genotypes\">");
 }
 
-int process(bcf1_t *rec)
+static void fill_an_ac(bcf1_t *rec, int **arr, int *marr)
 {
-    hts_expand(int,rec->n_allele,marr,arr);
-    int ret = bcf_calc_ac(hdr,rec,arr,BCF_UN_FMT);
+    hts_expand(int,rec->n_allele,*marr,*arr);
+    int ret = bcf_calc_ac(hdr,rec,*arr,BCF_UN_FMT);
     if ( ret>0 )
     {
         int i, an = 0;
-        for (i=0; i<rec->n_allele; i++) an += arr[i];
+        for (i=0; i<rec->n_allele; i++) an += (*arr)[i];
         bcf_update_info_int32(hdr, rec, "AN", &an, 1);
-        bcf_update_info_int32(hdr, rec, "AC", arr+1, rec->n_allele-1);
+        bcf_update_info_int32(hdr, rec, "AC", *arr+1, rec->n_allele-1);
     }
+}
+
+int process(bcf1_t *rec)
+{
+    fill_an_ac(rec, &arr, &marr);
+    return 0;
+}
+
+// Batches may be processed by several threads at once, the buffer is local
+int process_batch(bcf1_t **recs, int n)
+{
+    int i, *tmp = NULL, mtmp = 0;
+    for (i=0; i<n; i++) fill_an_ac(recs[i], &tmp, &mtmp);
+    free(tmp);
     return 0;
 }
 
+int thread_safe(void)
+{
+    return 1;
+}
+
 void destroy(void) 
 {
     free(arr);
@@ -37,6 +37,19 @@ int process(bcf1_t *rec)
 }
 
 
+/*
+    Optional. When defined, it is called with n consecutive records instead
+    of calling process() for each. Return 0 on success, -1 on critical errors;
+    set recs[i] to NULL to suppress the record from printing. If the plugin
+    also defines thread_safe() which returns non-zero, with --threads batches
+    may be processed by several threads at the same time. This plugin keeps
+    global counters, therefore it does not.
+
+int process_batch(bcf1_t **recs, int n);
+int thread_safe(void);
+*/
+
+
 /*
     Clean up.
 */
@@ -2,10 +2,12 @@
 #include <stdlib.h>
 #include <htslib/vcf.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 bcf_hdr_t *hdr;
 int *gts = NULL, mgts = 0;
 uint64_t nchanged = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 const char *about(void)
 {
@@ -17,28 +19,49 @@ void init(bcf_hdr_t *h)
     hdr = h;
 }
 
-int process(bcf1_t *rec)
+static int fill_ref(bcf1_t *rec, int **gts, int *mgts)
 {
-    int ngts = bcf_get_genotypes(hdr, rec, &gts, &mgts);
+    int ngts = bcf_get_genotypes(hdr, rec, gts, mgts);
 
     int i, changed = 0;
     for (i=0; i<ngts; i++)
     {
-        if ( gts[i]==bcf_gt_missing ) 
+        if ( (*gts)[i]==bcf_gt_missing ) 
         {
-            gts[i] = bcf_gt_unphased(0);
+            (*gts)[i] = bcf_gt_unphased(0);
             changed++;
         }
     }
+    if ( changed ) bcf_update_genotypes(hdr, rec, *gts, ngts);
+    return changed;
+}
+
+int process(bcf1_t *rec)
+{
+    nchanged += fill_ref(rec, &gts, &mgts);
+    return 0;
+}
+
+// Batches may be processed by several threads at once, the buffer is local
+int process_batch(bcf1_t **recs, int n)
+{
+    int i, *tmp = NULL, mtmp = 0;
+    uint64_t changed = 0;
+    for (i=0; i<n; i++) changed += fill_ref(recs[i], &tmp, &mtmp);
+    free(tmp);
+    pthread_mutex_lock(&lock);
     nchanged += changed;
-    if ( changed ) bcf_update_genotypes(hdr, rec, gts, ngts);
+    pthread_mutex_unlock(&lock);
     return 0;
 }
 
+int thread_safe(void)
+{
+    return 1;
+}
+
 void destroy(void) 
 {
     fprintf(stderr,"Filled %"PRId64" REF alleles\n", nchanged);
     free(gts);
 }
-
-
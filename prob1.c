@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <zlib.h>
 #include "prob1.h"
+#include "afskern.h"
 
 // #include "kstring.h"
 // #include "kseq.h"
@@ -237,11 +238,7 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 			for (; _min < _max && z[0][_min] < TINY; ++_min) z[0][_min] = z[1][_min] = 0.;
 			for (; _max > _min && z[0][_max] < TINY; --_max) z[0][_max] = z[1][_max] = 0.;
 			_max += 2;
-			if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-			if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-			for (k = _min < 2? 2 : _min; k <= _max; ++k)
-				z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-			for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+			sum = afskern_diploid(z[0], z[1], M0, p, _min, _max);
 			ma->t += log(sum / (M * (M - 1.)));
 			for (k = _min; k <= _max; ++k) z[1][k] /= sum;
 			if (_min >= 1) z[1][_min-1] = 0.;
@@ -283,11 +280,7 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 			} else if (ma->ploidy[j] == 2) {
 				p[0] = pdg[0]; p[1] = 2 * pdg[1]; p[2] = pdg[2];
 				_max += 2;
-				if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-				if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-				for (k = _min < 2? 2 : _min; k <= _max; ++k)
-					z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-				for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+				sum = afskern_diploid(z[0], z[1], M0, p, _min, _max);
 				ma->t += log(sum / (M * (M - 1.)));
 				for (k = _min; k <= _max; ++k) z[1][k] /= sum;
 				if (_min >= 1) z[1][_min-1] = 0.;
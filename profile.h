@@ -0,0 +1,113 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Per-stage timing of the main loops, printed to stderr at exit with the
+    global --profile option. A probe adds the wall and CPU time elapsed since
+    the previous probe to its stage, so a loop needs one probe after each of
+    its stages:
+
+        profile_mark_t prof;
+        PROFILE_START(prof);
+        while ( bcf_sr_next_line(files) )
+        {
+            PROFILE_LAP(PROF_READ, prof);
+            ...
+            PROFILE_LAP(PROF_WRITE, prof);
+        }
+
+    Without --profile a probe is a single branch. Building with
+    -DBCFTOOLS_NO_PROFILE removes the probes altogether.
+*/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define PROF_READ       0   // reading, BGZF decompression and parsing, synchronising the readers
+#define PROF_UNPACK     1   // explicit bcf_unpack() calls
+#define PROF_FILTER     2   // -i/-e expressions and other site selection
+#define PROF_CALL       3
+#define PROF_MERGE      4
+#define PROF_ANNOTATE   5
+#define PROF_SUBSET     6   // removing samples, recalculating INFO/AC,AN
+#define PROF_FORMAT     7   // text output of query
+#define PROF_WRITE      8   // encoding, compression and output
+#define PROF_NSTAGES    9
+
+typedef struct
+{
+    double wall, cpu;
+    uint64_t nrec;
+}
+profile_stage_t;
+
+typedef struct
+{
+    double wall, cpu;
+}
+profile_mark_t;
+
+extern int profile_enabled;
+extern profile_stage_t profile_stages[PROF_NSTAGES];
+
+static inline void profile_now(profile_mark_t *mark)
+{
+    // gettimeofday and getrusage rather than clock_gettime, which needs -lrt with older glibc
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    mark->wall = tv.tv_sec + tv.tv_usec*1e-6;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    mark->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+}
+
+static inline void profile_lap(int stage, profile_mark_t *mark, int nrec)
+{
+    profile_mark_t now;
+    profile_now(&now);
+    profile_stages[stage].wall += now.wall - mark->wall;
+    profile_stages[stage].cpu  += now.cpu - mark->cpu;
+    profile_stages[stage].nrec += nrec;
+    *mark = now;
+}
+
+void profile_report(FILE *fp);
+
+#ifndef BCFTOOLS_NO_PROFILE
+    #define PROFILE_START(mark)          do { if ( profile_enabled ) profile_now(&(mark)); } while (0)
+    #define PROFILE_LAP(stage,mark)      do { if ( profile_enabled ) profile_lap(stage,&(mark),1); } while (0)
+    #define PROFILE_LAPN(stage,mark,n)   do { if ( profile_enabled ) profile_lap(stage,&(mark),n); } while (0)
+#else
+    #define PROFILE_START(mark)          do { (void)(mark); } while (0)
+    #define PROFILE_LAP(stage,mark)      do { (void)(mark); } while (0)
+    #define PROFILE_LAPN(stage,mark,n)   do { (void)(mark); } while (0)
+#endif
+
+#endif
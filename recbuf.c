@@ -0,0 +1,109 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "recbuf.h"
+
+void recbuf_init(recbuf_t *buf, int size)
+{
+    memset(buf, 0, sizeof(recbuf_t));
+    rbuf_init(&buf->rbuf, size);
+    buf->recs = (bcf1_t**) calloc(size, sizeof(bcf1_t*));
+    buf->size = (size_t*) calloc(size, sizeof(size_t));
+}
+
+void recbuf_destroy(recbuf_t *buf)
+{
+    int i;
+    for (i=0; i<buf->rbuf.m; i++)
+        if ( buf->recs[i] ) bcf_destroy1(buf->recs[i]);
+    free(buf->recs);
+    free(buf->size);
+    memset(buf, 0, sizeof(recbuf_t));
+}
+
+size_t recbuf_rec_size(bcf1_t *rec)
+{
+    bcf_dec_t *d = &rec->d;
+    // bcf_dec_t has no m_var: bcf_set_variant_types() only grows d->var and
+    // n_var is its allocated size, not the number of alleles of this record
+    size_t size = sizeof(bcf1_t) + rec->shared.m + rec->indiv.m
+        + d->m_id + d->m_als + d->m_allele*sizeof(char*) + d->m_flt*sizeof(int)
+        + d->m_info*sizeof(bcf_info_t) + d->m_fmt*sizeof(bcf_fmt_t) + d->n_var*sizeof(variant_t);
+    int i;
+    for (i=0; i<d->m_info; i++)
+        if ( d->info[i].vptr_free ) size += d->info[i].vptr_len;
+    for (i=0; i<d->m_fmt; i++)
+        if ( d->fmt[i].p_free ) size += d->fmt[i].p_len;
+    return size;
+}
+
+// Double the size, the elements are moved to the start in their order
+static void recbuf_grow(recbuf_t *buf)
+{
+    int i, k, m = buf->rbuf.m ? 2*buf->rbuf.m : 16;
+    bcf1_t **recs = (bcf1_t**) calloc(m, sizeof(bcf1_t*));
+    size_t *size  = (size_t*) calloc(m, sizeof(size_t));
+    for (k=0; k<buf->rbuf.n; k++)
+    {
+        i = rbuf_kth(&buf->rbuf, k);
+        recs[k] = buf->recs[i];
+        size[k] = buf->size[i];
+    }
+    free(buf->recs);
+    free(buf->size);
+    buf->recs = recs;
+    buf->size = size;
+    buf->rbuf.m = m;
+    buf->rbuf.f = 0;
+}
+
+int recbuf_push(recbuf_t *buf, bcf1_t **rec)
+{
+    if ( buf->rbuf.n==buf->rbuf.m ) recbuf_grow(buf);
+    int i = rbuf_add(&buf->rbuf);
+    if ( !buf->recs[i] ) buf->recs[i] = bcf_init1();
+    bcf1_t *tmp = buf->recs[i]; buf->recs[i] = *rec; *rec = tmp;
+
+    buf->size[i] = recbuf_rec_size(buf->recs[i]);
+    buf->mem += buf->size[i];
+    if ( buf->mem_max < buf->mem ) buf->mem_max = buf->mem;
+    if ( buf->nmax < buf->rbuf.n ) buf->nmax = buf->rbuf.n;
+    return i;
+}
+
+bcf1_t **recbuf_shift(recbuf_t *buf)
+{
+    int i = rbuf_shift(&buf->rbuf);
+    if ( i<0 ) return NULL;
+    buf->mem -= buf->size[i];
+    return &buf->recs[i];
+}
+
+void recbuf_report(recbuf_t *buf, const char *name, FILE *fp)
+{
+    fprintf(fp, "[profile] %s buffer: peak %d records, %.1f MB\n", name, buf->nmax, buf->mem_max/1e6);
+}
@@ -0,0 +1,103 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Round buffer of bcf1_t records for commands which hold records back, such
+    as the sorting window of norm or the SnpGap/IndelGap buffer of filter.
+    The records are allocated once and recycled: a record taken out of the
+    buffer keeps its allocated memory for the next one. Records enter by
+    swapping pointers with the caller, typically with the synced reader's
+    buffer[0], so nothing is copied.
+
+    The buffer is a plain rbuf_t over the array of records, the rbuf_*
+    functions can be used on buf->rbuf to iterate over buf->recs.
+*/
+
+#ifndef __RECBUF_H__
+#define __RECBUF_H__
+
+#include <stdio.h>
+#include <htslib/vcf.h>
+#include "rbuf.h"
+
+typedef struct
+{
+    rbuf_t rbuf;
+    bcf1_t **recs;      // rbuf.m slots, allocated when first used
+    size_t *size;       // allocated memory of the buffered records
+    size_t mem, mem_max;    // memory held by the buffered records, the high-water mark
+    int nmax;               // the largest number of records buffered
+}
+recbuf_t;
+
+void recbuf_init(recbuf_t *buf, int size);
+void recbuf_destroy(recbuf_t *buf);
+
+/*
+ *  recbuf_push() - add the record as the last element, *rec is exchanged for
+ *  a recycled record. The buffer grows when full. Returns the index of the
+ *  new element in buf->recs.
+ */
+int recbuf_push(recbuf_t *buf, bcf1_t **rec);
+
+/*
+ *  recbuf_shift() - remove the first element. The returned slot stays valid
+ *  until the next recbuf_push(). NULL if the buffer is empty.
+ */
+bcf1_t **recbuf_shift(recbuf_t *buf);
+
+static inline bcf1_t *recbuf_kth(recbuf_t *buf, int k)
+{
+    int i = rbuf_kth(&buf->rbuf, k);
+    return i<0 ? NULL : buf->recs[i];
+}
+
+// Swap two elements given by their indexes in buf->recs, as when sorting
+static inline void recbuf_swap(recbuf_t *buf, int i, int j)
+{
+    bcf1_t *rec = buf->recs[i]; buf->recs[i] = buf->recs[j]; buf->recs[j] = rec;
+    size_t size = buf->size[i]; buf->size[i] = buf->size[j]; buf->size[j] = size;
+}
+
+// Remove all elements, the records are kept for reuse
+static inline void recbuf_clear(recbuf_t *buf)
+{
+    rbuf_shift_n(&buf->rbuf, buf->rbuf.n);
+    buf->mem = 0;
+}
+
+#define recbuf_n(buf)    ((buf)->rbuf.n)
+#define recbuf_last(buf) recbuf_kth(buf, (buf)->rbuf.n - 1)
+
+/*
+ *  recbuf_rec_size() - memory allocated by a record, including the capacity
+ *  kept for reuse
+ */
+size_t recbuf_rec_size(bcf1_t *rec);
+
+// Prints the peak number of records and memory held, e.g. with --profile
+void recbuf_report(recbuf_t *buf, const char *name, FILE *fp);
+
+#endif
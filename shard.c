@@ -0,0 +1,171 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <htslib/hts.h>
+#include <htslib/tbx.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+#include "bcftools.h"
+#include "shard.h"
+
+// Sequences are measured in windows of this size (in bp), shards are made of
+// consecutive windows of the same sequence
+#define SHARD_WINDOW    (1<<20)
+
+// Upper limit on the compressed size of a shard, bounds the memory taken by
+// the records of the shards waiting for output
+#define SHARD_MAX_SIZE  (4<<20)
+
+// Contig length from the header, 0 if not known
+static int contig_length(bcf_hdr_t *hdr, int rid)
+{
+    bcf_hrec_t *hrec = hdr->id[BCF_DT_CTG][rid].val->hrec[0];
+    int i;
+    for (i=0; hrec && i<hrec->nkeys; i++)
+        if ( !strcmp("length",hrec->keys[i]) ) return atoi(hrec->vals[i]);
+    return 0;
+}
+
+typedef struct
+{
+    int64_t beg, end;
+}
+interval_t;
+
+static int cmp_interval(const void *a, const void *b)
+{
+    const interval_t *ia = (const interval_t*) a, *ib = (const interval_t*) b;
+    if ( ia->beg < ib->beg ) return -1;
+    if ( ia->beg > ib->beg ) return 1;
+    return 0;
+}
+
+// Compressed bytes in the index chunks which overlap [beg,end]
+static uint64_t index_size(bcf_sr_t *reader, int tid, int beg, int end)
+{
+    hts_itr_t *itr = reader->tbx_idx ? tbx_itr_queryi(reader->tbx_idx, tid, beg, end+1) : bcf_itr_queryi(reader->bcf_idx, tid, beg, end+1);
+    if ( !itr ) return 0;
+    uint64_t size = 0;
+    int i;
+    for (i=0; i<itr->n_off; i++)
+        size += (itr->off[i].v >> 16) - (itr->off[i].u >> 16) + 1;    // a chunk within one BGZF block still counts
+    hts_itr_destroy(itr);
+    return size;
+}
+
+shard_t *shard_split(bcf_srs_t *files, int nmin, int *nshards)
+{
+    bcf_sr_t *reader = &files->readers[0];
+    bcf_sr_regions_t *reg = files->regions;
+    if ( !reg || (!reader->tbx_idx && !reader->bcf_idx) )
+        error("Failed to determine sequences from the index: %s\n", reader->fname);
+    if ( !reg->regs )
+        error("The regions are read from an indexed file, cannot split them into shards: %s\n", reg->fname);
+
+    // Measure the sequences within the regions, empty sequences are left out
+    shard_t *win = NULL;
+    interval_t *ints = NULL;
+    int i, j, k, nwin = 0, mwin = 0, mints = 0;
+    uint64_t total = 0;
+    for (i=0; i<reg->nseqs; i++)
+    {
+        int rid = bcf_hdr_name2id(reader->header, reg->seq_names[i]);
+        if ( rid<0 ) continue;  // not present in the VCF header
+        int tid = reader->tbx_idx ? tbx_name2id(reader->tbx_idx, reg->seq_names[i]) : rid;
+        if ( tid<0 ) continue;  // not in the index
+
+        // the intervals of the sequence, sorted and with the overlapping ones joined
+        region_t *seq = &reg->regs[i];
+        int nints = 0;
+        for (j=0; j<seq->nregs; j++)
+        {
+            nints++;
+            hts_expand(interval_t, nints, mints, ints);
+            int64_t beg = seq->regs[j].start, end = seq->regs[j].end;     // -1 if not set
+            ints[nints-1].beg = beg < 0 ? 0 : beg;
+            ints[nints-1].end = end < 0 || end > INT_MAX ? INT_MAX : end;
+        }
+        qsort(ints, nints, sizeof(*ints), cmp_interval);
+        for (j=0, k=1; k<nints; k++)
+        {
+            if ( ints[k].beg <= ints[j].end + 1 )
+            {
+                if ( ints[j].end < ints[k].end ) ints[j].end = ints[k].end;
+            }
+            else ints[++j] = ints[k];
+        }
+        if ( nints ) nints = j+1;
+
+        int len = contig_length(reader->header, rid), nwin0 = nwin;
+        uint64_t size = 0;
+        for (j=0; j<nints; j++)
+        {
+            int64_t beg = ints[j].beg;
+            while (1)
+            {
+                int64_t end = beg + SHARD_WINDOW - 1;
+                int last = len<=0 || end >= ints[j].end || end+1 >= len;
+                nwin++;
+                hts_expand(shard_t, nwin, mwin, win);
+                shard_t *w = &win[nwin-1];
+                w->rid  = rid;
+                w->beg  = beg;
+                w->end  = last ? ints[j].end : end;
+                w->size = index_size(reader, tid, w->beg, w->end);
+                size += w->size;
+                if ( last ) break;
+                beg = end + 1;
+            }
+        }
+        if ( !size ) nwin = nwin0;
+        total += size;
+    }
+    free(ints);
+
+    uint64_t target = nmin>0 ? total / nmin : total;
+    if ( target > SHARD_MAX_SIZE ) target = SHARD_MAX_SIZE;
+    if ( !target ) target = 1;
+
+    // Join adjacent windows into shards, the windows are merged in place. The
+    // windows of different regions are not joined, a shard must not include the
+    // records between them
+    int n = 0;
+    for (i=0; i<nwin; i=j)
+    {
+        shard_t shard = win[i];
+        for (j=i+1; j<nwin && win[j].rid==shard.rid && win[j].beg==shard.end+1 && shard.size < target; j++)
+        {
+            shard.end   = win[j].end;
+            shard.size += win[j].size;
+        }
+        win[n++] = shard;
+    }
+    *nshards = n;
+    if ( !n ) { free(win); win = NULL; }
+    return win;
+}
@@ -0,0 +1,58 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Splitting of an indexed file into region shards which can be processed
+    independently, as by "bcftools pipe --threads". The shards are balanced
+    by the compressed size of the index chunks overlapping them rather than
+    by their length in base pairs, so that dense and sparse regions give
+    similar amounts of work.
+*/
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stdint.h>
+#include <htslib/synced_bcf_reader.h>
+
+typedef struct
+{
+    int rid, beg, end;  // 0-based, inclusive; the shard owns the records with POS in [beg,end], within the regions
+    uint64_t size;      // estimated compressed size in bytes
+}
+shard_t;
+
+/*
+ *  shard_split() - split the sequences of the first reader, taken from the
+ *  index or the -r/-R regions, into about nmin shards, more when the input is
+ *  large so that a shard does not hold much more than SHARD_MAX_SIZE
+ *  compressed bytes. The shards are clipped to the regions and a shard does
+ *  not span two regions. Regions read from an indexed file are not supported.
+ *  The reader must have been added with require_index set.
+ *  Returns the shards in genomic order and their number in *nshards.
+ */
+shard_t *shard_split(bcf_srs_t *files, int nmin, int *nshards);
+
+#endif
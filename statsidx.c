@@ -0,0 +1,325 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include <htslib/vcfutils.h>
+#include "bcftools.h"
+#include "statsidx.h"
+
+/*
+    File layout:
+        header      64 bytes, see statsidx_hdr_t
+        quals       nquals x statsidx_qual_t, the non-empty QUAL bins of each bin
+        bins        nbins x statsidx_bin_t, sorted by sequence and bin
+        index       for each sequence: uint64_t ibin, nbins; uint32_t len; char name[len]
+*/
+
+#define STATSIDX_MAGIC "STATSIX\1"
+#define STATSIDX_HDR_SIZE 64
+
+typedef struct
+{
+    char magic[8];
+    uint32_t min_shift, nseq;
+    uint64_t nbins, nquals, data_size, index_offset;
+}
+statsidx_hdr_t;
+
+void statsidx_add_record(statsidx_sum_t *sum, bcf1_t *line)
+{
+    statsidx_cnt_t *cnt = &sum->cnt;
+    int line_type = bcf_get_variant_types(line);
+    int iqual = line->qual >= STATSIDX_NQUAL || isnan(line->qual) ? STATSIDX_NQUAL - 1 : line->qual;
+    cnt->n_records++;
+
+    // the same as do_snp_stats() in vcfstats.c
+    if ( line_type&VCF_SNP )
+    {
+        cnt->n_snps++;
+        int i, ref = bcf_acgt2int(*line->d.allele[0]);
+        if ( ref>=0 )
+        {
+            sum->qual_snps[iqual]++;
+            for (i=1; i<line->n_allele; i++)
+            {
+                if ( !(bcf_get_variant_type(line,i)&VCF_SNP) ) continue;
+                int alt = bcf_acgt2int(*line->d.allele[i]);
+                if ( alt<0 || ref==alt ) continue;
+                if ( abs(ref-alt)==2 )
+                {
+                    cnt->ts++;
+                    if ( i==1 ) { cnt->ts_alt1++; sum->qual_ts[iqual]++; }
+                }
+                else
+                {
+                    cnt->tv++;
+                    if ( i==1 ) { cnt->tv_alt1++; sum->qual_tv[iqual]++; }
+                }
+            }
+        }
+    }
+    if ( line_type&VCF_INDEL )
+    {
+        cnt->n_indels++;
+        sum->qual_indels[iqual]++;
+    }
+    if ( line_type&VCF_MNP ) cnt->n_mnps++;
+    if ( line_type&VCF_OTHER ) cnt->n_others++;
+    if ( line->n_allele>2 )
+    {
+        cnt->n_mals++;
+        if ( line_type==VCF_SNP ) cnt->n_snp_mals++;
+    }
+}
+
+static void add_cnt(statsidx_cnt_t *dst, const statsidx_cnt_t *src)
+{
+    dst->n_records += src->n_records; dst->n_snps += src->n_snps; dst->n_mnps += src->n_mnps;
+    dst->n_indels += src->n_indels; dst->n_others += src->n_others;
+    dst->n_mals += src->n_mals; dst->n_snp_mals += src->n_snp_mals;
+    dst->ts += src->ts; dst->tv += src->tv; dst->ts_alt1 += src->ts_alt1; dst->tv_alt1 += src->tv_alt1;
+}
+
+// Write out the bin collected in sum and reset it
+static void flush_bin(FILE *fp, const char *fname, statsidx_sum_t *sum, statsidx_bin_t *bin, uint64_t *nquals)
+{
+    int i;
+    bin->iqual = *nquals;
+    bin->nqual = 0;
+    bin->cnt   = sum->cnt;
+    for (i=0; i<STATSIDX_NQUAL; i++)
+    {
+        if ( !sum->qual_snps[i] && !sum->qual_ts[i] && !sum->qual_tv[i] && !sum->qual_indels[i] ) continue;
+        statsidx_qual_t qual = { i, sum->qual_snps[i], sum->qual_ts[i], sum->qual_tv[i], sum->qual_indels[i] };
+        if ( fwrite(&qual, sizeof(qual), 1, fp)!=1 ) error("Failed to write %s\n", fname);
+        bin->nqual++;
+    }
+    *nquals += bin->nqual;
+    memset(sum, 0, sizeof(*sum));
+}
+
+static void write_str(FILE *fp, const char *str)
+{
+    uint32_t len = strlen(str);
+    fwrite(&len, sizeof(len), 1, fp);
+    fwrite(str, 1, len, fp);
+}
+
+int statsidx_build(const char *fname, int min_shift)
+{
+    htsFile *in = hts_open(fname, "rb");
+    if ( !in ) return -1;
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    if ( !hdr ) { hts_close(in); return -1; }
+    struct stat st;
+    if ( stat(fname, &st) ) error("Failed to stat %s\n", fname);
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.sidx", fname);
+    FILE *fp = fopen(str.s, "w");
+    if ( !fp ) error("Failed to create %s\n", str.s);
+    uint8_t buf[STATSIDX_HDR_SIZE];
+    memset(buf, 0, sizeof(buf));
+    fwrite(buf, 1, STATSIDX_HDR_SIZE, fp);   // the header is written at the end
+
+    statsidx_t idx;
+    memset(&idx, 0, sizeof(idx));
+    statsidx_bin_t *bins = NULL;
+    statsidx_sum_t *sum = (statsidx_sum_t*) calloc(1, sizeof(statsidx_sum_t));
+    int i, prev_rid = -1, prev_pos = -1, mseq = 0;
+    uint64_t mbins = 0;
+    bcf1_t *line = bcf_init();
+    while ( bcf_read(in, hdr, line)==0 )
+    {
+        bcf_unpack(line, BCF_UN_STR);
+        uint32_t ibin = line->pos >> min_shift;
+        if ( line->rid!=prev_rid )
+        {
+            for (i=0; i<idx.nseq; i++)
+                if ( !strcmp(idx.seq[i].name, bcf_seqname(hdr,line)) ) error("The input is not sorted, %s appears in two blocks\n", bcf_seqname(hdr,line));
+            idx.nseq++;
+            hts_expand0(statsidx_seq_t, idx.nseq, mseq, idx.seq);
+            idx.seq[idx.nseq-1].name = strdup(bcf_seqname(hdr,line));
+            idx.seq[idx.nseq-1].ibin = idx.nbins;
+            prev_rid = line->rid;
+        }
+        else if ( line->pos < prev_pos )
+            error("The input is not sorted at %s:%d\n", bcf_seqname(hdr,line), line->pos+1);
+        prev_pos = line->pos;
+
+        statsidx_seq_t *seq = &idx.seq[idx.nseq-1];
+        if ( !seq->nbins || bins[idx.nbins-1].bin!=ibin )
+        {
+            if ( idx.nbins ) flush_bin(fp, str.s, sum, &bins[idx.nbins-1], &idx.nquals);
+            idx.nbins++;
+            hts_expand0(statsidx_bin_t, idx.nbins, mbins, bins);
+            bins[idx.nbins-1].bin = ibin;
+            seq->nbins++;
+        }
+        statsidx_add_record(sum, line);
+    }
+    if ( idx.nbins ) flush_bin(fp, str.s, sum, &bins[idx.nbins-1], &idx.nquals);
+    bcf_destroy(line);
+    bcf_hdr_destroy(hdr);
+    hts_close(in);
+
+    if ( idx.nbins && fwrite(bins, sizeof(statsidx_bin_t), idx.nbins, fp)!=idx.nbins ) error("Failed to write %s\n", str.s);
+    for (i=0; i<idx.nseq; i++)
+    {
+        fwrite(&idx.seq[i].ibin, sizeof(uint64_t), 1, fp);
+        fwrite(&idx.seq[i].nbins, sizeof(uint64_t), 1, fp);
+        write_str(fp, idx.seq[i].name);
+        free(idx.seq[i].name);
+    }
+
+    statsidx_hdr_t fhdr;
+    memset(&fhdr, 0, sizeof(fhdr));
+    memcpy(fhdr.magic, STATSIDX_MAGIC, 8);
+    fhdr.min_shift = min_shift;
+    fhdr.nseq      = idx.nseq;
+    fhdr.nbins     = idx.nbins;
+    fhdr.nquals    = idx.nquals;
+    fhdr.data_size = st.st_size;
+    fhdr.index_offset = STATSIDX_HDR_SIZE + idx.nquals*sizeof(statsidx_qual_t) + idx.nbins*sizeof(statsidx_bin_t);
+    if ( fseek(fp, 0, SEEK_SET) || fwrite(&fhdr, sizeof(fhdr), 1, fp)!=1 ) error("Failed to write %s\n", str.s);
+    if ( fclose(fp) ) error("Failed to close %s\n", str.s);
+
+    free(idx.seq);
+    free(bins);
+    free(sum);
+    free(str.s);
+    return 0;
+}
+
+static const uint8_t *read_str(statsidx_t *idx, const uint8_t *ptr, char **str)
+{
+    const uint8_t *end = idx->map + idx->map_size;
+    uint32_t len;
+    if ( ptr + sizeof(len) > end ) return NULL;
+    memcpy(&len, ptr, sizeof(len));
+    ptr += sizeof(len);
+    if ( ptr + len > end ) return NULL;
+    *str = (char*) malloc(len+1);
+    memcpy(*str, ptr, len);
+    (*str)[len] = 0;
+    return ptr + len;
+}
+
+statsidx_t *statsidx_open(const char *fname)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.sidx", fname);
+    int fd = open(str.s, O_RDONLY);
+    if ( fd<0 ) { free(str.s); return NULL; }
+    struct stat st, st_data;
+    if ( fstat(fd, &st) ) error("Failed to stat %s\n", str.s);
+    if ( stat(fname, &st_data) ) error("Failed to stat %s\n", fname);
+    if ( st.st_size < STATSIDX_HDR_SIZE ) error("Not a stats sidecar: %s\n", str.s);
+
+    statsidx_t *idx = (statsidx_t*) calloc(1, sizeof(statsidx_t));
+    idx->map_size = st.st_size;
+    idx->map = (uint8_t*) mmap(NULL, idx->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( idx->map==MAP_FAILED ) error("Failed to map %s\n", str.s);
+
+    statsidx_hdr_t fhdr;
+    memcpy(&fhdr, idx->map, sizeof(fhdr));
+    if ( memcmp(fhdr.magic, STATSIDX_MAGIC, 8) ) error("Not a stats sidecar: %s\n", str.s);
+    if ( fhdr.data_size!=(uint64_t)st_data.st_size || st.st_mtime < st_data.st_mtime )
+        error("The stats sidecar %s is older than the data, please run \"bcftools index --sidecar\" again\n", str.s);
+    idx->min_shift = fhdr.min_shift;
+    idx->nseq   = fhdr.nseq;
+    idx->nbins  = fhdr.nbins;
+    idx->nquals = fhdr.nquals;
+    idx->quals  = (const statsidx_qual_t*) (idx->map + STATSIDX_HDR_SIZE);
+    idx->bins   = (const statsidx_bin_t*) (idx->map + STATSIDX_HDR_SIZE + idx->nquals*sizeof(statsidx_qual_t));
+    if ( fhdr.index_offset != STATSIDX_HDR_SIZE + idx->nquals*sizeof(statsidx_qual_t) + idx->nbins*sizeof(statsidx_bin_t) || fhdr.index_offset > idx->map_size )
+        error("The stats sidecar is truncated or corrupted: %s\n", str.s);
+
+    int i;
+    const uint8_t *ptr = idx->map + fhdr.index_offset;
+    idx->seq = (statsidx_seq_t*) calloc(idx->nseq, sizeof(statsidx_seq_t));
+    for (i=0; i<idx->nseq; i++)
+    {
+        statsidx_seq_t *seq = &idx->seq[i];
+        if ( ptr + 2*sizeof(uint64_t) > idx->map + idx->map_size ) error("The stats sidecar is truncated or corrupted: %s\n", str.s);
+        memcpy(&seq->ibin, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+        memcpy(&seq->nbins, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+        if ( !(ptr = read_str(idx, ptr, &seq->name)) || seq->ibin + seq->nbins > idx->nbins )
+            error("The stats sidecar is truncated or corrupted: %s\n", str.s);
+    }
+    free(str.s);
+    return idx;
+}
+
+void statsidx_destroy(statsidx_t *idx)
+{
+    int i;
+    for (i=0; i<idx->nseq; i++) free(idx->seq[i].name);
+    free(idx->seq);
+    munmap(idx->map, idx->map_size);
+    free(idx);
+}
+
+int statsidx_seq(statsidx_t *idx, const char *name)
+{
+    int i;
+    for (i=0; i<idx->nseq; i++)
+        if ( !strcmp(idx->seq[i].name, name) ) return i;
+    return -1;
+}
+
+void statsidx_add_bins(statsidx_sum_t *sum, statsidx_t *idx, int iseq, uint32_t beg, uint32_t end)
+{
+    const statsidx_bin_t *bins = idx->bins + idx->seq[iseq].ibin;
+    uint64_t lo = 0, hi = idx->seq[iseq].nbins;
+    while ( lo < hi )
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if ( bins[mid].bin < beg ) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < idx->seq[iseq].nbins && bins[lo].bin <= end; lo++)
+    {
+        add_cnt(&sum->cnt, &bins[lo].cnt);
+        const statsidx_qual_t *qual = idx->quals + bins[lo].iqual;
+        uint32_t i;
+        for (i=0; i<bins[lo].nqual; i++)
+        {
+            sum->qual_snps[qual[i].qual]   += qual[i].snps;
+            sum->qual_ts[qual[i].qual]     += qual[i].ts;
+            sum->qual_tv[qual[i].qual]     += qual[i].tv;
+            sum->qual_indels[qual[i].qual] += qual[i].indels;
+        }
+    }
+}
@@ -0,0 +1,118 @@
+/* The MIT License
+
+   Copyright (c) 2014 Genome Research Ltd.
+   Authors:  see http://github.com/samtools/bcftools/blob/master/AUTHORS
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Sidecar summary index of a BCF for bcftools stats: the numbers of records
+    by variant type, transitions, transversions and QUAL histograms, kept for
+    each bin of 1<<min_shift bp in the same way as the CSI index bins the
+    records. Records belong to the bin of their POS. The file is written in the
+    native byte order and memory-mapped on reading.
+*/
+
+#ifndef __STATSIDX_H__
+#define __STATSIDX_H__
+
+#include <stdint.h>
+#include <htslib/vcf.h>
+
+#define STATSIDX_NQUAL 999      // the QUAL bins of vcfstats.c, the last for QUAL>=998 or missing
+
+typedef struct
+{
+    uint32_t n_records, n_snps, n_mnps, n_indels, n_others, n_mals, n_snp_mals;
+    uint32_t ts, tv, ts_alt1, tv_alt1;
+}
+statsidx_cnt_t;
+
+typedef struct
+{
+    uint32_t qual, snps, ts, tv, indels;    // ts and tv of the first ALT
+}
+statsidx_qual_t;
+
+typedef struct
+{
+    uint32_t bin, nqual;        // pos>>min_shift and the number of non-empty QUAL bins
+    uint64_t iqual;             // the first QUAL bin of this bin
+    statsidx_cnt_t cnt;
+}
+statsidx_bin_t;
+
+typedef struct
+{
+    char *name;
+    uint64_t ibin, nbins;
+}
+statsidx_seq_t;
+
+typedef struct
+{
+    int min_shift, nseq;
+    statsidx_seq_t *seq;
+    uint64_t nbins, nquals;
+    const statsidx_bin_t *bins;
+    const statsidx_qual_t *quals;
+    uint8_t *map;
+    size_t map_size;
+}
+statsidx_t;
+
+// Totals over a set of records
+typedef struct
+{
+    statsidx_cnt_t cnt;
+    uint32_t qual_snps[STATSIDX_NQUAL], qual_ts[STATSIDX_NQUAL], qual_tv[STATSIDX_NQUAL], qual_indels[STATSIDX_NQUAL];
+}
+statsidx_sum_t;
+
+/**
+ *  statsidx_build() - write the sidecar <fname>.sidx of a compressed BCF
+ *  Returns 0 on success, -1 if the file cannot be read.
+ */
+int statsidx_build(const char *fname, int min_shift);
+
+/**
+ *  statsidx_open() - map the sidecar of the BCF fname, NULL if it does not
+ *  exist. Exits with an error if the sidecar is older than the BCF.
+ */
+statsidx_t *statsidx_open(const char *fname);
+void statsidx_destroy(statsidx_t *idx);
+
+// The index to idx->seq, -1 if the sequence has no records
+int statsidx_seq(statsidx_t *idx, const char *name);
+
+/**
+ *  statsidx_add_record() - count a record as vcfstats does
+ *  The record must be unpacked up to BCF_UN_STR.
+ */
+void statsidx_add_record(statsidx_sum_t *sum, bcf1_t *line);
+
+/**
+ *  statsidx_add_bins() - add up the bins of a sequence that lie within
+ *  [beg,end], the 0-based inclusive coordinates are in bins
+ */
+void statsidx_add_bins(statsidx_sum_t *sum, statsidx_t *idx, int iseq, uint32_t beg, uint32_t end);
+
+#endif
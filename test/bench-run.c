@@ -0,0 +1,58 @@
+/*
+    Runs a shell command with stdout discarded and prints its wall, user and
+    system time in seconds and the peak resident set size of the child
+    process, as reported by wait4(): kilobytes on Linux, bytes on macOS.
+    Used by test/bench.pl.
+
+    Usage: bench-run <command>
+    Output: wall user sys maxrss
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static double timeval_sec(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec*1e-6;
+}
+
+int main(int argc, char **argv)
+{
+    if ( argc!=2 )
+    {
+        fprintf(stderr,"Usage: bench-run <command>\n");
+        return 1;
+    }
+
+    struct timeval beg, end;
+    gettimeofday(&beg, NULL);
+
+    pid_t pid = fork();
+    if ( pid<0 ) { perror("fork"); return 1; }
+    if ( !pid )
+    {
+        int fd = open("/dev/null", O_WRONLY);
+        if ( fd>=0 ) dup2(fd, 1);
+        execl("/bin/sh", "sh", "-c", argv[1], (char*)NULL);
+        perror("execl");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if ( wait4(pid, &status, 0, &ru)<0 ) { perror("wait4"); return 1; }
+    gettimeofday(&end, NULL);
+
+    if ( !WIFEXITED(status) || WEXITSTATUS(status) )
+    {
+        fprintf(stderr,"The command failed: %s\n", argv[1]);
+        return 1;
+    }
+    printf("%.6f\t%.6f\t%.6f\t%ld\n", timeval_sec(&end)-timeval_sec(&beg),
+        timeval_sec(&ru.ru_utime), timeval_sec(&ru.ru_stime), (long)ru.ru_maxrss);
+    return 0;
+}
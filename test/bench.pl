@@ -0,0 +1,245 @@
+#!/usr/bin/env perl
+#
+#   Benchmarks of the hot paths of the subcommands on synthetic cohorts. The
+#   data are generated from a fixed seed, so the numbers are comparable
+#   across commits as long as the same parameters are used.
+#
+#   Each kernel is run --repeat times and the fastest run is reported as a
+#   tab-delimited line:
+#
+#       BENCH  version  kernel  sites  samples  wall_s  user_s  sys_s  records/s  ns/sample  maxrss_kb
+#
+
+use strict;
+use warnings;
+use Carp;
+use FindBin;
+use lib "$FindBin::Bin";
+use Getopt::Long;
+use File::Temp qw/ tempfile tempdir /;
+
+my $opts = parse_params();
+
+generate_data($opts);
+
+# kernel => command benchmarked, {tmp} is replaced by the directory with the data
+my @kernels =
+(
+    [ 'filter_test'     => q[filter -Ou -i 'QUAL>30 && INFO/DP>500 && FMT/DP>10' {tmp}/a.bcf] ],
+    [ 'do_sample_stats' => q[stats -s - {tmp}/a.bcf] ],
+    [ 'merge_buffer'    => q[merge -Ou {tmp}/a.bcf {tmp}/b.bcf] ],
+    [ 'align'           => q[norm -Ou -f {tmp}/ref.fa {tmp}/a.bcf] ],
+    [ 'mc_cal_y_core'   => q[call -Ou -c {tmp}/a.bcf] ],
+    [ 'mcall'           => q[call -Ou -m {tmp}/a.bcf] ],
+    [ 'mcall_samples'   => q[call -Ou -m --sample-threads 4 {tmp}/a.bcf] ],     # parallel only with -s 16384 or more
+    [ 'cross_check_gts' => q[gtcheck {tmp}/a.bcf] ],
+    [ 'query_vcf'       => q[query -f '%CHROM\t%POS[\t%GT:%DP]\n' {tmp}/a.bcf] ],
+);
+
+my $version = version($opts);
+print join("\t",'#BENCH','version','kernel','sites','samples','wall_s','user_s','sys_s','records/s','ns/sample','maxrss_kb'),"\n";
+for my $kernel (@kernels)
+{
+    my ($name,$cmd) = @$kernel;
+    next if ( defined $$opts{kernels} && !exists($$opts{kernels}{$name}) );
+    $cmd =~ s/{tmp}/$$opts{tmp}/g;
+    my $best;
+    for (my $i=0; $i<$$opts{repeat}; $i++)
+    {
+        my $out = cmd(qq[$$opts{bin}/test/bench-run "$$opts{bin}/bcftools $cmd 2>/dev/null"]);
+        chomp($out);
+        my ($wall,$user,$sys,$rss) = split(/\t/,$out);
+        if ( !defined $best or $wall < $$best[0] ) { $best = [$wall,$user,$sys,$rss]; }
+    }
+    my ($wall,$user,$sys,$rss) = @$best;
+    my $nsmpl = $name eq 'merge_buffer' ? 2*$$opts{samples} : $$opts{samples};
+    my $rps = $wall ? $$opts{sites}/$wall : 0;
+    my $ns  = $wall*1e9/($$opts{sites}*$nsmpl);
+    printf "BENCH\t%s\t%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.0f\t%.2f\t%d\n", $version,$name,$$opts{sites},$nsmpl,$wall,$user,$sys,$rps,$ns,$rss;
+}
+
+exit 0;
+
+#--------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if ( scalar @msg ) { confess @msg; }
+    print
+        "About: bcftools benchmarks on synthetic data\n",
+        "Usage: bench.pl [OPTIONS]\n",
+        "Options:\n",
+        "   -a, --alleles <int>             Maximum number of alleles per site [3]\n",
+        "   -f, --format <list>             FORMAT tags to generate, PL is always added [GT,DP,AD]\n",
+        "   -k, --kernels <list>            Run only the listed kernels\n",
+        "   -n, --repeat <int>              Number of runs, the fastest is reported [3]\n",
+        "   -N, --sites <int>               Number of sites [20000]\n",
+        "   -s, --samples <int>             Number of samples [100]\n",
+        "   -S, --seed <int>                Random seed [1]\n",
+        "   -t, --temp-dir <path>           When given, temporary files will not be removed.\n",
+        "   -h, -?, --help                  This help message.\n",
+        "\n";
+    exit -1;
+}
+sub parse_params
+{
+    my $opts = { keep_files=>0, alleles=>3, format=>'GT,DP,AD', repeat=>3, sites=>20000, samples=>100, seed=>1 };
+    my ($help,$kernels);
+    Getopt::Long::Configure('bundling','no_ignore_case');
+    my $ret = GetOptions (
+            'a|alleles=i' => \$$opts{alleles},
+            'f|format=s' => \$$opts{format},
+            'k|kernels=s' => \$kernels,
+            'n|repeat=i' => \$$opts{repeat},
+            'N|sites=i' => \$$opts{sites},
+            's|samples=i' => \$$opts{samples},
+            'S|seed=i' => \$$opts{seed},
+            't|temp-dir:s' => \$$opts{keep_files},
+            'h|?|help' => \$help
+            );
+    if ( !$ret or $help ) { error(); }
+    if ( $$opts{alleles}<2 ) { error("Expected --alleles 2 or more\n"); }
+    if ( defined $kernels ) { $$opts{kernels} = { map { $_=>1 } split(/,/,$kernels) }; }
+    $$opts{tmp} = $$opts{keep_files} ? $$opts{keep_files} : tempdir(CLEANUP=>1);
+    if ( $$opts{keep_files} ) { cmd("mkdir -p $$opts{keep_files}"); }
+    $$opts{path} = $FindBin::RealBin;
+    $$opts{bin}  = $FindBin::RealBin;
+    $$opts{bin}  =~ s{/test/?$}{};
+    return $opts;
+}
+sub _cmd
+{
+    my ($cmd) = @_;
+    my $kid_io;
+    my @out;
+    my $pid = open($kid_io, "-|");
+    if ( !defined $pid ) { error("Cannot fork: $!"); }
+    if ($pid)
+    {
+        # parent
+        @out = <$kid_io>;
+        close($kid_io);
+    }
+    else
+    {
+        # child
+        exec('/bin/bash', '-o','pipefail','-c', $cmd) or error("Cannot execute the command [/bin/sh -o pipefail -c $cmd]: $!");
+    }
+    return ($? >> 8, join('',@out));
+}
+sub cmd
+{
+    my ($cmd) = @_;
+    my ($ret,$out) = _cmd($cmd);
+    if ( $ret ) { error("The command failed: $cmd\n", $out); }
+    return $out;
+}
+sub version
+{
+    my ($opts) = @_;
+    my ($ret,$out) = _cmd("cd $$opts{bin} && git describe --always --dirty 2>/dev/null");
+    chomp($out);
+    return $ret || $out eq '' ? 'unknown' : $out;
+}
+
+# Reference sequence with a hand-written .fai, then two cohorts with the same
+# sites and different samples
+sub generate_data
+{
+    my ($opts) = @_;
+    srand($$opts{seed});
+
+    my $len  = $$opts{sites}*100 + 1000;
+    my @acgt = qw(A C G T);
+    my $ref  = join('', map { $acgt[int(rand(4))] } 1..$len);
+    open(my $fh,'>',"$$opts{tmp}/ref.fa") or error("$$opts{tmp}/ref.fa: $!");
+    print $fh ">1\n";
+    for (my $i=0; $i<$len; $i+=60) { print $fh substr($ref,$i,60),"\n"; }
+    close($fh) or error("close failed: $$opts{tmp}/ref.fa");
+    open($fh,'>',"$$opts{tmp}/ref.fa.fai") or error("$$opts{tmp}/ref.fa.fai: $!");
+    print $fh "1\t$len\t3\t60\t61\n";
+    close($fh) or error("close failed: $$opts{tmp}/ref.fa.fai");
+
+    my %fmt = map { $_=>1 } split(/,/,$$opts{format});
+    my @fmt = grep { exists($fmt{$_}) } qw(GT PL DP AD);
+    if ( !exists($fmt{PL}) ) { push @fmt,'PL'; }
+
+    my @sites;
+    my $pos = 100;
+    for (my $i=0; $i<$$opts{sites}; $i++)
+    {
+        $pos += 1 + int(rand(98));
+        my $rbase = substr($ref,$pos-1,1);
+        my @als;
+        if ( rand() < 0.1 )
+        {
+            # indel, deletions and insertions in repetitive context are left for norm to realign
+            my $l = 1 + int(rand(4));
+            @als = rand() < 0.5 ? (substr($ref,$pos-1,$l+1), $rbase) : ($rbase, $rbase.join('', map { $acgt[int(rand(4))] } 1..$l));
+        }
+        else
+        {
+            my @alt = grep { $_ ne $rbase } @acgt;
+            my $nalt = 1 + int(rand($$opts{alleles}-1));
+            if ( $nalt > 3 ) { $nalt = 3; }
+            @als = ($rbase, @alt[0..$nalt-1]);
+        }
+        push @sites, [$pos,\@als,10+int(rand(90))];
+    }
+    write_cohort($opts,'a',\@sites,\@fmt);
+    write_cohort($opts,'b',\@sites,\@fmt);
+}
+sub write_cohort
+{
+    my ($opts,$name,$sites,$fmt) = @_;
+    open(my $fh,"| $$opts{bin}/bcftools view -Ob -o $$opts{tmp}/$name.bcf -") or error("$$opts{bin}/bcftools view: $!");
+    print $fh "##fileformat=VCFv4.1\n";
+    print $fh "##contig=<ID=1,length=".($$opts{sites}*100+1000).">\n";
+    print $fh qq[##INFO=<ID=DP,Number=1,Type=Integer,Description="Total depth">\n];
+    print $fh qq[##INFO=<ID=INDEL,Number=0,Type=Flag,Description="Indel">\n];
+    print $fh qq[##INFO=<ID=DP4,Number=4,Type=Integer,Description="Number of high-quality ref-forward, ref-reverse, alt-forward and alt-reverse bases">\n];
+    print $fh qq[##INFO=<ID=I16,Number=16,Type=Float,Description="Auxiliary tag used for calling">\n];
+    print $fh qq[##INFO=<ID=QS,Number=R,Type=Float,Description="Auxiliary tag used for calling">\n];
+    print $fh qq[##FORMAT=<ID=GT,Number=1,Type=String,Description="Genotype">\n];
+    print $fh qq[##FORMAT=<ID=PL,Number=G,Type=Integer,Description="List of Phred-scaled genotype likelihoods">\n];
+    print $fh qq[##FORMAT=<ID=DP,Number=1,Type=Integer,Description="Depth">\n];
+    print $fh qq[##FORMAT=<ID=AD,Number=R,Type=Integer,Description="Allelic depths">\n];
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT', map { "$name$_" } 1..$$opts{samples}),"\n";
+    for my $site (@$sites)
+    {
+        my ($pos,$als,$qual) = @$site;
+        my $nals = scalar @$als;
+        my @smpl;
+        my $dp = 0;
+        my @dp4 = (0,0,0,0);
+        my @qs  = (0) x $nals;
+        for (my $i=0; $i<$$opts{samples}; $i++)
+        {
+            # mostly ref, the first ALT more common than the others
+            my @gt = map { my $r = rand(); $r<0.7 ? 0 : ($r<0.9 ? 1 : 1+int(rand($nals-1))) } 1..2;
+            @gt = sort { $a<=>$b } @gt;
+            my $sdp = 5 + int(rand(45));
+            my @ad = (0) x $nals;
+            for (my $j=0; $j<$sdp; $j++) { $ad[$gt[$j&1]]++; }
+            my @pl;
+            for (my $b=0; $b<$nals; $b++)
+            {
+                for (my $a=0; $a<=$b; $a++) { push @pl, ($a==$gt[0] && $b==$gt[1]) ? 0 : 10+int(rand(90)); }
+            }
+            my %val = ( GT=>"$gt[0]/$gt[1]", PL=>join(',',@pl), DP=>$sdp, AD=>join(',',@ad) );
+            push @smpl, join(':', map { $val{$_} } @$fmt);
+            $dp += $sdp;
+            $dp4[0] += $ad[0]>>1; $dp4[1] += $ad[0]-($ad[0]>>1);
+            for (my $j=1; $j<$nals; $j++) { $dp4[2] += $ad[$j]>>1; $dp4[3] += $ad[$j]-($ad[$j]>>1); }
+            for (my $j=0; $j<$nals; $j++) { $qs[$j] += $ad[$j]; }
+        }
+        my @i16 = ($dp4[0],$dp4[1],$dp4[2],$dp4[3], map { $_*30 } ($dp4[0]+$dp4[1],$dp4[2]+$dp4[3]));
+        push @i16, (0) x (16 - scalar @i16);
+        my $info = "DP=$dp;DP4=".join(',',@dp4).";I16=".join(',',@i16).";QS=".join(',', map { sprintf("%.4f",$_/$dp) } @qs);
+        if ( length($$als[0])!=length($$als[1]) ) { $info = "INDEL;$info"; }
+        print $fh join("\t",1,$pos,'.',$$als[0],join(',',@$als[1..$nals-1]),$qual,'PASS',$info,join(':',@$fmt),@smpl),"\n";
+    }
+    close($fh) or error("close failed: $$opts{bin}/bcftools view -Ob -o $$opts{tmp}/$name.bcf");
+    cmd("$$opts{bin}/bcftools index $$opts{tmp}/$name.bcf");
+}
@@ -0,0 +1,160 @@
+/*
+    Checks the vectorised allele frequency spectrum recursion in afskern.h
+    against the scalar code, using the PLs of a VCF (test/mpileup.vcf by
+    default) with the samples replicated to make a bigger cohort, and
+    compares the speed of the two.
+
+    Usage: test-afskern [file.vcf [nreplicates]]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "afskern.h"
+
+#define TINY 1e-20
+#define TOLERANCE 1e-12
+
+typedef double (*afskern_f)(const double *z0, double *z1, int M0, const double *p, int kmin, int kmax);
+
+// The diploid part of mc_cal_y_core() in prob1.c, returns the log-likelihood
+static double cal_y(afskern_f kern, const double *pdg, int n, double *z0, double *z1, double **zout)
+{
+    int i, k, kmin = 0, kmax = 0, M = 0;
+    double t = 0;
+    memset(z0, 0, sizeof(double)*(2*n+1));
+    memset(z1, 0, sizeof(double)*(2*n+1));
+    z0[0] = 1;
+    for (i=0; i<n; i++)
+    {
+        int M0 = M;
+        double p[3] = { pdg[3*i], 2*pdg[3*i+1], pdg[3*i+2] };
+        M += 2;
+        for (; kmin < kmax && z0[kmin] < TINY; ++kmin) z0[kmin] = z1[kmin] = 0.;
+        for (; kmax > kmin && z0[kmax] < TINY; --kmax) z0[kmax] = z1[kmax] = 0.;
+        kmax += 2;
+        double sum = kern(z0, z1, M0, p, kmin, kmax);
+        t += log(sum / (M * (M - 1.)));
+        for (k = kmin; k <= kmax; ++k) z1[k] /= sum;
+        if (kmin >= 1) z1[kmin-1] = 0.;
+        if (kmin >= 2) z1[kmin-2] = 0.;
+        if (i < n - 1) z1[kmax+1] = z1[kmax+2] = 0.;
+        double *tmp = z0; z0 = z1; z1 = tmp;
+    }
+    *zout = z0;
+    return t;
+}
+
+static int differ(double a, double b)
+{
+    double d = fabs(a-b), m = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return d > TOLERANCE*m && d > 1e-300;
+}
+
+// Reads PL:... of all samples of biallelic sites, one line at a time
+static int read_site(FILE *fp, char **line, size_t *mline, double *q2p, double *pdg, int nrep, int *nsmpl)
+{
+    while ( getline(line, mline, fp) > 0 )
+    {
+        if ( (*line)[0]=='#' ) continue;
+        char *s = *line;
+        int i, ipl = -1, icol = 0, n = 0;
+        for (icol=0; icol<8 && s; icol++) { s = strchr(s,'\t'); if ( s ) s++; }
+        if ( !s ) continue;
+        // FORMAT
+        char *fmt = s, *end = strchr(s,'\t');
+        if ( !end ) continue;
+        for (i=0; fmt<end; i++)
+        {
+            if ( !strncmp(fmt,"PL",2) && (fmt[2]==':' || fmt[2]=='\t') ) { ipl = i; break; }
+            while ( fmt<end && *fmt!=':' ) fmt++;
+            fmt++;
+        }
+        if ( ipl<0 ) continue;
+        s = end + 1;
+        while ( *s && *s!='\n' )
+        {
+            for (i=0; i<ipl; i++) { while ( *s && *s!=':' && *s!='\t' ) s++; if ( *s==':' ) s++; }
+            int pl[3] = {0,0,0}, k;
+            for (k=0; k<3; k++)
+            {
+                pl[k] = strtol(s, &s, 10);
+                if ( pl[k] < 0 ) pl[k] = 0;
+                if ( pl[k] > 255 ) pl[k] = 255;
+                if ( *s!=',' ) break;
+                s++;
+            }
+            pdg[3*n] = q2p[pl[2]]; pdg[3*n+1] = q2p[pl[1]]; pdg[3*n+2] = q2p[pl[0]];
+            n++;
+            while ( *s && *s!='\t' && *s!='\n' ) s++;
+            if ( *s=='\t' ) s++;
+        }
+        // replicate the samples, shifting the PLs so that the copies differ
+        int j;
+        for (j=1; j<nrep; j++)
+            for (i=0; i<n; i++)
+            {
+                int r = (i+j) % 3;
+                pdg[3*(j*n+i)]   = pdg[3*i+r];
+                pdg[3*(j*n+i)+1] = pdg[3*i+1];
+                pdg[3*(j*n+i)+2] = pdg[3*i+(3-r)%3];
+            }
+        *nsmpl = n*nrep;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *fname = argc>1 ? argv[1] : "test/mpileup.vcf";
+    int nrep = argc>2 ? atoi(argv[2]) : 300;
+    FILE *fp = fopen(fname,"r");
+    if ( !fp ) { fprintf(stderr,"Could not read %s\n", fname); return 1; }
+
+    int i, nsmpl = 0, nsites = 0, nerr = 0, msmpl = 1000*nrep;
+    double q2p[256];
+    for (i=0; i<256; i++) q2p[i] = pow(10., -i / 10.);
+    double *pdg = (double*) malloc(sizeof(double)*3*msmpl);
+    double *buf = (double*) malloc(sizeof(double)*4*(2*msmpl+1));
+    char *line = NULL;
+    size_t mline = 0;
+    double tscalar = 0, tkern = 0;
+    while ( read_site(fp, &line, &mline, q2p, pdg, nrep, &nsmpl) )
+    {
+        if ( nsmpl > msmpl ) { fprintf(stderr,"Too many samples: %d\n", nsmpl); return 1; }
+        double *za, *zb;
+        clock_t start = clock();
+        double ta = cal_y(afskern_diploid_scalar, pdg, nsmpl, buf, buf+(2*msmpl+1), &za);
+        tscalar += (double)(clock() - start)/CLOCKS_PER_SEC;
+        start = clock();
+        double tb = cal_y(afskern_diploid, pdg, nsmpl, buf+2*(2*msmpl+1), buf+3*(2*msmpl+1), &zb);
+        tkern += (double)(clock() - start)/CLOCKS_PER_SEC;
+
+        int k, bad = differ(ta,tb);
+        for (k=0; k<=2*nsmpl; k++)
+            if ( differ(za[k],zb[k]) ) bad = 1;
+        if ( bad )
+        {
+            if ( nerr < 10 ) fprintf(stderr,"Mismatch at site %d: t=%.17g vs %.17g\n", nsites+1, ta, tb);
+            nerr++;
+        }
+        nsites++;
+    }
+    printf("sites=%d samples=%d\tscalar: %.3fs\tafskern%s: %.3fs\tmismatches=%d\n", nsites, nsmpl, tscalar,
+        #if defined(__AVX__)
+            "[avx]",
+        #elif defined(__SSE2__)
+            "[sse2]",
+        #else
+            "[scalar]",
+        #endif
+        tkern, nerr);
+
+    free(line);
+    free(pdg);
+    free(buf);
+    fclose(fp);
+    return nerr ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+/*
+    Checks the vectorised genotype classification in gtkern.h against
+    bcf_gt_type() and compares the speed of the two.
+
+    Usage: test-gtkern [nsamples [nsites]]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <htslib/vcf.h>
+#include <htslib/vcfutils.h>
+#include "gtkern.h"
+
+static int8_t random_allele(void)
+{
+    int r = rand() % 100;
+    if ( r < 2 ) return bcf_int8_missing;
+    if ( r < 4 ) return 0;      // missing allele, unphased
+    if ( r < 5 ) return 1;      // missing allele, phased
+    if ( r < 7 ) return bcf_int8_vector_end;
+    if ( r < 60 ) return 2 | (rand()&1);                // ref
+    return ((2+rand()%3)<<1) | (rand()&1);              // one of three alts
+}
+
+static double elapsed(clock_t start)
+{
+    return (double)(clock() - start)/CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    int nsmpl = argc>1 ? atoi(argv[1]) : 10007;
+    int nsites = argc>2 ? atoi(argv[2]) : 200;
+    int i, j, nerr = 0;
+
+    int8_t *gts = (int8_t*) malloc(2*nsmpl);
+    uint8_t *type = (uint8_t*) malloc(nsmpl), *ial = (uint8_t*) malloc(nsmpl);
+    bcf_fmt_t fmt;
+    fmt.id = 0; fmt.n = 2; fmt.size = 2; fmt.type = BCF_BT_INT8; fmt.p = (uint8_t*)gts;
+
+    srand(1);
+    for (i=0; i<2*nsmpl; i++) gts[i] = random_allele();
+
+    // correctness
+    gtkern_classify_diploid8(gts, nsmpl, type, ial);
+    for (i=0; i<nsmpl; i++)
+    {
+        int jal, gt_ial, gt = bcf_gt_type(&fmt, i, &gt_ial, &jal);
+        if ( gt!=type[i] || ((gt==GT_HOM_AA || gt==GT_HET_RA || gt==GT_HET_AA || gt==GT_HAPL_A) && gt_ial!=ial[i]) )
+        {
+            fprintf(stderr,"Mismatch in sample %d, alleles %d,%d: type %d vs %d, ial %d vs %d\n", i,gts[2*i],gts[2*i+1],gt,type[i],gt_ial,ial[i]);
+            nerr++;
+        }
+    }
+    if ( nerr ) return 1;
+
+    // speed
+    long int nhet = 0;
+    clock_t start = clock();
+    for (j=0; j<nsites; j++)
+    {
+        for (i=0; i<nsmpl; i++)
+        {
+            int gt_ial, gt = bcf_gt_type(&fmt, i, &gt_ial, NULL);
+            if ( gt==GT_HET_RA || gt==GT_HET_AA ) nhet++;
+        }
+    }
+    double tscalar = elapsed(start);
+
+    start = clock();
+    for (j=0; j<nsites; j++)
+    {
+        gtkern_classify_diploid8(gts, nsmpl, type, ial);
+        for (i=0; i<nsmpl; i++) nhet -= type[i]==GT_HET_RA || type[i]==GT_HET_AA;
+    }
+    double tkern = elapsed(start);
+
+    printf("samples=%d sites=%d\tbcf_gt_type: %.3fs\tgtkern%s: %.3fs\t(%ld)\n", nsmpl, nsites, tscalar,
+        #if defined(__AVX2__)
+            "[avx2]",
+        #elif defined(__SSE2__)
+            "[sse2]",
+        #else
+            "[scalar]",
+        #endif
+        tkern, nhet);
+
+    free(gts);
+    free(type);
+    free(ial);
+    return 0;
+}
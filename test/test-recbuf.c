@@ -0,0 +1,67 @@
+/*
+    Checks that recbuf_t keeps the order of the records when pushing,
+    shifting and growing, and that the records are recycled rather than
+    reallocated.
+
+    Usage: test-recbuf
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <htslib/vcf.h>
+#include "recbuf.h"
+
+int main(int argc, char **argv)
+{
+    recbuf_t buf;
+    recbuf_init(&buf, 4);
+
+    int i, npos = 0, nshift = 0, nerr = 0;
+    bcf1_t *rec = bcf_init1();
+
+    // push 10 records, shifting one after every third push: the buffer grows from 4
+    for (i=0; i<10; i++)
+    {
+        rec->pos = npos++;
+        recbuf_push(&buf, &rec);
+        if ( i%3==2 )
+        {
+            bcf1_t **ptr = recbuf_shift(&buf);
+            if ( (*ptr)->pos!=nshift ) { fprintf(stderr,"Shifted %d, expected %d\n", (*ptr)->pos,nshift); nerr++; }
+            nshift++;
+        }
+    }
+    if ( buf.rbuf.m!=8 ) { fprintf(stderr,"Expected the buffer to grow to 8, got %d\n", buf.rbuf.m); nerr++; }
+    for (i=0; i<recbuf_n(&buf); i++)
+    {
+        bcf1_t *kth = recbuf_kth(&buf, i);
+        if ( kth->pos!=nshift+i ) { fprintf(stderr,"The %d-th is %d, expected %d\n", i,kth->pos,nshift+i); nerr++; }
+    }
+    if ( recbuf_last(&buf)->pos!=npos-1 ) { fprintf(stderr,"The last is %d, expected %d\n", recbuf_last(&buf)->pos,npos-1); nerr++; }
+
+    // once every slot holds a record, no new records are allocated
+    recbuf_clear(&buf);
+    for (i=0; i<buf.rbuf.m; i++)
+    {
+        recbuf_push(&buf, &rec);
+        recbuf_shift(&buf);
+    }
+    bcf1_t *seen[16];
+    int nseen = 0, j;
+    for (i=0; i<buf.rbuf.m; i++)
+        if ( buf.recs[i] ) seen[nseen++] = buf.recs[i];
+    seen[nseen++] = rec;
+    for (i=0; i<20; i++)
+    {
+        rec->pos = npos++;
+        recbuf_push(&buf, &rec);
+        recbuf_shift(&buf);
+        for (j=0; j<nseen; j++)
+            if ( rec==seen[j] ) break;
+        if ( j==nseen ) { fprintf(stderr,"A new record was allocated\n"); nerr++; break; }
+    }
+    printf("peak %d records, %lu bytes\n", buf.nmax, (unsigned long)buf.mem_max);
+
+    bcf_destroy1(rec);
+    recbuf_destroy(&buf);
+    return nerr ? 1 : 0;
+}
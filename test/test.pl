@@ -8,6 +8,7 @@ use FindBin;
 use lib "$FindBin::Bin";
 use Getopt::Long;
 use File::Temp qw/ tempfile tempdir /;
+use Time::HiRes;
 
 my $opts = parse_params();
 
@@ -18,14 +19,23 @@ test_tabix($opts,in=>'merge.a',reg=>'1:3000151-3000151',out=>'tabix.1.3000151.ou
 test_tabix($opts,in=>'large_chrom_tbi_limit',reg=>'chr11:1-536870912',out=>'large_chrom_tbi_limit.20.1.536870912.out'); # 536870912 (1<<29) is the current limit for tbi. cannot retrieve regions larger than that
 test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20:1-2147483647',out=>'large_chrom_csi_limit.20.1.2147483647.out'); # 2147483647 (1<<31-1) is the current chrom limit for csi. bcf conversion and indexing fail above this 
 # test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20',out=>'large_chrom.20.1.2147483647.out'); # this fails until bug resolved
+test_kernels($opts);
 test_vcf_check($opts,in=>'check',out=>'check.chk');
+test_vcf_check($opts,in=>'check',out=>'check.chk',args=>'--threads 3');
+test_stats_sidecar($opts,in=>'check',out=>'check.sidecar.chk',args=>'',reg=>'');
+test_stats_checkpoint($opts,in=>'check',out=>'check.chk');
+test_stats_sidecar($opts,in=>'check',out=>'check.sidecar.chk',args=>'-m2',reg=>'-r 1:3000000-3100000,1:3050000-3300000,2,3,4:3258448-3258454');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.out',args=>'-n =2');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.both.out',args=>'-n =2 -c both');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.any.out',args=>'-n =2 -c any');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.C.out',args=>'-C -c any');
 test_vcf_isec2($opts,vcf_in=>['isec.a'],tab_in=>'isec',out=>'isec.tab.out',args=>'');
+test_vcf_isec_threads($opts,in=>['isec.a','isec.b'],args=>'-c any');
+test_vcf_som($opts,in=>'som.tab',args=>'-f 3 -s 10');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out');
+test_vcf_merge_tree($opts,in=>['merge.a','merge.b','merge.c'],args=>'-m all',tree=>2);
 test_vcf_query($opts,in=>'query',out=>'query.out',args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n']);
+test_vcf_query_columnar($opts,in=>'query',out=>'query.out',args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n' --row-group 5]);
 test_vcf_norm($opts,in=>'norm',out=>'norm.out',fai=>'norm');
 test_vcf_view($opts,in=>'view',out=>'view.1.out',args=>'-aUc1 -C1 -s NA00002 -v snps',reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.2.out',args=>'-f PASS -Xks NA00003',reg=>'-r20,Y');
@@ -40,18 +50,54 @@ test_vcf_view($opts,in=>'view',out=>'view.10.out',args=>q[-ne 'INDEL=1 || PV4[0]
 test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.omitgenotypes.out',args=>'',reg=>'');
 test_vcf_view($opts,in=>'view.vectors',out=>'view.vectors.out',args=>'-asA',reg=>'');
 test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv');
+test_vcf_gtcheck_threads($opts,in=>'mpileup',args=>'-a',threads=>2);
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv --threads 2',indexed=>1);
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv --sample-threads 2 --sample-chunk 1');
+test_vcf_roh_batch($opts,in=>'mpileup.1',args=>'-e all');
+test_vcf_roh_batch($opts,in=>'mpileup.1',args=>'-e all -f');
+test_vcf_roh_batch($opts,in=>'mpileup.1',args=>'-e all -w 4');
+test_vcf_roh_batch($opts,in=>'mpileup.1',args=>'-e all -f -w 4');
+test_vcf_roh_genmap($opts,in=>'mpileup.1');
+test_vcf_roh_sites($opts,in=>'mpileup.1',out=>'mpileup.1.roh.w4.out',args=>'-e all -w 4');
+test_vcf_roh_sites($opts,in=>'mpileup.1',out=>'mpileup.1.roh.w4.out',args=>'-e all -w 4 -f');
+test_gtcache($opts,in=>'mpileup.1.out',cmd=>'gtcheck -a');
+test_gtcache($opts,in=>'mpileup.1.out',cmd=>'roh');
+test_gtcache($opts,in=>'mpileup.1.out',cmd=>'roh -G 30');
 test_vcf_call_cAls($opts,in=>'mpileup',out=>'mpileup.cAls.out',tab=>'mpileup');
+test_vcf_call_trio_threads($opts,in=>'mpileup',threads=>2);
 test_vcf_filter($opts,in=>'filter.1',out=>'filter.1.out',args=>'-mx -g2 -G2');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.2.out',args=>q[-e'%QUAL==59.2 || (INDEL=0 & (FMT/GQ=25 | FMT/DP=10))' -sModified -S.]);
+test_vcf_filter_debug($opts,in=>'filter.2',out=>'filter.2.debug.out',args=>q[-i 'QUAL>50 && FMT/DP>20']);
+test_vcf_filter_short_circuit($opts,in=>'filter.2',args=>q[-i 'QUAL>50 && FMT/DP>20' -S.]);
+test_vcf_filter_short_circuit($opts,in=>'filter.2',args=>q[-e 'QUAL<50 || FMT/DP>20' -S0 -sModified]);
+test_vcf_pipe($opts,in=>'filter.1',out=>'filter.1.out',args=>'-- filter -mx -g2 -G2');
+test_vcf_pipe($opts,in=>'filter.2',out=>'filter.2.out',args=>q[--stage-threads -- filter -e'%QUAL==59.2 || (INDEL=0 & (FMT/GQ=25 | FMT/DP=10))' -sModified -S.]);
+test_vcf_pipe($opts,in=>'view',out=>'view.3.out',args=>'--stage-threads -- view -xs NA00003');
+test_vcf_pipe($opts,in=>'view',out=>'view.3.out',args=>'--threads 3 -- view -xs NA00003',indexed=>1);
+test_vcf_pipe($opts,in=>'filter.2',out=>'filter.2.out',args=>q[--threads 2 -- filter -e'%QUAL==59.2 || (INDEL=0 & (FMT/GQ=25 | FMT/DP=10))' -sModified -S.],indexed=>1);
+test_vcf_pipe_vs_unix($opts,in=>'norm',args=>'',cmds=>['norm -f {path}/norm.fa','filter -s LowPos -e"POS<100"']);
+test_vcf_pipe_vs_unix($opts,in=>'norm',args=>'--stage-threads',cmds=>['norm -f {path}/norm.fa','filter -s LowPos -e"POS<100"']);
+test_vcf_pipe_vs_unix($opts,in=>'view',args=>'--threads 3',regs=>'20:100000-200000,X:2930000-2950000,Y',cmds=>['view -xs NA00003'],indexed=>1);
 test_vcf_regions($opts,in=>'regions');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>'-c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate2',out=>'annotate2.out',args=>'-c CHROM,FROM,TO,T_STR');
+test_vcf_annotate_threads($opts,in=>'annotate',plugin=>'fill-AN-AC',threads=>2);
+test_vcf_annotate_vcf($opts,in=>'annotate',src=>'annotate.src',out=>'annotate.src.out',args=>'-c INFO/TEST,INFO/T_STR,INFO/T_INT,INFO/T_FLOAT,INFO/T_FLAG');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.vcf.out',do_bcf=>0,args=>'');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.bcf.out',do_bcf=>1,args=>'');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.2.vcf.out',do_bcf=>0,args=>'-a');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.2.bcf.out',do_bcf=>1,args=>'-a');
 test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.vcf.out',do_bcf=>0,args=>'-l');
 test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.bcf.out',do_bcf=>1,args=>'-l');
+test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.vcf.out',do_bcf=>0,args=>'-l --max-mem 1');
+test_naive_concat($opts,in=>'view',out=>'view.3.out',args=>'-xs NA00003',regs=>['11','20','X,Y']);
+test_threads($opts,out=>'view.1.out',cmd=>"view -aUc1 -C1 -s NA00002 -v snps {tmp}/view.vcf.gz");
+test_threads($opts,out=>'filter.1.out',cmd=>"filter -mx -g2 -G2 {path}/filter.1.vcf");
+test_threads($opts,out=>'annotate.out',cmd=>"annotate -a {tmp}/annotate.tab.gz -h {path}/annotate.hdr -c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL {path}/annotate.vcf");
+test_threads($opts,out=>'norm.out',cmd=>"norm -f {path}/norm.fa {tmp}/norm.vcf.gz");
+test_threads($opts,out=>'concat.1.vcf.out',cmd=>"concat {tmp}/concat.1.a.vcf.gz {tmp}/concat.1.b.vcf.gz");
+test_threads($opts,out=>'merge.abc.out',cmd=>"merge {tmp}/merge.a.vcf.gz {tmp}/merge.b.vcf.gz {tmp}/merge.c.vcf.gz");
+test_threads($opts,out=>'mpileup.1.out',cmd=>"call -mv {path}/mpileup.vcf");
 
 print "\nNumber of tests:\n";
 printf "    total   .. %d\n", $$opts{nok}+$$opts{nfailed};
@@ -181,6 +227,72 @@ sub test_cmd
     }
     passed($opts,$test);
 }
+# Two commands which must give the same output, such as with and without
+# threads, for when there is no file with the expected output
+sub test_same_output
+{
+    my ($opts,%args) = @_;
+    my ($package, $filename, $line, $test)=caller(1);
+    $test =~ s/^.+:://;
+
+    print "$test:\n";
+    print "\t$args{cmd}\n";
+    print "\t$args{cmd2}\n";
+
+    my ($ret,$out) = _cmd($args{cmd});
+    if ( $ret ) { failed($opts,$test,"Non-zero status $ret"); return; }
+    my ($ret2,$out2) = _cmd($args{cmd2});
+    if ( $ret2 ) { failed($opts,$test,"Non-zero status $ret2"); return; }
+    if ( $out eq '' ) { failed($opts,$test,"No output"); return; }
+    if ( $out ne $out2 )
+    {
+        my $fname = "$$opts{tmp}/$test.$$opts{nfailed}";
+        for my $i (1,2)
+        {
+            open(my $fh,'>',"$fname.$i") or error("$fname.$i: $!");
+            print $fh ($i==1 ? $out : $out2);
+            close($fh);
+        }
+        failed($opts,$test,"The outputs differ:\n\t\t$fname.1\n\t\t$fname.2");
+        return;
+    }
+    passed($opts,$test);
+}
+# The command is expected to exit with an error
+sub test_kernels
+{
+    my ($opts) = @_;
+    # the vectorized kernels are checked against their scalar versions, the programs exit non-zero on a mismatch
+    test_cmd_ok($opts,cmd=>"$$opts{bin}/test/test-gtkern 1003 20");
+    test_cmd_ok($opts,cmd=>"$$opts{bin}/test/test-afskern $$opts{path}/mpileup.vcf 3");
+    test_cmd_ok($opts,cmd=>"$$opts{bin}/test/test-recbuf");
+}
+sub test_cmd_fails
+{
+    my ($opts,%args) = @_;
+    my ($package, $filename, $line, $test)=caller(1);
+    $test =~ s/^.+:://;
+
+    print "$test:\n";
+    print "\t$args{cmd}\n";
+
+    my ($ret,$out) = _cmd("$args{cmd} 2>&1");
+    if ( !$ret ) { failed($opts,$test,"Expected a non-zero status"); return; }
+    passed($opts,$test);
+}
+sub test_cmd_ok
+{
+    my ($opts,%args) = @_;
+    my ($package, $filename, $line, $test)=caller(1);
+    $test =~ s/^.+:://;
+
+    print "$test:\n";
+    print "\t$args{cmd}\n";
+
+    my ($ret,$out) = _cmd("$args{cmd} 2>&1");
+    if ( $ret ) { failed($opts,$test,"Non-zero status $ret:\n$out"); return; }
+    passed($opts,$test);
+}
 sub failed
 {
     my ($opts,$test,$reason) = @_;
@@ -244,12 +356,41 @@ sub test_index
     cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
+
+    # batch and multi-threaded builds must give identical indexes
+    for my $file ("$args{in}.vcf.gz","$args{in}.bcf") { cmd("cp $$opts{tmp}/$file.csi $$opts{tmp}/$file.csi.1"); }
+    cmd("$$opts{bin}/bcftools index -f --threads 2 $$opts{tmp}/$args{in}.vcf.gz $$opts{tmp}/$args{in}.bcf");
+    for my $file ("$args{in}.vcf.gz","$args{in}.bcf") { cmd("cmp $$opts{tmp}/$file.csi $$opts{tmp}/$file.csi.1"); }
+    cmd("$$opts{bin}/bcftools index -f --threads 3 $$opts{tmp}/$args{in}.bcf");
+    cmd("cmp $$opts{tmp}/$args{in}.bcf.csi $$opts{tmp}/$args{in}.bcf.csi.1");
+    test_cmd_fails($opts,cmd=>"$$opts{bin}/bcftools index -f --threads 2x $$opts{tmp}/$args{in}.bcf");
+    test_cmd_fails($opts,cmd=>"$$opts{bin}/bcftools index -f --threads 0 $$opts{tmp}/$args{in}.bcf");
+}
+sub test_stats_checkpoint
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $filter = "grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'";
+    cmd("$$opts{bin}/bcftools stats -s - -r 1,2 --save-checkpoint $$opts{tmp}/$args{in}.1.ckpt $$opts{tmp}/$args{in}.vcf.gz > /dev/null");
+    cmd("$$opts{bin}/bcftools stats -s - -r 3,4 --save-checkpoint $$opts{tmp}/$args{in}.2.ckpt $$opts{tmp}/$args{in}.vcf.gz > /dev/null");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats -s - -r 3,4 --load-checkpoint $$opts{tmp}/$args{in}.1.ckpt $$opts{tmp}/$args{in}.vcf.gz | $filter");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats --load-checkpoint $$opts{tmp}/$args{in}.1.ckpt --load-checkpoint $$opts{tmp}/$args{in}.2.ckpt | $filter");
+    test_cmd_fails($opts,cmd=>"$$opts{bin}/bcftools stats --load-checkpoint $$opts{tmp}/$args{in}.1.ckpt --load-checkpoint $$opts{tmp}/$args{in}.1.ckpt");
+    test_cmd_fails($opts,cmd=>"$$opts{bin}/bcftools stats -s - -r 2 --load-checkpoint $$opts{tmp}/$args{in}.1.ckpt $$opts{tmp}/$args{in}.vcf.gz");
+}
+sub test_stats_sidecar
+{
+    my ($opts,%args) = @_;
+    cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
+    cmd("$$opts{bin}/bcftools index -f --sidecar $args{args} $$opts{tmp}/$args{in}.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats --sidecar $args{reg} $$opts{tmp}/$args{in}.bcf | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
 }
 sub test_vcf_check
 {
     my ($opts,%args) = @_;
     bgzip_tabix_vcf($opts,$args{in});
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats -s - $$opts{tmp}/$args{in}.vcf.gz | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
+    my $args = exists($args{args}) ? $args{args} : '';
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats -s - $args $$opts{tmp}/$args{in}.vcf.gz | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
 }
 sub test_vcf_merge
 {
@@ -263,6 +404,22 @@ sub test_vcf_merge
     my $files = join(' ',@files);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge $files | grep -v ^##bcftools_merge");
 }
+# --tree requires one record per position, the first one is kept
+sub test_vcf_merge_tree
+{
+    my ($opts,%args) = @_;
+    my @files;
+    for my $file (@{$args{in}})
+    {
+        cmd("awk '/^#/ || !seen[\$1,\$2]++' $$opts{path}/$file.vcf | bgzip -c > $$opts{tmp}/$file.uniq.vcf.gz");
+        cmd("$$opts{bin}/bcftools tabix -f -p vcf $$opts{tmp}/$file.uniq.vcf.gz");
+        push @files, "$$opts{tmp}/$file.uniq.vcf.gz";
+    }
+    my $files = join(' ',@files);
+    my $cmd = "$$opts{bin}/bcftools merge $args{args}";
+    test_same_output($opts,cmd=>"$cmd $files | grep -v ^##bcftools_merge",
+        cmd2=>"$cmd --tree $args{tree} --threads 2 $files | grep -v ^##bcftools_merge");
+}
 sub test_vcf_isec
 {
     my ($opts,%args) = @_;
@@ -275,6 +432,21 @@ sub test_vcf_isec
     my $files = join(' ',@files);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec $args{args} $files");
 }
+sub test_vcf_isec_threads
+{
+    my ($opts,%args) = @_;
+    my @files;
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        push @files, "$$opts{tmp}/$file.vcf.gz";
+    }
+    my $files = join(' ',@files);
+    my $cmd = "$$opts{bin}/bcftools isec $args{args} -O v";
+    my $out = "cat sites.txt 0*.vcf | grep -v ^##bcftools_isec";
+    test_same_output($opts,cmd=>"$cmd -p $$opts{tmp}/isec.p1 $files && cd $$opts{tmp}/isec.p1 && $out",
+        cmd2=>"$cmd -p $$opts{tmp}/isec.p2 --threads 2 $files && cd $$opts{tmp}/isec.p2 && $out");
+}
 sub test_vcf_isec2
 {
     my ($opts,%args) = @_;
@@ -288,12 +460,98 @@ sub test_vcf_isec2
     bgzip_tabix($opts,file=>$args{tab_in},suffix=>'tab',args=>'-s 1 -b 2 -e 3');
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec $args{args} -T $$opts{tmp}/$args{tab_in}.tab.gz $files 2>/dev/null | grep -v ^##bcftools_isec");
 }
+sub test_vcf_som
+{
+    my ($opts,%args) = @_;
+    my $cmd = "$$opts{bin}/bcftools som $args{args}";
+    my $in  = "$$opts{path}/$args{in}";
+    test_same_output($opts,cmd=>"$cmd -t -p $$opts{tmp}/som.1 $in && $cmd -c -p $$opts{tmp}/som.1 $in",
+        cmd2=>"$cmd -t -p $$opts{tmp}/som.2 --threads 2 $in && $cmd -c -p $$opts{tmp}/som.2 --threads 2 $in");
+}
 sub test_vcf_query
 {
     my ($opts,%args) = @_;
     bgzip_tabix_vcf($opts,$args{in});
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query $args{args} $$opts{tmp}/$args{in}.vcf.gz");
 }
+# Decodes the --columnar output into the tab-separated text of query
+sub decode_columnar
+{
+    my ($dat) = @_;
+    my $off = 0;
+    my $get = sub { my ($tmpl,$len) = @_; my @v = unpack($tmpl,substr($dat,$off,$len)); $off += $len; return wantarray ? @v : $v[0]; };
+    if ( $get->('a8',8) ne "BCFQCOL\1" ) { return undef; }
+    my ($ncols,$nsmpl) = $get->('LL',8);
+    for (1..$nsmpl) { $off += $get->('L',4); }
+    my @cols;
+    for (1..$ncols)
+    {
+        my ($per_smpl,$type) = $get->('CC',4);
+        $off += $get->('L',4);
+        push @cols, { per_smpl=>$per_smpl, type=>$type };
+    }
+    my $txt = '';
+    while ( my $nrows = $get->('L',4) )
+    {
+        my @vals;
+        for my $col (@cols)
+        {
+            my $data   = $get->('a*',$get->('Q',8));
+            my $ncells = $nrows * ($$col{per_smpl} ? $nsmpl : 1);
+            my @cells;
+            if ( $$col{type}==3 )
+            {
+                my @beg = unpack("L".($ncells+1),$data);
+                for my $i (0..$ncells-1) { push @cells, substr($data,4*($ncells+1)+$beg[$i],$beg[$i+1]-$beg[$i]); }
+            }
+            elsif ( $$col{type}==1 ) { @cells = map { $_==-2147483648 ? '.' : $_ } unpack("l$ncells",$data); }
+            else
+            {
+                my @bits = unpack("L$ncells",$data);
+                @cells = map { $bits[$_]==0x7F800001 ? '.' : sprintf("%g",unpack('f',substr($data,4*$_,4))) } 0..$ncells-1;
+            }
+            push @vals, \@cells;
+        }
+        for my $irow (0..$nrows-1)
+        {
+            my @row;
+            for my $i (0..$#cols) { if ( !$cols[$i]{per_smpl} ) { push @row, $vals[$i][$irow]; } }
+            for my $is (0..$nsmpl-1)
+            {
+                for my $i (0..$#cols) { if ( $cols[$i]{per_smpl} ) { push @row, $vals[$i][$irow*$nsmpl+$is]; } }
+            }
+            $txt .= join("\t",@row)."\n";
+        }
+    }
+    return $txt;
+}
+sub test_vcf_query_columnar
+{
+    my ($opts,%args) = @_;
+    my ($package, $filename, $line, $test)=caller(1);
+    $test =~ s/^.+:://;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $cmd = "$$opts{bin}/bcftools query --columnar $args{args} $$opts{tmp}/$args{in}.vcf.gz";
+    print "$test:\n";
+    print "\t$cmd\n";
+    my ($ret,$out) = _cmd($cmd);
+    if ( $ret ) { failed($opts,$test,"Non-zero status $ret"); return; }
+    $out = decode_columnar($out);
+    if ( !defined $out ) { failed($opts,$test,"Not a columnar file"); return; }
+    open(my $fh,'<',"$$opts{path}/$args{out}") or error("$$opts{path}/$args{out}: $!");
+    my $exp = join('',<$fh>);
+    close($fh);
+    if ( $out ne $exp )
+    {
+        my $fname = "$$opts{tmp}/$test.$$opts{nfailed}";
+        open($fh,'>',$fname) or error("$fname: $!");
+        print $fh $out;
+        close($fh);
+        failed($opts,$test,"The decoded output differs:\n\t\t$$opts{path}/$args{out}\n\t\t$fname");
+        return;
+    }
+    passed($opts,$test);
+}
 sub test_vcf_norm
 {
     my ($opts,%args) = @_;
@@ -306,10 +564,95 @@ sub test_vcf_view
     bgzip_tabix_vcf($opts,$args{in});
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view $args{args} $$opts{tmp}/$args{in}.vcf.gz $args{reg} | grep -v ^##bcftools_view");
 }
+sub test_vcf_gtcheck_threads
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $cmd = "$$opts{bin}/bcftools gtcheck $args{args}";
+    my $in  = "$$opts{tmp}/$args{in}.vcf.gz | grep -v ^#";
+    test_same_output($opts,cmd=>"$cmd $in",cmd2=>"$cmd --threads $args{threads} $in");
+}
+sub test_vcf_roh_batch
+{
+    my ($opts,%args) = @_;
+    # the input is a call output, -e needs the GT field
+    bgzip_tabix($opts,file=>$args{in},suffix=>'out',args=>'-p vcf');
+    my $cmd = "$$opts{bin}/bcftools roh $args{args}";
+    my $in  = "$$opts{tmp}/$args{in}.out.gz | grep -v '^# The command line'";
+    test_same_output($opts,cmd=>"$cmd $in",cmd2=>"$cmd --batch-samples $in");
+}
+# The sites printed by Viterbi and forward-backward, the first site of each window is not printed
+sub test_vcf_roh_sites
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix($opts,file=>$args{in},suffix=>'out',args=>'-p vcf');
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools roh $args{args} $$opts{tmp}/$args{in}.out.gz | grep -v '^#' | cut -f1-3");
+}
+# The forward-backward algorithm does not support genetic maps, with or without --batch-samples
+sub test_vcf_roh_genmap
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix($opts,file=>$args{in},suffix=>'out',args=>'-p vcf');
+    my $map = "$$opts{tmp}/roh.genmap.txt";
+    cmd(qq[printf 'position COMBINED_rate(cM/Mb) Genetic_Map(cM)\\n1 1.0 0\\n5000 1.0 0.005\\n' > $map]);
+    my $in = "$$opts{tmp}/$args{in}.out.gz";
+    cmd("$$opts{bin}/bcftools roh -e all -m $map $in");
+    test_cmd_fails($opts,cmd=>"$$opts{bin}/bcftools roh -e all -f -m $map $in");
+    test_cmd_fails($opts,cmd=>"$$opts{bin}/bcftools roh -e all -f --batch-samples -m $map $in");
+}
+# Runs the command with and without --cache on a VCF the cache holds exactly:
+# bi-allelic sites with the PLs capped at 254
+sub test_gtcache
+{
+    my ($opts,%args) = @_;
+    my $in = "$$opts{tmp}/gtcache.vcf.gz";
+    my $cap = q[awk 'BEGIN{OFS="\t"} /^#/{print;next} $5!~/,/{for(i=10;i<=NF;i++){n=split($i,f,":"); m=split(f[2],p,","); s=p[1]>254?254:p[1]; for(j=2;j<=m;j++) s=s","(p[j]>254?254:p[j]); t=f[1]":"s; for(j=3;j<=n;j++) t=t":"f[j]; $i=t} print}'];
+    cmd("$cap $$opts{path}/$args{in} | bgzip -c > $in");
+    my $cmd = "$$opts{bin}/bcftools $args{cmd}";
+    my $cache = "$$opts{tmp}/gtcache.gtc";
+    my $filter = "grep -v '^#'";
+    test_same_output($opts,cmd=>"$cmd $in | $filter",
+        cmd2=>"rm -f $cache && $cmd --cache $cache $in >/dev/null 2>&1 && $cmd --cache $cache $in | $filter");
+}
 sub test_vcf_call
 {
     my ($opts,%args) = @_;
-    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools call $args{args} $$opts{path}/$args{in}.vcf | grep -v ^##bcftools_call");
+    my $in = "$$opts{path}/$args{in}.vcf";
+    if ( $args{indexed} )
+    {
+        bgzip_tabix_vcf($opts,$args{in});
+        $in = "$$opts{tmp}/$args{in}.vcf.gz";
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools call $args{args} $in | grep -v ^##bcftools_call");
+}
+# Two families made of the three samples, one family per chunk so that the
+# chunks are evaluated by different threads
+sub test_vcf_call_trio_threads
+{
+    my ($opts,%args) = @_;
+    my $vcf = "$$opts{tmp}/$args{in}.trio.vcf";
+    my $ped = "$$opts{tmp}/$args{in}.trio.ped";
+    open(my $in,'<',"$$opts{path}/$args{in}.vcf") or error("$$opts{path}/$args{in}.vcf: $!");
+    open(my $out,'>',$vcf) or error("$vcf: $!");
+    my @smpl;
+    while (my $line=<$in>)
+    {
+        if ( $line=~/^##/ ) { print $out $line; next; }
+        chomp($line);
+        my @col = split(/\t/,$line);
+        if ( $line=~/^#/ ) { @smpl = @col[9..11]; push @col, map { "$_.b" } @smpl; }
+        else { push @col, @col[10,11,9]; }
+        print $out join("\t",@col), "\n";
+    }
+    close($out) or error("close $vcf");
+    close($in);
+    open($out,'>',$ped) or error("$ped: $!");
+    print $out "A $smpl[0] 0 0 1\nA $smpl[1] 0 0 2\nA $smpl[2] $smpl[0] $smpl[1] 1\n";
+    print $out "B $smpl[1].b 0 0 1\nB $smpl[2].b 0 0 2\nB $smpl[0].b $smpl[1].b $smpl[2].b 2\n";
+    close($out) or error("close $ped");
+    my $cmd = "$$opts{bin}/bcftools call -mv -C trio -S $ped";
+    test_same_output($opts,cmd=>"$cmd $vcf | grep -v ^##bcftools_call",
+        cmd2=>"$cmd --trio-threads $args{threads} --trio-chunk 1 $vcf | grep -v ^##bcftools_call");
 }
 sub test_vcf_call_cAls
 {
@@ -322,6 +665,48 @@ sub test_vcf_filter
     my ($opts,%args) = @_;
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter $args{args} $$opts{path}/$args{in}.vcf | grep -v ^##bcftools_filter");
 }
+sub test_vcf_filter_debug
+{
+    my ($opts,%args) = @_;
+    # the compiled program is reduced to the short-circuit jumps, the setter addresses are not reproducible
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter --debug-filter $args{args} $$opts{path}/$args{in}.vcf 2>&1 >/dev/null | awk -F'\\t' '/skip to/{print \$3\"\\t\"\$5\"\\t\"\$6; next} !/^ *[0-9]/'");
+}
+sub test_vcf_filter_short_circuit
+{
+    my ($opts,%args) = @_;
+    test_same_output($opts,
+        cmd=>"$$opts{bin}/bcftools filter $args{args} $$opts{path}/$args{in}.vcf | grep -v ^##bcftools_filter",
+        cmd2=>"$$opts{bin}/bcftools filter --no-short-circuit $args{args} $$opts{path}/$args{in}.vcf | grep -v ^##bcftools_filter");
+}
+sub test_vcf_pipe
+{
+    my ($opts,%args) = @_;
+    my $in = "$$opts{path}/$args{in}.vcf";
+    if ( $args{indexed} )
+    {
+        bgzip_tabix_vcf($opts,$args{in});
+        $in = "$$opts{tmp}/$args{in}.vcf.gz";
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools pipe $in $args{args} | grep -v ^##bcftools_");
+}
+# Compares the output of the commands run by bcftools pipe with that of a Unix
+# pipe, the regions are given to the pipe and to the first command
+sub test_vcf_pipe_vs_unix
+{
+    my ($opts,%args) = @_;
+    my $in = "$$opts{path}/$args{in}.vcf";
+    if ( $args{indexed} )
+    {
+        bgzip_tabix_vcf($opts,$args{in});
+        $in = "$$opts{tmp}/$args{in}.vcf.gz";
+    }
+    my $regs = exists($args{regs}) ? "-r $args{regs}" : '';
+    my @cmds = map { my $x = $_; $x =~ s/{path}/$$opts{path}/g; $x } @{$args{cmds}};
+    my $unix = join(' | ', map { "$$opts{bin}/bcftools $_" } @cmds);
+    $unix =~ s/ \| / $regs $in | / or $unix .= " $regs $in";
+    test_same_output($opts,cmd=>"$unix | grep -v ^##bcftools_",
+        cmd2=>"$$opts{bin}/bcftools pipe $regs $in $args{args} -- ".join(' -- ',@cmds)." | grep -v ^##bcftools_");
+}
 sub test_vcf_regions
 {
     my ($opts,%args) = @_;
@@ -437,6 +822,54 @@ sub test_vcf_annotate
     bgzip_tabix($opts,file=>$args{tab},suffix=>'tab',args=>'-s1 -b2 -e2');
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools annotate -a $$opts{tmp}/$args{tab}.tab.gz -h $$opts{path}/$args{in}.hdr $args{args} $$opts{path}/$args{in}.vcf | grep -v ^##bcftools_annotate");
 }
+sub test_vcf_annotate_threads
+{
+    my ($opts,%args) = @_;
+    my $cmd = "$$opts{bin}/bcftools annotate -p $$opts{bin}/plugins/$args{plugin}.so";
+    my $in  = "$$opts{path}/$args{in}.vcf | grep -v ^##bcftools_annotate";
+    test_same_output($opts,cmd=>"$cmd $in",cmd2=>"$cmd --threads $args{threads} $in");
+}
+sub test_vcf_annotate_vcf
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    bgzip_tabix_vcf($opts,$args{src});
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools annotate -a $$opts{tmp}/$args{src}.vcf.gz $args{args} $$opts{tmp}/$args{in}.vcf.gz | grep -v ^##bcftools_annotate");
+}
+# Runs a command with the global --threads option and compressed output, the
+# output must be the same as of the single-threaded run. The throughput with
+# and without threads is printed.
+sub test_threads
+{
+    my ($opts,%args) = @_;
+    my $nthreads = exists($args{threads}) ? $args{threads} : 4;
+    $args{cmd} =~ s/{tmp}/$$opts{tmp}/g;
+    $args{cmd} =~ s/{path}/$$opts{path}/g;
+    my %rate;
+    for my $threads (0,$nthreads)
+    {
+        my $global = $threads ? "--threads $threads" : '';
+        my $start = Time::HiRes::time();
+        cmd("$$opts{bin}/bcftools $global $args{cmd} -Oz > $$opts{tmp}/threads.$threads.vcf.gz");
+        my $elapsed = Time::HiRes::time() - $start;
+        my $size = -s "$$opts{tmp}/threads.$threads.vcf.gz";
+        $rate{$threads} = $elapsed>0 ? $size/$elapsed/1e6 : 0;
+    }
+    printf "\tthroughput: %.2f MB/s, with %d threads %.2f MB/s\n", $rate{0}, $nthreads, $rate{$nthreads};
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view $$opts{tmp}/threads.$nthreads.vcf.gz | grep -v ^##bcftools_");
+}
+sub test_naive_concat
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $files;
+    for (my $i=0; $i<@{$args{regs}}; $i++)
+    {
+        cmd("$$opts{bin}/bcftools view -Ob $args{args} -r $args{regs}[$i] $$opts{tmp}/$args{in}.vcf.gz > $$opts{tmp}/naive.$i.bcf");
+        $files .= " $$opts{tmp}/naive.$i.bcf";
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools concat -n -Ob $files | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
+}
 sub test_vcf_concat
 {
     my ($opts,%args) = @_;
@@ -37,7 +37,10 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include "bcftools.h"
+#include "profile.h"
+#include "pipe.h"
 #include "vcmp.h"
 #include "filter.h"
 
@@ -47,17 +50,32 @@ typedef char* (*dl_about_f) (void);
 typedef int (*dl_process_f) (bcf1_t *);     // return 0:success, 1:don't print the line, -1:abort
 typedef void (*dl_destroy_f) (void);
 
+/*
+ *  Optional: process_batch is given n consecutive records in place of calling
+ *  process() for each; it returns 0 on success or -1 to abort, records which
+ *  should not be printed are set to NULL in recs. If thread_safe returns
+ *  non-zero, with --threads the batches may be processed concurrently.
+ *  On abort the whole batch is discarded.
+ */
+typedef int (*dl_process_batch_f) (bcf1_t **recs, int n);
+typedef int (*dl_thread_safe_f) (void);
+
 typedef struct
 {
     char *name;
     dl_init_f init;
     dl_about_f about;
     dl_process_f process;
+    dl_process_batch_f process_batch;   // NULL if not provided
     dl_destroy_f destroy;
     void *handle;
+    int thread_safe;
 }
 plugin_t;
 
+// records passed to batch plugins at once, per thread
+#define PLUGIN_BATCH_SIZE 1024
+
 struct _args_t;
 
 typedef struct _rm_tag_t
@@ -68,6 +86,14 @@ typedef struct _rm_tag_t
 }
 rm_tag_t;
 
+typedef struct
+{
+    int n, m;       // number of values, -1 for missing ".", -2 if not parsed yet
+    int32_t *i;
+    float *f;
+}
+annot_val_t;
+
 typedef struct
 {
     char **cols;
@@ -76,6 +102,8 @@ typedef struct
     int nals, mals;
     kstring_t line;
     int rid, start, end;
+    int max_end;        // the largest end of this and all preceding buffered lines
+    annot_val_t *vals;  // numeric columns converted once when first used, one per args->cols
 }
 annot_line_t;
 
@@ -83,7 +111,9 @@ typedef struct _annot_col_t
 {
     int icol;
     char *hdr_key;
+    int src_id, dst_id;     // INFO tag ids in the annotation and output header, for vcf_setter_info_raw
     int (*setter)(struct _args_t *, bcf1_t *, struct _annot_col_t *, void*);
+    void (*parse)(struct _args_t *, bcf1_t *, struct _annot_col_t *, annot_line_t *, annot_val_t *);   // NULL if not needed
 }
 annot_col_t;
 
@@ -98,21 +128,28 @@ typedef struct _args_t
     htsFile *out_fh;
     int output_type;
     bcf_sr_regions_t *tgts;
+    pipe_stage_t *stage;    // set when running as a stage of bcftools pipe
+    int stage_aborted;      // a plugin requested to abort, the remaining records are dropped
 
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
+    int debug_filter;
 
     plugin_t *plugins;      // user plugins
     int nplugins, nplugin_paths;
     char **plugin_paths;
+    bcf1_t **batch, **batch_tmp;    // records buffered for batch plugins, NULL if none loaded
+    uint8_t *batch_skip;
+    int nbatch, mbatch, nthreads;
+    struct _plugin_pool_t *pool;    // threads for the thread-safe batch plugins, NULL if not needed
 
     rm_tag_t *rm;           // tags scheduled for removal
     int nrm;
 
     vcmp_t *vcmp;           // for matching annotation and VCF lines by allele
-    annot_line_t *alines;   // buffered annotation lines
-    int nalines, malines;
+    annot_line_t *alines;   // buffered annotation lines sorted by start, lines before ialines have expired
+    int nalines, malines, ialines, ncompact;
     int ref_idx, alt_idx, chr_idx, from_idx, to_idx;   // -1 if not present
     annot_col_t *cols;      // column indexes and setters
     int ncols;
@@ -121,6 +158,7 @@ typedef struct _args_t
     int32_t *tmpi;
     float *tmpf;
     char *tmps;
+    kstring_t tmpks;
 
     char **argv, *targets_fname, *regions_list, *header_fname;
     char *remove_annots, *columns;
@@ -232,6 +270,11 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error)
             return -1;
         }
 
+        plugin->process_batch = (dl_process_batch_f) dlsym(plugin->handle, "process_batch");
+        dl_thread_safe_f thread_safe = (dl_thread_safe_f) dlsym(plugin->handle, "thread_safe");
+        plugin->thread_safe = plugin->process_batch && thread_safe ? thread_safe() : 0;
+        dlerror();
+
         if ( se ) { *se = ','; ss = se+1; }
         else ss = NULL;
     }
@@ -239,11 +282,174 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error)
     return 0;
 }
 
-static void init_plugins(args_t *args)
+typedef struct _plugin_pool_t plugin_pool_t;
+typedef struct
+{
+    plugin_pool_t *pool;
+    plugin_t *plugin;
+    bcf1_t **recs;
+    int n, ret;
+}
+plugin_job_t;
+
+// The threads are started once, jobs[0] is run by the calling thread
+struct _plugin_pool_t
+{
+    int nthreads, quit;
+    pthread_t *tids;
+    plugin_job_t *jobs;     // one slice of the batch per thread
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int job, njobs_done;    // job is incremented for each batch
+};
+
+static void *plugin_worker(void *arg)
+{
+    plugin_job_t *job = (plugin_job_t*) arg;
+    plugin_pool_t *pool = job->pool;
+    int ijob = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while ( pool->job==ijob && !pool->quit ) pthread_cond_wait(&pool->work, &pool->lock);
+        if ( pool->quit ) break;
+        ijob = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+        job->ret = job->n ? job->plugin->process_batch(job->recs, job->n) : 0;
+        pthread_mutex_lock(&pool->lock);
+        if ( ++pool->njobs_done == pool->nthreads - 1 ) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void init_plugin_pool(args_t *args)
 {
+    plugin_pool_t *pool = (plugin_pool_t*) calloc(1, sizeof(plugin_pool_t));
+    pool->nthreads = args->nthreads;
+    pool->tids = (pthread_t*) malloc(sizeof(pthread_t)*pool->nthreads);
+    pool->jobs = (plugin_job_t*) calloc(pool->nthreads, sizeof(plugin_job_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
     int i;
+    for (i=0; i<pool->nthreads; i++) pool->jobs[i].pool = pool;
+    for (i=1; i<pool->nthreads; i++)
+        if ( pthread_create(&pool->tids[i], NULL, plugin_worker, &pool->jobs[i]) ) error("Failed to create a thread\n");
+    args->pool = pool;
+}
+
+static void destroy_plugin_pool(plugin_pool_t *pool)
+{
+    if ( !pool ) return;
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=1; i<pool->nthreads; i++) pthread_join(pool->tids[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->jobs);
+    free(pool->tids);
+    free(pool);
+}
+
+static void init_plugins(args_t *args)
+{
+    int i, nbatch = 0;
     for (i=0; i<args->nplugins; i++)
+    {
         args->plugins[i].init(args->hdr);
+        if ( args->plugins[i].process_batch ) nbatch++;
+    }
+    if ( !nbatch ) return;
+
+    // at least one plugin takes batches, buffer the records for all of them
+    args->mbatch = PLUGIN_BATCH_SIZE * (args->nthreads > 1 ? args->nthreads : 1);
+    args->batch  = (bcf1_t**) malloc(sizeof(bcf1_t*)*args->mbatch);
+    args->batch_tmp  = (bcf1_t**) malloc(sizeof(bcf1_t*)*args->mbatch);
+    args->batch_skip = (uint8_t*) malloc(args->mbatch);
+    for (i=0; i<args->mbatch; i++) args->batch[i] = bcf_init1();
+
+    for (i=0; i<args->nplugins; i++)
+        if ( args->plugins[i].thread_safe ) break;
+    if ( args->nthreads > 1 && i<args->nplugins ) init_plugin_pool(args);
+}
+
+// Split args->batch_tmp into nthreads slices and process them concurrently
+static int process_batch_mt(args_t *args, plugin_t *plugin)
+{
+    plugin_pool_t *pool = args->pool;
+    int i, nthreads = pool->nthreads, ret = 0;
+    int beg = 0, len = (args->nbatch + nthreads - 1) / nthreads;
+    pthread_mutex_lock(&pool->lock);
+    for (i=0; i<nthreads; i++)
+    {
+        plugin_job_t *job = &pool->jobs[i];
+        job->plugin = plugin;
+        job->recs = args->batch_tmp + beg;
+        job->n = beg + len < args->nbatch ? len : args->nbatch - beg;
+        job->ret = 0;
+        beg += job->n;
+    }
+    pool->njobs_done = 0;
+    pool->job++;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    plugin_job_t *job = &pool->jobs[0];
+    if ( job->n ) job->ret = plugin->process_batch(job->recs, job->n);
+
+    pthread_mutex_lock(&pool->lock);
+    while ( pool->njobs_done < nthreads - 1 ) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<nthreads; i++)
+        if ( pool->jobs[i].ret<0 ) ret = -1;
+    return ret;
+}
+
+/*
+ *  Run all plugins on the buffered records, in the order they were given,
+ *  and write out the records none of them suppressed. Returns -1 if a plugin
+ *  requested to abort.
+ */
+static int flush_batch(args_t *args)
+{
+    int i, j, n = args->nbatch;
+    args->nbatch = 0;
+    memset(args->batch_skip, 0, n);
+    for (i=0; i<args->nplugins; i++)
+    {
+        plugin_t *plugin = &args->plugins[i];
+        if ( !plugin->process_batch )
+        {
+            for (j=0; j<n; j++)
+            {
+                int ret = plugin->process(args->batch[j]);
+                if ( ret<0 ) return ret;
+                if ( ret>0 ) args->batch_skip[j] = 1;
+            }
+            continue;
+        }
+        memcpy(args->batch_tmp, args->batch, sizeof(bcf1_t*)*n);
+        args->nbatch = n;
+        int ret = plugin->thread_safe && args->pool ? process_batch_mt(args, plugin) : plugin->process_batch(args->batch_tmp, n);
+        args->nbatch = 0;
+        if ( ret<0 ) return ret;
+        for (j=0; j<n; j++)
+            if ( !args->batch_tmp[j] ) args->batch_skip[j] = 1;
+    }
+    for (j=0; j<n; j++)
+    {
+        if ( args->batch_skip[j] ) continue;
+        if ( args->stage )
+            pipe_emit(args->stage, &args->batch[j]);
+        else
+            bcf_write1(args->out_fh, args->hdr_out, args->batch[j]);
+    }
+    return 0;
 }
 
 static int list_plugins(args_t *args)
@@ -412,15 +618,31 @@ static int vcf_setter_id(args_t *args, bcf1_t *line, annot_col_t *col, void *dat
     bcf1_t *rec = (bcf1_t*) data;
     return bcf_update_id(args->hdr_out,line,rec->d.id);
 }
+// The numeric columns are parsed only when the line is used, lines which never match are not checked
+static inline annot_val_t *annot_val(args_t *args, bcf1_t *line, annot_col_t *col, annot_line_t *tab)
+{
+    annot_val_t *val = &tab->vals[col - args->cols];
+    if ( val->n == -2 ) col->parse(args, line, col, tab, val);
+    return val;
+}
+static void parse_qual(args_t *args, bcf1_t *line, annot_col_t *col, annot_line_t *tab, annot_val_t *val)
+{
+    char *str = tab->cols[col->icol], *end;
+    val->n = -1;
+    if ( str[0]=='.' && str[1]==0 ) return;
+
+    hts_expand(float,1,val->m,val->f);
+    val->f[0] = strtod(str, &end);
+    if ( end == str )
+        error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key,bcf_seqname(args->hdr,line),tab->start+1,tab->cols[col->icol]);
+    val->n = 1;
+}
 static int setter_qual(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     annot_line_t *tab = (annot_line_t*) data;
-    char *str = tab->cols[col->icol];
-    if ( str[0]=='.' && str[1]==0 ) return 0;
-
-    line->qual = strtod(str, &str);
-    if ( str == tab->cols[col->icol] ) 
-        error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key,bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
+    annot_val_t *val = annot_val(args, line, col, tab);
+    if ( val->n < 0 ) return 0;
+    line->qual = val->f[0];
     return 0;
 }
 static int vcf_setter_qual(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
@@ -429,16 +651,24 @@ static int vcf_setter_qual(args_t *args, bcf1_t *line, annot_col_t *col, void *d
     line->qual = rec->qual;
     return 0;
 }
+static void parse_info_flag(args_t *args, bcf1_t *line, annot_col_t *col, annot_line_t *tab, annot_val_t *val)
+{
+    char *str = tab->cols[col->icol];
+    val->n = -1;
+    if ( str[0]=='.' && str[1]==0 ) return;
+
+    hts_expand(int32_t,1,val->m,val->i);
+    if ( str[0]=='1' && str[1]==0 ) val->i[0] = 1;
+    else if ( str[0]=='0' && str[1]==0 ) val->i[0] = 0;
+    else error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key,bcf_seqname(args->hdr,line),tab->start+1,tab->cols[col->icol]);
+    val->n = 1;
+}
 static int setter_info_flag(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     annot_line_t *tab = (annot_line_t*) data;
-    char *str = tab->cols[col->icol];
-    if ( str[0]=='.' && str[1]==0 ) return 0;
-
-    if ( str[0]=='1' && str[1]==0 ) return bcf_update_info_flag(args->hdr_out,line,col->hdr_key,NULL,1);
-    if ( str[0]=='0' && str[1]==0 ) return bcf_update_info_flag(args->hdr_out,line,col->hdr_key,NULL,0);
-    error("Could not parse %s at %s:%d .. [%s]\n", bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
-    return -1;
+    annot_val_t *val = annot_val(args, line, col, tab);
+    if ( val->n < 0 ) return 0;
+    return bcf_update_info_flag(args->hdr_out,line,col->hdr_key,NULL,val->i[0]);
 }
 static int vcf_setter_info_flag(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
@@ -447,24 +677,30 @@ static int vcf_setter_info_flag(args_t *args, bcf1_t *line, annot_col_t *col, vo
     bcf_update_info_flag(args->hdr_out,line,col->hdr_key,NULL,flag);
     return 0;
 }
-static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data) 
-{ 
-    annot_line_t *tab = (annot_line_t*) data;
+static void parse_info_int(args_t *args, bcf1_t *line, annot_col_t *col, annot_line_t *tab, annot_val_t *val)
+{
     char *str = tab->cols[col->icol], *end = str;
-    if ( str[0]=='.' && str[1]==0 ) return 0;
+    val->n = -1;
+    if ( str[0]=='.' && str[1]==0 ) return;
 
-    args->ntmpi = 0;
+    val->n = 0;
     while ( *end )
     {
-        int val = strtol(str, &end, 10);
+        int ival = strtol(str, &end, 10);
         if ( end==str )
-            error("Could not parse %s at %s:%d .. [%s]\n", bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
-        args->ntmpi++;
-        hts_expand(int,args->ntmpi,args->mtmpi,args->tmpi);
-        args->tmpi[args->ntmpi-1] = val;
+            error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key,bcf_seqname(args->hdr,line),tab->start+1,tab->cols[col->icol]);
+        val->n++;
+        hts_expand(int32_t,val->n,val->m,val->i);
+        val->i[val->n-1] = ival;
         str = end+1;
     }
-    return bcf_update_info_int32(args->hdr_out,line,col->hdr_key,args->tmpi,args->ntmpi);
+}
+static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data) 
+{ 
+    annot_line_t *tab = (annot_line_t*) data;
+    annot_val_t *val = annot_val(args, line, col, tab);
+    if ( val->n < 0 ) return 0;
+    return bcf_update_info_int32(args->hdr_out,line,col->hdr_key,val->i,val->n);
 }
 static int vcf_setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
@@ -474,24 +710,30 @@ static int vcf_setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, voi
         bcf_update_info_int32(args->hdr_out,line,col->hdr_key,args->tmpi,args->ntmpi);
     return 0;
 }
-static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
-{ 
-    annot_line_t *tab = (annot_line_t*) data;
+static void parse_info_real(args_t *args, bcf1_t *line, annot_col_t *col, annot_line_t *tab, annot_val_t *val)
+{
     char *str = tab->cols[col->icol], *end = str;
-    if ( str[0]=='.' && str[1]==0 ) return 0;
+    val->n = -1;
+    if ( str[0]=='.' && str[1]==0 ) return;
 
-    args->ntmpf = 0;
+    val->n = 0;
     while ( *end )
     {
-        double val = strtod(str, &end);
+        double fval = strtod(str, &end);
         if ( end==str )
-            error("Could not parse %s at %s:%d .. [%s]\n", bcf_seqname(args->hdr,line),line->pos+1,tab->cols[col->icol]);
-        args->ntmpf++;
-        hts_expand(float,args->ntmpf,args->mtmpf,args->tmpf);
-        args->tmpf[args->ntmpf-1] = val;
+            error("Could not parse %s at %s:%d .. [%s]\n", col->hdr_key,bcf_seqname(args->hdr,line),tab->start+1,tab->cols[col->icol]);
+        val->n++;
+        hts_expand(float,val->n,val->m,val->f);
+        val->f[val->n-1] = fval;
         str = end+1;
     }
-    return bcf_update_info_float(args->hdr_out,line,col->hdr_key,args->tmpf,args->ntmpf);
+}
+static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{ 
+    annot_line_t *tab = (annot_line_t*) data;
+    annot_val_t *val = annot_val(args, line, col, tab);
+    if ( val->n < 0 ) return 0;
+    return bcf_update_info_float(args->hdr_out,line,col->hdr_key,val->f,val->n);
 }
 static int vcf_setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
@@ -514,6 +756,79 @@ static int vcf_setter_info_str(args_t *args, bcf1_t *line, annot_col_t *col, voi
         bcf_update_info_string(args->hdr_out,line,col->hdr_key,args->tmps);
     return 0;
 }
+/*
+ *  Copy the encoded INFO field src from the annotation record into line
+ *  under the new id, without decoding the values. The types of the tag must
+ *  be the same in both headers.
+ */
+static void info_copy_raw(bcf1_t *line, int id, bcf_info_t *src, kstring_t *tmp_str)
+{
+    uint8_t *ptr = src->vptr - src->vptr_off;
+    bcf_dec_typed_int1(ptr, &ptr);      // skip the old id, keep the type and size bytes
+
+    tmp_str->l = 0;
+    bcf_enc_int1(tmp_str, id);
+    kputsn_(ptr, src->vptr - ptr, tmp_str);
+    int vptr_off = tmp_str->l;
+    kputsn_(src->vptr, src->vptr_len, tmp_str);
+
+    int i;
+    for (i=0; i<line->n_info; i++)
+        if ( line->d.info[i].key==id ) break;
+    bcf_info_t *inf;
+    if ( i<line->n_info )
+    {
+        inf = &line->d.info[i];
+        if ( inf->vptr && tmp_str->l <= inf->vptr_off + inf->vptr_len )
+        {
+            // reuse the memory of the existing field, the record is repacked only if the size changed
+            if ( tmp_str->l != inf->vptr_off + inf->vptr_len ) line->d.shared_dirty |= BCF1_DIRTY_INF;
+            ptr = inf->vptr - inf->vptr_off;
+            memcpy(ptr, tmp_str->s, tmp_str->l);
+            inf->vptr = ptr + vptr_off;
+            inf->vptr_off = vptr_off;
+            inf->vptr_len = src->vptr_len;
+            inf->type = src->type;
+            inf->len  = src->len;
+            inf->v1 = src->v1;
+            return;
+        }
+        if ( inf->vptr_free ) free(inf->vptr - inf->vptr_off);
+    }
+    else
+    {
+        line->n_info++;
+        hts_expand0(bcf_info_t, line->n_info, line->d.m_info, line->d.info);
+        inf = &line->d.info[line->n_info-1];
+    }
+    inf->key  = id;
+    inf->type = src->type;
+    inf->len  = src->len;
+    inf->v1   = src->v1;
+    inf->vptr = (uint8_t*) tmp_str->s + vptr_off;
+    inf->vptr_off  = vptr_off;
+    inf->vptr_len  = src->vptr_len;
+    inf->vptr_free = 1;
+    line->d.shared_dirty |= BCF1_DIRTY_INF;
+    tmp_str->s = NULL;
+    tmp_str->m = 0;
+    tmp_str->l = 0;
+}
+static int vcf_setter_info_raw(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    bcf1_t *rec = (bcf1_t*) data;
+    bcf_unpack(rec, BCF_UN_INFO);
+    bcf_unpack(line, BCF_UN_INFO);
+
+    int i;
+    for (i=0; i<rec->n_info; i++)
+        if ( rec->d.info[i].key==col->src_id && rec->d.info[i].vptr ) break;
+    if ( i<rec->n_info )
+        info_copy_raw(line, col->dst_id, &rec->d.info[i], &args->tmpks);
+    else if ( bcf_hdr_id2type(args->hdr_out,BCF_HL_INFO,col->dst_id)==BCF_HT_FLAG )
+        bcf_update_info_flag(args->hdr_out,line,col->hdr_key,NULL,0);   // as vcf_setter_info_flag
+    return 0;
+}
 static void init_columns(args_t *args)
 {
     kstring_t str = {0,0,0}, tmp = {0,0,0};
@@ -540,6 +855,7 @@ static void init_columns(args_t *args)
             annot_col_t *col = &args->cols[args->ncols-1];
             col->icol = i;
             col->setter = args->tgts ? setter_id : vcf_setter_id;
+            col->parse  = NULL;
             col->hdr_key = strdup(str.s);
         }
         else if ( !strcasecmp("QUAL",str.s) )
@@ -548,6 +864,7 @@ static void init_columns(args_t *args)
             annot_col_t *col = &args->cols[args->ncols-1];
             col->icol = i;
             col->setter = args->tgts ? setter_qual : vcf_setter_qual;
+            col->parse  = args->tgts ? parse_qual : NULL;
             col->hdr_key = strdup(str.s);
         }
         else 
@@ -573,14 +890,34 @@ static void init_columns(args_t *args)
             annot_col_t *col = &args->cols[args->ncols-1];
             col->icol = i;
             col->hdr_key = strdup(str.s);
+            col->parse = NULL;
             switch ( bcf_hdr_id2type(args->hdr_out,BCF_HL_INFO,hdr_id) )
             {
-                case BCF_HT_FLAG:   col->setter = args->tgts ? setter_info_flag : vcf_setter_info_flag; break;
-                case BCF_HT_INT:    col->setter = args->tgts ? setter_info_int  : vcf_setter_info_int; break;
-                case BCF_HT_REAL:   col->setter = args->tgts ? setter_info_real : vcf_setter_info_real; break;
+                case BCF_HT_FLAG:   col->setter = args->tgts ? setter_info_flag : vcf_setter_info_flag;
+                                    if ( args->tgts ) col->parse = parse_info_flag;
+                                    break;
+                case BCF_HT_INT:    col->setter = args->tgts ? setter_info_int  : vcf_setter_info_int;
+                                    if ( args->tgts ) col->parse = parse_info_int;
+                                    break;
+                case BCF_HT_REAL:   col->setter = args->tgts ? setter_info_real : vcf_setter_info_real;
+                                    if ( args->tgts ) col->parse = parse_info_real;
+                                    break;
                 case BCF_HT_STR:    col->setter = args->tgts ? setter_info_str  : vcf_setter_info_str; break;
                 default: error("The type of %s not recognised (%d)\n", str.s,bcf_hdr_id2type(args->hdr_out,BCF_HL_INFO,hdr_id));
             }
+            if ( !args->tgts && args->files->nreaders==2 )
+            {
+                // annotating from a VCF: when the types agree, the field is transferred without decoding
+                bcf_hdr_t *src_hdr = args->files->readers[1].header;
+                int src_id = bcf_hdr_id2int(src_hdr, BCF_DT_ID, str.s);
+                if ( bcf_hdr_idinfo_exists(src_hdr,BCF_HL_INFO,src_id) 
+                        && bcf_hdr_id2type(src_hdr,BCF_HL_INFO,src_id)==bcf_hdr_id2type(args->hdr_out,BCF_HL_INFO,hdr_id) )
+                {
+                    col->src_id = src_id;
+                    col->dst_id = hdr_id;
+                    col->setter = vcf_setter_info_raw;
+                }
+            }
         }
         if ( !*se ) break;
         ss = ++se;
@@ -592,7 +929,7 @@ static void init_columns(args_t *args)
 
 static void init_data(args_t *args)
 {
-    args->hdr = args->files->readers[0].header;
+    args->hdr = args->stage ? args->stage->hdr : args->files->readers[0].header;
     args->hdr_out = bcf_hdr_dup(args->hdr);
 
     if ( args->targets_fname )
@@ -617,21 +954,29 @@ static void init_data(args_t *args)
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
+    if ( args->filter && args->debug_filter )
+        filter_debug(args->filter, stderr);
 
     bcf_hdr_append_version(args->hdr_out, args->argc, args->argv, "bcftools_annotate");
-    args->out_fh = hts_open("-",hts_bcf_wmode(args->output_type));
+    if ( !args->stage )
+        args->out_fh = hts_open_mt("-",hts_bcf_wmode(args->output_type));
 }
 
 static void destroy_data(args_t *args)
 {
-    int i;
+    int i, j;
     for (i=0; i<args->nplugins; i++)
     {
         free(args->plugins[i].name);
         args->plugins[i].destroy();
         dlclose(args->plugins[i].handle);
     }
+    destroy_plugin_pool(args->pool);
     free(args->plugins);
+    for (i=0; i<args->mbatch; i++) bcf_destroy1(args->batch[i]);
+    free(args->batch);
+    free(args->batch_tmp);
+    free(args->batch_skip);
     for (i=0; i<args->nrm; i++) free(args->rm[i].key);
     free(args->rm);
     bcf_hdr_destroy(args->hdr_out);
@@ -649,35 +994,78 @@ static void destroy_data(args_t *args)
         free(args->alines[i].cols);
         free(args->alines[i].als);
         free(args->alines[i].line.s);
+        if ( !args->alines[i].vals ) continue;
+        for (j=0; j<args->ncols; j++)
+        {
+            free(args->alines[i].vals[j].i);
+            free(args->alines[i].vals[j].f);
+        }
+        free(args->alines[i].vals);
     }
     free(args->alines);
     if ( args->tgts ) bcf_sr_regions_destroy(args->tgts);
     free(args->tmpi);
     free(args->tmpf);
     free(args->tmps);
+    free(args->tmpks.s);
     if ( args->filter )
+    {
+        if ( args->debug_filter ) filter_stats(args->filter, stderr);
         filter_destroy(args->filter);
+    }
 }
 
-static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+/*
+ *  Drop the expired lines from the buffer, moving their structures past the
+ *  live lines so that the allocated memory can be reused. The order of the
+ *  live lines is preserved.
+ */
+static void compact_annot_lines(args_t *args, int pos)
 {
-    if ( args->nalines && args->alines[0].rid != line->rid ) args->nalines = 0;
-
-    int i = 0;
-    while ( i<args->nalines )
+    int i, n = 0;
+    for (i=args->ialines; i<args->nalines; i++)
     {
-        if ( line->pos > args->alines[i].end )
+        if ( args->alines[i].end < pos ) continue;
+        if ( i!=n )
         {
-            args->nalines--;
-            if ( args->nalines && i<args->nalines )
-            {
-                annot_line_t tmp = args->alines[i];
-                memmove(&args->alines[i],&args->alines[i+1],(args->nalines-i)*sizeof(annot_line_t));
-                args->alines[args->nalines] = tmp;
-            }
+            annot_line_t tmp = args->alines[n];
+            args->alines[n] = args->alines[i];
+            args->alines[i] = tmp;
         }
-        else i++;
+        args->alines[n].max_end = n && args->alines[n-1].max_end > args->alines[n].end ? args->alines[n-1].max_end : args->alines[n].end;
+        n++;
+    }
+    args->nalines = n;
+    args->ialines = 0;
+    args->ncompact = n<8 ? 16 : 2*n;
+}
+
+/*
+ *  Index of the first buffered line which may overlap pos. The lines are
+ *  sorted by start and max_end is non-decreasing, the lines which end before
+ *  pos form a prefix of the buffer.
+ */
+static int first_annot_line(args_t *args, int pos)
+{
+    int lo = args->ialines, hi = args->nalines;
+    while ( lo < hi )
+    {
+        int mid = (lo + hi) / 2;
+        if ( args->alines[mid].max_end < pos ) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
+
+static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+{
+    if ( args->nalines && args->alines[args->ialines].rid != line->rid ) args->nalines = args->ialines = 0;
+
+    // Expired lines at the head are skipped, those hidden behind a long
+    // interval are removed only when the buffer grows too big
+    args->ialines = first_annot_line(args, line->pos);
+    if ( args->ialines==args->nalines ) args->nalines = args->ialines = 0;
+    else if ( args->nalines >= args->ncompact ) compact_annot_lines(args, line->pos);
 
     if ( args->ref_idx==-1 && args->nalines ) return;
 
@@ -689,6 +1077,7 @@ static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int en
         tmp->rid   = line->rid;
         tmp->start = args->tgts->start;
         tmp->end   = args->tgts->end;
+        tmp->max_end = args->nalines > args->ialines+1 && args->alines[args->nalines-2].max_end > tmp->end ? args->alines[args->nalines-2].max_end : tmp->end;
         tmp->line.l = 0;
         kputs(args->tgts->line.s, &tmp->line);
         char *s = tmp->line.s;
@@ -725,6 +1114,16 @@ static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int en
                 }
                 s++;
             }
+        }
+        if ( args->ncols )
+        {
+            int j;
+            if ( !tmp->vals ) tmp->vals = (annot_val_t*) calloc(args->ncols,sizeof(annot_val_t));
+            for (j=0; j<args->ncols; j++)
+                tmp->vals[j].n = -2;
+        }
+        if ( args->ref_idx != -1 )
+        {
             int iseq = args->tgts->iseq;
             if ( bcf_sr_regions_next(args->tgts)<0 || args->tgts->iseq!=iseq ) break;
         }
@@ -749,9 +1148,10 @@ static int annotate(args_t *args, bcf1_t *line)
             if ( len > line->d.var[i].n ) len = line->d.var[i].n;
         int end_pos = len<0 ? line->pos - len : line->pos;
         buffer_annot_lines(args, line, line->pos, end_pos);
-        for (i=0; i<args->nalines; i++)
+        for (i=first_annot_line(args, line->pos); i<args->nalines; i++)
         {
-            if ( line->pos > args->alines[i].end || end_pos < args->alines[i].start ) continue;
+            if ( end_pos < args->alines[i].start ) { i = args->nalines; break; }    // sorted by start, no more overlaps
+            if ( line->pos > args->alines[i].end ) continue;
             if ( args->ref_idx != -1 )
             {
                 if ( vcmp_set_ref(args->vcmp, line->d.allele[0], args->alines[i].cols[args->ref_idx]) < 0 ) continue;   // refs not compatible
@@ -780,6 +1180,8 @@ static int annotate(args_t *args, bcf1_t *line)
                 error("fixme: Could not set %s at %s:%d\n", args->cols[j].hdr_key,bcf_seqname(args->hdr,line),line->pos+1);
     }
 
+    if ( args->batch ) return 0;    // the plugins are run by flush_batch()
+
     int skip = 0;
     for (i=0; i<args->nplugins; i++)
     {
@@ -790,6 +1192,43 @@ static int annotate(args_t *args, bcf1_t *line)
     return skip;
 }
 
+static void stage_process(pipe_stage_t *stage, bcf1_t **line)
+{
+    args_t *args = (args_t*) stage->data;
+    if ( args->stage_aborted ) return;
+    if ( (*line)->errcode ) error("Encountered error, cannot proceed. Please check the error output above.\n");
+    if ( args->filter )
+    {
+        int pass = filter_test(args->filter, *line, NULL);
+        if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+        if ( !pass ) return;
+    }
+    int ret = annotate(args, *line);
+    if ( ret<0 ) { args->stage_aborted = 1; return; }
+    if ( ret>0 ) return;
+    if ( !args->batch )
+    {
+        pipe_emit(stage, line);
+        return;
+    }
+    bcf_copy(args->batch[args->nbatch++], *line);
+    if ( args->nbatch==args->mbatch && flush_batch(args)<0 ) args->stage_aborted = 1;
+}
+
+static void stage_flush(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    if ( args->nbatch && !args->stage_aborted && flush_batch(args)<0 ) args->stage_aborted = 1;
+}
+
+static void stage_destroy(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+    free(args);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -799,6 +1238,7 @@ static void usage(args_t *args)
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "   -a, --annotations <file>       VCF file or tabix-indexed file with annotations: CHR\\tPOS[\\tVALUE]+\n");
     fprintf(stderr, "   -c, --columns <list>           list of columns in the annotation file, e.g. CHROM,POS,REF,ALT,-,INFO/TAG. See man page for details\n");
+    fprintf(stderr, "       --debug-filter             print the compiled -i/-e expression to stderr\n");
     fprintf(stderr, "   -e, --exclude <expr>           exclude sites for which the expression is true (see below for details)\n");
     fprintf(stderr, "   -h, --header-lines <file>      lines which should be appended to the VCF header\n");
     fprintf(stderr, "   -i, --include <expr>           select sites for which the expression is true (see below for details)\n");
@@ -807,6 +1247,7 @@ static void usage(args_t *args)
     fprintf(stderr, "   -p, --plugins <name|...>       comma-separated list of dynamically loaded user-defined plugins. See man page for details\n");
     fprintf(stderr, "   -r, --regions <region>         restrict to comma-separated list of regions\n");
     fprintf(stderr, "   -R, --regions-file <file>      restrict to regions listed in a file\n");
+    fprintf(stderr, "       --threads <int>            run plugins which support it on batches of records in <int> threads [1]\n");
     fprintf(stderr, "   -x, --remove <list>            list of annotations to remove (e.g. ID,INFO/DP,FORMAT/DP,FILTER). See man page for details\n");
     fprintf(stderr, "\n");
     filter_expression_info(stderr);
@@ -838,6 +1279,8 @@ int main_vcfannotate(int argc, char *argv[])
         {"remove",1,0,'x'},
         {"columns",1,0,'c'},
         {"header-lines",1,0,'h'},
+        {"debug-filter",0,0,1},
+        {"threads",1,0,2},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "h:?O:r:R:a:p:x:c:li:e:",loptions,NULL)) >= 0) 
@@ -862,12 +1305,37 @@ int main_vcfannotate(int argc, char *argv[])
             case 'p': load_plugin(args, optarg, 1); break;
             case 'l': plist_only = 1; break;
             case 'h': args->header_fname = optarg; break;
+            case  1 : args->debug_filter = 1; break;
+            case  2 : 
+                args->nthreads = atoi(optarg); 
+                if ( args->nthreads<1 ) error("Expected positive integer with --threads: %s\n", optarg);
+                break;
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
         }
     }
     if ( plist_only ) return list_plugins(args);
 
+    pipe_stage_t *stage = pipe_stage_init();
+    if ( stage )
+    {
+        if ( optind<argc || args->regions_list )
+            error("Input files, regions and targets cannot be given to a pipe stage, use the options of bcftools pipe\n");
+        if ( args->targets_fname && hts_file_type(args->targets_fname) & (FT_VCF|FT_BCF) )
+            error("Annotating from a VCF/BCF requires the synced reader and cannot be done in a pipe stage: %s\n", args->targets_fname);
+        args->stage = stage;
+        init_data(args);
+        stage->hdr     = args->hdr_out;
+        stage->data    = args;
+        stage->process = stage_process;
+        stage->flush   = stage_flush;
+        stage->destroy = stage_destroy;
+        int i;
+        for (i=0; i<args->nplugins; i++)
+            if ( !args->plugins[i].thread_safe ) stage->no_shards = 1;    // the plugin may keep state across records
+        return 0;
+    }
+
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -886,8 +1354,12 @@ int main_vcfannotate(int argc, char *argv[])
     
     init_data(args);
     bcf_hdr_write(args->out_fh, args->hdr_out);
+    profile_mark_t prof;
+    PROFILE_START(prof);
+    int ret = 0;
     while ( bcf_sr_next_line(args->files) )
     {
+        PROFILE_LAP(PROF_READ, prof);
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = bcf_sr_get_line(args->files,0);
         if ( line->errcode ) error("Encountered error, cannot proceed. Please check the error output above.\n");
@@ -895,13 +1367,29 @@ int main_vcfannotate(int argc, char *argv[])
         {
             int pass = filter_test(args->filter, line, NULL);
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            PROFILE_LAP(PROF_FILTER, prof);
             if ( !pass ) continue;
         }
-        int ret = annotate(args, line);
+        ret = annotate(args, line);
+        PROFILE_LAP(PROF_ANNOTATE, prof);
         if ( ret<0 ) break;
         if ( ret>0 ) continue;
+        if ( args->batch )
+        {
+            bcf_copy(args->batch[args->nbatch++], line);
+            if ( args->nbatch==args->mbatch )
+            {
+                // plugins run in the batch, the time is attributed to annotate
+                ret = flush_batch(args);
+                PROFILE_LAPN(PROF_ANNOTATE, prof, 0);
+                if ( ret<0 ) break;
+            }
+            continue;
+        }
         bcf_write1(args->out_fh, args->hdr_out, line);
+        PROFILE_LAP(PROF_WRITE, prof);
     }
+    if ( ret>=0 && args->nbatch ) ret = flush_batch(args);   // on abort the batch is discarded, as in the loop
     hts_close(args->out_fh);
     destroy_data(args);
     bcf_sr_destroy(args->files);
@@ -34,7 +34,10 @@
 #include <htslib/kfunc.h>
 #include <htslib/synced_bcf_reader.h>
 #include <ctype.h>
+#include <pthread.h>
 #include "bcftools.h"
+#include "profile.h"
+#include "pipe.h"
 #include "call.h"
 #include "prob1.h"
 
@@ -61,7 +64,29 @@ void error(const char *format, ...);
 #define CF_QCNT         (1<<13)
 #define CF_INDEL_ONLY   (1<<14)
 
-typedef struct 
+// With --threads, the input is split into chunks of this size (in bp) which
+// are called independently and written in genomic order
+#define CHUNK_SIZE      100000
+
+typedef struct
+{
+    int rid, beg, end;      // 0-based, inclusive
+    bcf1_t **recs;          // called records ready for output
+    int nrecs, mrecs;
+    int done;
+}
+chunk_t;
+
+struct _args_t;
+typedef struct
+{
+    struct _args_t *args;
+    call_t aux;             // private copy of args->aux
+    pthread_t tid;
+}
+worker_t;
+
+typedef struct _args_t
 {
     int flag;   // combination of CF_* flags above
     int output_type;
@@ -69,11 +94,21 @@ typedef struct
     char *bcf_fname;
     char **samples;             // for subsampling and ploidy
     int nsamples, *samples_map;
+    int subset_in_reader;       // the readers drop the samples not listed in args->samples
     char *regions, *targets;    // regions to process
     int regions_is_file, targets_is_file;
+    pipe_stage_t *stage;        // set when running as a stage of bcftools pipe
 
     call_t aux;     // parameters and temporary data
 
+    int nthreads;
+    worker_t *workers;
+    chunk_t *chunks;
+    int nchunks, mchunks;
+    int ichunk_next, ichunk_out;    // next chunk to process and to output
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
     int argc;
     char **argv;
 
@@ -242,6 +277,7 @@ static char **read_samples(call_t *call, const char *fn, int is_file, int *_n)
 static void init_data(args_t *args)
 {
     args->aux.srs = bcf_sr_init();
+    if ( args->nthreads ) args->aux.srs->require_index = 1;
 
     // Open files for input and output, initialize structures
     if ( args->targets )
@@ -256,19 +292,35 @@ static void init_data(args_t *args)
     }
     
     int i;
-    if ( !bcf_sr_add_reader(args->aux.srs, args->bcf_fname) ) error("Failed to open: %s\n", args->bcf_fname);
+    bcf_hdr_t *hdr_in;
+    if ( args->stage )
+        hdr_in = args->stage->hdr;
+    else
+    {
+        if ( !bcf_sr_add_reader(args->aux.srs, args->bcf_fname) ) error("Failed to open: %s\n", args->bcf_fname);
+        hdr_in = args->aux.srs->readers[0].header;
+    }
 
-    if ( args->nsamples && args->nsamples != bcf_hdr_nsamples(args->aux.srs->readers[0].header) )
+    if ( args->nsamples && args->nsamples != bcf_hdr_nsamples(hdr_in) )
     {
+        // the FORMAT fields of the samples not listed are not decoded at all
+        int ret = args->stage ? -1 : bcf_hdr_subset_reader(hdr_in, args->nsamples, args->samples, NULL);
+        if ( ret>=0 ) args->subset_in_reader = 1;
         args->samples_map = (int *) malloc(sizeof(int)*args->nsamples);
-        args->aux.hdr = bcf_hdr_subset(args->aux.srs->readers[0].header, args->nsamples, args->samples, args->samples_map);
+        args->aux.hdr = bcf_hdr_subset(hdr_in, args->nsamples, args->samples, args->samples_map);
         for (i=0; i<args->nsamples; i++)
             if ( args->samples_map[i]<0 ) error("No such sample \"%s\", please prefix with ':' to indicate file name\n", args->samples[i]);
         if ( !bcf_hdr_nsamples(args->aux.hdr) ) error("No matching sample found\n");
+        if ( ret==1 )
+        {
+            // the records come in the requested order already
+            free(args->samples_map);
+            args->samples_map = NULL;
+        }
     }
     else
     {
-        args->aux.hdr = bcf_hdr_dup(args->aux.srs->readers[0].header);
+        args->aux.hdr = bcf_hdr_dup(hdr_in);
         for (i=0; i<args->nsamples; i++)
             if ( bcf_hdr_id2int(args->aux.hdr,BCF_DT_SAMPLE,args->samples[i])<0 ) 
                 error("No such sample \"%s\", please prefix with ':' to indicate file name\n", args->samples[i]);
@@ -305,7 +357,8 @@ static void init_data(args_t *args)
         args->aux.ploidy = ploidy;
     }
 
-    args->out_fh = hts_open("-", hts_bcf_wmode(args->output_type));
+    if ( !args->stage )
+        args->out_fh = hts_open_mt("-", hts_bcf_wmode(args->output_type));
 
     if ( args->flag & CF_QCALL ) 
         return;
@@ -317,11 +370,18 @@ static void init_data(args_t *args)
         ccall_init(&args->aux);
 
     bcf_hdr_append_version(args->aux.hdr, args->argc, args->argv, "bcftools_call");
-    bcf_hdr_write(args->out_fh, args->aux.hdr);
+    if ( args->out_fh ) bcf_hdr_write(args->out_fh, args->aux.hdr);
 }
 
 static void destroy_data(args_t *args)
 {
+    if ( args->aux.flag & CALL_TIMING )
+    {
+        double *t = args->aux.timing;
+        fprintf(stderr,"Time spent in mcall: PLs %.3fs, alleles %.3fs, genotypes %.3fs, PL trimming %.3fs\n",
+            t[MCALL_T_PDG],t[MCALL_T_ALLELES],t[MCALL_T_GTS],t[MCALL_T_TRIM]);
+        fprintf(stderr,"Allele combinations skipped: %llu\n", (unsigned long long)args->aux.nals_pruned);
+    }
     if ( args->flag & CF_CCALL ) ccall_destroy(&args->aux);
     else if ( args->flag & CF_MCALL ) mcall_destroy(&args->aux);
     else if ( args->flag & CF_QCALL ) qcall_destroy(&args->aux);
@@ -336,10 +396,237 @@ static void destroy_data(args_t *args)
     free(args->samples_map);
     free(args->aux.ploidy);
     bcf_hdr_destroy(args->aux.hdr);
-    hts_close(args->out_fh);
+    if ( args->out_fh ) hts_close(args->out_fh);
     bcf_sr_destroy(args->aux.srs);
 }
 
+/*
+ *  Returns 1 if the record should be printed, 0 if it should be skipped.
+ *  The call_t context can be the master args->aux or a private copy of
+ *  a worker thread.
+ */
+static int call_record(args_t *args, call_t *aux, bcf1_t *bcf_rec)
+{
+    if ( args->samples_map ) bcf_subset(aux->hdr, bcf_rec, args->nsamples, args->samples_map);
+    bcf_unpack(bcf_rec, BCF_UN_STR);
+
+    // Skip unwanted sites
+    if ( aux->flag & CALL_VARONLY )
+    {
+        if ( bcf_rec->n_allele==1 ) return 0;                                       // not a variant
+        if ( bcf_rec->n_allele==2 && bcf_rec->d.allele[1][0]=='X' ) return 0;       // second allele is mpileup's X, not a variant
+    }
+    if ( (args->flag & CF_INDEL_ONLY) && bcf_is_snp(bcf_rec) ) return 0;    // not an indel
+    if ( (args->flag & CF_NO_INDEL) && !bcf_is_snp(bcf_rec) ) return 0;     // not a SNP
+    if ( (args->flag & CF_ACGT_ONLY) && (bcf_rec->d.allele[0][0]=='N' || bcf_rec->d.allele[0][0]=='n') ) return 0;   // REF[0] is 'N'
+
+    bcf_unpack(bcf_rec, BCF_UN_ALL);
+
+    // Various output modes: QCall output (todo)
+    if ( args->flag & CF_QCALL ) 
+    {
+        qcall(aux, bcf_rec);
+        return 0;
+    }
+
+    // Calling modes which output VCFs
+    int ret;
+    if ( args->flag & CF_MCALL )
+        ret = mcall(aux, bcf_rec);
+    else
+        ret = ccall(aux, bcf_rec);
+
+    if ( ret==-1 ) error("Something is wrong\n");
+    if ( (aux->flag & CALL_VARONLY) && ret==0 ) return 0;     // not a variant
+    return 1;
+}
+
+static void add_chunks(args_t *args, int rid)
+{
+    // Contig length from the header, sequences of unknown length are not split
+    bcf_hdr_t *hdr = args->aux.srs->readers[0].header;
+    bcf_hrec_t *hrec = hdr->id[BCF_DT_CTG][rid].val->hrec[0];
+    int i, len = 0;
+    for (i=0; hrec && i<hrec->nkeys; i++)
+        if ( !strcmp("length",hrec->keys[i]) ) len = atoi(hrec->vals[i]);
+
+    int beg = 0;
+    do
+    {
+        args->nchunks++;
+        hts_expand(chunk_t, args->nchunks, args->mchunks, args->chunks);
+        chunk_t *chunk = &args->chunks[args->nchunks-1];
+        memset(chunk, 0, sizeof(chunk_t));
+        chunk->rid = rid;
+        chunk->beg = beg;
+        chunk->end = len>0 && beg+CHUNK_SIZE < len ? beg + CHUNK_SIZE - 1 : INT_MAX;
+        beg += CHUNK_SIZE;
+    }
+    while ( len>0 && beg < len );
+}
+
+// Split the sequences from the index or the -r list into fixed-size chunks
+static void init_chunks(args_t *args)
+{
+    bcf_sr_regions_t *reg = args->aux.srs->regions;
+    bcf_hdr_t *hdr = args->aux.srs->readers[0].header;
+    if ( !reg ) error("Failed to determine sequences from the index: %s\n", args->bcf_fname);
+    int i;
+    for (i=0; i<reg->nseqs; i++)
+    {
+        int rid = bcf_hdr_name2id(hdr, reg->seq_names[i]);
+        if ( rid<0 ) continue;  // not present in the VCF header
+        add_chunks(args, rid);
+    }
+}
+
+static void process_chunk(worker_t *worker, chunk_t *chunk)
+{
+    args_t *args = worker->args;
+    bcf_srs_t *srs = worker->aux.srs;
+    const char *chr = bcf_hdr_id2name(srs->readers[0].header, chunk->rid);
+
+    bcf_sr_seek(srs, chr, chunk->beg);
+    while ( bcf_sr_next_line(srs) )
+    {
+        bcf1_t *rec = srs->readers[0].buffer[0];
+        if ( rec->rid != chunk->rid || rec->pos > chunk->end ) break;
+        if ( rec->pos < chunk->beg ) continue;  // overlapping record owned by the previous chunk
+
+        if ( !call_record(args, &worker->aux, rec) ) continue;
+
+        // Take over the record, the reader's buffer gets a blank one
+        hts_expand0(bcf1_t*, chunk->nrecs+1, chunk->mrecs, chunk->recs);
+        if ( !chunk->recs[chunk->nrecs] ) chunk->recs[chunk->nrecs] = bcf_init1();
+        bcf1_t *tmp = chunk->recs[chunk->nrecs];
+        chunk->recs[chunk->nrecs] = srs->readers[0].buffer[0];
+        srs->readers[0].buffer[0] = tmp;
+        chunk->nrecs++;
+    }
+}
+
+static void *worker_run(void *data)
+{
+    worker_t *worker = (worker_t*) data;
+    args_t *args = worker->args;
+    while (1)
+    {
+        // Wait until a chunk is available and the number of chunks pending
+        // output is bounded so that memory does not grow indefinitely
+        pthread_mutex_lock(&args->lock);
+        while ( args->ichunk_next < args->nchunks && args->ichunk_next - args->ichunk_out >= 2*args->nthreads )
+            pthread_cond_wait(&args->cond, &args->lock);
+        int ichunk = args->ichunk_next < args->nchunks ? args->ichunk_next++ : -1;
+        pthread_mutex_unlock(&args->lock);
+        if ( ichunk<0 ) break;
+
+        chunk_t *chunk = &args->chunks[ichunk];
+        process_chunk(worker, chunk);
+
+        pthread_mutex_lock(&args->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&args->cond);
+        pthread_mutex_unlock(&args->lock);
+    }
+    return NULL;
+}
+
+static void init_worker(args_t *args, worker_t *worker)
+{
+    worker->args = args;
+    if ( args->flag & CF_MCALL ) mcall_init_worker(&worker->aux, &args->aux);
+    else ccall_init_worker(&worker->aux, &args->aux);
+
+    bcf_srs_t *srs = bcf_sr_init();
+    srs->require_index = 1;
+    if ( args->targets && bcf_sr_set_targets(srs, args->targets, args->targets_is_file, args->aux.flag&CALL_CONSTR_ALLELES ? 3 : 0)<0 )
+        error("Failed to read the targets: %s\n", args->targets);
+    if ( args->regions && bcf_sr_set_regions(srs, args->regions, args->regions_is_file)<0 )
+        error("Failed to read the regions: %s\n", args->regions);
+    if ( !bcf_sr_add_reader(srs, args->bcf_fname) ) error("Failed to open: %s\n", args->bcf_fname);
+    if ( args->subset_in_reader ) bcf_hdr_subset_reader(srs->readers[0].header, args->nsamples, args->samples, NULL);
+    worker->aux.srs = srs;
+}
+
+static void destroy_worker(args_t *args, worker_t *worker)
+{
+    int i;
+    for (i=0; i<MCALL_NT; i++) args->aux.timing[i] += worker->aux.timing[i];
+    args->aux.nals_pruned += worker->aux.nals_pruned;
+    bcf_sr_destroy(worker->aux.srs);
+    if ( args->flag & CF_MCALL ) mcall_destroy_worker(&worker->aux);
+    else ccall_destroy_worker(&worker->aux);
+}
+
+/*
+ *  Region-parallel calling: each worker thread has its own reader and call_t
+ *  context and processes one chunk at a time. The main thread writes the
+ *  chunks in genomic order as they are completed.
+ */
+static void call_threaded(args_t *args)
+{
+    int i, j;
+    init_chunks(args);
+
+    pthread_mutex_init(&args->lock, NULL);
+    pthread_cond_init(&args->cond, NULL);
+    args->workers = (worker_t*) calloc(args->nthreads, sizeof(worker_t));
+    for (i=0; i<args->nthreads; i++)
+    {
+        init_worker(args, &args->workers[i]);
+        if ( pthread_create(&args->workers[i].tid, NULL, worker_run, &args->workers[i]) )
+            error("Failed to create a thread\n");
+    }
+
+    // the main thread only waits and writes, reading and calling in the workers is profiled as "call"
+    profile_mark_t prof;
+    PROFILE_START(prof);
+    for (i=0; i<args->nchunks; i++)
+    {
+        chunk_t *chunk = &args->chunks[i];
+        pthread_mutex_lock(&args->lock);
+        while ( !chunk->done ) pthread_cond_wait(&args->cond, &args->lock);
+        pthread_mutex_unlock(&args->lock);
+        PROFILE_LAPN(PROF_CALL, prof, chunk->nrecs);
+
+        for (j=0; j<chunk->nrecs; j++)
+            bcf_write1(args->out_fh, args->aux.hdr, chunk->recs[j]);
+        PROFILE_LAPN(PROF_WRITE, prof, chunk->nrecs);
+        for (j=0; j<chunk->mrecs; j++)
+            if ( chunk->recs[j] ) bcf_destroy1(chunk->recs[j]);
+        free(chunk->recs);
+        chunk->recs = NULL;
+
+        pthread_mutex_lock(&args->lock);
+        args->ichunk_out = i+1;
+        pthread_cond_broadcast(&args->cond);
+        pthread_mutex_unlock(&args->lock);
+    }
+
+    for (i=0; i<args->nthreads; i++)
+    {
+        pthread_join(args->workers[i].tid, NULL);
+        destroy_worker(args, &args->workers[i]);
+    }
+    free(args->workers);
+    free(args->chunks);
+    pthread_mutex_destroy(&args->lock);
+    pthread_cond_destroy(&args->cond);
+}
+
+static void stage_process(pipe_stage_t *stage, bcf1_t **rec)
+{
+    args_t *args = (args_t*) stage->data;
+    if ( call_record(args, &args->aux, *rec) ) pipe_emit(stage, rec);
+}
+
+static void stage_destroy(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    destroy_data(args);
+    free(args);
+}
+
 void parse_novel_rate(args_t *args, const char *str)
 {
     if ( sscanf(str,"%le,%le,%le",&args->aux.trio_Pm_SNPs,&args->aux.trio_Pm_del,&args->aux.trio_Pm_ins)==3 )  // explicit for all
@@ -380,6 +667,8 @@ static void usage(args_t *args)
     fprintf(stderr, "   -S, --samples-file <file>       PED file or a file with optional second column for ploidy (0, 1 or 2) [all samples]\n");
     fprintf(stderr, "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "       --threads <int>             number of calling threads, requires indexed input [0]\n");
+    fprintf(stderr, "       --timing                    print the time spent in the stages of -m calling\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Input/output options:\n");
     fprintf(stderr, "   -A, --keep-alts                 keep all possible alternate alleles at variant sites\n");
@@ -393,6 +682,8 @@ static void usage(args_t *args)
     fprintf(stderr, "   -m, --multiallelic-caller       alternative model for multiallelic and rare-variant calling (conflicts with -c)\n");
     fprintf(stderr, "   -n, --novel-rate <float>,[...]  likelihood of novel mutation for constrained trio calling, see man page for details [1e-8,1e-9,1e-9]\n");
     fprintf(stderr, "   -p, --pval-threshold <float>    variant if P(ref|D)<FLOAT with -c [0.5] or another allele accepted if P(chi^2)>=1-FLOAT with -m [1e-2]\n");
+    fprintf(stderr, "       --sample-threads <int>      with -m, split the samples of each site between <int> threads in cohorts of 16384+ samples [1]\n");
+    fprintf(stderr, "       --trio-threads <int>        evaluate the families of \"-C trio\" calling in <int> threads [1]\n");
     fprintf(stderr, "   -X, --chromosome-X              haploid output for male samples (requires PED file with -s)\n");
     fprintf(stderr, "   -Y, --chromosome-Y              haploid output for males and skips females (requires PED file with -s)\n");
 
@@ -424,6 +715,7 @@ int main_vcfcall(int argc, char *argv[])
     args.aux.trio_Pm_ins  = args.aux.trio_Pm_del  = 1 - 1e-9;
 
     float p_arg = -1;
+    char *tmp;
     int i, c, samples_is_file = 0;
 
     static struct option loptions[] = 
@@ -448,6 +740,12 @@ int main_vcfcall(int argc, char *argv[])
         {"chromosome-X",0,0,'X'},
         {"chromosome-Y",0,0,'Y'},
         {"novel-rate",1,0,'n'},
+        {"threads",1,0,1},
+        {"timing",0,0,2},
+        {"trio-threads",1,0,3},
+        {"sample-threads",1,0,4},
+        {"trio-chunk",1,0,5},           // not documented, for testing --trio-threads with few families
+        {"sample-chunk",1,0,6},         // not documented, for testing --sample-threads with few samples
         {0,0,0,0}
     };
 
@@ -490,10 +788,38 @@ int main_vcfcall(int argc, char *argv[])
             case 'T': args.targets = optarg; args.targets_is_file = 1; break;
             case 's': samples_fname = optarg; break;
             case 'S': samples_fname = optarg; samples_is_file = 1; break;
+            case  1 : 
+                      args.nthreads = strtol(optarg,&tmp,10);
+                      if ( *tmp || args.nthreads<0 ) error("Could not parse: --threads %s\n", optarg);
+                      break;
+            case  2 : args.aux.flag |= CALL_TIMING; break;
+            case  3 : 
+                      args.aux.trio_nthreads = strtol(optarg,&tmp,10);
+                      if ( *tmp || args.aux.trio_nthreads<1 ) error("Could not parse: --trio-threads %s\n", optarg);
+                      break;
+            case  4 : 
+                      args.aux.smpl_nthreads = strtol(optarg,&tmp,10);
+                      if ( *tmp || args.aux.smpl_nthreads<1 ) error("Could not parse: --sample-threads %s\n", optarg);
+                      break;
+            case  5 : 
+                      args.aux.fam_chunk = strtol(optarg,&tmp,10);
+                      if ( *tmp || args.aux.fam_chunk<1 ) error("Could not parse: --trio-chunk %s\n", optarg);
+                      break;
+            case  6 : 
+                      args.aux.smpl_chunk = strtol(optarg,&tmp,10);
+                      if ( *tmp || args.aux.smpl_chunk<1 ) error("Could not parse: --sample-chunk %s\n", optarg);
+                      break;
             default: usage(&args);
         }
     }
-    if ( optind>=argc )
+    pipe_stage_t *stage = pipe_stage_init();
+    if ( stage )
+    {
+        if ( optind<argc || args.regions || args.targets )
+            error("Input files, regions and targets cannot be given to a pipe stage, use the options of bcftools pipe\n");
+        if ( args.nthreads || args.flag & CF_QCALL ) error("The --threads option and QCall output cannot be used in a pipe stage\n");
+    }
+    else if ( optind>=argc )
     {
         if ( !isatty(fileno((FILE *)stdin)) ) args.bcf_fname = "-";  // reading from stdin
         else usage(&args);
@@ -522,46 +848,48 @@ int main_vcfcall(int argc, char *argv[])
         if ( !(args.flag & CF_MCALL) ) error("The \"-C alleles\" mode requires -m\n");
     }
     if ( args.aux.flag & CALL_CHR_X && args.aux.flag & CALL_CHR_Y ) error("Only one of -X or -Y should be given\n");
+    if ( args.aux.flag & CALL_TIMING && !(args.flag & CF_MCALL) ) error("The --timing option requires -m\n");
+    if ( args.aux.trio_nthreads>1 && !(args.aux.flag & CALL_CONSTR_TRIO) ) error("The --trio-threads option requires \"-C trio\"\n");
+    if ( args.aux.smpl_nthreads>1 && !(args.flag & CF_MCALL) ) error("The --sample-threads option requires -m\n");
 
+    if ( args.nthreads )
+    {
+        if ( args.flag & CF_QCALL ) error("The --threads option is not supported with QCall output\n");
+        if ( !strcmp("-",args.bcf_fname) ) error("The --threads option requires indexed input, cannot stream from stdin\n");
+    }
+    if ( stage )
+    {
+        // the stage outlives this function
+        args_t *stage_args = (args_t*) malloc(sizeof(args_t));
+        *stage_args = args;
+        stage_args->stage = stage;
+        init_data(stage_args);
+        stage->hdr     = stage_args->aux.hdr;
+        stage->data    = stage_args;
+        stage->process = stage_process;
+        stage->destroy = stage_destroy;
+        return 0;
+    }
     init_data(&args);
 
-    while ( bcf_sr_next_line(args.aux.srs) )
+    if ( args.nthreads )
+        call_threaded(&args);
+    else
     {
-        bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
-        if ( args.samples_map ) bcf_subset(args.aux.hdr, bcf_rec, args.nsamples, args.samples_map);
-        bcf_unpack(bcf_rec, BCF_UN_STR);
-
-        // Skip unwanted sites
-        if ( args.aux.flag & CALL_VARONLY )
-        {
-            if ( bcf_rec->n_allele==1 ) continue;                                       // not a variant
-            if ( bcf_rec->n_allele==2 && bcf_rec->d.allele[1][0]=='X' ) continue;       // second allele is mpileup's X, not a variant
-        }
-        if ( (args.flag & CF_INDEL_ONLY) && bcf_is_snp(bcf_rec) ) continue;    // not an indel
-        if ( (args.flag & CF_NO_INDEL) && !bcf_is_snp(bcf_rec) ) continue;     // not a SNP
-        if ( (args.flag & CF_ACGT_ONLY) && (bcf_rec->d.allele[0][0]=='N' || bcf_rec->d.allele[0][0]=='n') ) continue;   // REF[0] is 'N'
-
-        bcf_unpack(bcf_rec, BCF_UN_ALL);
-
-        // Various output modes: QCall output (todo)
-        if ( args.flag & CF_QCALL ) 
+        profile_mark_t prof;
+        PROFILE_START(prof);
+        while ( bcf_sr_next_line(args.aux.srs) )
         {
-            qcall(&args.aux, bcf_rec);
-            continue;
+            PROFILE_LAP(PROF_READ, prof);
+            bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
+            int ret = call_record(&args, &args.aux, bcf_rec);
+            PROFILE_LAP(PROF_CALL, prof);
+            if ( ret )
+            {
+                bcf_write1(args.out_fh, args.aux.hdr, bcf_rec);
+                PROFILE_LAP(PROF_WRITE, prof);
+            }
         }
-
-        // Calling modes which output VCFs
-        int ret;
-        if ( args.flag & CF_MCALL )
-            ret = mcall(&args.aux, bcf_rec);
-        else
-            ret = ccall(&args.aux, bcf_rec);
-
-        if ( ret==-1 ) error("Something is wrong\n");
-        if ( (args.aux.flag & CALL_VARONLY) && ret==0 ) continue;     // not a variant
-
-        // Output
-        bcf_write1(args.out_fh, args.aux.hdr, bcf_rec);
     }
     destroy_data(&args);
 	return 0;
@@ -24,15 +24,19 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <stdint.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
+#include <htslib/bgzf.h>
 #include "bcftools.h"
+#include "recbuf.h"
 
 typedef struct _args_t
 {
@@ -45,12 +49,22 @@ typedef struct _args_t
     // phasing
     int *start_pos, start_tid, ifname;
     int *swap_phase, nswap, *nmatch, *nmism;
-    bcf1_t **buf;
-    int nbuf, mbuf, prev_chr, min_PQ, prev_pos_check;
+    recbuf_t buf;           // pairs of overlapping records from the two files
+    int prev_chr, min_PQ, prev_pos_check;
     int32_t *GTa, *GTb, mGTa, mGTb, *phase_qual, *phase_set;
+    uint64_t *hap_same, *hap_swap;  // per sample, bits of up to 64 overlapping sites with the same/swapped phase in A and B
+    int nhap_sites;
+
+    // with --max-mem, overlapping records beyond the limit go to temporary files, A and B
+    size_t max_mem;
+    htsFile *spill_fh[2];
+    bcf_hdr_t *spill_hdr[2];
+    bcf1_t *spill_rec[2];
+    char *spill_fname[2];
+    int nspilled, spill_next[2];    // pairs in the files, the next pair to be read
 
     char **argv, *file_list, **fnames;
-    int argc, nfnames, allow_overlaps, phased_concat;
+    int argc, nfnames, allow_overlaps, phased_concat, naive_concat;
 }
 args_t;
 
@@ -112,7 +126,7 @@ static void init_data(args_t *args)
         bcf_hdr_append(args->out_hdr,"##FORMAT=<ID=PS,Number=1,Type=Integer,Description=\"Phase Set\">");
     }
     bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_concat");
-    args->out_fh = hts_open("-",hts_bcf_wmode(args->output_type));
+    args->out_fh = hts_open_mt("-",hts_bcf_wmode(args->output_type));
     bcf_hdr_write(args->out_fh, args->out_hdr);
 
     if ( args->allow_overlaps ) 
@@ -151,6 +165,9 @@ static void init_data(args_t *args)
         args->nmism  = (int*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(int));
         args->phase_qual = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
         args->phase_set  = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
+        recbuf_init(&args->buf, 64);
+        args->hap_same = (uint64_t*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(uint64_t));
+        args->hap_swap = (uint64_t*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(uint64_t));
         args->files = bcf_sr_init();
         args->files->require_index = 1;
         args->ifname = 0;
@@ -168,14 +185,17 @@ static void destroy_data(args_t *args)
     free(args->seen_seq);
     free(args->start_pos);
     free(args->swap_phase);
-    for (i=0; i<args->mbuf; i++) bcf_destroy(args->buf[i]);
-    free(args->buf);
+    recbuf_destroy(&args->buf);
     free(args->GTa);
     free(args->GTb);
     free(args->nmatch);
     free(args->nmism);
     free(args->phase_qual);
     free(args->phase_set);
+    free(args->hap_same);
+    free(args->hap_swap);
+    for (i=0; i<2; i++)
+        if ( args->spill_rec[i] ) bcf_destroy1(args->spill_rec[i]);
 }
 
 int vcf_write_line(htsFile *fp, kstring_t *line);
@@ -195,48 +215,157 @@ static void phase_update(args_t *args, bcf_hdr_t *hdr, bcf1_t *rec)
     bcf_update_genotypes(hdr,rec,args->GTa,nGTs);
 }
 
-static void phased_flush(args_t *args)
+static inline int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+// Add the packed sites to the per-sample counts of matching and mismatching phase
+static void hap_fold(args_t *args)
 {
-    if ( !args->nbuf ) return;
+    if ( !args->nhap_sites ) return;
+    int j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
+    for (j=0; j<nsmpl; j++)
+    {
+        int nsame = popcount64(args->hap_same[j]);
+        int nswap = popcount64(args->hap_swap[j]);
+        if ( args->swap_phase[j] ) { args->nmism[j] += nsame; args->nmatch[j] += nswap; }
+        else { args->nmatch[j] += nsame; args->nmism[j] += nswap; }
+    }
+    memset(args->hap_same, 0, sizeof(uint64_t)*nsmpl);
+    memset(args->hap_swap, 0, sizeof(uint64_t)*nsmpl);
+    args->nhap_sites = 0;
+}
 
+/*
+ *  Compare the phase of heterozygous genotypes phased in both A and B. The
+ *  phase decision does not change within an overlap, so the comparison is
+ *  done as the pairs come and the genotypes need not be kept.
+ */
+static void hap_compare(args_t *args, bcf1_t *arec, bcf1_t *brec)
+{
     bcf_hdr_t *ahdr = args->files->readers[0].header;
     bcf_hdr_t *bhdr = args->files->readers[1].header;
+    int j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
 
-    int i, j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
+    int nGTs = bcf_get_genotypes(ahdr, arec, &args->GTa, &args->mGTa);
+    if ( nGTs < 0 ) error("GT is not present at %s:%d\n", bcf_seqname(ahdr,arec), arec->pos+1);
+    if ( nGTs != 2*nsmpl ) return;    // not diploid
+    nGTs = bcf_get_genotypes(bhdr, brec, &args->GTb, &args->mGTb);
+    if ( nGTs < 0 ) error("GT is not present at %s:%d\n", bcf_seqname(bhdr,brec), brec->pos+1);
+    if ( nGTs != 2*nsmpl ) return;    // not diploid
 
-    for (i=0; i<args->nbuf; i+=2)
+    uint64_t bit = 1ULL << args->nhap_sites;
+    for (j=0; j<nsmpl; j++)
     {
-        bcf1_t *arec = args->buf[i];
-        bcf1_t *brec = args->buf[i+1];
-
-        int nGTs = bcf_get_genotypes(ahdr, arec, &args->GTa, &args->mGTa);
-        if ( nGTs < 0 ) error("GT is not present at %s:%d\n", bcf_seqname(ahdr,arec), arec->pos+1);
-        if ( nGTs != 2*nsmpl ) continue;    // not diploid
-        nGTs = bcf_get_genotypes(bhdr, brec, &args->GTb, &args->mGTb);
-        if ( nGTs < 0 ) error("GT is not present at %s:%d\n", bcf_seqname(bhdr,brec), brec->pos+1);
-        if ( nGTs != 2*nsmpl ) continue;    // not diploid
+        int *gta = &args->GTa[j*2];
+        int *gtb = &args->GTb[j*2];
+        if ( gta[1]==bcf_int32_vector_end || gtb[1]==bcf_int32_vector_end ) continue;
+        if ( gta[0]==bcf_gt_missing || gta[1]==bcf_gt_missing || gtb[0]==bcf_gt_missing || gtb[1]==bcf_gt_missing ) continue;
+        if ( !bcf_gt_is_phased(gta[1]) || !bcf_gt_is_phased(gtb[1]) ) continue;
+        if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gta[1]) || bcf_gt_allele(gtb[0])==bcf_gt_allele(gtb[1]) ) continue;
+        if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[0]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[1]) )
+            args->hap_same[j] |= bit;
+        if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[1]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[0]) )
+            args->hap_swap[j] |= bit;
+    }
+    if ( ++args->nhap_sites==64 ) hap_fold(args);
+}
 
-        for (j=0; j<nsmpl; j++)
+// Move the buffered pairs to the temporary files
+static void spill_pairs(args_t *args)
+{
+    int i;
+    if ( !args->spill_fh[0] )
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        for (i=0; i<2; i++)
         {
-            int *gta = &args->GTa[j*2];
-            int *gtb = &args->GTb[j*2];
-            if ( gta[1]==bcf_int32_vector_end || gtb[1]==bcf_int32_vector_end ) continue;
-            if ( gta[0]==bcf_gt_missing || gta[1]==bcf_gt_missing || gtb[0]==bcf_gt_missing || gtb[1]==bcf_gt_missing ) continue;
-            if ( !bcf_gt_is_phased(gta[1]) || !bcf_gt_is_phased(gtb[1]) ) continue;
-            if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gta[1]) || bcf_gt_allele(gtb[0])==bcf_gt_allele(gtb[1]) ) continue;
-            if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[0]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[1]) )
-            {
-                if ( args->swap_phase[j] ) args->nmism[j]++; else args->nmatch[j]++;
-            }
-            if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[1]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[0]) )
-            {
-                if ( args->swap_phase[j] ) args->nmatch[j]++; else args->nmism[j]++;
-            }
+            kstring_t str = {0,0,0};
+            ksprintf(&str, "%s/bcftools-concat.XXXXXX", tmpdir ? tmpdir : "/tmp");
+            int fd = mkstemp(str.s);
+            if ( fd<0 ) error("Could not create a temporary file: %s\n", str.s);
+            close(fd);
+            args->spill_fname[i] = str.s;
+            args->spill_fh[i] = hts_open(str.s, "wbu");
+            if ( !args->spill_fh[i] ) error("Could not open %s for writing\n", str.s);
+            bcf_hdr_write(args->spill_fh[i], args->files->readers[i].header);
         }
     }
-    for (i=0; i<args->nbuf/2; i+=2)
+    int n = recbuf_n(&args->buf);
+    for (i=0; i<n; i++)
+    {
+        if ( bcf_write1(args->spill_fh[i%2], args->files->readers[i%2].header, recbuf_kth(&args->buf, i))!=0 )
+            error("Failed to write to %s\n", args->spill_fname[i%2]);
+    }
+    args->nspilled += n/2;
+    recbuf_clear(&args->buf);
+}
+
+// The A (ifile=0) or B (ifile=1) record of the k-th overlapping pair. The spilled records can be read only once and in order.
+static bcf1_t *overlap_rec(args_t *args, int k, int ifile)
+{
+    if ( k >= args->nspilled ) return recbuf_kth(&args->buf, 2*(k - args->nspilled) + ifile);
+    while ( args->spill_next[ifile] <= k )
+    {
+        if ( bcf_read1(args->spill_fh[ifile], args->spill_hdr[ifile], args->spill_rec[ifile])!=0 )
+            error("Failed to read from %s\n", args->spill_fname[ifile]);
+        args->spill_next[ifile]++;
+    }
+    return args->spill_rec[ifile];
+}
+
+static void spill_rewind(args_t *args)
+{
+    int i;
+    for (i=0; i<2; i++)
+    {
+        if ( hts_close(args->spill_fh[i])!=0 ) error("Failed to close %s\n", args->spill_fname[i]);
+        args->spill_fh[i] = hts_open(args->spill_fname[i], "rb");
+        if ( !args->spill_fh[i] ) error("Could not read %s\n", args->spill_fname[i]);
+        args->spill_hdr[i] = bcf_hdr_read(args->spill_fh[i]);
+        if ( !args->spill_rec[i] ) args->spill_rec[i] = bcf_init1();
+        args->spill_next[i] = 0;
+    }
+}
+
+static void spill_close(args_t *args)
+{
+    int i;
+    for (i=0; i<2; i++)
+    {
+        bcf_hdr_destroy(args->spill_hdr[i]);
+        hts_close(args->spill_fh[i]);
+        unlink(args->spill_fname[i]);
+        free(args->spill_fname[i]);
+        args->spill_fh[i] = NULL;
+        args->spill_hdr[i] = NULL;
+        args->spill_fname[i] = NULL;
+    }
+    args->nspilled = 0;
+}
+
+static void phased_flush(args_t *args)
+{
+    int npairs = args->nspilled + recbuf_n(&args->buf)/2;
+    if ( !npairs ) return;
+    if ( args->nspilled ) spill_rewind(args);
+    hap_fold(args);
+
+    int i, j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
+
+    // A records from the first half of the overlap, B records from the second
+    int na = (npairs + 1)/2;
+    for (i=0; i<na; i++)
     {
-        bcf1_t *arec = args->buf[i];
+        bcf1_t *arec = overlap_rec(args, i, 0);
         bcf_translate(args->out_hdr, args->files->readers[0].header, arec);
         if ( args->nswap )
             phase_update(args, args->out_hdr, arec);
@@ -268,9 +397,9 @@ static void phased_flush(args_t *args)
         args->nmism[j]  = 0;
     }
     int PQ_printed = 0;
-    for (; i<args->nbuf; i+=2)
+    for (i=na; i<npairs; i++)
     {
-        bcf1_t *brec = args->buf[i+1];
+        bcf1_t *brec = overlap_rec(args, i, 1);
         bcf_translate(args->out_hdr, args->files->readers[1].header, brec);
         if ( !PQ_printed )
         {
@@ -287,7 +416,8 @@ static void phased_flush(args_t *args)
         if ( brec->pos < args->prev_pos_check ) error("FIXME, disorder: %s:%d vs %d  [2]\n", bcf_seqname(args->files->readers[1].header,brec),brec->pos+1,args->prev_pos_check+1);
         args->prev_pos_check = brec->pos;
     }
-    args->nbuf = 0;
+    recbuf_clear(&args->buf);
+    if ( args->nspilled ) spill_close(args);
 }
 
 static void phased_push(args_t *args, bcf1_t *arec, bcf1_t *brec)
@@ -321,14 +451,10 @@ static void phased_push(args_t *args, bcf1_t *arec, bcf1_t *brec)
         return;
     }
 
-    int m = args->mbuf;
-    args->nbuf += 2;
-    hts_expand(bcf1_t*,args->nbuf,args->mbuf,args->buf);
-    for (i=m; i<args->mbuf; i++)
-        args->buf[i] = bcf_init1();
-
-    SWAP(bcf1_t*, args->files->readers[0].buffer[0], args->buf[args->nbuf-2]);
-    SWAP(bcf1_t*, args->files->readers[1].buffer[0], args->buf[args->nbuf-1]);
+    hap_compare(args, arec, brec);
+    recbuf_push(&args->buf, &args->files->readers[0].buffer[0]);
+    recbuf_push(&args->buf, &args->files->readers[1].buffer[0]);
+    if ( args->max_mem && args->buf.mem > args->max_mem ) spill_pairs(args);
 }
 
 static void concat(args_t *args)
@@ -495,6 +621,115 @@ static void concat(args_t *args)
     }
 }
 
+// The binary records refer to the header dictionaries by index, a block can
+// be copied verbatim only if the contigs, tags and samples are numbered the
+// same way and the tags are of the same type in both headers.
+static int naive_hdr_compatible(bcf_hdr_t *a, bcf_hdr_t *b)
+{
+    int i, j, k;
+    for (i=0; i<3; i++)
+    {
+        if ( a->n[i]!=b->n[i] ) return 0;
+        for (j=0; j<a->n[i]; j++)
+        {
+            if ( !a->id[i][j].key != !b->id[i][j].key ) return 0;
+            if ( !a->id[i][j].key ) continue;
+            if ( strcmp(a->id[i][j].key,b->id[i][j].key) ) return 0;
+            if ( i!=BCF_DT_ID ) continue;
+            for (k=0; k<3; k++)
+                if ( a->id[i][j].val->info[k]!=b->id[i][j].val->info[k] ) return 0;
+        }
+    }
+    return 1;
+}
+
+static htsFile *naive_open(args_t *args, int i, bcf_hdr_t **hdr)
+{
+    htsFile *fp = hts_open(args->fnames[i], "r"); if ( !fp ) error("Failed to open: %s\n", args->fnames[i]);
+    if ( !fp->is_bin || !fp->fp.bgzf->is_compressed ) error("The --naive option requires compressed BCF on input: %s\n", args->fnames[i]);
+    *hdr = bcf_hdr_read(fp); if ( !*hdr ) error("Failed to parse header: %s\n", args->fnames[i]);
+    return fp;
+}
+
+/*
+    Concatenate BCFs with compatible headers without decoding the records:
+    only the data sharing the BGZF block with the header is recompressed,
+    the remaining blocks are copied as they are, less the EOF markers.
+*/
+static void naive_concat(args_t *args)
+{
+    static const uint8_t bgzf_eof[28] = { 0x1f,0x8b,0x08,0x04,0,0,0,0,0,0xff,0x06,0,0x42,0x43,0x02,0,0x1b,0,0x03,0,0,0,0,0,0,0,0,0 };
+    const size_t page_size = 65536;
+    uint8_t *buf = (uint8_t*) malloc(page_size + sizeof(bgzf_eof));
+
+    int i;
+    for (i=0; i<args->nfnames; i++)
+    {
+        bcf_hdr_t *hdr;
+        htsFile *fp = naive_open(args, i, &hdr);
+        if ( !args->out_hdr ) args->out_hdr = hdr;
+        else
+        {
+            if ( !naive_hdr_compatible(args->out_hdr, hdr) )
+                error("The header of %s is not compatible with %s, cannot use --naive\n", args->fnames[i],args->fnames[0]);
+            bcf_hdr_destroy(hdr);
+        }
+        hts_close(fp);
+    }
+
+    bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_concat");
+    args->out_fh = hts_open_mt("-",hts_bcf_wmode(args->output_type));
+    bcf_hdr_write(args->out_fh, args->out_hdr);
+    BGZF *out = args->out_fh->fp.bgzf;
+
+    for (i=0; i<args->nfnames; i++)
+    {
+        bcf_hdr_t *hdr;
+        htsFile *fp = naive_open(args, i, &hdr);
+        bcf_hdr_destroy(hdr);
+
+        // records read together with the header
+        BGZF *bgzf = fp->fp.bgzf;
+        if ( bgzf->block_length > bgzf->block_offset
+            && bgzf_write(out, (uint8_t*)bgzf->uncompressed_block + bgzf->block_offset, bgzf->block_length - bgzf->block_offset) < 0 )
+            error("Failed to write the output\n");
+        if ( bgzf_flush(out)<0 ) error("Failed to write the output\n");
+
+        // keep the last bytes back until it is known whether they are the EOF block
+        size_t ncached = 0;
+        while (1)
+        {
+            ssize_t nread = bgzf_raw_read(bgzf, buf + ncached, page_size);
+            if ( nread < 0 ) error("Failed to read %s\n", args->fnames[i]);
+            ncached += nread;
+            if ( !nread ) break;
+            if ( ncached <= sizeof(bgzf_eof) ) continue;
+            size_t nwr = ncached - sizeof(bgzf_eof);
+            if ( bgzf_raw_write(out, buf, nwr)!=(ssize_t)nwr ) error("Failed to write the output\n");
+            memmove(buf, buf + nwr, sizeof(bgzf_eof));
+            ncached = sizeof(bgzf_eof);
+        }
+        if ( ncached && (ncached!=sizeof(bgzf_eof) || memcmp(buf, bgzf_eof, ncached)) )
+        {
+            if ( bgzf_raw_write(out, buf, ncached)!=(ssize_t)ncached ) error("Failed to write the output\n");
+        }
+        hts_close(fp);
+    }
+    free(buf);
+}
+
+static size_t parse_mem(const char *str)
+{
+    char *tmp;
+    double mem = strtod(str, &tmp);
+    if ( tmp==str || mem<0 ) error("Could not parse the memory limit: %s\n", str);
+    if ( *tmp=='k' || *tmp=='K' ) { mem *= 1024; tmp++; }
+    else if ( *tmp=='m' || *tmp=='M' ) { mem *= 1024*1024; tmp++; }
+    else if ( *tmp=='g' || *tmp=='G' ) { mem *= 1024*1024*1024; tmp++; }
+    if ( *tmp ) error("Could not parse the memory limit: %s\n", str);
+    return mem;
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -510,6 +745,8 @@ static void usage(args_t *args)
 	fprintf(stderr, "   -a, --allow-overlaps           First coordinate of the next file can precede last record of the current file.\n");
 	fprintf(stderr, "   -f, --file-list <file>         Read the list of files from a file.\n");
 	fprintf(stderr, "   -l, --ligate                   Ligate phased VCFs by matching phase at overlapping haplotypes\n");
+	fprintf(stderr, "       --max-mem <size>           With -l, keep at most <size> of overlapping records in memory, e.g. 500M [0, no limit]\n");
+	fprintf(stderr, "   -n, --naive                    Concatenate BCF files with compatible headers without recompression\n");
 	fprintf(stderr, "   -q, --min-PQ <int>             Break phase set if phasing quality is lower than <int> [30]\n");
 	fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "\n");
@@ -528,17 +765,21 @@ int main_vcfconcat(int argc, char *argv[])
     {
         {"allow-overlap",1,0,'a'},
         {"ligate",1,0,'l'},
+        {"naive",0,0,'n'},
         {"output-type",1,0,'O'},
         {"file-list",1,0,'f'},
         {"min-PQ",1,0,'q'},
+        {"max-mem",1,0,1},
         {0,0,0,0}
     };
-    while ((c = getopt_long(argc, argv, "h:?O:f:alq:",loptions,NULL)) >= 0) 
+    while ((c = getopt_long(argc, argv, "h:?O:f:alq:n",loptions,NULL)) >= 0) 
     {
         switch (c) {
     	    case 'q': args->min_PQ = atoi(optarg); break;
+            case  1 : args->max_mem = parse_mem(optarg); break;
     	    case 'a': args->allow_overlaps = 1; break;
     	    case 'l': args->phased_concat = 1; break;
+    	    case 'n': args->naive_concat = 1; break;
     	    case 'f': args->file_list = optarg; break;
     	    case 'O': 
                 switch (optarg[0]) {
@@ -567,6 +808,16 @@ int main_vcfconcat(int argc, char *argv[])
         args->fnames = hts_readlines(args->file_list, &args->nfnames);
     }
     if ( !args->nfnames ) usage(args);
+    if ( args->max_mem && !args->phased_concat ) error("The option --max-mem requires -l\n");
+    if ( args->naive_concat )
+    {
+        if ( args->allow_overlaps || args->phased_concat ) error("The option --naive cannot be combined with -a or -l\n");
+        if ( args->output_type!=FT_BCF_GZ ) error("The option --naive requires -Ob\n");
+        naive_concat(args);
+        destroy_data(args);
+        free(args);
+        return 0;
+    }
     init_data(args);
     concat(args);
     destroy_data(args);
@@ -36,8 +36,10 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
+#include "profile.h"
+#include "pipe.h"
 #include "filter.h"
-#include "rbuf.h"
+#include "recbuf.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -56,6 +58,7 @@ typedef struct _args_t
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
+    int debug_filter, no_short_circuit;
     const uint8_t *smpl_pass;
     int set_gts;
     char *soft_filter;  // drop failed sites or annotate FILTER column?
@@ -63,13 +66,13 @@ typedef struct _args_t
     int flt_fail, flt_pass;     // BCF ids of fail and pass filters
     int snp_gap, indel_gap, IndelGap_id, SnpGap_id;
     int32_t ntmpi, *tmpi;
-    rbuf_t rbuf;
-    bcf1_t **rbuf_lines;
+    recbuf_t buf;           // records waiting for SnpGap and IndelGap, buf.recs is NULL if not needed
 
     bcf_srs_t *files;
     bcf_hdr_t *hdr;
     htsFile *out_fh;
     int output_type;
+    pipe_stage_t *stage;    // set when running as a stage of bcftools pipe
 
     char **argv, *targets_list, *regions_list;
     int argc;
@@ -78,9 +81,10 @@ args_t;
 
 static void init_data(args_t *args)
 {
-    args->out_fh = hts_open("-",hts_bcf_wmode(args->output_type));
+    if ( !args->stage )
+        args->out_fh = hts_open_mt("-",hts_bcf_wmode(args->output_type));
 
-    args->hdr = args->files->readers[0].header;
+    args->hdr = args->stage ? args->stage->hdr : args->files->readers[0].header;
     if ( args->soft_filter )
     {
         kstring_t flt_name = {0,0,0};
@@ -118,8 +122,7 @@ static void init_data(args_t *args)
 
     if ( args->snp_gap || args->indel_gap )
     {
-        rbuf_init(&args->rbuf, 100);
-        args->rbuf_lines = (bcf1_t**) calloc(args->rbuf.m, sizeof(bcf1_t*));
+        recbuf_init(&args->buf, 100);
         if ( args->snp_gap )
         {
             bcf_hdr_printf(args->hdr, "##FILTER=<ID=SnpGap,Description=\"SNP within %d bp of an indel\">", args->snp_gap);
@@ -138,29 +141,39 @@ static void init_data(args_t *args)
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
+    if ( args->filter && args->no_short_circuit )
+        filter_set_short_circuit(args->filter, 0);
+    if ( args->filter && args->debug_filter )
+        filter_debug(args->filter, stderr);
 }
 
 static void destroy_data(args_t *args)
 {
-    if ( args->rbuf_lines )
+    if ( args->buf.recs )
     {
-        int i;
-        for (i=0; i<args->rbuf.m; i++)
-            if ( args->rbuf_lines[i] ) bcf_destroy1(args->rbuf_lines[i]);
-        free(args->rbuf_lines);
+        if ( profile_enabled ) recbuf_report(&args->buf, "filter", stderr);
+        recbuf_destroy(&args->buf);
     }
     if ( args->filter )
+    {
+        if ( args->debug_filter ) filter_stats(args->filter, stderr);
         filter_destroy(args->filter);
+    }
     free(args->tmpi);
 }
 
+static void write_record(args_t *args, bcf1_t **rec)
+{
+    if ( args->stage ) pipe_emit(args->stage, rec);
+    else bcf_write1(args->out_fh, args->hdr, *rec);
+}
+
 static void flush_buffer(args_t *args, int n)
 {
     int i, j;
     for (i=0; i<n; i++)
     {
-        int k = rbuf_shift(&args->rbuf);
-        bcf1_t *rec = args->rbuf_lines[k];
+        bcf1_t **rec_ptr = recbuf_shift(&args->buf), *rec = *rec_ptr;
 
         int pass = 1;
         if ( !args->soft_filter )
@@ -171,12 +184,11 @@ static void flush_buffer(args_t *args, int n)
                 if ( args->snp_gap && rec->d.flt[j]==args->SnpGap_id ) { pass = 0; break; }
             }
         }
-        if ( pass ) bcf_write1(args->out_fh, args->hdr, rec);
+        if ( pass ) write_record(args, rec_ptr);
     }
 }
 
-#define SWAP(type_t, a, b) { type_t t = a; a = b; b = t; }
-static void buffered_filters(args_t *args, bcf1_t *line)
+static void buffered_filters(args_t *args, bcf1_t **line_ptr)
 {
     /**
      *  The logic of SnpGap=3. The SNPs at positions 1 and 7 are filtered,
@@ -204,20 +216,19 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     const int IndelGap_set   = VCF_OTHER<<2;
     const int IndelGap_flush = VCF_OTHER<<3;
 
+    bcf1_t *line = line_ptr ? *line_ptr : NULL;
     int var_type = 0, i;
     if ( line ) 
     {
         // Still on the same chromosome?
-        int ilast = rbuf_last(&args->rbuf); 
-        if ( ilast>=0 && line->rid != args->rbuf_lines[ilast]->rid ) 
-            flush_buffer(args, args->rbuf.n); // new chromosome, flush everything
+        int ilast = rbuf_last(&args->buf.rbuf); 
+        if ( ilast>=0 && line->rid != args->buf.recs[ilast]->rid ) 
+            flush_buffer(args, args->buf.rbuf.n); // new chromosome, flush everything
 
         // Insert the new record in the buffer. The line would be overwritten in
         // the next bcf_sr_next_line call, therefore we need to swap it with an
         // unused one
-        ilast = rbuf_add(&args->rbuf);
-        if ( !args->rbuf_lines[ilast] ) args->rbuf_lines[ilast] = bcf_init1();
-        SWAP(bcf1_t*, args->files->readers[0].buffer[0], args->rbuf_lines[ilast]);
+        recbuf_push(&args->buf, line_ptr);
 
         var_type = bcf_get_variant_types(line);
 
@@ -242,9 +253,9 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     {
         // Find indels which are too close to each other
         int last_to = -1;
-        for (i=-1; rbuf_next(&args->rbuf,&i); )
+        for (i=-1; rbuf_next(&args->buf.rbuf,&i); )
         {
-            bcf1_t *rec  = args->rbuf_lines[i];
+            bcf1_t *rec  = args->buf.recs[i];
             int rec_from = rec->pos;
             if ( last_to!=-1 && last_to < rec_from ) break;
 
@@ -254,15 +265,15 @@ static void buffered_filters(args_t *args, bcf1_t *line)
             rec->d.var_type |= IndelGap_set;
             last_to = args->indel_gap + rec->pos + rec->d.var[0].n - 1;
         }
-        if ( i==args->rbuf.f && line && last_to!=-1 ) k_flush = 0;
+        if ( i==args->buf.rbuf.f && line && last_to!=-1 ) k_flush = 0;
         if ( k_flush || !line )
         {
             // Select the best indel from the cluster of k_flush indels
             int k = 0, max_ac = -1, imax_ac = -1;
-            for (i=-1; rbuf_next(&args->rbuf,&i) && k<k_flush; )
+            for (i=-1; rbuf_next(&args->buf.rbuf,&i) && k<k_flush; )
             {
                 k++;
-                bcf1_t *rec  = args->rbuf_lines[i];
+                bcf1_t *rec  = args->buf.recs[i];
                 if ( !(rec->d.var_type & IndelGap_set) ) continue;
                 hts_expand(int, rec->n_allele, args->ntmpi, args->tmpi);
                 int ret = bcf_calc_ac(args->hdr, rec, args->tmpi, BCF_UN_ALL);
@@ -271,13 +282,13 @@ static void buffered_filters(args_t *args, bcf1_t *line)
 
             // Filter all but the best indel (with max AF or first if AF not available)
             k = 0;
-            for (i=-1; rbuf_next(&args->rbuf,&i) && k<k_flush; )
+            for (i=-1; rbuf_next(&args->buf.rbuf,&i) && k<k_flush; )
             {
                 k++;
-                bcf1_t *rec = args->rbuf_lines[i];
+                bcf1_t *rec = args->buf.recs[i];
                 if ( !(rec->d.var_type & IndelGap_set) ) continue;
                 rec->d.var_type |= IndelGap_flush;
-                if ( i!=imax_ac ) bcf_add_filter(args->hdr, args->rbuf_lines[i], args->IndelGap_id);
+                if ( i!=imax_ac ) bcf_add_filter(args->hdr, args->buf.recs[i], args->IndelGap_id);
             }
         }
     }
@@ -285,7 +296,7 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     if ( !line ) 
     {
         // Finished: flush everything
-        flush_buffer(args, args->rbuf.n);
+        flush_buffer(args, args->buf.rbuf.n);
         return;
     }
 
@@ -293,9 +304,9 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     if ( args->snp_gap )
     {
         int last_from = line->pos;
-        for (i=-1; rbuf_next(&args->rbuf,&i); )
+        for (i=-1; rbuf_next(&args->buf.rbuf,&i); )
         {
-            bcf1_t *rec = args->rbuf_lines[i];
+            bcf1_t *rec = args->buf.recs[i];
             int rec_to  = rec->pos + rec->d.var[0].n - 1;   // last position affected by the variant
             if ( rec_to + args->snp_gap < last_from ) 
                 j_flush++;
@@ -348,6 +359,52 @@ static void set_genotypes(args_t *args, bcf1_t *line)
     bcf_update_genotypes(args->hdr,line,args->tmpi,ngts*bcf_hdr_nsamples(args->hdr));
 }
 
+// Applies -i/-e, returns 1 if the line is to be output
+static int filter_line(args_t *args, bcf1_t *line)
+{
+    int pass = 1;
+    if ( args->filter )
+    {
+        pass = filter_test(args->filter, line, &args->smpl_pass);
+        if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+    }
+    if ( !args->soft_filter && !args->set_gts && !pass ) return 0;
+    if ( pass ) 
+    {
+        if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
+    }
+    else if ( args->soft_filter )
+    {
+        if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
+        else bcf_update_filter(args->hdr, line, &args->flt_fail, 1);
+    }
+    if ( args->set_gts ) set_genotypes(args, line);
+    return 1;
+}
+
+static void stage_process(pipe_stage_t *stage, bcf1_t **line)
+{
+    args_t *args = (args_t*) stage->data;
+    if ( !filter_line(args, *line) ) return;
+    if ( !args->buf.recs )
+        pipe_emit(stage, line);
+    else
+        buffered_filters(args, line);
+}
+
+static void stage_flush(pipe_stage_t *stage)
+{
+    buffered_filters((args_t*) stage->data, NULL);
+}
+
+static void stage_destroy(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+    free(args);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -355,6 +412,7 @@ static void usage(args_t *args)
     fprintf(stderr, "Usage:   bcftools filter [options] <in.vcf.gz>\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "        --debug-filter            print the compiled -i/-e expression to stderr\n");
     fprintf(stderr, "    -e, --exclude <expr>          exclude sites for which the expression is true (e.g. '%%TYPE=\"snp\" && %%QUAL>=10 && (DP4[2]+DP4[3] > 2')\n");
     fprintf(stderr, "    -g, --SnpGap <int>            filter SNPs within <int> base pairs of an indel\n");
     fprintf(stderr, "    -G, --IndelGap <int>          filter clusters of indels separated by <int> or fewer base pairs allowing only one to pass\n");
@@ -396,6 +454,8 @@ int main_vcffilter(int argc, char *argv[])
         {"output-type",1,0,'O'},
         {"SnpGap",1,0,'g'},
         {"IndelGap",1,0,'G'},
+        {"debug-filter",0,0,1},
+        {"no-short-circuit",0,0,2},     // not documented, for testing that short-circuit evaluation gives the same output
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "e:i:t:T:r:R:h?s:m:O:g:G:S:",loptions,NULL)) >= 0) {
@@ -427,6 +487,8 @@ int main_vcffilter(int argc, char *argv[])
                 else if ( !strcmp("0",optarg) ) args->set_gts = SET_GTS_REF;
                 else error("The argument to -S not recognised: %s\n", optarg);
                 break;
+            case  1 : args->debug_filter = 1; break;
+            case  2 : args->no_short_circuit = 1; break;
             case 'h':
             case '?': usage(args);
             default: error("Unknown argument: %s\n", optarg);
@@ -434,6 +496,23 @@ int main_vcffilter(int argc, char *argv[])
     }
 
     if ( args->filter_logic == (FLT_EXCLUDE|FLT_INCLUDE) ) error("Only one of -i or -e can be given.\n");
+
+    pipe_stage_t *stage = pipe_stage_init();
+    if ( stage )
+    {
+        if ( optind<argc || args->regions_list || args->targets_list )
+            error("Input files, regions and targets cannot be given to a pipe stage, use the options of bcftools pipe\n");
+        args->stage = stage;
+        init_data(args);
+        stage->hdr     = args->hdr;
+        stage->data    = args;
+        stage->process = stage_process;
+        stage->flush   = stage_flush;
+        stage->destroy = stage_destroy;
+        stage->no_shards = args->snp_gap || args->indel_gap;
+        return 0;
+    }
+
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -468,32 +547,19 @@ int main_vcffilter(int argc, char *argv[])
     
     init_data(args);
     bcf_hdr_write(args->out_fh, args->hdr);
+    profile_mark_t prof;
+    PROFILE_START(prof);
     while ( bcf_sr_next_line(args->files) )
     {
-        bcf1_t *line = bcf_sr_get_line(args->files, 0);
-        int pass = 1;
-        if ( args->filter )
-        {
-            pass = filter_test(args->filter, line, &args->smpl_pass);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-        }
-        if ( args->soft_filter || args->set_gts || pass )
-        {
-            if ( pass ) 
-            {
-                if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
-            }
-            else if ( args->soft_filter )
-            {
-                if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
-                else bcf_update_filter(args->hdr, line, &args->flt_fail, 1);
-            }
-            if ( args->set_gts ) set_genotypes(args, line);
-            if ( !args->rbuf_lines )
-                bcf_write1(args->out_fh, args->hdr, line);
-            else
-                buffered_filters(args, line);
-        }
+        PROFILE_LAP(PROF_READ, prof);
+        int pass = filter_line(args, bcf_sr_get_line(args->files, 0));
+        PROFILE_LAP(PROF_FILTER, prof);
+        if ( !pass ) continue;
+        if ( !args->buf.recs )
+            write_record(args, &args->files->readers[0].buffer[0]);
+        else
+            buffered_filters(args, &args->files->readers[0].buffer[0]);
+        PROFILE_LAP(PROF_WRITE, prof);      // includes SnpGap and IndelGap filtering
     }
     buffered_filters(args, NULL);
 
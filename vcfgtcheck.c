@@ -33,21 +33,71 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <math.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
+#include "gtcache.h"
+
+// Cross-check: sites are buffered in batches and the pairwise triangle is
+// processed in tiles of GTC_TILE x GTC_TILE samples, each tile running
+// through all buffered sites while its counters stay in the cache
+#define GTC_TILE    64
+#define GTC_NSITES  256
+#define GTC_MAXBUF  (1<<24)     // maximum number of buffered PL values
+#define GTC_BIG     0x3fffffff  // PL padding past vector_end or missing values
+
+typedef struct
+{
+    int rid, pos, npl, has_gaps;
+    size_t ipl, igap;       // offsets to gtc_batch_t.pl and .gaps
+}
+gtc_site_t;
+
+typedef struct
+{
+    int nsmpl, nsites, ntiles, itile_next;
+    gtc_site_t sites[GTC_NSITES];
+    int32_t *pl;            // PLs of a site transposed, pl[ipl + k*nsmpl + ismpl]
+    int32_t *dp;            // dp[isite*nsmpl + ismpl]
+    uint8_t *usable;        // same layout as dp, PL, DP and -H filters passed
+    int *gaps;              // PL vector end and first missing value, only for sites with incomplete PLs
+    size_t npl, mpl, ngaps, mgaps;
+
+    // the workers are started once and woken up for each batch
+    int job, quit, ntiles_done;     // job is incremented for each batch
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+}
+gtc_batch_t;
 
 typedef struct
+{
+    struct _args_t *args;
+    pthread_t tid;
+    uint64_t *dp, *ndp;                 // per-sample depth sums of the worker
+    double site_sum[GTC_NSITES];        // -a output
+    int site_n[GTC_NSITES];
+    int tmp[GTC_TILE];
+}
+gtc_worker_t;
+
+typedef struct _args_t
 {
 	bcf_srs_t *files;           // first reader is the query VCF - single sample normally or multi-sample for cross-check
     bcf_hdr_t *gt_hdr, *sm_hdr; // VCF with genotypes to compare against and the query VCF
     int ntmp_arr, npl_arr;
     int32_t *tmp_arr, *pl_arr;
     double *lks, *sites;
-    int *cnts, *dps, hom_only, cross_check, all_sites;
+    uint64_t *cnts, *dps;
+    int hom_only, cross_check, all_sites, nthreads, ignore_dp;
 	char *cwd, **argv, *gt_fname, *plot, *query_sample, *target_sample;
 	int argc, no_PLs;
+    gtc_batch_t batch;
+    char *cache_fname;
+    gtcache_t *cache;
 }
 args_t;
 
@@ -223,17 +273,17 @@ static void init_data(args_t *args)
         int nsamples = bcf_hdr_nsamples(args->gt_hdr);
         if ( !nsamples ) error("No samples in %s?\n", args->files->readers[1].fname);
         args->lks   = (double*) calloc(nsamples,sizeof(double));
-        args->cnts  = (int*) calloc(nsamples,sizeof(int));
+        args->cnts  = (uint64_t*) calloc(nsamples,sizeof(uint64_t));
         args->sites = (double*) calloc(nsamples,sizeof(double));
-        args->dps   = (int*) calloc(nsamples,sizeof(int));
+        args->dps   = (uint64_t*) calloc(nsamples,sizeof(uint64_t));
     }
     else
     {
         int nsamples = bcf_hdr_nsamples(args->sm_hdr);
-        int narr = (nsamples-1)*nsamples/2;
+        size_t narr = (size_t)(nsamples-1)*nsamples/2;
         args->lks  = (double*) calloc(narr,sizeof(double));
-        args->cnts = (int*) calloc(narr,sizeof(int));
-        args->dps  = (int*) calloc(narr,sizeof(int));
+        args->cnts = (uint64_t*) calloc(narr,sizeof(uint64_t));
+        args->dps  = (uint64_t*) calloc(narr,sizeof(uint64_t));
     }
 }
 
@@ -514,13 +564,220 @@ static inline int is_hom_most_likely(int nals, int *pls)
     return min_is_hom;
 }
 
+// Buffer PLs and DPs of the current site for cross_check_tile()
+static void cross_check_add_site(args_t *args, int rid, int pos, int npl, int32_t *dp_arr, int *is_hom)
+{
+    gtc_batch_t *b = &args->batch;
+    gtc_site_t *site = &b->sites[b->nsites];
+    int i, k, n = b->nsmpl;
+    site->rid = rid;
+    site->pos = pos;
+    site->npl = npl;
+    site->ipl = b->npl;
+    site->has_gaps = 0;
+    b->npl += (size_t)npl*n;
+    hts_expand(int32_t, b->npl, b->mpl, b->pl);
+
+    int32_t *dst = b->pl + site->ipl;
+    int32_t *dp  = b->dp + (size_t)b->nsites*n;
+    uint8_t *usable = b->usable + (size_t)b->nsites*n;
+    for (i=0; i<n; i++)
+    {
+        int *ipl = &args->pl_arr[i*npl];
+        usable[i] = 1;
+        if ( *ipl==-1 ) usable[i] = 0;      // missing genotype
+        if ( !args->ignore_dp && (dp_arr[i]==bcf_int32_missing || !dp_arr[i]) ) usable[i] = 0;
+        if ( args->hom_only && !is_hom[i] ) usable[i] = 0;
+        dp[i] = args->ignore_dp ? 1 : dp_arr[i];
+
+        // The PL comparison stops at the first vector_end or missing value. The
+        // values from there on are padded so that they never win the minimum,
+        // incomplete vectors are remembered to resolve the missing values later
+        int end = npl, miss = INT_MAX;
+        for (k=0; k<npl; k++)
+        {
+            if ( ipl[k]==bcf_int32_missing ) { end = miss = k; break; }
+            if ( ipl[k]==bcf_int32_vector_end ) { end = k; break; }
+        }
+        for (k=0; k<end; k++) dst[k*n+i] = ipl[k];
+        for (; k<npl; k++) dst[k*n+i] = GTC_BIG;
+        if ( end==npl ) continue;
+        if ( !site->has_gaps )
+        {
+            site->has_gaps = 1;
+            site->igap = b->ngaps;
+            b->ngaps += 2*n;
+            hts_expand(int, b->ngaps, b->mgaps, b->gaps);
+            int *gaps = b->gaps + site->igap;
+            for (k=0; k<n; k++) { gaps[2*k] = npl; gaps[2*k+1] = INT_MAX; }
+        }
+        b->gaps[site->igap + 2*i]   = end;
+        b->gaps[site->igap + 2*i+1] = miss;
+    }
+    b->nsites++;
+}
+
+static void cross_check_tile(args_t *args, gtc_worker_t *w, int itile)
+{
+    gtc_batch_t *b = &args->batch;
+    int n = b->nsmpl;
+
+    // tiles are numbered row by row in the lower triangle
+    int bi = 0, bj = itile;
+    while ( bj > bi ) { bj -= bi+1; bi++; }
+    int i, j, k, isite;
+    int i0 = bi*GTC_TILE, i1 = i0+GTC_TILE < n ? i0+GTC_TILE : n;
+    int j0 = bj*GTC_TILE, j1 = j0+GTC_TILE < n ? j0+GTC_TILE : n;
+
+    for (isite=0; isite<b->nsites; isite++)
+    {
+        gtc_site_t *site = &b->sites[isite];
+        int32_t *pl = b->pl + site->ipl;
+        int32_t *dp = b->dp + (size_t)isite*n;
+        uint8_t *usable = b->usable + (size_t)isite*n;
+        int *gaps = site->has_gaps ? b->gaps + site->igap : NULL;
+        for (i=i0; i<i1; i++)
+        {
+            if ( !usable[i] ) continue;
+            int nj = (bi==bj ? i : j1) - j0;
+            if ( nj<=0 ) continue;
+
+            // min(ipl[k]+jpl[k]) for all j of the tile at once
+            int *min_pl = w->tmp;
+            for (j=0; j<nj; j++) min_pl[j] = INT_MAX;
+            for (k=0; k<site->npl; k++)
+            {
+                int32_t ipl = pl[k*n+i], *jpl = pl + k*n + j0;
+                for (j=0; j<nj; j++)
+                {
+                    int32_t val = ipl + jpl[j];
+                    min_pl[j] = val < min_pl[j] ? val : min_pl[j];
+                }
+            }
+
+            uint64_t *dps = args->dps + (size_t)i*(i-1)/2 + j0;
+            uint64_t *cnts = args->cnts + (size_t)i*(i-1)/2 + j0;
+            double *lks = args->lks + (size_t)i*(i-1)/2 + j0;
+            for (j=0; j<nj; j++)
+            {
+                if ( !usable[j0+j] ) continue;
+                if ( gaps )
+                {
+                    // the pair is skipped if a missing value comes before the other's vector_end
+                    int *igap = gaps + 2*i, *jgap = gaps + 2*(j0+j);
+                    if ( igap[1]<=jgap[0] || jgap[1]<=igap[0] ) continue;
+                }
+                int val = min_pl[j] >= GTC_BIG ? INT_MAX : min_pl[j];
+                w->site_sum[isite] += val;
+                w->site_n[isite]++;
+                lks[j] += val;
+                cnts[j]++;
+                dps[j] += dp[i] < dp[j0+j] ? dp[i] : dp[j0+j];
+                w->dp[i] += dp[i]; w->ndp[i]++;
+                w->dp[j0+j] += dp[j0+j]; w->ndp[j0+j]++;
+            }
+        }
+    }
+}
+
+static void *cross_check_worker(void *data)
+{
+    gtc_worker_t *w = (gtc_worker_t*) data;
+    gtc_batch_t *b = &w->args->batch;
+    int job = 0;
+    pthread_mutex_lock(&b->lock);
+    while (1)
+    {
+        while ( b->job==job && !b->quit ) pthread_cond_wait(&b->work, &b->lock);
+        if ( b->quit ) break;
+        job = b->job;
+        while ( b->itile_next < b->ntiles )
+        {
+            int itile = b->itile_next++;
+            pthread_mutex_unlock(&b->lock);
+            cross_check_tile(w->args, w, itile);
+            pthread_mutex_lock(&b->lock);
+            if ( ++b->ntiles_done == b->ntiles ) pthread_cond_signal(&b->done);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static void cross_check_start(args_t *args, gtc_worker_t *workers)
+{
+    gtc_batch_t *b = &args->batch;
+    int i;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->work, NULL);
+    pthread_cond_init(&b->done, NULL);
+    for (i=0; i<args->nthreads; i++)
+        if ( pthread_create(&workers[i].tid, NULL, cross_check_worker, &workers[i]) ) error("Failed to create a thread\n");
+}
+
+static void cross_check_stop(args_t *args, gtc_worker_t *workers)
+{
+    gtc_batch_t *b = &args->batch;
+    int i;
+    pthread_mutex_lock(&b->lock);
+    b->quit = 1;
+    pthread_cond_broadcast(&b->work);
+    pthread_mutex_unlock(&b->lock);
+    for (i=0; i<args->nthreads; i++) pthread_join(workers[i].tid, NULL);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->work);
+    pthread_cond_destroy(&b->done);
+}
+
+// Process the buffered sites. Each pair is updated by a single tile, in the
+// order of sites, so the output does not depend on the number of threads.
+static void cross_check_flush(args_t *args, gtc_worker_t *workers, FILE *fp)
+{
+    gtc_batch_t *b = &args->batch;
+    if ( !b->nsites ) return;
+    int i, j, nblocks = (b->nsmpl + GTC_TILE - 1) / GTC_TILE;
+    if ( args->nthreads )
+    {
+        pthread_mutex_lock(&b->lock);
+        b->ntiles = nblocks*(nblocks+1)/2;
+        b->itile_next = 0;
+        b->ntiles_done = 0;
+        b->job++;
+        pthread_cond_broadcast(&b->work);
+        while ( b->ntiles_done < b->ntiles ) pthread_cond_wait(&b->done, &b->lock);
+        pthread_mutex_unlock(&b->lock);
+    }
+    else
+    {
+        b->ntiles = nblocks*(nblocks+1)/2;
+        for (i=0; i<b->ntiles; i++) cross_check_tile(args, &workers[0], i);
+    }
+
+    int nw = args->nthreads ? args->nthreads : 1;
+    for (i=0; i<b->nsites; i++)
+    {
+        double sum = 0; int nsum = 0;
+        for (j=0; j<nw; j++)
+        {
+            sum  += workers[j].site_sum[i];
+            nsum += workers[j].site_n[i];
+            workers[j].site_sum[i] = 0;
+            workers[j].site_n[i] = 0;
+        }
+        if ( args->all_sites ) 
+            fprintf(fp,"SD\t%s\t%d\t%d\t%.0f\n", args->sm_hdr->id[BCF_DT_CTG][b->sites[i].rid].key, b->sites[i].pos+1, nsum, nsum?sum/nsum:0);
+    }
+    b->nsites = 0;
+    b->npl = b->ngaps = 0;
+}
+
 static void cross_check_gts(args_t *args)
 {
     int nsamples = bcf_hdr_nsamples(args->sm_hdr), ndp_arr = 0;
-    unsigned int *dp = (unsigned int*) calloc(nsamples,sizeof(unsigned int)), *ndp = (unsigned int*) calloc(nsamples,sizeof(unsigned int)); // this will overflow one day...
-    int fake_pls = args->no_PLs, ignore_dp = 0;
+    uint64_t *dp = (uint64_t*) calloc(nsamples,sizeof(uint64_t)), *ndp = (uint64_t*) calloc(nsamples,sizeof(uint64_t));
+    int fake_pls = args->no_PLs;
 
-    int i,j,k,idx, pl_warned = 0, dp_warned = 0;
+    int i,j,idx, pl_warned = 0, dp_warned = 0;
     int32_t *dp_arr = NULL;
     int *is_hom = args->hom_only ? (int*) malloc(sizeof(int)*nsamples) : NULL;
     if ( bcf_hdr_id2int(args->sm_hdr, BCF_DT_ID, "PL")<0 ) 
@@ -530,13 +787,27 @@ static void cross_check_gts(args_t *args)
         fprintf(stderr,"Warning: PL not present in the header of %s, using GT instead\n", args->files->readers[0].fname);
         fake_pls = 1;
     }
-    if ( bcf_hdr_id2int(args->sm_hdr, BCF_DT_ID, "DP")<0 ) ignore_dp = 1;
+    if ( bcf_hdr_id2int(args->sm_hdr, BCF_DT_ID, "DP")<0 ) args->ignore_dp = 1;
+
+    gtc_batch_t *batch = &args->batch;
+    batch->nsmpl  = nsamples;
+    batch->dp     = (int32_t*) malloc(sizeof(int32_t)*nsamples*GTC_NSITES);
+    batch->usable = (uint8_t*) malloc(sizeof(uint8_t)*nsamples*GTC_NSITES);
+    int nworkers = args->nthreads ? args->nthreads : 1;
+    gtc_worker_t *workers = (gtc_worker_t*) calloc(nworkers, sizeof(gtc_worker_t));
+    for (i=0; i<nworkers; i++)
+    {
+        workers[i].args = args;
+        workers[i].dp   = (uint64_t*) calloc(nsamples,sizeof(uint64_t));
+        workers[i].ndp  = (uint64_t*) calloc(nsamples,sizeof(uint64_t));
+    }
+    cross_check_start(args, workers);
 
     FILE *fp = args->plot ? open_file(NULL, "w", "%s.tab", args->plot) : stdout;
     print_header(args, fp);
     if ( args->all_sites ) fprintf(fp,"# [1]SD, Average Site Discordance\t[2]Chromosome\t[3]Position\t[4]Number of available pairs\t[5]Average discordance\n");
 
-    while ( bcf_sr_next_line(args->files) )
+    while ( !args->cache && bcf_sr_next_line(args->files) )
     {
         bcf1_t *line = args->files->readers[0].buffer[0];
         bcf_unpack(line, BCF_UN_FMT);
@@ -550,7 +821,7 @@ static void cross_check_gts(args_t *args)
         }
         else
             npl = fake_PLs(args, args->sm_hdr, line);
-        if ( !ignore_dp && bcf_get_format_int32(args->sm_hdr, line, "DP", &dp_arr, &ndp_arr) <= 0 ) { dp_warned++; continue; }
+        if ( !args->ignore_dp && bcf_get_format_int32(args->sm_hdr, line, "DP", &dp_arr, &ndp_arr) <= 0 ) { dp_warned++; continue; }
 
         if ( args->hom_only )
         {
@@ -558,53 +829,73 @@ static void cross_check_gts(args_t *args)
                 is_hom[i] = is_hom_most_likely(line->n_allele, args->pl_arr+i*npl);
         }
 
-        double sum = 0; int nsum = 0;
-        idx = 0;
-        for (i=0; i<nsamples; i++)
+        if ( batch->nsites==GTC_NSITES || batch->npl + (size_t)npl*nsamples > GTC_MAXBUF ) cross_check_flush(args, workers, fp);
+        cross_check_add_site(args, line->rid, line->pos, npl, dp_arr, is_hom);
+    }
+    for (i=0; args->cache && i<args->cache->nseq; i++)
+    {
+        // the same as above, only the sites come from the genotype cache
+        gtcache_t *cache = args->cache;
+        gtcache_seq_t *seq = &cache->seq[i];
+        if ( seq->rid<0 ) error("The sequence %s from the genotype cache is not in the VCF header\n", seq->name);
+        int npl = 3;
+        uint64_t isite;
+        hts_expand(int32_t, npl*nsamples, args->npl_arr, args->pl_arr);
+        hts_expand(int32_t, nsamples, ndp_arr, dp_arr);
+        for (isite=seq->beg; isite<seq->beg+seq->n; isite++)
         {
-            int *ipl = &args->pl_arr[i*npl];
-            if ( *ipl==-1 ) { idx += i; continue; } // missing genotype
-            if ( !ignore_dp && (dp_arr[i]==bcf_int32_missing || !dp_arr[i]) ) { idx += i; continue; }
-            if ( args->hom_only && !is_hom[i] ) { idx += i; continue; }
-
-            for (j=0; j<i; j++)
+            const gtcache_rec_t *rec = gtcache_rec(cache, isite);
+            if ( !fake_pls )
             {
-                int *jpl = &args->pl_arr[j*npl];
-                if ( *jpl==-1 ) { idx++; continue; } // missing genotype
-                if ( !ignore_dp && (dp_arr[j]==bcf_int32_missing || !dp_arr[j]) ) { idx++; continue; }
-                if ( args->hom_only && !is_hom[j] ) { idx++; continue; }
-
-                int min_pl = INT_MAX;
-                for (k=0; k<npl; k++)
-                {
-                    if ( ipl[k]==bcf_int32_missing || jpl[k]==bcf_int32_missing ) break;
-                    if ( ipl[k]==bcf_int32_vector_end || jpl[k]==bcf_int32_vector_end ) { k = npl; break; }
-                    if ( min_pl > ipl[k]+jpl[k] ) min_pl = ipl[k]+jpl[k];
-                }
-                if ( k!=npl ) { idx++; continue; }
-
-                if ( args->all_sites ) { sum += min_pl; nsum++; }
-                args->lks[idx] += min_pl;
-                args->cnts[idx]++;
-
-                if ( !ignore_dp )
-                {
-                    args->dps[idx] += dp_arr[i] < dp_arr[j] ? dp_arr[i] : dp_arr[j];
-                    dp[i] += dp_arr[i]; ndp[i]++;
-                    dp[j] += dp_arr[j]; ndp[j]++;
-                }
-                else
+                if ( !(rec->flags & GTCREC_PL) ) { pl_warned++; continue; }
+                const uint8_t *pl = gtcache_pl(cache, rec);
+                for (j=0; j<npl*nsamples; j++) args->pl_arr[j] = pl[j]==GTCACHE_PL_MISSING ? bcf_int32_missing : pl[j];
+            }
+            else
+            {
+                if ( !(rec->flags & GTCREC_GT) ) error("GT not present at %s:%d?\n", seq->name, rec->pos+1);
+                int fake_PL = args->no_PLs ? args->no_PLs : 99;
+                for (j=0; j<nsamples; j++)
                 {
-                    args->dps[idx]++;
-                    dp[i]++; ndp[i]++;
-                    dp[j]++; ndp[j]++;
+                    int k, gt = gtcache_gt(cache, rec, j);
+                    for (k=0; k<npl; k++) args->pl_arr[j*npl+k] = gt==GTCACHE_GT_MISSING ? -1 : fake_PL;
+                    if ( gt!=GTCACHE_GT_MISSING ) args->pl_arr[j*npl+gt] = 0;
                 }
-                idx++;
             }
+            if ( !args->ignore_dp )
+            {
+                if ( !(rec->flags & GTCREC_DP) ) { dp_warned++; continue; }
+                const uint16_t *dp = gtcache_dp(cache, rec);
+                for (j=0; j<nsamples; j++) dp_arr[j] = dp[j];
+            }
+            if ( args->hom_only )
+            {
+                for (j=0; j<nsamples; j++)
+                    is_hom[j] = is_hom_most_likely(2, args->pl_arr+j*npl);
+            }
+            if ( batch->nsites==GTC_NSITES || batch->npl + (size_t)npl*nsamples > GTC_MAXBUF ) cross_check_flush(args, workers, fp);
+            cross_check_add_site(args, seq->rid, rec->pos, npl, dp_arr, is_hom);
         }
-        if ( args->all_sites ) 
-            fprintf(fp,"SD\t%s\t%d\t%d\t%.0f\n", args->sm_hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1, nsum, nsum?sum/nsum:0);
     }
+    cross_check_flush(args, workers, fp);
+    cross_check_stop(args, workers);
+
+    for (i=0; i<nworkers; i++)
+    {
+        for (j=0; j<nsamples; j++)
+        {
+            dp[j]  += workers[i].dp[j];
+            ndp[j] += workers[i].ndp[j];
+        }
+        free(workers[i].dp);
+        free(workers[i].ndp);
+    }
+    free(workers);
+    free(batch->pl);
+    free(batch->dp);
+    free(batch->usable);
+    free(batch->gaps);
+
     if ( dp_arr ) free(dp_arr);
     if ( args->pl_arr ) free(args->pl_arr);
     if ( args->tmp_arr ) free(args->tmp_arr);
@@ -659,7 +950,7 @@ static void cross_check_gts(args_t *args)
     {
         for (j=0; j<i; j++)
         {
-            fprintf(fp, "CN\t%.0f\t%d\t%.2f\t%s\t%s\n", args->lks[idx], args->cnts[idx], args->cnts[idx]?(double)args->dps[idx]/args->cnts[idx]:0.0, 
+            fprintf(fp, "CN\t%.0f\t%"PRIu64"\t%.2f\t%s\t%s\n", args->lks[idx], args->cnts[idx], args->cnts[idx]?(double)args->dps[idx]/args->cnts[idx]:0.0, 
                     args->sm_hdr->samples[i],args->sm_hdr->samples[j]);
             idx++;
         }
@@ -695,6 +986,8 @@ static void usage(void)
 	fprintf(stderr, "    -S, --target-sample <string>    target sample in the -g file (used only for plotting)\n");
     fprintf(stderr, "    -t, --targets <region>          similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --cache <file>              read genotypes from <file>, create it from the VCF if it does not exist\n");
+    fprintf(stderr, "        --threads <int>             number of worker threads in the cross-check mode [0]\n");
 	fprintf(stderr, "\n");
 	exit(1);
 }
@@ -702,6 +995,7 @@ static void usage(void)
 int main_vcfgtcheck(int argc, char *argv[])
 {
 	int c;
+    char *tmp;
 	args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->files  = bcf_sr_init();
 	args->argc   = argc; args->argv = argv; set_cwd(args);
@@ -718,6 +1012,8 @@ int main_vcfgtcheck(int argc, char *argv[])
 		{"plot",1,0,'p'},
 		{"target-sample",1,0,'S'},
 		{"query-sample",1,0,'s'},
+        {"threads",1,0,1},
+        {"cache",1,0,2},
         {"regions",1,0,'r'},
         {"regions-file",1,0,'R'},
         {"targets",1,0,'t'},
@@ -733,6 +1029,11 @@ int main_vcfgtcheck(int argc, char *argv[])
 			case 'p': args->plot = optarg; break;
 			case 'S': args->target_sample = optarg; break;
 			case 's': args->query_sample = optarg; break;
+            case  1 : 
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nthreads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
+            case  2 : args->cache_fname = optarg; break;
             case 'r': regions = optarg; break;
             case 'R': regions = optarg; regions_is_file = 1; break;
             case 't': targets = optarg; break;
@@ -752,11 +1053,24 @@ int main_vcfgtcheck(int argc, char *argv[])
     args->files->collapse = COLLAPSE_SNPS|COLLAPSE_INDELS;
     if ( args->plot ) args->plot = init_prefix(args->plot);
     init_data(args);
+    if ( args->cache_fname )
+    {
+        if ( !args->cross_check ) error("The --cache option can be used only in the cross-check mode\n");
+        if ( !(args->cache = gtcache_open(args->cache_fname, args->files->readers[0].fname, args->sm_hdr)) )
+        {
+            uint64_t nsites = gtcache_build(args->cache_fname, args->files);
+            fprintf(stderr,"Created the genotype cache %s with %"PRIu64" sites\n", args->cache_fname, nsites);
+            args->cache = gtcache_open(args->cache_fname, args->files->readers[0].fname, args->sm_hdr);
+        }
+        else if ( regions || targets ) 
+            error("The -r/-t options are applied when the cache is created, remove them or the cache %s\n", args->cache_fname);
+    }
     if ( args->cross_check )
         cross_check_gts(args);
     else
         check_gt(args);
     destroy_data(args);
+    if ( args->cache ) gtcache_destroy(args->cache);
 	bcf_sr_destroy(args->files);
     if (args->plot) free(args->plot);
 	free(args);
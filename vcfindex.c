@@ -25,61 +25,243 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/tbx.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
 #include <sys/stat.h>
+#include "bcftools.h"
+#include "statsidx.h"
 
-static void usage(void)
+/*
+    Multi-threaded CSI indexing of a single BCF. The file is processed in rounds,
+    each thread finds the first BGZF block starting in its share of the round
+    and inflates all blocks which start there. The main thread then walks the
+    records in order and pushes them to the index exactly as bcf_index() does,
+    so min_shift is honoured and the result is identical to the serial build.
+*/
+
+#define BGZF_HDR_LEN    18
+#define IDX_CHUNK_SIZE  (4<<20)     // compressed bytes per thread and round
+
+typedef struct
 {
-    fprintf(stderr, "\n");
-    fprintf(stderr, "About:   Index bgzip compressed VCF/BCF files for random access.\n");
-    fprintf(stderr, "Usage:   bcftools index [options] <in.bcf>|<in.vcf.gz>\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "    -f, --force           overwrite index if it already exists\n");
-    fprintf(stderr, "    -m, --min-shift INT   set the minimal interval size to 1<<INT [14]\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Notes: The old tabix (.tbi) index can be invoked by setting -m0.\n");
-    fprintf(stderr, "       Otherwise the new coordinate-sorted (.csi) index is created.\n");
-    fprintf(stderr, "\n");
-    exit(1);
+    int64_t addr, next;     // compressed offsets of the block and of the one after it
+    size_t boff, len;       // offset and length of the uncompressed data in the buffer
+    uint8_t *data;
 }
+idx_block_t;
 
-int main_vcfindex(int argc, char *argv[])
+typedef struct
 {
-    int c, min_shift = 14, force = 0;
+    const char *fname;
+    int fd, scan;           // scan: beg is not known to be a block boundary
+    int64_t beg, end, fsize;
+    int64_t first, next;    // the first block started at or after beg and the block after the last one inflated
+    idx_block_t *blocks;
+    int nblocks, mblocks, ret;
+}
+idx_chunk_t;
 
-    static struct option loptions[] = 
+static inline uint32_t idx_u32(const uint8_t *x)
+{
+    return (uint32_t)x[0] | (uint32_t)x[1]<<8 | (uint32_t)x[2]<<16 | (uint32_t)x[3]<<24;
+}
+
+static inline int is_bgzf_header(const uint8_t *h)
+{
+    return h[0]==31 && h[1]==139 && h[2]==8 && (h[3]&4) && h[10]==6 && h[11]==0
+        && h[12]=='B' && h[13]=='C' && h[14]==2 && h[15]==0;
+}
+
+// The first block starting at or after pos, accepted only if another block
+// or the end of the file follows where the block ends
+static int64_t find_block(idx_chunk_t *c, int64_t pos)
+{
+    uint8_t *buf = (uint8_t*) malloc(BGZF_MAX_BLOCK_SIZE + BGZF_HDR_LEN), hdr[BGZF_HDR_LEN];
+    ssize_t i, n = pread(c->fd, buf, BGZF_MAX_BLOCK_SIZE + BGZF_HDR_LEN, pos);
+    int64_t ret = n<0 ? -1 : (pos + n >= c->fsize ? c->fsize : -1);
+    for (i=0; i+BGZF_HDR_LEN<=n; i++)
     {
-        {"help",0,0,'h'},
-        {"force",0,0,'f'},
-        {"min-shift",1,0,'m'},
-        {0,0,0,0}
-    };
+        if ( !is_bgzf_header(buf+i) ) continue;
+        int64_t next = pos + i + (buf[i+16] | buf[i+17]<<8) + 1;
+        if ( next > c->fsize ) continue;
+        if ( next < c->fsize && (pread(c->fd, hdr, BGZF_HDR_LEN, next)!=BGZF_HDR_LEN || !is_bgzf_header(hdr)) ) continue;
+        ret = pos + i;
+        break;
+    }
+    free(buf);
+    return ret;
+}
 
-    while ((c = getopt_long(argc, argv, "h?fm:", loptions,NULL)) >= 0)
+static void *index_chunk(void *arg)
+{
+    idx_chunk_t *c = (idx_chunk_t*) arg;
+    c->ret = -1;
+    c->nblocks = 0;
+    c->first = c->scan ? find_block(c, c->beg) : c->beg;
+    if ( c->first < 0 ) return NULL;
+    c->next = c->first;
+    if ( c->next >= c->end ) { c->ret = 0; return NULL; }
+
+    BGZF *fp = bgzf_open(c->fname, "r");
+    if ( !fp ) return NULL;
+    if ( bgzf_seek(fp, c->first<<16, SEEK_SET) < 0 ) { bgzf_close(fp); return NULL; }
+    while ( c->next < c->end )
     {
-        switch (c) 
+        if ( bgzf_read_block(fp) < 0 || fp->block_address!=c->next ) break;
+        const uint8_t *h = (const uint8_t*) fp->compressed_block;
+        int64_t next = c->next + (h[16] | h[17]<<8) + 1;
+        if ( fp->block_length )
         {
-            case 'f': force = 1; break;
-            case 'm': min_shift = atoi(optarg); break;
-            default: usage();
+            hts_expand(idx_block_t, c->nblocks+1, c->mblocks, c->blocks);
+            idx_block_t *blk = &c->blocks[c->nblocks++];
+            blk->addr = c->next;
+            blk->next = next;
+            blk->len  = fp->block_length;
+            blk->data = (uint8_t*) malloc(blk->len);
+            memcpy(blk->data, fp->uncompressed_block, blk->len);
         }
+        c->next = next;
     }
-    if ( optind==argc ) usage();
-    if (min_shift < 0 || min_shift > 30)
+    if ( c->next >= c->end ) c->ret = 0;
+    bgzf_close(fp);
+    return NULL;
+}
+
+/**
+ *  bcf_index_build_mt() - build the CSI index of a BCF with nthreads threads
+ *  Returns 0 on success, -1 on error and -2 if the block boundaries could not
+ *  be established, in which case the serial bcf_index_build() should be used.
+ */
+static int bcf_index_build_mt(const char *fname, int min_shift, int nthreads)
+{
+    htsFile *fp = hts_open(fname, "rb");
+    if ( !fp ) return -1;
+    bcf_hdr_t *hdr = fp->fp.bgzf->is_compressed ? bcf_hdr_read(fp) : NULL;
+    int64_t hdr_end = bgzf_tell(fp->fp.bgzf);
+    hts_close(fp);
+    if ( !hdr ) return -1;
+
+    // the same binning as in bcf_index()
+    int i, j, nids = 0, n_lvls;
+    int64_t max_len = 0, s;
+    for (i=0; i<hdr->n[BCF_DT_CTG]; i++)
     {
-        fprintf(stderr, "[E::%s] expected min_shift in range [0,30] (%d)\n", __func__, min_shift);
-        return 1;
+        if ( !hdr->id[BCF_DT_CTG][i].val ) continue;
+        if ( max_len < hdr->id[BCF_DT_CTG][i].val->info[0] ) max_len = hdr->id[BCF_DT_CTG][i].val->info[0];
+        nids++;
     }
+    bcf_hdr_destroy(hdr);
+    if ( !max_len ) max_len = ((int64_t)1<<31) - 1;
+    max_len += 256;
+    for (n_lvls=0, s=1<<min_shift; max_len > s; n_lvls++, s <<= 3);
+
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if ( fd<0 || fstat(fd, &st)!=0 ) { if ( fd>=0 ) close(fd); return -1; }
+
+    hts_idx_t *idx = hts_idx_init(nids, HTS_FMT_CSI, hdr_end, min_shift, n_lvls);
+    idx_chunk_t *chunks = (idx_chunk_t*) calloc(nthreads, sizeof(idx_chunk_t));
+    pthread_t *tids = (pthread_t*) malloc(nthreads*sizeof(pthread_t));
+    idx_block_t *pend = NULL;   // the blocks with data in buf
+    int npend = 0, mpend = 0, ipend = 0, ret = 0;
+    kstring_t buf = {0,0,0};
+    size_t p = hdr_end & 0xffff;
+    int64_t wbeg = hdr_end >> 16;
 
-    char *fname = argv[optind];
+    while ( wbeg < st.st_size && !ret )
+    {
+        int nchunks = 0;
+        for (i=0; i<nthreads; i++)
+        {
+            idx_chunk_t *c = &chunks[i];
+            c->fname = fname;
+            c->fd    = fd;
+            c->fsize = st.st_size;
+            c->scan  = i>0;
+            c->beg   = wbeg + (int64_t)i*IDX_CHUNK_SIZE;
+            c->end   = c->beg + IDX_CHUNK_SIZE;
+            if ( c->beg >= st.st_size ) break;
+            if ( c->end > st.st_size ) c->end = st.st_size;
+            if ( pthread_create(&tids[i], NULL, index_chunk, c) ) error("Could not create a thread\n");
+            nchunks++;
+        }
+        for (i=0; i<nchunks; i++) pthread_join(tids[i], NULL);
+
+        for (i=0; i<nchunks; i++)
+        {
+            idx_chunk_t *c = &chunks[i];
+            if ( c->ret<0 || (i && c->first!=chunks[i-1].next) ) ret = -2;
+            for (j=0; j<c->nblocks; j++)
+            {
+                idx_block_t *blk = &c->blocks[j];
+                if ( !ret )
+                {
+                    hts_expand(idx_block_t, npend+1, mpend, pend);
+                    pend[npend] = *blk;
+                    pend[npend].boff = buf.l;
+                    pend[npend].data = NULL;
+                    npend++;
+                    kputsn((char*)blk->data, blk->len, &buf);
+                }
+                free(blk->data);
+            }
+            c->nblocks = 0;
+        }
+        if ( ret ) break;
+        wbeg = chunks[nchunks-1].next;
+
+        // records complete in the buffer, the offsets are those bgzf_tell() gives after reading them
+        while ( buf.l - p >= 32 )
+        {
+            const uint8_t *x = (const uint8_t*) buf.s + p;
+            size_t e = p + 8 + (size_t)idx_u32(x) + idx_u32(x+4);
+            if ( e > buf.l ) break;
+            int32_t rid = idx_u32(x+8), pos = idx_u32(x+12), rlen = idx_u32(x+16);
+            while ( pend[ipend].boff + pend[ipend].len < e ) ipend++;
+            idx_block_t *blk = &pend[ipend];
+            uint64_t off = e==blk->boff+blk->len ? (uint64_t)blk->next<<16 : (uint64_t)blk->addr<<16 | (e - blk->boff);
+            if ( hts_idx_push(idx, rid, pos, pos+rlen, off, 1) < 0 ) { ret = -1; break; }
+            p = e;
+        }
+
+        // keep only the unfinished record
+        for (i=0; i<npend && pend[i].boff + pend[i].len <= p; i++);
+        memmove(pend, pend+i, (npend-i)*sizeof(idx_block_t));
+        npend -= i;
+        for (i=0; i<npend; i++) pend[i].boff -= p;
+        memmove(buf.s, buf.s+p, buf.l-p);
+        buf.l -= p;
+        p = ipend = 0;
+    }
+    if ( !ret && buf.l ) ret = -1;     // truncated record
+    if ( !ret )
+    {
+        hts_idx_finish(idx, (uint64_t)wbeg<<16);
+        hts_idx_save(idx, fname, HTS_FMT_CSI);
+    }
+    hts_idx_destroy(idx);
+    close(fd);
+    for (i=0; i<nthreads; i++) free(chunks[i].blocks);
+    free(chunks);
+    free(tids);
+    free(pend);
+    free(buf.s);
+    return ret;
+}
+
+static int index_file(const char *fname, int min_shift, int force, int nthreads, int sidecar)
+{
     int ftype = hts_file_type(fname);
     if (!ftype)
     {
-        fprintf(stderr, "[E::%s] unknown filetype; expected .vcf.gz or .bcf\n", __func__);
+        fprintf(stderr, "[E::%s] unknown filetype; expected .vcf.gz or .bcf: %s\n", __func__, fname);
         return 1;
     }
 
@@ -94,7 +276,7 @@ int main_vcfindex(int argc, char *argv[])
             stat(fname, &stat_file);
             if ( stat_file.st_mtime <= stat_tbi.st_mtime )
             {
-                fprintf(stderr,"[E::%s] the index file exists. Please use '-f' to overwrite.\n", __func__);
+                fprintf(stderr,"[E::%s] the index file exists. Please use '-f' to overwrite: %s\n", __func__, fname);
                 return 1;
             }
         }
@@ -102,19 +284,166 @@ int main_vcfindex(int argc, char *argv[])
 
     if (ftype == FT_BCF_GZ)
     {
-        if ( bcf_index_build(fname, min_shift) != 0 ) 
+        int ret = -2;
+        if ( nthreads > 1 && min_shift > 0 )
+        {
+            ret = bcf_index_build_mt(fname, min_shift, nthreads);
+            if ( ret==-2 ) fprintf(stderr,"[W::%s] could not split %s into BGZF blocks, indexing on a single thread\n", __func__, fname);
+        }
+        if ( ret==-2 ) ret = bcf_index_build(fname, min_shift);
+        if ( ret != 0 )
         {
-            fprintf(stderr,"[E::%s] bcf_index_build failed: Is the BCF compressed?\n", __func__);
+            fprintf(stderr,"[E::%s] bcf_index_build failed: Is the BCF compressed? %s\n", __func__, fname);
             return 1;
         }        
+        if ( sidecar && statsidx_build(fname, min_shift > 0 ? min_shift : 14) != 0 )
+        {
+            fprintf(stderr,"[E::%s] failed to write the stats sidecar of %s\n", __func__, fname);
+            return 1;
+        }
     }
     else if (ftype == FT_VCF_GZ)
     {
+        if ( sidecar )
+        {
+            fprintf(stderr,"[E::%s] the stats sidecar can be created only for BCF files: %s\n", __func__, fname);
+            return 1;
+        }
         if ( tbx_index_build(fname, min_shift, &tbx_conf_vcf) != 0 )
         {
-            fprintf(stderr,"[E::%s] tbx_index_build failed: Is the file bgzip-compressed?\n", __func__);
+            fprintf(stderr,"[E::%s] tbx_index_build failed: Is the file bgzip-compressed? %s\n", __func__, fname);
             return 1;
         }
     }
     return 0;
 }
+
+typedef struct
+{
+    char **fnames;
+    int nfnames, ifname, nfailed, min_shift, force, sidecar;
+    pthread_mutex_t lock;
+}
+batch_t;
+
+static void *index_batch(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+    while (1)
+    {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->ifname++;
+        pthread_mutex_unlock(&batch->lock);
+        if ( i >= batch->nfnames ) break;
+        if ( index_file(batch->fnames[i], batch->min_shift, batch->force, 1, batch->sidecar)==0 ) continue;
+        pthread_mutex_lock(&batch->lock);
+        batch->nfailed++;
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Index bgzip compressed VCF/BCF files for random access.\n");
+    fprintf(stderr, "Usage:   bcftools index [options] <in.bcf>|<in.vcf.gz> [...]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -f, --force           overwrite index if it already exists\n");
+    fprintf(stderr, "    -m, --min-shift INT   set the minimal interval size to 1<<INT [14]\n");
+    fprintf(stderr, "        --file-list FILE  index the files listed in FILE, one per line\n");
+    fprintf(stderr, "        --sidecar         write also summary stats for \"bcftools stats --sidecar\", BCF only\n");
+    fprintf(stderr, "        --threads INT     index multiple files, or a single BCF, on INT threads [1]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Notes: The old tabix (.tbi) index can be invoked by setting -m0.\n");
+    fprintf(stderr, "       Otherwise the new coordinate-sorted (.csi) index is created.\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfindex(int argc, char *argv[])
+{
+    int c, i, min_shift = 14, force = 0, nthreads = 1, sidecar = 0;
+    char *file_list = NULL, *tmp;
+
+    static struct option loptions[] = 
+    {
+        {"help",0,0,'h'},
+        {"force",0,0,'f'},
+        {"min-shift",1,0,'m'},
+        {"file-list",1,0,1},
+        {"threads",1,0,2},
+        {"sidecar",0,0,3},
+        {0,0,0,0}
+    };
+
+    while ((c = getopt_long(argc, argv, "h?fm:", loptions,NULL)) >= 0)
+    {
+        switch (c) 
+        {
+            case 'f': force = 1; break;
+            case 'm': min_shift = atoi(optarg); break;
+            case  1 : file_list = optarg; break;
+            case  2 :
+                nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || nthreads<1 ) error("Could not parse: --threads %s\n", optarg);
+                break;
+            case  3 : sidecar = 1; break;
+            default: usage();
+        }
+    }
+    if ( optind==argc && !file_list ) usage();
+    if (min_shift < 0 || min_shift > 30)
+    {
+        fprintf(stderr, "[E::%s] expected min_shift in range [0,30] (%d)\n", __func__, min_shift);
+        return 1;
+    }
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.min_shift = min_shift;
+    batch.force = force;
+    batch.sidecar = sidecar;
+    if ( file_list )
+    {
+        if ( optind<argc )
+        {
+            fprintf(stderr, "[E::%s] cannot combine --file-list with file names on command line\n", __func__);
+            return 1;
+        }
+        batch.fnames = hts_readlines(file_list, &batch.nfnames);
+        if ( !batch.fnames )
+        {
+            fprintf(stderr, "[E::%s] could not read the file list: %s\n", __func__, file_list);
+            return 1;
+        }
+    }
+    else
+    {
+        batch.nfnames = argc - optind;
+        batch.fnames = (char**) malloc(sizeof(char*)*batch.nfnames);
+        for (i=0; i<batch.nfnames; i++) batch.fnames[i] = strdup(argv[optind+i]);
+    }
+
+    if ( batch.nfnames==1 || nthreads==1 )
+    {
+        for (i=0; i<batch.nfnames; i++)
+            if ( index_file(batch.fnames[i], min_shift, force, nthreads, sidecar)!=0 ) batch.nfailed++;
+    }
+    else
+    {
+        if ( nthreads > batch.nfnames ) nthreads = batch.nfnames;
+        pthread_t *tids = (pthread_t*) malloc(nthreads*sizeof(pthread_t));
+        pthread_mutex_init(&batch.lock, NULL);
+        for (i=0; i<nthreads; i++)
+            if ( pthread_create(&tids[i], NULL, index_batch, &batch) ) error("Could not create a thread\n");
+        for (i=0; i<nthreads; i++) pthread_join(tids[i], NULL);
+        pthread_mutex_destroy(&batch.lock);
+        free(tids);
+    }
+
+    for (i=0; i<batch.nfnames; i++) free(batch.fnames[i]);
+    free(batch.fnames);
+    return batch.nfailed ? 1 : 0;
+}
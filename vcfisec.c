@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
@@ -42,12 +43,46 @@
 #define OP_VENN 4
 #define OP_COMPLEMENT 5
 
+// Which readers have a line at the current position, one bit per reader
+#define MASK_SET(mask,i)   ((mask)[(i)>>6] |= (uint64_t)1<<((i)&63))
+#define MASK_TEST(mask,i)  ((mask)[(i)>>6] & ((uint64_t)1<<((i)&63)))
+
+#define WRITER_BATCH 256    // records buffered per output file before handing over to the pool
+
+/*
+    Asynchronous output: each output file buffers copies of its records and,
+    when the buffer is full, swaps it with a second one which is then written
+    by one of the pool threads. A file has at most one batch in flight, so the
+    records are written in order while the compression of different files
+    runs in parallel with the reading.
+*/
 typedef struct
 {
-    int isec_op, isec_n, *write, iwrite, nwrite, output_type;
+    htsFile *fh;
+    bcf_hdr_t *hdr;
+    bcf1_t **fill, **flush;     // the batch being buffered and the batch being written
+    int nfill, nflush, busy;
+}
+writer_t;
+
+typedef struct
+{
+    writer_t **queue;           // writers with a batch ready, a ring of nwriters slots
+    int nwriters, iqueue, nqueue, done, nthreads;
+    pthread_t *tid;
+    pthread_mutex_t lock;
+    pthread_cond_t job, written;
+}
+writer_pool_t;
+
+typedef struct
+{
+    int isec_op, isec_n, *write, iwrite, nwrite, output_type, nthreads, nmask;
 	bcf_srs_t *files;
     FILE *fh_log, *fh_sites;
-    htsFile **fh_out;
+    writer_t *out;
+    writer_pool_t *pool;
+    uint64_t *mask;
 	char **argv, *prefix, **fnames, *write_files, *targets_list, *regions_list;
 	int argc;
 }
@@ -127,11 +162,128 @@ const char *hts_bcf_wmode(int file_type)
     return "w";                                 // uncompressed VCF
 }
 
+static void *writer_worker(void *arg)
+{
+    writer_pool_t *pool = (writer_pool_t*) arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while ( !pool->nqueue && !pool->done ) pthread_cond_wait(&pool->job, &pool->lock);
+        if ( !pool->nqueue ) break;
+        writer_t *wrt = pool->queue[pool->iqueue];
+        pool->iqueue = (pool->iqueue+1) % pool->nwriters;
+        pool->nqueue--;
+        pthread_mutex_unlock(&pool->lock);
+
+        int i;
+        for (i=0; i<wrt->nflush; i++) bcf_write1(wrt->fh, wrt->hdr, wrt->flush[i]);
+
+        pthread_mutex_lock(&pool->lock);
+        wrt->nflush = 0;
+        wrt->busy = 0;
+        pthread_cond_broadcast(&pool->written);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void init_writer(writer_t *wrt, htsFile *fh, bcf_hdr_t *hdr, int buffered)
+{
+    wrt->fh  = fh;
+    wrt->hdr = hdr;
+    if ( !buffered ) return;
+    int i;
+    wrt->fill  = (bcf1_t**) malloc(sizeof(bcf1_t*)*WRITER_BATCH);
+    wrt->flush = (bcf1_t**) malloc(sizeof(bcf1_t*)*WRITER_BATCH);
+    for (i=0; i<WRITER_BATCH; i++)
+    {
+        wrt->fill[i]  = bcf_init1();
+        wrt->flush[i] = bcf_init1();
+    }
+}
+
+static void destroy_writer(writer_t *wrt)
+{
+    if ( !wrt->fill ) return;
+    int i;
+    for (i=0; i<WRITER_BATCH; i++)
+    {
+        bcf_destroy1(wrt->fill[i]);
+        bcf_destroy1(wrt->flush[i]);
+    }
+    free(wrt->fill);
+    free(wrt->flush);
+    wrt->fill = wrt->flush = NULL;
+}
+
+static writer_pool_t *init_writer_pool(int nthreads, int nwriters)
+{
+    writer_pool_t *pool = (writer_pool_t*) calloc(1,sizeof(writer_pool_t));
+    pool->nwriters = nwriters;
+    pool->nthreads = nthreads;
+    pool->queue = (writer_t**) malloc(sizeof(writer_t*)*nwriters);
+    pool->tid   = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job, NULL);
+    pthread_cond_init(&pool->written, NULL);
+    int i;
+    for (i=0; i<nthreads; i++)
+        if ( pthread_create(&pool->tid[i], NULL, writer_worker, pool) ) error("Could not create a writer thread\n");
+    return pool;
+}
+
+// Hand the buffered records over to the pool, waiting for the previous batch of this file first
+static void submit_batch(writer_pool_t *pool, writer_t *wrt)
+{
+    pthread_mutex_lock(&pool->lock);
+    while ( wrt->busy ) pthread_cond_wait(&pool->written, &pool->lock);
+    bcf1_t **tmp = wrt->flush; wrt->flush = wrt->fill; wrt->fill = tmp;
+    wrt->nflush = wrt->nfill;
+    wrt->nfill  = 0;
+    wrt->busy   = 1;
+    pool->queue[(pool->iqueue+pool->nqueue) % pool->nwriters] = wrt;
+    pool->nqueue++;
+    pthread_cond_signal(&pool->job);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void write_record(args_t *args, writer_t *wrt, bcf1_t *line)
+{
+    if ( !wrt->fill )
+    {
+        bcf_write1(wrt->fh, wrt->hdr, line);
+        return;
+    }
+    bcf_copy(wrt->fill[wrt->nfill++], line);
+    if ( wrt->nfill==WRITER_BATCH ) submit_batch(args->pool, wrt);
+}
+
+// Write out what is left in the buffers and stop the threads
+static void destroy_writer_pool(writer_pool_t *pool, writer_t *wrt, int nwrt)
+{
+    int i;
+    for (i=0; i<nwrt; i++)
+        if ( wrt[i].nfill ) submit_batch(pool, &wrt[i]);
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->job);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<pool->nthreads; i++) pthread_join(pool->tid[i], NULL);
+    for (i=0; i<nwrt; i++) destroy_writer(&wrt[i]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job);
+    pthread_cond_destroy(&pool->written);
+    free(pool->queue);
+    free(pool->tid);
+    free(pool);
+}
+
 void isec_vcf(args_t *args)
 {
     bcf_srs_t *files = args->files;
     kstring_t str = {0,0,0};
-    htsFile *out_fh = NULL;
+    writer_t out_std_wrt;
+    memset(&out_std_wrt,0,sizeof(writer_t));
 
     // When only one VCF is output, print VCF to stdout
     int out_std = 0;
@@ -139,9 +291,18 @@ void isec_vcf(args_t *args)
     if ( args->targets_list && files->nreaders==1 ) out_std = 1;
     if ( out_std ) 
     {
-        out_fh = hts_open("-",hts_bcf_wmode(args->output_type));
+        htsFile *out_fh = hts_open_mt("-",hts_bcf_wmode(args->output_type));
         bcf_hdr_append_version(files->readers[args->iwrite].header,args->argc,args->argv,"bcftools_isec");
         bcf_hdr_write(out_fh, files->readers[args->iwrite].header);
+        init_writer(&out_std_wrt, out_fh, files->readers[args->iwrite].header, args->nthreads);
+        if ( args->nthreads ) args->pool = init_writer_pool(1, 1);
+    }
+    else if ( args->nthreads && args->prefix )
+    {
+        int i, nout = 0, nslots = args->isec_op==OP_VENN ? 3 : files->nreaders;
+        for (i=0; i<nslots; i++)
+            if ( args->out[i].fh ) nout++;
+        if ( nout ) args->pool = init_writer_pool(args->nthreads < nout ? args->nthreads : nout, nslots);
     }
     if ( !args->nwrite && !out_std && !args->prefix )
         fprintf(stderr,"Note: -w option not given, printing list of sites...\n");
@@ -151,7 +312,8 @@ void isec_vcf(args_t *args)
     {
         bcf_sr_t *reader = NULL;
         bcf1_t *line = NULL;
-        int i, ret = 0;
+        int i;
+        memset(args->mask, 0, sizeof(uint64_t)*args->nmask);
         for (i=0; i<files->nreaders; i++)
         {
             if ( !bcf_sr_has_line(files,i) ) continue;
@@ -160,7 +322,7 @@ void isec_vcf(args_t *args)
                 line = files->readers[i].buffer[0];
                 reader = &files->readers[i];
             }
-            ret |= 1<<i;    // this may overflow for many files, but will be used only with two (OP_VENN)
+            MASK_SET(args->mask, i);
         }
 
         switch (args->isec_op) 
@@ -173,7 +335,7 @@ void isec_vcf(args_t *args)
 
         if ( out_std )
         {
-            bcf_write1(out_fh, files->readers[args->iwrite].header, files->readers[args->iwrite].buffer[0]);
+            write_record(args, &out_std_wrt, files->readers[args->iwrite].buffer[0]);
             continue;
         }
         else if ( args->fh_sites )
@@ -193,7 +355,7 @@ void isec_vcf(args_t *args)
             }
             kputc('\t', &str);
             for (i=0; i<files->nreaders; i++)
-                kputc(bcf_sr_has_line(files,i)?'1':'0', &str);
+                kputc(MASK_TEST(args->mask,i)?'1':'0', &str);
             kputc('\n', &str);
             fwrite(str.s,sizeof(char),str.l,args->fh_sites);
         }
@@ -201,25 +363,34 @@ void isec_vcf(args_t *args)
         if ( args->prefix )
         {
             if ( args->isec_op==OP_VENN )
-                bcf_write1(args->fh_out[ret-1], reader->header, line);
+                write_record(args, &args->out[args->mask[0]-1], line);     // OP_VENN is used only with two files
             else
             {
                 for (i=0; i<files->nreaders; i++)
                 {
-                    if ( !bcf_sr_has_line(files,i) ) continue;
+                    if ( !MASK_TEST(args->mask,i) ) continue;
                     if ( args->write && !args->write[i] ) continue;
-                    bcf_write1(args->fh_out[i], files->readers[i].header, files->readers[i].buffer[0]);
+                    write_record(args, &args->out[i], files->readers[i].buffer[0]);
                 }
             }
         }
     }
     if ( str.s ) free(str.s);
-    if ( out_fh ) hts_close(out_fh);
+    if ( args->pool )
+    {
+        if ( out_std ) destroy_writer_pool(args->pool, &out_std_wrt, 1);
+        else destroy_writer_pool(args->pool, args->out, args->isec_op==OP_VENN ? 3 : files->nreaders);
+        args->pool = NULL;
+    }
+    if ( out_std_wrt.fh ) hts_close(out_std_wrt.fh);
 }
 
 static void destroy_data(args_t *args);
 static void init_data(args_t *args)
 {
+    args->nmask = (args->files->nreaders+63)/64;
+    args->mask  = (uint64_t*) calloc(args->nmask,sizeof(uint64_t));
+
     // Which files to write: parse the string passed with -w
     char *p = args->write_files;
     while (p && *p)
@@ -260,15 +431,16 @@ static void init_data(args_t *args)
         // Open output files and write the legend
         if ( args->isec_op==OP_VENN )
         {
-            args->fh_out = (htsFile**) malloc(sizeof(htsFile*)*3);
+            args->out    = (writer_t*) calloc(3, sizeof(writer_t));
             args->fnames = (char**) malloc(sizeof(char*)*3);
 
             #define OPEN_FILE(i,j) { \
                 open_file(&args->fnames[i], NULL, "%s/%04d.%s", args->prefix, i, suffix); \
-                args->fh_out[i] = hts_open(args->fnames[i], hts_bcf_wmode(args->output_type));  \
-                if ( !args->fh_out[i] ) error("Could not open %s\n", args->fnames[i]); \
+                htsFile *fh = hts_open_mt(args->fnames[i], hts_bcf_wmode(args->output_type));  \
+                if ( !fh ) error("Could not open %s\n", args->fnames[i]); \
                 bcf_hdr_append_version(args->files->readers[j].header,args->argc,args->argv,"bcftools_isec"); \
-                bcf_hdr_write(args->fh_out[i], args->files->readers[j].header); \
+                bcf_hdr_write(fh, args->files->readers[j].header); \
+                init_writer(&args->out[i], fh, args->files->readers[j].header, args->nthreads); \
             }
             OPEN_FILE(0,0);
             fprintf(args->fh_log,"%s\tfor records private to\t%s\n", args->fnames[0], args->files->readers[0].fname);
@@ -280,7 +452,7 @@ static void init_data(args_t *args)
         else
         {
             // Init one output file for each reader
-            args->fh_out = (htsFile**) calloc(args->files->nreaders, sizeof(htsFile*));
+            args->out    = (writer_t*) calloc(args->files->nreaders, sizeof(writer_t));
             args->fnames = (char**) calloc(args->files->nreaders, sizeof(char*));
 
             for (i=0; i<args->files->nreaders; i++)
@@ -309,7 +481,8 @@ static void destroy_data(args_t *args)
         for (i=0; i<n; i++)
         {
             if ( !args->fnames[i] ) continue;
-            hts_close(args->fh_out[i]);
+            destroy_writer(&args->out[i]);
+            hts_close(args->out[i].fh);
             if ( args->output_type==FT_VCF_GZ )
             {
                 tbx_conf_t conf = tbx_conf_vcf;
@@ -321,11 +494,12 @@ static void destroy_data(args_t *args)
             }
             free(args->fnames[i]);
         }
-        free(args->fh_out);
+        free(args->out);
         free(args->fnames);
         if ( args->fh_sites ) fclose(args->fh_sites);
         if ( args->write ) free(args->write);
     }
+    free(args->mask);
 }
 
 static void usage(void)
@@ -345,6 +519,7 @@ static void usage(void)
     fprintf(stderr, "    -R, --regions-file <file>         restrict to regions listed in a file\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>               number of threads writing and compressing the output files in parallel [0]\n");
 	fprintf(stderr, "    -w, --write <list>                list of files to write with -p given as 1-based indexes. By default, all files are written\n");
     fprintf(stderr, "\n");
 	fprintf(stderr, "Examples:\n");
@@ -363,6 +538,7 @@ static void usage(void)
 int main_vcfisec(int argc, char *argv[])
 {
 	int c;
+    char *tmp;
 	args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->files  = bcf_sr_init();
 	args->argc   = argc; args->argv = argv;
@@ -383,6 +559,7 @@ int main_vcfisec(int argc, char *argv[])
 		{"regions",1,0,'r'},
 		{"regions-file",1,0,'R'},
 		{"output-type",1,0,'O'},
+		{"threads",1,0,1},
 		{0,0,0,0}
 	};
 	while ((c = getopt_long(argc, argv, "hc:r:R:p:n:w:t:T:Cf:O:",loptions,NULL)) >= 0) {
@@ -414,6 +591,10 @@ int main_vcfisec(int argc, char *argv[])
 			case 'T': args->targets_list = optarg; targets_is_file = 1; break;
 			case 'p': args->prefix = optarg; break;
 			case 'w': args->write_files = optarg; break;
+			case  1 :
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nthreads<1 ) error("Could not parse: --threads %s\n", optarg);
+                break;
 			case 'n': 
                 {
                     char *p = optarg;
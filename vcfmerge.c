@@ -26,10 +26,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <strings.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
+#include "profile.h"
 
 #include <htslib/khash.h>
 KHASH_MAP_INIT_STR(strdict, int)
@@ -81,7 +84,7 @@ typedef struct
     int nals, mals, nout_als, mout_als; // size of the output array
     int *cnt, ncnt; // number of records that refer to the alleles
     int *nbuf;      // readers have buffers of varying lengths
-    int *smpl_ploidy, *smpl_nGsize; // ploidy and derived number of values in Number=G tags, updated for each line (todo: cache for missing cases)
+    int *smpl_ploidy;   // ploidy of each sample, updated for each line by merge_GT()
     int *flt, mflt, minf;
     bcf_info_t *inf;// out_line's INFO fields
     bcf_fmt_t **fmt_map; // i-th output FORMAT field corresponds in j-th reader to i*nreader+j, first row is reserved for GT
@@ -93,6 +96,10 @@ typedef struct
     int nAGR_info, mAGR_info;
     bcf_srs_t *files;
     int *has_line;  // which files are being merged
+    int *active, nactive;   // sorted readers with lines at the current position, see maux_update_active()
+    int *heap, nheap, *heap_pos;    // min-heap of readers by the position of the next line
+    char *chr;      // the current chromosome, readers with lines elsewhere are not in the heap
+    int rescan;     // all readers must be checked, set at the start and when the chromosome changes
 }
 maux_t;
 
@@ -111,6 +118,12 @@ typedef struct
     bcf_hdr_t *out_hdr;
     char **argv;
     int argc;
+    char *output_fname;         // "-" unless the intermediate file of the merge tree
+    int tree, nthreads;         // files per node of the merge tree and nodes merged in parallel
+    char **fnames;              // the tree mode opens the input files only when needed
+    int nfnames, mfnames, regions_is_file;
+    int is_node;                // intermediate merge of the tree, possibly in a thread, not profiled
+    profile_mark_t prof;
 }
 args_t;
 
@@ -496,8 +509,15 @@ maux_t *maux_init(bcf_srs_t *files)
     for (i=0; i<ma->n; i++)
         n_smpl += bcf_hdr_nsamples(files->readers[i].header);
     ma->smpl_ploidy = (int*) calloc(n_smpl,sizeof(int));
-    ma->smpl_nGsize = (int*) malloc(n_smpl*sizeof(int));
-    ma->has_line = (int*) malloc(ma->n*sizeof(int));
+
+    // the FORMAT arena, big enough for diploid GTs and two values per sample, grows for bigger fields
+    ma->ntmp_arr = n_smpl*2*(sizeof(float)>sizeof(int32_t) ? sizeof(float) : sizeof(int32_t));
+    ma->tmp_arr  = ma->ntmp_arr ? malloc(ma->ntmp_arr) : NULL;
+    ma->has_line = (int*) calloc(ma->n,sizeof(int));
+    ma->active   = (int*) malloc(ma->n*sizeof(int));
+    ma->heap     = (int*) malloc(ma->n*sizeof(int));
+    ma->heap_pos = (int*) malloc(ma->n*sizeof(int));
+    ma->rescan   = 1;
     return ma;
 }
 void maux_destroy(maux_t *ma)
@@ -524,8 +544,11 @@ void maux_destroy(maux_t *ma)
     free(ma->als);
     free(ma->cnt);
     free(ma->smpl_ploidy);
-    free(ma->smpl_nGsize);
     free(ma->has_line);
+    free(ma->active);
+    free(ma->heap);
+    free(ma->heap_pos);
+    free(ma->chr);
     free(ma);
 }
 void maux_expand1(maux_t *ma, int i)
@@ -541,9 +564,117 @@ void maux_expand1(maux_t *ma, int i)
 void maux_reset(maux_t *ma)
 {
     int i;
-    for (i=0; i<ma->n; i++) maux_expand1(ma, i);
+    for (i=0; i<ma->nactive; i++) maux_expand1(ma, ma->active[i]);
     for (i=1; i<ma->ncnt; i++) ma->cnt[i] = 0;
 }
+
+static void maux_heap_push(maux_t *ma, int ir, int pos)
+{
+    int i = ma->nheap++;
+    ma->heap_pos[ir] = pos;
+    while ( i>0 )
+    {
+        int parent = (i-1)/2;
+        if ( ma->heap_pos[ma->heap[parent]] <= pos ) break;
+        ma->heap[i] = ma->heap[parent];
+        i = parent;
+    }
+    ma->heap[i] = ir;
+}
+static int maux_heap_pop(maux_t *ma)
+{
+    int top = ma->heap[0], ir = ma->heap[--ma->nheap], i = 0;
+    int pos = ma->heap_pos[ir];
+    while ( 2*i+1 < ma->nheap )
+    {
+        int child = 2*i+1;
+        if ( child+1 < ma->nheap && ma->heap_pos[ma->heap[child+1]] < ma->heap_pos[ma->heap[child]] ) child++;
+        if ( pos <= ma->heap_pos[ma->heap[child]] ) break;
+        ma->heap[i] = ma->heap[child];
+        i = child;
+    }
+    ma->heap[i] = ir;
+    return top;
+}
+
+// Position of the first buffered line of the reader on the current chromosome, -1 if none
+static int maux_next_pos(maux_t *ma, int ir)
+{
+    bcf_sr_t *reader = &ma->files->readers[ir];
+    if ( !reader->buffer ) return -1;
+    int j, pos = -1;
+    for (j=bcf_sr_has_line(ma->files,ir) ? 0 : 1; j<=reader->nbuffer; j++)
+    {
+        bcf1_t *line = reader->buffer[j];
+        if ( line->pos<0 || (pos>=0 && line->pos>=pos) ) continue;
+        if ( strcmp(ma->chr, bcf_seqname(reader->header,line)) ) continue;
+        pos = line->pos;
+    }
+    return pos;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *((const int*)a) - *((const int*)b);
+}
+
+// Find the readers with lines at the current position. Only the readers which
+// had lines at the previous position are changed by next_line(), the rest stay
+// in the heap untouched.
+static void maux_update_active(maux_t *ma)
+{
+    bcf_srs_t *files = ma->files;
+    int i;
+    if ( !ma->rescan )
+    {
+        for (i=0; i<ma->nactive; i++)
+        {
+            int pos = maux_next_pos(ma, ma->active[i]);
+            if ( pos>=0 ) maux_heap_push(ma, ma->active[i], pos);
+        }
+        if ( !ma->nheap ) ma->rescan = 1;   // a new chromosome
+    }
+    int rescanned = 0;
+    while (1)
+    {
+        if ( ma->rescan )
+        {
+            rescanned = 1;
+            ma->nheap = 0;
+            for (i=0; i<ma->n; i++)
+                if ( bcf_sr_has_line(files,i) ) break;
+            if ( i==ma->n ) { ma->nactive = 0; return; }
+            free(ma->chr);
+            ma->chr = strdup(bcf_seqname(files->readers[i].header, bcf_sr_get_line(files,i)));
+            for (i=0; i<ma->n; i++)
+            {
+                bcf_sr_t *reader = &files->readers[i];
+                if ( reader->buffer && !bcf_sr_has_line(files,i) ) reader->buffer[0]->pos = -1;   // as shake_buffer() would do
+                int pos = maux_next_pos(ma, i);
+                if ( pos>=0 ) maux_heap_push(ma, i, pos);
+            }
+            ma->rescan = 0;
+        }
+        ma->nactive = 0;
+        int pos = ma->nheap ? ma->heap_pos[ma->heap[0]] : -1;
+        while ( ma->nheap && ma->heap_pos[ma->heap[0]]==pos )
+            ma->active[ma->nactive++] = maux_heap_pop(ma);
+        qsort(ma->active, ma->nactive, sizeof(int), cmp_int);
+
+        // the position must agree with the synced reader, otherwise check all readers
+        for (i=0; i<ma->nactive; i++)
+            if ( bcf_sr_has_line(files,ma->active[i]) ) break;
+        if ( i<ma->nactive && bcf_sr_get_line(files,ma->active[i])->pos==pos ) break;
+        ma->rescan = 1;
+        if ( rescanned )
+        {
+            // should not happen, fall back to checking all readers
+            for (i=0; i<ma->n; i++) ma->active[i] = i;
+            ma->nactive = ma->n;
+            return;
+        }
+    }
+}
 void maux_debug(maux_t *ma, int ir, int ib)
 {
     printf("[%d,%d]\t", ir,ib);
@@ -573,8 +704,10 @@ void merge_chrom2qual(args_t *args, bcf1_t *out)
 
     // CHROM, POS, ID, QUAL
     out->pos = -1;
-    for (i=0; i<files->nreaders; i++)
+    int ia;
+    for (ia=0; ia<ma->nactive; ia++)
     {
+        i = ma->active[ia];
         if ( !ma->has_line[i] ) continue;
 
         bcf_sr_t *reader = &files->readers[i];
@@ -626,8 +759,9 @@ void merge_chrom2qual(args_t *args, bcf1_t *out)
         // Adjust the indexes, the allele map could be created for multiple collapsed records, 
         //  some of which might be unused for this output line
         int ir, j;
-        for (ir=0; ir<files->nreaders; ir++)
+        for (ia=0; ia<ma->nactive; ia++)
         {
+            ir = ma->active[ia];
             if ( !ma->has_line[ir] ) continue;
             bcf1_t *line = files->readers[ir].buffer[0];
             for (j=1; j<line->n_allele; j++)
@@ -659,8 +793,10 @@ void merge_filter(args_t *args, bcf1_t *out)
 
     maux_t *ma = args->maux;
     out->d.n_flt = 0;
-    for (i=0; i<files->nreaders; i++)
+    int ia;
+    for (ia=0; ia<ma->nactive; ia++)
     {
+        i = ma->active[ia];
         if ( !ma->has_line[i]) continue;
 
         bcf_sr_t *reader = &files->readers[i];
@@ -897,8 +1033,10 @@ void merge_info(args_t *args, bcf1_t *out)
     ma->nAGR_info = 0;
     out->n_info   = 0;
     info_rules_reset(args);
-    for (i=0; i<files->nreaders; i++)
+    int ia;
+    for (ia=0; ia<ma->nactive; ia++)
     {
+        i = ma->active[ia];
         if ( !ma->has_line[i] ) continue;
         bcf_sr_t *reader = &files->readers[i];
         bcf1_t *line = reader->buffer[0];
@@ -1016,7 +1154,6 @@ void merge_GT(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
         ma->ntmp_arr = nsamples*nsize*msize;
         ma->tmp_arr  = realloc(ma->tmp_arr, ma->ntmp_arr);
     }
-    memset(ma->smpl_ploidy,0,nsamples*sizeof(int));
 
     for (i=0; i<files->nreaders; i++)
     {
@@ -1024,17 +1161,32 @@ void merge_GT(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
         bcf_hdr_t *hdr = reader->header;
         bcf_fmt_t *fmt_ori = fmt_map[i];
         int32_t *tmp  = (int32_t *) ma->tmp_arr + ismpl*nsize;
+        int *ploidy   = ma->smpl_ploidy + ismpl;
 
-        int j, k;
+        int j, k, nsmpl = bcf_hdr_nsamples(hdr);
         if ( !fmt_ori )
         {
             // missing values: assume maximum ploidy
-            for (j=0; j<bcf_hdr_nsamples(hdr); j++)
+            memset(tmp, 0, sizeof(int32_t)*nsmpl*nsize);
+            for (j=0; j<nsmpl; j++) ploidy[j] = nsize;
+            ismpl += nsmpl;
+            continue;
+        }
+        if ( fmt_ori->type==BCF_BT_INT32 && fmt_ori->n==nsize && !ma->d[i][0].als_differ )
+        {
+            // the same layout as the output, copy over and fix up missing alleles
+            memcpy(tmp, fmt_ori->p, sizeof(int32_t)*nsmpl*nsize);
+            for (j=0; j<nsmpl; j++)
             {
-                for (k=0; k<nsize; k++) { tmp[k] = 0; ma->smpl_ploidy[ismpl+j]++; }
+                for (k=0; k<nsize; k++)
+                {
+                    if ( tmp[k]==bcf_int32_vector_end ) break;
+                    if ( tmp[k]==bcf_int32_missing ) tmp[k] = 0;
+                }
+                ploidy[j] = k;
                 tmp += nsize;
             }
-            ismpl += bcf_hdr_nsamples(hdr);
+            ismpl += nsmpl;
             continue;
         }
 
@@ -1043,29 +1195,28 @@ void merge_GT(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
             if ( !ma->d[i][0].als_differ ) \
             { \
                 /* the allele numbering is unchanged */ \
-                for (j=0; j<bcf_hdr_nsamples(hdr); j++) \
+                for (j=0; j<nsmpl; j++) \
                 { \
                     for (k=0; k<fmt_ori->n; k++) \
                     { \
                         if ( p_ori[k]==vector_end ) break; /* smaller ploidy */ \
-                        ma->smpl_ploidy[ismpl+j]++; \
                         if ( p_ori[k]==missing ) tmp[k] = 0; /* missing allele */ \
                         else tmp[k] = p_ori[k]; \
                     } \
+                    ploidy[j] = k; \
                     for (; k<nsize; k++) tmp[k] = bcf_int32_vector_end; \
                     tmp += nsize; \
                     p_ori += fmt_ori->n; \
                 } \
-                ismpl += bcf_hdr_nsamples(hdr); \
+                ismpl += nsmpl; \
                 continue; \
             } \
             /* allele numbering needs to be changed */ \
-            for (j=0; j<bcf_hdr_nsamples(hdr); j++) \
+            for (j=0; j<nsmpl; j++) \
             { \
                 for (k=0; k<fmt_ori->n; k++) \
                 { \
                     if ( p_ori[k]==vector_end ) break; /* smaller ploidy */ \
-                    ma->smpl_ploidy[ismpl+j]++; \
                     if ( !(p_ori[k]>>1) || p_ori[k]==missing ) tmp[k] = 0; /* missing allele */ \
                     else \
                     { \
@@ -1074,11 +1225,12 @@ void merge_GT(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
                         tmp[k] = (al << 1) | ((p_ori[k])&1); \
                     } \
                 } \
+                ploidy[j] = k; \
                 for (; k<nsize; k++) tmp[k] = bcf_int32_vector_end; \
                 tmp += nsize; \
                 p_ori += fmt_ori->n; \
             } \
-            ismpl += bcf_hdr_nsamples(hdr); \
+            ismpl += nsmpl; \
         }
         switch (fmt_ori->type)
         {
@@ -1091,11 +1243,6 @@ void merge_GT(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
     }
 
     bcf_update_format_int32(out_hdr, out, "GT", (int32_t*)ma->tmp_arr, nsamples*nsize);
-    for (i=0; i<nsamples; i++)
-    {
-        assert( ma->smpl_ploidy[i]>0 && ma->smpl_ploidy[i]<=2 );
-        ma->smpl_nGsize[i] = ma->smpl_ploidy[i]==1 ?  out->n_allele : out->n_allele*(out->n_allele + 1)/2;
-    }
 }
 
 void merge_format_field(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
@@ -1133,6 +1280,17 @@ void merge_format_field(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
         bcf_fmt_t *fmt_ori = fmt_map[i];
         if ( fmt_ori ) type = fmt_ori->type;
 
+        int nsmpl = bcf_hdr_nsamples(hdr);
+        if ( fmt_ori && fmt_ori->n==nsize && (type==BCF_BT_INT32 || type==BCF_BT_FLOAT || type==BCF_BT_CHAR)
+                && ((length!=BCF_VL_G && length!=BCF_VL_A) || (reader->buffer[0]->n_allele==out->n_allele && !ma->d[i][0].als_differ)) )
+        {
+            // the values are stored as in the output, copy over
+            int size = type==BCF_BT_CHAR ? 1 : 4;
+            memcpy((uint8_t*)ma->tmp_arr + ismpl*nsize*size, fmt_ori->p, (size_t)nsmpl*nsize*size);
+            ismpl += nsmpl;
+            continue;
+        }
+
         // set the values
         #define BRANCH(tgt_type_t, src_type_t, src_is_missing, src_is_vector_end, tgt_set_missing, tgt_set_vector_end) { \
             int j, l, k; \
@@ -1175,8 +1333,11 @@ void merge_format_field(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
                 /* Number=G tags */ \
                 for (j=0; j<bcf_hdr_nsamples(hdr); j++) \
                 { \
+                    int ploidy = ma->smpl_ploidy[ismpl+j]; \
+                    assert( ploidy>0 && ploidy<=2 ); \
+                    int nGsize = ploidy==1 ? out->n_allele : out->n_allele*(out->n_allele + 1)/2; \
                     tgt = (tgt_type_t *) ma->tmp_arr + (ismpl+j)*nsize; \
-                    for (l=0; l<ma->smpl_nGsize[ismpl+j]; l++) { tgt_set_missing; tgt++; } \
+                    for (l=0; l<nGsize; l++) { tgt_set_missing; tgt++; } \
                     for (; l<nsize; l++) { tgt_set_vector_end; tgt++; } \
                     int iori,jori, inew,jnew; \
                     for (iori=0; iori<line->n_allele; iori++) \
@@ -1257,8 +1418,10 @@ void merge_format(args_t *args, bcf1_t *out)
     strdict_t *tmph = args->tmph;
     kh_clear(strdict, tmph);
     int i, j, ret, has_GT = 0, max_ifmt = 0; // max fmt index
-    for (i=0; i<files->nreaders; i++)
+    int ia;
+    for (ia=0; ia<ma->nactive; ia++)
     {
+        i = ma->active[ia];
         if ( !ma->has_line[i] ) continue;
         bcf_sr_t *reader = &files->readers[i];
         bcf1_t *line = reader->buffer[0];
@@ -1326,8 +1489,10 @@ void merge_line(args_t *args)
     merge_filter(args, out);
     merge_info(args, out);
     merge_format(args, out);
+    if ( !args->is_node ) PROFILE_LAP(PROF_MERGE, args->prof);
 
     bcf_write1(args->out_fh, args->out_hdr, out);
+    if ( !args->is_node ) PROFILE_LAP(PROF_WRITE, args->prof);
 }
 
 
@@ -1483,13 +1648,15 @@ void debug_maux(args_t *args, int pos, int var_type)
 void merge_buffer(args_t *args)
 {
     bcf_srs_t *files = args->files;
-    int i, pos = -1, var_type = 0;
+    int i, ia, pos = -1, var_type = 0;
     maux_t *maux = args->maux;
+    maux_update_active(maux);
     maux_reset(maux);
 
     // set the current position
-    for (i=0; i<files->nreaders; i++)
+    for (ia=0; ia<maux->nactive; ia++)
     {
+        i = maux->active[ia];
         if ( bcf_sr_has_line(files,i) )
         {
             bcf1_t *line = bcf_sr_get_line(files,i);
@@ -1503,11 +1670,13 @@ void merge_buffer(args_t *args)
     // (i.e. SNPs or indels). Go through all files and all lines at this
     // position and normalize relevant alleles.
     // REF-only sites may be associated with both SNPs and indels.
-    for (i=0; i<files->nreaders; i++)
+    // Only the active readers can have lines at this position.
+    for (ia=0; ia<maux->nactive; ia++)
     {
+        i = maux->active[ia];
         bcf_sr_t *reader = &files->readers[i];
         if ( !reader->buffer ) continue;
-        int j;
+        int j, nsame = 0;
         for (j=0; j<=reader->nbuffer; j++)
         {
             bcf1_t *line = reader->buffer[j];
@@ -1520,6 +1689,8 @@ void merge_buffer(args_t *args)
                 if ( j==0 ) maux->d[i][j].skip |= SKIP_DONE; // left from previous run, force to ignore
                 continue; 
             }
+            if ( args->is_node && nsame++ )
+                error("Only one record per position can be merged with --tree, %s has more at %s:%d\n", reader->fname,bcf_seqname(reader->header,line),line->pos+1);
             if ( args->collapse==COLLAPSE_NONE && var_type!=line->d.var_type ) continue;
             if ( var_type&VCF_SNP && !(line_type&VCF_SNP) && !(args->collapse&COLLAPSE_ANY) && line_type!=VCF_REF ) continue;
             if ( var_type&VCF_INDEL && !(line_type&VCF_INDEL) && !(args->collapse&COLLAPSE_ANY) && line_type!=VCF_REF ) continue;
@@ -1567,8 +1738,9 @@ void merge_buffer(args_t *args)
         if ( maux->cnt[icnt]<0 ) break;
 
         int nmask = 0;
-        for (i=0; i<files->nreaders; i++)
+        for (ia=0; ia<maux->nactive; ia++)
         {
+            i = maux->active[ia];
             maux->has_line[i] = 0;
 
             bcf_sr_t *reader = &files->readers[i];
@@ -1635,9 +1807,14 @@ void merge_buffer(args_t *args)
     }
     maux->nals = 0;
 
-    // get the buffers ready for the next next_line() call
-    for (i=0; i<files->nreaders; i++)
+    // get the buffers ready for the next next_line() call, the buffers of
+    // inactive readers have no lines at this position
+    for (ia=0; ia<maux->nactive; ia++)
+    {
+        i = maux->active[ia];
+        maux->has_line[i] = 0;
         shake_buffer(maux, i, pos);
+    }
 }
 
 void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *cmd)
@@ -1665,14 +1842,16 @@ void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *c
 
 void merge_vcf(args_t *args)
 {
-    args->out_fh  = hts_open("-", hts_bcf_wmode(args->output_type));
-    args->out_hdr = bcf_hdr_init("w");
+    args->out_fh  = hts_open_mt(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( args->out_fh == NULL ) error("Can't write to %s\n", args->output_fname);
+    int has_hdr = args->out_hdr ? 1 : 0;     // prepared by merge_tree()
+    if ( !has_hdr ) args->out_hdr = bcf_hdr_init("w");
 
     if ( args->header_fname )
     {
         if ( bcf_hdr_set(args->out_hdr,args->header_fname) ) error("Could not read/parse the header: %s\n", args->header_fname);
     }
-    else
+    else if ( !has_hdr )
     {
         int i;
         for (i=0; i<args->files->nreaders; i++)
@@ -1697,9 +1876,12 @@ void merge_vcf(args_t *args)
     args->out_line = bcf_init1();
     args->tmph = kh_init(strdict);
     int ret;
+    if ( !args->is_node ) PROFILE_START(args->prof);
     while ( (ret=bcf_sr_next_line(args->files)) )
     {
+        if ( !args->is_node ) PROFILE_LAP(PROF_READ, args->prof);
         merge_buffer(args);
+        if ( !args->is_node ) PROFILE_LAP(PROF_MERGE, args->prof);
     }
     info_rules_destroy(args);
     maux_destroy(args->maux);
@@ -1710,6 +1892,171 @@ void merge_vcf(args_t *args)
     if ( args->tmps.m ) free(args->tmps.s);
 }
 
+/*
+ *  Hierarchical merge: the inputs are merged in groups of args->tree files
+ *  into temporary BCFs, level by level, until few enough are left for the
+ *  final merge. Because the files are merged in the original order and the
+ *  output header is created from the original headers, the output is the
+ *  same as of the flat merge, provided that each position is merged into a
+ *  single record. Otherwise merge_buffer() would choose and order the lines
+ *  by the allele counts in maux->cnt, and an intermediate file counts only
+ *  once. Therefore -m all is required and a file with more than one record
+ *  at a position is an error.
+ */
+typedef struct
+{
+    args_t *args;
+    char **fnames, **out_fnames;
+    int nfnames, inode, nnodes;
+    pthread_mutex_t lock;
+}
+merge_level_t;
+
+static void merge_node(args_t *args, char **fnames, int nfnames, const char *out_fname, int is_leaf)
+{
+    args_t *node = (args_t*) calloc(1,sizeof(args_t));
+    node->argc = args->argc; node->argv = args->argv;
+    node->collapse    = args->collapse;
+    node->info_rules  = args->info_rules;
+    node->output_type = FT_BCF_GZ;
+    node->output_fname = (char*) out_fname;
+    node->is_node = 1;
+    node->files = bcf_sr_init();
+    node->files->require_index = 1;
+    if ( is_leaf )
+    {
+        // filters and regions are applied once, on the original files
+        node->files->apply_filters = args->files->apply_filters;
+        if ( args->regions_list && bcf_sr_set_regions(node->files, args->regions_list, args->regions_is_file)<0 )
+            error("Failed to read the regions: %s\n", args->regions_list);
+    }
+    int i;
+    for (i=0; i<nfnames; i++)
+        if ( !bcf_sr_add_reader(node->files, fnames[i]) ) error("Failed to open: %s\n", fnames[i]);
+    merge_vcf(node);
+    bcf_sr_destroy(node->files);
+    free(node);
+    if ( bcf_index_build(out_fname,14) ) error("Could not index %s\n", out_fname);
+}
+
+static void *merge_level_worker(void *arg)
+{
+    merge_level_t *level = (merge_level_t*) arg;
+    int tree = level->args->tree;
+    while (1)
+    {
+        pthread_mutex_lock(&level->lock);
+        int inode = level->inode++;
+        pthread_mutex_unlock(&level->lock);
+        if ( inode >= level->nnodes ) break;
+        int n = level->nfnames - inode*tree < tree ? level->nfnames - inode*tree : tree;
+        merge_node(level->args, level->fnames + inode*tree, n, level->out_fnames[inode], level->fnames==level->args->fnames);
+    }
+    return NULL;
+}
+
+static void remove_tmp(char **fnames, int n)
+{
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<n; i++)
+    {
+        str.l = 0;
+        ksprintf(&str, "%s.csi", fnames[i]);
+        unlink(str.s);
+        unlink(fnames[i]);
+        free(fnames[i]);
+    }
+    free(fnames);
+    free(str.s);
+}
+
+static void merge_tree(args_t *args)
+{
+    int i;
+    if ( !(args->collapse&COLLAPSE_ANY) ) error("The --tree option requires -m all\n");
+    if ( args->info_rules )
+    {
+        char *ss = args->info_rules;
+        while ( (ss = strchr(ss,':')) )
+        {
+            ss++;
+            if ( !strncasecmp(ss,"avg",3) && (!ss[3] || ss[3]==',') ) error("The \"avg\" INFO rule cannot be used with --tree\n");
+        }
+    }
+
+    // the output header, as in merge_vcf(), from the original headers read one at a time
+    args->out_hdr = bcf_hdr_init("w");
+    if ( !args->header_fname )
+    {
+        for (i=0; i<args->nfnames; i++)
+        {
+            htsFile *fp = hts_open(args->fnames[i], "r");
+            if ( !fp ) error("Failed to open: %s\n", args->fnames[i]);
+            bcf_hdr_t *hdr = bcf_hdr_read(fp);
+            if ( !hdr ) error("Failed to read the header: %s\n", args->fnames[i]);
+            int j;
+            for (j=0; j<bcf_hdr_nsamples(hdr); j++)
+                if ( bcf_hdr_id2int(args->out_hdr, BCF_DT_SAMPLE, hdr->samples[j])>=0 )
+                    error("Duplicate sample names cannot be merged with --tree: %s\n", hdr->samples[j]);
+            char buf[10]; snprintf(buf,10,"%d",i+1);
+            bcf_hdr_merge(args->out_hdr, hdr, buf);
+            bcf_hdr_destroy(hdr);
+            hts_close(fp);
+        }
+        bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_merge");
+        bcf_hdr_sync(args->out_hdr);
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/bcftools-merge.XXXXXX", tmpdir ? tmpdir : "/tmp");
+    char *dir = mkdtemp(str.s);
+    if ( !dir ) error("Could not create a temporary directory: %s\n", str.s);
+    dir = strdup(dir);
+
+    merge_level_t level;
+    level.args   = args;
+    level.fnames = args->fnames;
+    level.nfnames = args->nfnames;
+    pthread_mutex_init(&level.lock, NULL);
+    pthread_t *tids = (pthread_t*) malloc(sizeof(pthread_t)*args->nthreads);
+    int ilevel = 0;
+    while ( level.nfnames > args->tree )
+    {
+        level.inode  = 0;
+        level.nnodes = (level.nfnames + args->tree - 1) / args->tree;
+        level.out_fnames = (char**) malloc(sizeof(char*)*level.nnodes);
+        for (i=0; i<level.nnodes; i++)
+        {
+            str.l = 0;
+            ksprintf(&str, "%s/%d.%d.bcf", dir, ilevel, i);
+            level.out_fnames[i] = strdup(str.s);
+        }
+        int nthreads = args->nthreads < level.nnodes ? args->nthreads : level.nnodes;
+        for (i=0; i<nthreads; i++)
+            if ( pthread_create(&tids[i], NULL, merge_level_worker, &level) ) error("Failed to create a thread\n");
+        for (i=0; i<nthreads; i++) pthread_join(tids[i], NULL);
+
+        if ( level.fnames!=args->fnames ) remove_tmp(level.fnames, level.nfnames);
+        level.fnames  = level.out_fnames;
+        level.nfnames = level.nnodes;
+        ilevel++;
+    }
+    free(tids);
+    pthread_mutex_destroy(&level.lock);
+
+    // the final merge, the filters were applied by the leaf nodes
+    args->files->apply_filters = NULL;
+    for (i=0; i<level.nfnames; i++)
+        if ( !bcf_sr_add_reader(args->files, level.fnames[i]) ) error("Failed to open: %s\n", level.fnames[i]);
+    merge_vcf(args);
+    if ( level.fnames!=args->fnames ) remove_tmp(level.fnames, level.nfnames);
+    rmdir(dir);
+    free(dir);
+    free(str.s);
+}
+
 static void usage(void)
 {
     fprintf(stderr, "\n");
@@ -1727,6 +2074,8 @@ static void usage(void)
     fprintf(stderr, "    -O, --output-type <b|u|z|v>        'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
 	fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
+    fprintf(stderr, "        --threads <int>                number of nodes of the merge tree to merge in parallel [1]\n");
+    fprintf(stderr, "        --tree <int>                   merge in a tree of temporary files, <int> files per node, requires -m all\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -1738,6 +2087,8 @@ int main_vcfmerge(int argc, char *argv[])
     args->files  = bcf_sr_init();
     args->argc   = argc; args->argv = argv;
     args->collapse = COLLAPSE_BOTH;
+    args->output_fname = "-";
+    args->nthreads = 1;
     int regions_is_file = 0;
 
     static struct option loptions[] = 
@@ -1752,6 +2103,8 @@ int main_vcfmerge(int argc, char *argv[])
         {"regions",1,0,'r'},
         {"regions-file",1,0,'R'},
         {"info-rules",1,0,'i'},
+        {"tree",1,0,3},
+        {"threads",1,0,4},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hm:f:r:R:1:2O:i:l:",loptions,NULL)) >= 0) {
@@ -1782,6 +2135,14 @@ int main_vcfmerge(int argc, char *argv[])
             case 'R': args->regions_list = optarg; regions_is_file = 1; break;
             case  1 : args->header_fname = optarg; break;
             case  2 : args->header_only = 1; break;
+            case  3 : 
+                args->tree = atoi(optarg); 
+                if ( args->tree<2 ) error("Expected integer bigger than 1 with --tree: %s\n", optarg);
+                break;
+            case  4 : 
+                args->nthreads = atoi(optarg); 
+                if ( args->nthreads<1 ) error("Expected positive integer with --threads: %s\n", optarg);
+                break;
             case 'h': 
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -1794,9 +2155,12 @@ int main_vcfmerge(int argc, char *argv[])
     if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
         error("Failed to read the regions: %s\n", args->regions_list);
 
+    // collect the file names first, the tree mode does not open all of them at once
     while (optind<argc)
     {
-        if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open: %s\n", argv[optind]);
+        args->nfnames++;
+        hts_expand(char*, args->nfnames, args->mfnames, args->fnames);
+        args->fnames[args->nfnames-1] = strdup(argv[optind]);
         optind++;
     }
     if ( args->file_list )
@@ -1805,11 +2169,27 @@ int main_vcfmerge(int argc, char *argv[])
         char **files = hts_readlines(args->file_list, &nfiles);
         if ( !files ) error("Failed to read from %s\n", args->file_list);
         for (i=0;i<nfiles; i++)
-            if ( !bcf_sr_add_reader(args->files, files[i]) ) error("Failed to open: %s\n", files[i]);
-        for (i=0; i<nfiles; i++) free(files[i]);
+        {
+            args->nfnames++;
+            hts_expand(char*, args->nfnames, args->mfnames, args->fnames);
+            args->fnames[args->nfnames-1] = files[i];
+        }
         free(files);
     }
-    merge_vcf(args);
+    int i;
+    if ( args->tree && args->nfnames > args->tree && !args->header_only )
+    {
+        args->regions_is_file = regions_is_file;
+        merge_tree(args);
+    }
+    else
+    {
+        for (i=0; i<args->nfnames; i++)
+            if ( !bcf_sr_add_reader(args->files, args->fnames[i]) ) error("Failed to open: %s\n", args->fnames[i]);
+        merge_vcf(args);
+    }
+    for (i=0; i<args->nfnames; i++) free(args->fnames[i]);
+    free(args->fnames);
     bcf_sr_destroy(args->files);
     free(args);
     return 0;
@@ -35,7 +35,9 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/faidx.h>
 #include "bcftools.h"
-#include "rbuf.h"
+#include "recbuf.h"
+#include "profile.h"
+#include "pipe.h"
 
 #define CHECK_REF_EXIT 0
 #define CHECK_REF_WARN 1
@@ -50,6 +52,7 @@ typedef struct
 {
     int nmat, nref, nseq;
     int ipos, lref, lseq;
+    int band, ncore, kd, dmin;     // the matrix is stored by diagonals j-i in the band [dmin,dmin+kd-3], see aln_idx()
     cell_t *mat;
     char *ref, *seq;
     int m_arr, *ipos_arr, *lref_arr, *lseq_arr;
@@ -61,19 +64,27 @@ typedef struct
     aln_aux_t aln;
     char *tseq, *seq;
     int mseq;
-    bcf1_t **lines;
-    rbuf_t rbuf;
+    recbuf_t lines;         // the sorting window
     int buf_win;            // maximum distance between two records to consider
     int aln_win;            // the realignment window size (maximum repeat size)
     bcf_srs_t *files;       // using the synced reader only for -r option
     bcf_hdr_t *hdr;
+    htsFile *out;
+    pipe_stage_t *stage;    // set when running as a stage of bcftools pipe
     faidx_t *fai;
 	char **argv, *ref_fname, *vcf_fname, *region;
 	int argc, rmdup, output_type, check_ref;
     int nchanged, nskipped, ntotal;
+    int naln_fast, naln_band, naln_full;    // alleles realigned by trimming, by banded and by full alignment
 }
 args_t;
 
+// Index of the cell in the row i and column j, with a sentinel cell at both ends of each row
+static inline int aln_idx(aln_aux_t *aux, int i, int j)
+{
+    return i*aux->kd + j - i - aux->dmin + 1;
+}
+
 void _vcfnorm_debug_print(aln_aux_t *aux)
 {
     cell_t *mat = aux->mat;
@@ -81,16 +92,15 @@ void _vcfnorm_debug_print(aln_aux_t *aux)
     char *seq = aux->seq; 
     int nref  = aux->nref;
     int nseq  = aux->nseq;
-    int nlen  = nref>nseq ? nref : nseq;
-    int k     = (nref+1)*(nseq+1)-1;
-    int kd    = nref+2;
-    int i = k/(nref+1);
-    int j = k - i*(nref+1);
-    assert(i>0 && j>0);
+    int nlen  = nref+nseq;
+    int k     = aln_idx(aux,nseq,nref);
+    int kd    = aux->kd;
+    int i = nseq;
+    int j = nref;
     int l = k, ialn = 0, nout_ref = 0, nout_seq = 0, ipos = 0;
     char *aln_ref = (char*) malloc(sizeof(char)*(nlen+1));
     char *aln_seq = (char*) malloc(sizeof(char)*(nlen+1));
-    while ( l>0 )
+    while ( i>0 || j>0 )
     {
         if ( j<=0 || mat[l].dir==1 )    // i
         {
@@ -138,41 +148,92 @@ void _vcfnorm_debug_print(aln_aux_t *aux)
         fprintf(stderr, "%c", i==0 ? ' ' : seq[nseq-i]);
         for (j=0; j<=nref; j++)
         {
+            if ( j-i < aux->dmin || j-i > aux->dmin+kd-3 ) { fprintf(stderr, "     "); continue; }
             char dir = ' ';
-            if ( mat[i*(nref+1)+j].dir==1 ) dir = 'i';
-            else if ( mat[i*(nref+1)+j].dir==-1 ) dir = 'd';
-            fprintf(stderr, " %3d%c", (int)mat[i*(nref+1)+j].val, dir);
+            k = aln_idx(aux,i,j);
+            if ( mat[k].dir==1 ) dir = 'i';
+            else if ( mat[k].dir==-1 ) dir = 'd';
+            fprintf(stderr, " %3d%c", (int)mat[k].val, dir);
         }
         fprintf(stderr,"\n");
     } 
 }
 
+/*
+ *  Pure insertions and deletions do not need the alignment: the leftmost
+ *  position of the gap is given by the length of the common suffix. Returns
+ *  -1 if the alleles differ in more than one gap or if the window is too small.
+ */
+static int trim_shift(aln_aux_t *aux)
+{
+    char *ref = aux->ref;
+    char *seq = aux->seq;
+    int nref  = aux->nref;
+    int nseq  = aux->nseq;
+    int nmin = nref < nseq ? nref : nseq;
+    int npre = 0, nsuf = 0;
+    while ( nsuf<nmin && ref[nref-nsuf-1]==seq[nseq-nsuf-1] ) nsuf++;
+    while ( npre<nmin-nsuf && ref[npre]==seq[npre] ) npre++;
+    aux->ncore = nmin - npre - nsuf;     // the length of the differing part, widens the alignment band
+    if ( nref==nseq || npre+nsuf < nmin || !npre ) return -1;
+    aux->ipos = npre - 1;
+    aux->lref = npre + nref - nmin;
+    aux->lseq = npre + nseq - nmin;
+    return 0;
+}
+
 static int align(args_t *args, aln_aux_t *aux)
 {
+    if ( trim_shift(aux)==0 ) { args->naln_fast++; return 0; }
+
     // Needleman-Wunsch global alignment. Note that the sequences are aligned from
     //  the end where matches are preferred, gaps are pushed to the front (left-aligned)
+    // Only the diagonals within the band of the diagonal (nseq,nref) are calculated,
+    // the band is wide enough to cover the whole matrix for short alleles.
     char *ref = aux->ref;
     char *seq = aux->seq;
     int nref  = aux->nref;
     int nseq  = aux->nseq;
-    if ( (nref+1)*(nseq+1) > aux->nmat )
+    int dmin  = nref < nseq ? nref - nseq : 0;
+    int dmax  = nref < nseq ? 0 : nref - nseq;
+    dmin -= aux->band + aux->ncore; if ( dmin < -nseq ) dmin = -nseq;
+    dmax += aux->band + aux->ncore; if ( dmax > nref ) dmax = nref;
+    if ( dmin==-nseq && dmax==nref ) args->naln_full++;
+    else args->naln_band++;
+    aux->dmin = dmin;
+    aux->kd   = dmax - dmin + 3;
+    if ( (nseq+1)*aux->kd > aux->nmat )
     {
-        aux->nmat = (nref+1)*(nseq+1);
+        aux->nmat = (nseq+1)*aux->kd;
         aux->mat  = (cell_t *) realloc(aux->mat, sizeof(cell_t)*aux->nmat);
         if ( !aux->mat ) 
-            error("Could not allocate %ld bytes of memory at %d\n", sizeof(cell_t)*aux->nmat, args->files->readers[0].buffer[0]->pos+1);
+            error("Could not allocate %ld bytes of memory\n", sizeof(cell_t)*aux->nmat);
     }
     const int GAP_OPEN = -1, GAP_CLOSE = -1, GAP_EXT = 0, MATCH = 1, MISM = -1, DI = 1, DD = -1, DM = 0;
+    const int OUTSIDE = -(1<<26);
     cell_t *mat = aux->mat;
-    int i, j, k = nref+2, kd = nref+2;
-    mat[0].val = 20; mat[0].dir = DM;   // the last ref and alt bases match
-    for (j=1; j<=nref; j++) { mat[j].val = 0; mat[j].dir = DM; }
+    int i, j, k, kd = aux->kd;
+    for (i=0; i<=nseq; i++)
+    {
+        // the sentinels just outside the band
+        mat[i*kd].val = mat[(i+1)*kd-1].val = OUTSIDE;
+        mat[i*kd].dir = mat[(i+1)*kd-1].dir = DM;
+    }
+    mat[aln_idx(aux,0,0)].val = 20; mat[aln_idx(aux,0,0)].dir = DM;   // the last ref and alt bases match
+    for (j=1; j<=dmax; j++) { k = aln_idx(aux,0,j); mat[k].val = 0; mat[k].dir = DM; }
     for (i=1; i<=nseq; i++)
     {
-        mat[k-1].val = 0;
-        mat[k-1].dir = DM;
-        int jmax = i-1 < nref ? i-1 : nref;
-        for (j=1; j<=jmax; j++)
+        int jbeg = i+dmin > 1 ? i+dmin : 1;
+        int jend = i+dmax < nref ? i+dmax : nref;
+        if ( jbeg==1 && i+dmin<=0 )
+        {
+            k = aln_idx(aux,i,0);
+            mat[k].val = 0;
+            mat[k].dir = DM;
+        }
+        k = aln_idx(aux,i,jbeg);
+        int jmax = i-1 < jend ? i-1 : jend;
+        for (j=jbeg; j<=jmax; j++)
         {
             // prefer insertions to deletions and mismatches
             int max, dir, score;
@@ -210,7 +271,7 @@ static int align(args_t *args, aln_aux_t *aux)
             mat[k].dir = dir;
             k++;
         }
-        for (j=jmax+1; j<=nref; j++)
+        for (j=jmax>=jbeg ? jmax+1 : jbeg; j<=jend; j++)
         {
             // prefer deletions to insertions and mismatches
             int max, dir, score;
@@ -248,20 +309,18 @@ static int align(args_t *args, aln_aux_t *aux)
             mat[k].dir = dir;
             k++;
         }
-        k++;
     }
 
     // _vcfnorm_debug_print(aux);
 
     // Skip as much of the matching sequence at the beggining as possible. (Note, the sequence
     // is reversed, thus skipping from the end.)
-    k = (nref+1)*(nseq+1)-1;
-    int kmin = nref>nseq ? 2*(nref+1) - nseq : (nseq-nref)*(nref+1);    // skip the first row and column of the matrix, which are 0s
+    i = nseq;                   // seq[nseq-i]
+    j = nref;                   // ref[nref-j]
+    k = aln_idx(aux,i,j);
+    int imin = nref>nseq ? 1 : nseq-nref;   // skip the first row and column of the matrix, which are 0s
     int ipos = 0;
-    while (k>kmin && mat[k].dir==DM) { k -= kd; ipos++; }
-
-    i = k/(nref+1);             // seq[nseq-i]
-    j = k - i*(nref+1);         // ref[nref-j]
+    while (i>imin && mat[k].dir==DM) { k -= kd; i--; j--; ipos++; }
 
     if ( !i && !j ) 
     {
@@ -279,7 +338,7 @@ static int align(args_t *args, aln_aux_t *aux)
     assert(i>0 && j>0);
 
     int l = k, nout_ref = ipos, nout_seq = ipos, nsuffix = 0;
-    while ( l>0 )
+    while ( i>0 || j>0 )
     {
         if ( j<=0 || mat[l].dir==DI )    // insertion
         {
@@ -497,41 +556,47 @@ int realign(args_t *args, bcf1_t *line)
     return 1;
 }
 
-void flush_buffer(args_t *args, htsFile *file, int n)
+void flush_buffer(args_t *args, int n)
 {
-    int i, k, prev_rid = -1, prev_pos = 0, prev_type = 0;
+    int i, prev_rid = -1, prev_pos = 0, prev_type = 0;
     for (i=0; i<n; i++)
     {
-        k = rbuf_shift(&args->rbuf);
+        bcf1_t **rec = recbuf_shift(&args->lines);
         // todo: merge with next record if POS and the type are same. For now, just discard if asked to do so.
         if ( args->rmdup )
         {
-            int line_type = bcf_get_variant_types(args->lines[k]);
-            if ( prev_rid>=0 && prev_rid==args->lines[k]->rid && prev_pos==args->lines[k]->pos && prev_type==line_type )
+            int line_type = bcf_get_variant_types(*rec);
+            if ( prev_rid>=0 && prev_rid==(*rec)->rid && prev_pos==(*rec)->pos && prev_type==line_type )
                 continue;
-            prev_rid  = args->lines[k]->rid;
-            prev_pos  = args->lines[k]->pos;
+            prev_rid  = (*rec)->rid;
+            prev_pos  = (*rec)->pos;
             prev_type = line_type;
         }
-        bcf_write1(file, args->hdr, args->lines[k]);
+        if ( args->stage )
+            pipe_emit(args->stage, rec);
+        else
+            bcf_write1(args->out, args->hdr, *rec);
     }
 }
 
 static void init_data(args_t *args)
 {
-    args->hdr = args->files->readers[0].header;
-    rbuf_init(&args->rbuf, 100);
-    args->lines = (bcf1_t**) calloc(args->rbuf.m, sizeof(bcf1_t*));
+    args->hdr = args->stage ? args->stage->hdr : args->files->readers[0].header;
+    bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
+    recbuf_init(&args->lines, 100);
     args->fai = fai_load(args->ref_fname);
     if ( !args->fai ) error("Failed to load the fai index: %s\n", args->ref_fname);
+
+    // preallocate the matrix for the common case of short indels
+    args->aln.band = args->aln_win;
+    args->aln.nmat = (args->aln_win+10)*(2*args->aln_win+23);
+    args->aln.mat  = (cell_t*) malloc(sizeof(cell_t)*args->aln.nmat);
 }
 
 static void destroy_data(args_t *args)
 {
-    int i;
-    for (i=0; i<args->rbuf.m; i++)
-        if ( args->lines[i] ) bcf_destroy1(args->lines[i]);
-    free(args->lines);
+    if ( profile_enabled ) recbuf_report(&args->lines, "norm", stderr);
+    recbuf_destroy(&args->lines);
     fai_destroy(args->fai);
     if ( args->mseq ) free(args->seq);
     if ( args->aln.nmat ) free(args->aln.mat);
@@ -539,52 +604,77 @@ static void destroy_data(args_t *args)
 }
 
 
-#define SWAP(type_t, a, b) { type_t t = a; a = b; b = t; }
-static void normalize_vcf(args_t *args)
+static void normalize_line(args_t *args, bcf1_t **line_ptr)
 {
-    htsFile *out = hts_open("-", hts_bcf_wmode(args->output_type));
-    bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
-    bcf_hdr_write(out, args->hdr);
+    args->ntotal++;
 
-    while ( bcf_sr_next_line(args->files) )
+    bcf1_t *line = *line_ptr;
+    if ( realign(args, line)<0 && args->check_ref & CHECK_REF_SKIP ) 
     {
-        args->ntotal++;
-
-        bcf1_t *line = args->files->readers[0].buffer[0];
-        if ( realign(args, line)<0 && args->check_ref & CHECK_REF_SKIP ) 
-        {
-            args->nskipped++;
-            continue;   // exclude broken VCF lines
-        }
+        args->nskipped++;
+        return;     // exclude broken VCF lines
+    }
 
-        // still on the same chromosome?
-        int i, j, ilast = rbuf_last(&args->rbuf); 
-        if ( ilast>=0 && line->rid != args->lines[ilast]->rid ) flush_buffer(args, out, args->rbuf.n); // new chromosome
+    // still on the same chromosome?
+    int i, j, ilast = rbuf_last(&args->lines.rbuf); 
+    if ( ilast>=0 && line->rid != args->lines.recs[ilast]->rid ) flush_buffer(args, args->lines.rbuf.n); // new chromosome
 
-        // insert into sorted buffer
-        i = j = ilast = rbuf_add(&args->rbuf);
-        if ( !args->lines[i] ) args->lines[i] = bcf_init1();
-        SWAP(bcf1_t*, args->files->readers[0].buffer[0], args->lines[i]);
-        while ( rbuf_prev(&args->rbuf,&i) )
-        {
-            if ( args->lines[i]->pos > args->lines[j]->pos ) SWAP(bcf1_t*, args->lines[i], args->lines[j]);
-            j = i;
-        }
+    // insert into sorted buffer
+    i = j = ilast = recbuf_push(&args->lines, line_ptr);
+    while ( rbuf_prev(&args->lines.rbuf,&i) )
+    {
+        if ( args->lines.recs[i]->pos > args->lines.recs[j]->pos ) recbuf_swap(&args->lines, i, j);
+        j = i;
+    }
 
-        // find out how many sites to flush
-        j = 0;
-        for (i=-1; rbuf_next(&args->rbuf,&i); )
-        {
-            if ( args->lines[ilast]->pos - args->lines[i]->pos < args->buf_win ) break;
-            j++;
-        }
-        if ( args->rbuf.n==args->rbuf.m ) j = 1;
-        if ( j>0 ) flush_buffer(args, out, j);
+    // find out how many sites to flush
+    j = 0;
+    for (i=-1; rbuf_next(&args->lines.rbuf,&i); )
+    {
+        if ( args->lines.recs[ilast]->pos - args->lines.recs[i]->pos < args->buf_win ) break;
+        j++;
     }
-    flush_buffer(args, out, args->rbuf.n);
-    hts_close(out);
+    if ( args->lines.rbuf.n==args->lines.rbuf.m ) j = 1;
+    if ( j>0 ) flush_buffer(args, j);
+}
 
+static void print_stats(args_t *args)
+{
     fprintf(stderr,"Lines total/modified/skipped:\t%d/%d/%d\n", args->ntotal,args->nchanged,args->nskipped);
+    fprintf(stderr,"Alleles trimmed/band-aligned/aligned:\t%d/%d/%d\n", args->naln_fast,args->naln_band,args->naln_full);
+}
+
+static void normalize_vcf(args_t *args)
+{
+    args->out = hts_open_mt("-", hts_bcf_wmode(args->output_type));
+    bcf_hdr_write(args->out, args->hdr);
+
+    while ( bcf_sr_next_line(args->files) )
+        normalize_line(args, &args->files->readers[0].buffer[0]);
+
+    flush_buffer(args, args->lines.rbuf.n);
+    hts_close(args->out);
+    print_stats(args);
+}
+
+static void stage_process(pipe_stage_t *stage, bcf1_t **line)
+{
+    normalize_line((args_t*) stage->data, line);
+}
+
+static void stage_flush(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    flush_buffer(args, args->lines.rbuf.n);
+    print_stats(args);
+}
+
+static void stage_destroy(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+    free(args);
 }
 
 static void usage(void)
@@ -654,6 +744,22 @@ int main_vcfnorm(int argc, char *argv[])
 		}
 	}
     if ( !args->ref_fname || argc>optind+1 ) usage();
+
+    pipe_stage_t *stage = pipe_stage_init();
+    if ( stage )
+    {
+        if ( optind<argc || args->region )
+            error("Input files, regions and targets cannot be given to a pipe stage, use the options of bcftools pipe\n");
+        args->stage = stage;
+        init_data(args);
+        stage->hdr     = args->hdr;
+        stage->data    = args;
+        stage->process = stage_process;
+        stage->flush   = stage_flush;
+        stage->destroy = stage_destroy;
+        return 0;
+    }
+
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -0,0 +1,565 @@
+/*  vcfpipe.c -- run several commands in one process.
+
+    Copyright (C) 2014 Genome Research Ltd.
+
+    Author: Petr Danecek <pd3@sanger.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+#include "bcftools.h"
+#include "pipe.h"
+#include "shard.h"
+
+// records waiting between two stages with --stage-threads
+#define QUEUE_SIZE 1024
+
+typedef struct
+{
+    bcf1_t **recs;      // ring buffer, the slots outside [beg,beg+n) hold spare records
+    int beg, n, done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}
+queue_t;
+
+// with --threads, the number of shards per thread to even out the load
+#define SHARDS_PER_THREAD 8
+
+typedef struct
+{
+    bcf1_t **recs;      // the output of a shard, written when the preceding shards are done
+    int nrecs, mrecs, done;
+}
+shard_out_t;
+
+struct _args_t;
+typedef struct
+{
+    struct _args_t *args;
+    bcf_srs_t *files;       // private reader
+    pipe_stage_t *stages;   // private stages
+    char ***stage_argv;
+    shard_out_t *out;       // the output of the shard being processed
+    pthread_t tid;
+}
+worker_t;
+
+typedef struct _args_t
+{
+    bcf_srs_t *files;
+    htsFile *out_fh;
+    bcf_hdr_t *out_hdr;
+    int output_type, stage_threads;
+    char *output_fname;
+
+    pipe_stage_t *stages;
+    char ***stage_argv;
+    int nstages;
+    queue_t *queues;    // with --stage-threads, queues[i] feeds the stage i and queues[nstages] the output
+    pthread_t *tids;
+
+    int nthreads;
+    char *fname, *regions_list, *targets_list;
+    int regions_is_file, targets_is_file;
+    worker_t *workers;
+    shard_t *shards;
+    shard_out_t *shards_out;
+    int nshards, ishard_next, ishard_out;   // next shard to process and to output
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    char **argv;
+    int argc;
+}
+args_t;
+
+static pipe_stage_t *stage_being_set_up = NULL;
+
+pipe_stage_t *pipe_stage_init(void)
+{
+    return stage_being_set_up;
+}
+
+static void emit_next(pipe_stage_t *stage, bcf1_t **rec)
+{
+    args_t *args = (args_t*) stage->pipe;
+    int i = stage->istage + 1;
+    if ( i < args->nstages )
+        args->stages[i].process(&args->stages[i], rec);
+    else if ( bcf_write1(args->out_fh, args->out_hdr, *rec)!=0 )
+        error("Failed to write to %s\n", args->output_fname ? args->output_fname : "standard output");
+}
+
+static void queue_init(queue_t *q)
+{
+    int i;
+    q->recs = (bcf1_t**) malloc(sizeof(bcf1_t*)*QUEUE_SIZE);
+    for (i=0; i<QUEUE_SIZE; i++) q->recs[i] = bcf_init1();
+    q->beg = q->n = q->done = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_destroy(queue_t *q)
+{
+    int i;
+    for (i=0; i<QUEUE_SIZE; i++) bcf_destroy1(q->recs[i]);
+    free(q->recs);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+// Swaps the record in, *rec is given a spare record in exchange
+static void queue_push(queue_t *q, bcf1_t **rec)
+{
+    pthread_mutex_lock(&q->lock);
+    while ( q->n==QUEUE_SIZE ) pthread_cond_wait(&q->cond, &q->lock);
+    int i = (q->beg + q->n) % QUEUE_SIZE;
+    bcf1_t *tmp = q->recs[i]; q->recs[i] = *rec; *rec = tmp;
+    q->n++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Swaps the first record out, returns 0 when the queue is empty and closed
+static int queue_pop(queue_t *q, bcf1_t **rec)
+{
+    pthread_mutex_lock(&q->lock);
+    while ( !q->n && !q->done ) pthread_cond_wait(&q->cond, &q->lock);
+    if ( !q->n )
+    {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    bcf1_t *tmp = q->recs[q->beg]; q->recs[q->beg] = *rec; *rec = tmp;
+    q->beg = (q->beg + 1) % QUEUE_SIZE;
+    q->n--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+static void queue_close(queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->done = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void emit_queued(pipe_stage_t *stage, bcf1_t **rec)
+{
+    args_t *args = (args_t*) stage->pipe;
+    queue_push(&args->queues[stage->istage+1], rec);
+}
+
+static void *stage_worker(void *data)
+{
+    pipe_stage_t *stage = (pipe_stage_t*) data;
+    args_t *args = (args_t*) stage->pipe;
+    bcf1_t *rec = bcf_init1();
+    while ( queue_pop(&args->queues[stage->istage], &rec) )
+        stage->process(stage, &rec);
+    if ( stage->flush ) stage->flush(stage);
+    queue_close(&args->queues[stage->istage+1]);
+    bcf_destroy1(rec);
+    return NULL;
+}
+
+static void *output_worker(void *data)
+{
+    args_t *args = (args_t*) data;
+    bcf1_t *rec = bcf_init1();
+    while ( queue_pop(&args->queues[args->nstages], &rec) )
+        if ( bcf_write1(args->out_fh, args->out_hdr, rec)!=0 )
+            error("Failed to write to %s\n", args->output_fname ? args->output_fname : "standard output");
+    bcf_destroy1(rec);
+    return NULL;
+}
+
+static void init_stage(args_t *args, pipe_stage_t *stage, char ***stage_argv, int argc, char **argv)
+{
+    int flags = 0;
+    pipe_cmd_f func = pipe_stage_cmd(argv[0], &flags);
+    if ( !func ) error("The command \"%s\" cannot be used in a pipe\n", argv[0]);
+    if ( args->nthreads && !(flags & PIPE_SHARD) ) error("The command \"%s\" cannot be run in region shards with --threads\n", argv[0]);
+
+    // the command keeps pointers to its arguments, the copy lives until the stage is destroyed
+    *stage_argv = (char**) malloc(sizeof(char*)*(argc+1));
+    memcpy(*stage_argv, argv, sizeof(char*)*argc);
+    (*stage_argv)[argc] = NULL;
+
+    stage_being_set_up = stage;
+    optind = 1;
+    func(argc, *stage_argv);
+    stage_being_set_up = NULL;
+    if ( !stage->process ) error("Failed to set up the pipe stage: %s\n", argv[0]);
+    if ( args->nthreads && stage->no_shards ) error("The options of \"%s\" need the records of neighbouring regions and cannot be used with --threads\n", argv[0]);
+}
+
+/*
+ *  Sets up a stage for each command of the pipe, the commands are separated
+ *  by "--" and the first "--" is at argv[0]. The stages are called with
+ *  stage->pipe set to pipe.
+ */
+static void init_stages(args_t *args, pipe_stage_t *stages, char ***stage_argv, bcf_hdr_t *hdr, void *pipe,
+        void (*emit)(pipe_stage_t *stage, bcf1_t **rec), int argc, char **argv)
+{
+    int i, istage = 0, beg = 1;
+    for (i=beg; i<=argc; i++)
+    {
+        if ( i<argc && strcmp(argv[i],"--") ) continue;
+        if ( i==beg ) error("Expected a command after \"--\"\n");
+        pipe_stage_t *stage = &stages[istage];
+        stage->hdr    = istage ? stages[istage-1].hdr : hdr;
+        stage->pipe   = pipe;
+        stage->istage = istage;
+        stage->emit   = emit;
+        init_stage(args, stage, &stage_argv[istage], i - beg, argv + beg);
+        istage++;
+        beg = i + 1;
+    }
+}
+
+static void destroy_stages(args_t *args, pipe_stage_t *stages, char ***stage_argv)
+{
+    int i;
+    for (i=0; i<args->nstages; i++)
+    {
+        stages[i].destroy(&stages[i]);
+        free(stage_argv[i]);
+    }
+    free(stages);
+    free(stage_argv);
+}
+
+static void run_threaded(args_t *args)
+{
+    int i;
+    args->queues = (queue_t*) malloc(sizeof(queue_t)*(args->nstages+1));
+    for (i=0; i<=args->nstages; i++) queue_init(&args->queues[i]);
+    args->tids = (pthread_t*) malloc(sizeof(pthread_t)*(args->nstages+1));
+    for (i=0; i<args->nstages; i++)
+        if ( pthread_create(&args->tids[i], NULL, stage_worker, &args->stages[i]) ) error("Could not create a thread\n");
+    if ( pthread_create(&args->tids[args->nstages], NULL, output_worker, args) ) error("Could not create a thread\n");
+
+    while ( bcf_sr_next_line(args->files) )
+        queue_push(&args->queues[0], &args->files->readers[0].buffer[0]);
+    queue_close(&args->queues[0]);
+
+    for (i=0; i<=args->nstages; i++) pthread_join(args->tids[i], NULL);
+    for (i=0; i<=args->nstages; i++) queue_destroy(&args->queues[i]);
+    free(args->queues);
+    free(args->tids);
+}
+
+static void run(args_t *args)
+{
+    int i;
+    while ( bcf_sr_next_line(args->files) )
+        args->stages[0].process(&args->stages[0], &args->files->readers[0].buffer[0]);
+
+    // the buffered records of a stage pass through the stages which follow
+    for (i=0; i<args->nstages; i++)
+        if ( args->stages[i].flush ) args->stages[i].flush(&args->stages[i]);
+}
+
+// The last stage of a worker: take over the record, the stage gets a blank one in exchange
+static void emit_sharded(pipe_stage_t *stage, bcf1_t **rec)
+{
+    worker_t *worker = (worker_t*) stage->pipe;
+    int i = stage->istage + 1;
+    if ( i < worker->args->nstages )
+    {
+        worker->stages[i].process(&worker->stages[i], rec);
+        return;
+    }
+    shard_out_t *out = worker->out;
+    hts_expand0(bcf1_t*, out->nrecs+1, out->mrecs, out->recs);
+    if ( !out->recs[out->nrecs] ) out->recs[out->nrecs] = bcf_init1();
+    bcf1_t *tmp = out->recs[out->nrecs];
+    out->recs[out->nrecs] = *rec;
+    *rec = tmp;
+    out->nrecs++;
+}
+
+static void process_shard(worker_t *worker, shard_t *shard)
+{
+    args_t *args = worker->args;
+    bcf_srs_t *files = worker->files;
+    const char *chr = bcf_hdr_id2name(files->readers[0].header, shard->rid);
+    int i;
+
+    bcf_sr_seek(files, chr, shard->beg);
+    while ( bcf_sr_next_line(files) )
+    {
+        bcf1_t *rec = files->readers[0].buffer[0];
+        if ( rec->rid != shard->rid || rec->pos > shard->end ) break;
+        if ( rec->pos < shard->beg ) continue;  // overlapping record owned by the previous shard
+        worker->stages[0].process(&worker->stages[0], &files->readers[0].buffer[0]);
+    }
+    for (i=0; i<args->nstages; i++)
+        if ( worker->stages[i].flush ) worker->stages[i].flush(&worker->stages[i]);
+}
+
+/*
+ *  The threads take the shards in order as they become free, so a thread
+ *  which got light shards goes on to take more of them. The number of shards
+ *  waiting for output is bounded so that memory does not grow indefinitely.
+ */
+static void *shard_worker(void *data)
+{
+    worker_t *worker = (worker_t*) data;
+    args_t *args = worker->args;
+    while (1)
+    {
+        pthread_mutex_lock(&args->lock);
+        while ( args->ishard_next < args->nshards && args->ishard_next - args->ishard_out >= 2*args->nthreads )
+            pthread_cond_wait(&args->cond, &args->lock);
+        int ishard = args->ishard_next < args->nshards ? args->ishard_next++ : -1;
+        pthread_mutex_unlock(&args->lock);
+        if ( ishard<0 ) break;
+
+        worker->out = &args->shards_out[ishard];
+        process_shard(worker, &args->shards[ishard]);
+
+        pthread_mutex_lock(&args->lock);
+        worker->out->done = 1;
+        pthread_cond_broadcast(&args->cond);
+        pthread_mutex_unlock(&args->lock);
+    }
+    return NULL;
+}
+
+static void init_worker(args_t *args, worker_t *worker, int argc, char **argv)
+{
+    worker->args  = args;
+    worker->files = bcf_sr_init();
+    worker->files->require_index = 1;
+    if ( args->regions_list && bcf_sr_set_regions(worker->files, args->regions_list, args->regions_is_file)<0 )
+        error("Failed to read the regions: %s\n", args->regions_list);
+    if ( args->targets_list && bcf_sr_set_targets(worker->files, args->targets_list, args->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", args->targets_list);
+    if ( !bcf_sr_add_reader(worker->files, args->fname) ) error("Failed to open or the file not indexed: %s\n", args->fname);
+
+    worker->stages = (pipe_stage_t*) calloc(args->nstages, sizeof(pipe_stage_t));
+    worker->stage_argv = (char***) calloc(args->nstages, sizeof(char**));
+    init_stages(args, worker->stages, worker->stage_argv, worker->files->readers[0].header, worker, emit_sharded, argc, argv);
+}
+
+/*
+ *  Region-sharded run: the input is split into shards of similar compressed
+ *  size, each thread has its own reader and stages and processes one shard
+ *  at a time. The main thread writes the shards in genomic order as they are
+ *  completed.
+ */
+static void run_sharded(args_t *args)
+{
+    int i, j;
+    args->shards = shard_split(args->files, args->nthreads*SHARDS_PER_THREAD, &args->nshards);
+    args->shards_out = (shard_out_t*) calloc(args->nshards, sizeof(shard_out_t));
+
+    pthread_mutex_init(&args->lock, NULL);
+    pthread_cond_init(&args->cond, NULL);
+    for (i=0; i<args->nthreads; i++)
+        if ( pthread_create(&args->workers[i].tid, NULL, shard_worker, &args->workers[i]) )
+            error("Failed to create a thread\n");
+
+    for (i=0; i<args->nshards; i++)
+    {
+        shard_out_t *out = &args->shards_out[i];
+        pthread_mutex_lock(&args->lock);
+        while ( !out->done ) pthread_cond_wait(&args->cond, &args->lock);
+        pthread_mutex_unlock(&args->lock);
+
+        for (j=0; j<out->nrecs; j++)
+            if ( bcf_write1(args->out_fh, args->out_hdr, out->recs[j])!=0 )
+                error("Failed to write to %s\n", args->output_fname ? args->output_fname : "standard output");
+        for (j=0; j<out->mrecs; j++)
+            if ( out->recs[j] ) bcf_destroy1(out->recs[j]);
+        free(out->recs);
+        out->recs = NULL;
+
+        pthread_mutex_lock(&args->lock);
+        args->ishard_out = i+1;
+        pthread_cond_broadcast(&args->cond);
+        pthread_mutex_unlock(&args->lock);
+    }
+
+    for (i=0; i<args->nthreads; i++) pthread_join(args->workers[i].tid, NULL);
+    free(args->shards);
+    free(args->shards_out);
+    pthread_mutex_destroy(&args->lock);
+    pthread_cond_destroy(&args->cond);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Run several commands in one process, passing the records between them in memory\n");
+    fprintf(stderr, "         rather than through VCF/BCF streams.\n");
+    fprintf(stderr, "Usage:   bcftools pipe [options] <in.vcf.gz> -- <command> [options] [-- <command> [options] ...]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Commands: annotate, call, filter, norm, view. Regions, targets and the output are\n");
+    fprintf(stderr, "given to the pipe, the remaining options of the commands work as usual. The query\n");
+    fprintf(stderr, "command writes text rather than records and cannot be a stage, pass the output to it.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -o, --output-file <file>          output file name [stdout]\n");
+    fprintf(stderr, "    -O, --output-type <b|u|z|v>       b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "    -r, --regions <region>            restrict to comma-separated list of regions\n");
+    fprintf(stderr, "    -R, --regions-file <file>         restrict to regions listed in a file\n");
+    fprintf(stderr, "        --stage-threads               run each command and the output in a thread of its own\n");
+    fprintf(stderr, "        --threads <int>               run the commands on region shards of the indexed input in <int> threads\n");
+    fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
+    fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "    bcftools pipe -Ob -o calls.bcf in.bcf -- call -mv -- norm -f ref.fa -- filter -s LowQual -i 'QUAL>=20'\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfpipe(int argc, char *argv[])
+{
+    int c, i;
+    char *tmp;
+    args_t *args  = (args_t*) calloc(1,sizeof(args_t));
+    args->argc    = argc; args->argv = argv;
+    args->files   = bcf_sr_init();
+    args->output_type = FT_VCF;
+
+    // the options of the pipe end with the first "--"
+    int npipe_args = 1;
+    while ( npipe_args<argc && strcmp(argv[npipe_args],"--") ) npipe_args++;
+
+    static struct option loptions[] =
+    {
+        {"output-file",1,0,'o'},
+        {"output-type",1,0,'O'},
+        {"regions",1,0,'r'},
+        {"regions-file",1,0,'R'},
+        {"targets",1,0,'t'},
+        {"targets-file",1,0,'T'},
+        {"stage-threads",0,0,1},
+        {"threads",1,0,2},
+        {"help",0,0,'h'},
+        {0,0,0,0}
+    };
+    while ((c = getopt_long(npipe_args, argv, "o:O:r:R:t:T:h?",loptions,NULL)) >= 0)
+    {
+        switch (c) {
+            case 'o': args->output_fname = optarg; break;
+            case 'O':
+                switch (optarg[0]) {
+                    case 'b': args->output_type = FT_BCF_GZ; break;
+                    case 'u': args->output_type = FT_BCF; break;
+                    case 'z': args->output_type = FT_VCF_GZ; break;
+                    case 'v': args->output_type = FT_VCF; break;
+                    default: error("The output type \"%s\" not recognised\n", optarg);
+                }
+                break;
+            case 'r': args->regions_list = optarg; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = 1; break;
+            case 't': args->targets_list = optarg; break;
+            case 'T': args->targets_list = optarg; args->targets_is_file = 1; break;
+            case  1 : args->stage_threads = 1; break;
+            case  2 :
+                args->nthreads = strtol(optarg, &tmp, 10);
+                if ( *tmp || args->nthreads<=0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
+            case 'h':
+            case '?': usage();
+            default: error("Unknown argument: %s\n", optarg);
+        }
+    }
+    if ( npipe_args+1>=argc ) usage();     // no commands
+    if ( args->nthreads && args->stage_threads ) error("The options --threads and --stage-threads cannot be combined\n");
+
+    if ( optind>=npipe_args )
+    {
+        if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";  // reading from stdin
+        else usage();
+    }
+    else if ( optind+1==npipe_args ) args->fname = argv[optind];
+    else usage();
+    if ( args->nthreads && !strcmp(args->fname,"-") ) error("The option --threads requires an indexed file, cannot read from standard input\n");
+
+    if ( args->nthreads ) args->files->require_index = 1;
+    if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
+        error("Failed to read the regions: %s\n", args->regions_list);
+    if ( args->targets_list && bcf_sr_set_targets(args->files, args->targets_list, args->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", args->targets_list);
+    if ( !bcf_sr_add_reader(args->files, args->fname) ) error("Failed to open or the file not indexed: %s\n", args->fname);
+
+    // split the rest at "--", a stage for each command; with --threads each
+    // thread has its own stages and the output header is taken from the first
+    for (i=npipe_args; i<argc; i++)
+        if ( !strcmp(argv[i],"--") ) args->nstages++;
+    if ( args->nthreads )
+    {
+        args->workers = (worker_t*) calloc(args->nthreads, sizeof(worker_t));
+        for (i=0; i<args->nthreads; i++)
+            init_worker(args, &args->workers[i], argc - npipe_args, argv + npipe_args);
+        args->out_hdr = args->workers[0].stages[args->nstages-1].hdr;
+    }
+    else
+    {
+        args->stages = (pipe_stage_t*) calloc(args->nstages, sizeof(pipe_stage_t));
+        args->stage_argv = (char***) calloc(args->nstages, sizeof(char**));
+        init_stages(args, args->stages, args->stage_argv, args->files->readers[0].header, args,
+                args->stage_threads ? emit_queued : emit_next, argc - npipe_args, argv + npipe_args);
+        args->out_hdr = args->stages[args->nstages-1].hdr;
+    }
+    bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_pipe");
+    args->out_fh = hts_open_mt(args->output_fname ? args->output_fname : "-", hts_bcf_wmode(args->output_type));
+    if ( !args->out_fh ) error("Failed to open %s for writing\n", args->output_fname ? args->output_fname : "standard output");
+    bcf_hdr_write(args->out_fh, args->out_hdr);
+
+    if ( args->nthreads )
+        run_sharded(args);
+    else if ( args->stage_threads )
+        run_threaded(args);
+    else
+        run(args);
+
+    hts_close(args->out_fh);
+    if ( args->nthreads )
+    {
+        for (i=0; i<args->nthreads; i++)
+        {
+            destroy_stages(args, args->workers[i].stages, args->workers[i].stage_argv);
+            bcf_sr_destroy(args->workers[i].files);
+        }
+        free(args->workers);
+    }
+    else
+        destroy_stages(args, args->stages, args->stage_argv);
+    bcf_sr_destroy(args->files);
+    free(args);
+    return 0;
+}
@@ -28,6 +28,7 @@
 #include <getopt.h>
 #include <ctype.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,6 +36,7 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
+#include "profile.h"
 #include "filter.h"
 
 #define T_CHROM   1
@@ -55,6 +57,14 @@
 #define T_TGT     16
 #define T_LINE    17
 
+#define QUERY_BUFFER_SIZE 65536     // flush the output when this many bytes are buffered
+
+// --columnar column types
+#define COL_INT32   1
+#define COL_FLOAT   2
+#define COL_STR     3
+#define COL_ROW_GROUP_BYTES (64<<20)    // flush a row group when this many bytes are buffered
+
 struct _args_t;
 typedef struct _args_t args_t;
 
@@ -63,6 +73,7 @@ typedef struct _fmt_t
     int type, id, is_gt_field, ready, subscript;
     int nsamples, *samples;
     char *key;
+    int nkey;
     bcf_fmt_t *fmt;
     void (*handler)(args_t *, bcf1_t *, struct _fmt_t *, int, kstring_t *);
 }
@@ -72,11 +83,24 @@ fmt_t;
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+typedef struct
+{
+    fmt_t *fmt;
+    int type;           // one of the COL_* types
+    kstring_t data;     // the values, or the concatenated strings
+    uint32_t *off;      // string offsets, noff = ncells+1
+    int noff, moff;
+}
+col_t;
+
 struct _args_t
 {
+    col_t *cols;        // the --columnar output, NULL otherwise
+    int columnar, ncols, nrows, row_group;
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
+    int debug_filter;
     fmt_t *fmt;
     int nfmt, mfmt;
 	bcf_srs_t *files;
@@ -228,8 +252,7 @@ static void process_info(args_t *args, bcf1_t *line, fmt_t *fmt, int isample, ks
 }
 static void init_format(args_t *args, bcf1_t *line, fmt_t *fmt)
 {
-    fmt->id = bcf_hdr_id2int(args->header, BCF_DT_ID, fmt->key);
-    if ( fmt->id==-1 ) error("Error: no such tag defined in the VCF header: FORMAT/%s\n", fmt->key);
+    // the tag id is resolved once in register_tag()
     fmt->fmt = NULL;
     int i;
     for (i=0; i<(int)line->n_fmt; i++)  
@@ -315,6 +338,121 @@ static void process_line(args_t *args, bcf1_t *line, fmt_t *fmt, int isample, ks
     vcf_format1(args->header, line, str);
 }
 
+/*
+    The per-sample part of the format string is run as a single loop over
+    the samples with the most common fields specialised by type. The FORMAT
+    fields are looked up once per record and printed directly from the
+    contiguous bcf_fmt_t arrays into space reserved upfront, without going
+    through kputw() and ksprintf() for each value.
+*/
+static inline char *put_int(char *p, int32_t x)
+{
+    char buf[12];
+    uint32_t u = x<0 ? -(uint32_t)x : (uint32_t)x;
+    int l = 0;
+    if ( x<0 ) *p++ = '-';
+    do { buf[l++] = '0' + u%10; u /= 10; } while ( u );
+    while ( l ) *p++ = buf[--l];
+    return p;
+}
+#define PUT_FLOAT_MAX 16
+static inline char *put_float(char *p, float f)
+{
+    // integral values print the same with %g as with %d
+    if ( f > -1e6 && f < 1e6 && f==(int32_t)f && !(f==0 && signbit(f)) ) return put_int(p, (int32_t)f);
+    return p + snprintf(p, PUT_FLOAT_MAX, "%g", f);
+}
+
+// same output as bcf_fmt_array() for numeric types
+static void put_fmt_array(kstring_t *str, int n, int type, uint8_t *data)
+{
+    if ( n==0 ) { kputc('.', str); return; }
+    if ( type==BCF_BT_CHAR ) { bcf_fmt_array(str, n, type, data); return; }
+    ks_resize(str, str->l + n*(PUT_FLOAT_MAX+1) + 1);
+    char *p = str->s + str->l;
+    int j;
+    #define BRANCH(type_t, is_missing, is_vector_end, put) { \
+        type_t *v = (type_t*) data; \
+        for (j=0; j<n; j++) \
+        { \
+            if ( is_vector_end ) break; \
+            if ( j ) *p++ = ','; \
+            if ( is_missing ) *p++ = '.'; \
+            else p = put; \
+        } \
+    }
+    switch (type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  v[j]==bcf_int8_missing,  v[j]==bcf_int8_vector_end,  put_int(p, v[j])); break;
+        case BCF_BT_INT16: BRANCH(int16_t, v[j]==bcf_int16_missing, v[j]==bcf_int16_vector_end, put_int(p, v[j])); break;
+        case BCF_BT_INT32: BRANCH(int32_t, v[j]==bcf_int32_missing, v[j]==bcf_int32_vector_end, put_int(p, v[j])); break;
+        case BCF_BT_FLOAT: BRANCH(float,   bcf_float_is_missing(v[j]), bcf_float_is_vector_end(v[j]), put_float(p, v[j])); break;
+        default: error("Unexpected type %d\n", type);
+    }
+    #undef BRANCH
+    str->l = p - str->s;
+}
+
+// same output as bcf_format_gt()
+static inline void put_gt(kstring_t *str, bcf_fmt_t *fmt, int isample)
+{
+    if ( fmt->type!=BCF_BT_INT8 ) { bcf_format_gt(fmt, isample, str); return; }
+    int8_t *x = (int8_t*)(fmt->p + isample*fmt->size);
+    ks_resize(str, str->l + fmt->n*13 + 1);
+    char *p = str->s + str->l;
+    int l;
+    for (l=0; l<fmt->n && x[l]!=bcf_int8_vector_end; l++)
+    {
+        if ( l ) *p++ = "/|"[x[l]&1];
+        int ial = x[l]>>1;
+        if ( !ial ) *p++ = '.';
+        else if ( ial>0 && ial<=10 ) *p++ = '0' + ial - 1;
+        else p = put_int(p, ial - 1);
+    }
+    if ( l==0 ) *p++ = '.';
+    str->l = p - str->s;
+}
+
+// Print the fields args->fmt[ibeg..iend) for all samples
+static void process_gt_block(args_t *args, bcf1_t *line, int ibeg, int iend, kstring_t *str)
+{
+    int i, js, ir;
+    for (i=ibeg; i<iend; i++)
+    {
+        fmt_t *fmt = &args->fmt[i];
+        if ( fmt->type==T_FORMAT || fmt->type==T_GT || fmt->type==T_TGT ) init_format(args, line, fmt);
+        else fmt->ready = 0;
+    }
+    for (js=0; js<args->nsamples; js++)
+    {
+        int ks = args->samples[js];
+        for (i=ibeg; i<iend; i++)
+        {
+            fmt_t *fmt = &args->fmt[i];
+            switch (fmt->type)
+            {
+                case T_SEP:
+                    if ( fmt->key ) kputsn(fmt->key, fmt->nkey, str);
+                    break;
+                case T_GT:
+                    if ( fmt->fmt ) put_gt(str, fmt->fmt, ks);
+                    else kputc('.', str);
+                    break;
+                case T_FORMAT:
+                    if ( fmt->fmt ) put_fmt_array(str, fmt->fmt->n, fmt->fmt->type, fmt->fmt->p + ks*fmt->fmt->size);
+                    else kputc('.', str);
+                    break;
+                case T_MASK:
+                    for (ir=0; ir<args->files->nreaders; ir++) 
+                        kputc(bcf_sr_has_line(args->files,ir)?'1':'0', str);
+                    break;
+                default:
+                    if ( fmt->handler ) fmt->handler(args, line, fmt, ks, str);
+            }
+        }
+    }
+}
+
 static fmt_t *register_tag(args_t *args, int type, char *key, int is_gtf)
 {
     args->nfmt++;
@@ -327,6 +465,7 @@ static fmt_t *register_tag(args_t *args, int type, char *key, int is_gtf)
     fmt_t *fmt = &args->fmt[ args->nfmt-1 ];
     fmt->type  = type;
     fmt->key   = key ? strdup(key) : NULL;
+    fmt->nkey  = key ? strlen(key) : 0;
     fmt->is_gt_field = is_gtf;
     fmt->subscript = -1;
 
@@ -379,6 +518,11 @@ static fmt_t *register_tag(args_t *args, int type, char *key, int is_gtf)
             fmt->id = bcf_hdr_id2int(args->header, BCF_DT_ID, key);
             if ( fmt->id==-1 ) error("Error: no such tag defined in the VCF header: INFO/%s\n", key);
         }
+        else if ( fmt->type==T_FORMAT || fmt->type==T_GT || fmt->type==T_TGT )
+        {
+            fmt->id = bcf_hdr_id2int(args->header, BCF_DT_ID, key);
+            if ( fmt->id==-1 ) error("Error: no such tag defined in the VCF header: FORMAT/%s\n", key);
+        }
     }
     return fmt;
 }
@@ -529,6 +673,8 @@ static void init_data(args_t *args)
 
     if ( args->filter_str )
         args->filter = filter_init(args->header, args->filter_str);
+    if ( args->filter && args->debug_filter )
+        filter_debug(args->filter, stderr);
 }
 
 static void destroy_data(args_t *args)
@@ -540,7 +686,10 @@ static void destroy_data(args_t *args)
     args->nfmt = args->mfmt = 0;
     args->fmt = NULL;
     if ( args->filter )
+    {
+        if ( args->debug_filter ) filter_stats(args->filter, stderr);
         filter_destroy(args->filter);
+    }
     free(args->samples);
 }
 
@@ -594,53 +743,269 @@ static void print_header(args_t *args, kstring_t *str)
     str->l = 0;
 }
 
+/*
+    The --columnar output. All fields of the -f expression except for the
+    separators become columns. The numbers are in the native byte order of
+    the machine which wrote the file.
+
+        char     magic[8]         "BCFQCOL\1"
+        uint32   ncols, nsamples
+        nsamples x { uint32 len; char name[len] }
+        ncols x { uint8 per_sample; uint8 type; uint16 pad; uint32 len; char name[len] }
+        row groups:
+            uint32   nrows          number of sites, 0 marks the end of the file
+            ncols x { uint64 nbytes; uint8 data[nbytes] }
+
+    The per-sample columns have nrows*nsamples values stored site by site,
+    the rest nrows values. COL_INT32 columns are int32 arrays with missing
+    values set to bcf_int32_missing, COL_FLOAT are float arrays with missing
+    values set to bcf_float_missing. COL_STR columns are an array of
+    ncells+1 uint32 offsets followed by the concatenated strings, the same
+    text as printed by query without --columnar.
+*/
+static int column_type(args_t *args, fmt_t *fmt)
+{
+    int hl;
+    switch (fmt->type)
+    {
+        case T_POS: case T_IS_TS: return COL_INT32;
+        case T_QUAL: return COL_FLOAT;
+        case T_INFO: hl = BCF_HL_INFO; break;
+        case T_FORMAT: hl = BCF_HL_FMT; break;
+        default: return COL_STR;
+    }
+    int type = bcf_hdr_id2type(args->header,hl,fmt->id);
+    if ( type==BCF_HT_FLAG ) return COL_INT32;
+    if ( type!=BCF_HT_INT && type!=BCF_HT_REAL ) return COL_STR;
+    // vectors are exported as scalars only when subscripted
+    if ( fmt->subscript<0 && (bcf_hdr_id2length(args->header,hl,fmt->id)!=BCF_VL_FIXED || bcf_hdr_id2number(args->header,hl,fmt->id)!=1) ) return COL_STR;
+    return type==BCF_HT_INT ? COL_INT32 : COL_FLOAT;
+}
+static void write_u32(uint32_t x) { fwrite(&x, sizeof(x), 1, stdout); }
+static void init_columnar(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nfmt; i++)
+    {
+        if ( args->fmt[i].type==T_SEP ) continue;
+        args->cols = (col_t*) realloc(args->cols, sizeof(col_t)*(args->ncols+1));
+        col_t *col = &args->cols[args->ncols++];
+        memset(col, 0, sizeof(col_t));
+        col->fmt  = &args->fmt[i];
+        col->type = column_type(args, col->fmt);
+    }
+    if ( !args->ncols ) error("No fields to output in the --columnar mode: %s\n", args->format);
+
+    fwrite("BCFQCOL\1", 8, 1, stdout);
+    write_u32(args->ncols);
+    write_u32(args->nsamples);
+    for (i=0; i<args->nsamples; i++)
+    {
+        char *name = args->header->samples[args->samples[i]];
+        write_u32(strlen(name));
+        fwrite(name, strlen(name), 1, stdout);
+    }
+    for (i=0; i<args->ncols; i++)
+    {
+        uint8_t desc[4] = { args->cols[i].fmt->is_gt_field ? 1 : 0, args->cols[i].type, 0, 0 };
+        char *name = args->cols[i].fmt->key ? args->cols[i].fmt->key : "";
+        fwrite(desc, 4, 1, stdout);
+        write_u32(strlen(name));
+        fwrite(name, strlen(name), 1, stdout);
+    }
+}
+static void flush_row_group(args_t *args)
+{
+    int i;
+    if ( !args->nrows ) return;
+    write_u32(args->nrows);
+    for (i=0; i<args->ncols; i++)
+    {
+        col_t *col = &args->cols[i];
+        uint64_t nbytes = col->data.l;
+        if ( col->type==COL_STR ) nbytes += sizeof(uint32_t)*col->noff;
+        fwrite(&nbytes, sizeof(nbytes), 1, stdout);
+        if ( col->type==COL_STR ) fwrite(col->off, sizeof(uint32_t), col->noff, stdout);
+        fwrite(col->data.s, col->data.l, 1, stdout);
+        col->data.l = 0;
+        col->noff = 0;
+    }
+    args->nrows = 0;
+}
+static void destroy_columnar(args_t *args)
+{
+    int i;
+    flush_row_group(args);
+    write_u32(0);
+    for (i=0; i<args->ncols; i++)
+    {
+        free(args->cols[i].data.s);
+        free(args->cols[i].off);
+    }
+    free(args->cols);
+    args->cols = NULL;
+    args->ncols = 0;
+}
+// Value idx of an INFO or FORMAT array converted to int32, missing if beyond the end
+static int32_t col_array_ival(uint8_t *arr, int type, int n, int idx)
+{
+    if ( idx>=n ) return bcf_int32_missing;
+    if ( type==BCF_BT_INT8 )
+    {
+        int8_t x = ((int8_t*)arr)[idx];
+        return x==bcf_int8_missing || x==bcf_int8_vector_end ? bcf_int32_missing : x;
+    }
+    if ( type==BCF_BT_INT16 )
+    {
+        int16_t x = ((int16_t*)arr)[idx];
+        return x==bcf_int16_missing || x==bcf_int16_vector_end ? bcf_int32_missing : x;
+    }
+    if ( type==BCF_BT_INT32 )
+    {
+        int32_t x = ((int32_t*)arr)[idx];
+        return x==bcf_int32_vector_end ? bcf_int32_missing : x;
+    }
+    if ( type==BCF_BT_FLOAT )
+    {
+        float x = ((float*)arr)[idx];
+        return bcf_float_is_missing(x) || bcf_float_is_vector_end(x) ? bcf_int32_missing : (int32_t)x;
+    }
+    return bcf_int32_missing;
+}
+static float col_array_fval(uint8_t *arr, int type, int n, int idx)
+{
+    float x;
+    bcf_float_set_missing(x);
+    if ( idx>=n ) return x;
+    if ( type==BCF_BT_FLOAT )
+    {
+        float y = ((float*)arr)[idx];
+        if ( !bcf_float_is_vector_end(y) ) x = y;
+        return x;
+    }
+    int32_t i = col_array_ival(arr, type, n, idx);
+    if ( i!=bcf_int32_missing ) x = i;
+    return x;
+}
+static void add_cell(args_t *args, bcf1_t *line, col_t *col, int isample)
+{
+    fmt_t *fmt = col->fmt;
+    if ( col->type==COL_STR )
+    {
+        if ( !col->noff ) { hts_expand(uint32_t,1,col->moff,col->off); col->off[col->noff++] = 0; }
+        if ( fmt->type==T_MASK )
+        {
+            int ir;
+            for (ir=0; ir<args->files->nreaders; ir++) 
+                kputc(bcf_sr_has_line(args->files,ir)?'1':'0', &col->data);
+        }
+        else if ( fmt->handler ) fmt->handler(args, line, fmt, isample, &col->data);
+        col->noff++;
+        hts_expand(uint32_t,col->noff,col->moff,col->off);
+        col->off[col->noff-1] = col->data.l;
+        return;
+    }
+
+    int32_t ival = bcf_int32_missing;
+    float fval;
+    bcf_float_set_missing(fval);
+    int idx = fmt->subscript>=0 ? fmt->subscript : 0;
+    if ( fmt->type==T_POS ) ival = line->pos+1;
+    else if ( fmt->type==T_IS_TS )
+    {
+        if ( bcf_get_variant_types(line) & (VCF_SNP|VCF_MNP) ) 
+            ival = abs(bcf_acgt2int(*line->d.allele[0])-bcf_acgt2int(*line->d.allele[1])) == 2 ? 1 : 0;
+        else
+            ival = 0;
+    }
+    else if ( fmt->type==T_QUAL ) fval = line->qual;
+    else if ( fmt->type==T_INFO )
+    {
+        int i;
+        for (i=0; i<line->n_info; i++)
+            if ( line->d.info[i].key==fmt->id ) break;
+        if ( bcf_hdr_id2type(args->header,BCF_HL_INFO,fmt->id)==BCF_HT_FLAG ) ival = i<line->n_info ? 1 : 0;
+        else if ( i<line->n_info )
+        {
+            bcf_info_t *info = &line->d.info[i];
+            if ( col->type==COL_INT32 ) ival = col_array_ival(info->vptr, info->type, info->len, idx);
+            else fval = col_array_fval(info->vptr, info->type, info->len, idx);
+        }
+    }
+    else if ( fmt->type==T_FORMAT && fmt->fmt )
+    {
+        uint8_t *ptr = fmt->fmt->p + isample*fmt->fmt->size;
+        if ( col->type==COL_INT32 ) ival = col_array_ival(ptr, fmt->fmt->type, fmt->fmt->n, idx);
+        else fval = col_array_fval(ptr, fmt->fmt->type, fmt->fmt->n, idx);
+    }
+    if ( col->type==COL_INT32 ) kputsn((char*)&ival, sizeof(ival), &col->data);
+    else kputsn((char*)&fval, sizeof(fval), &col->data);
+}
+static void columnar_add_record(args_t *args, bcf1_t *line)
+{
+    int i, js;
+    size_t nbytes = 0;
+    for (i=0; i<args->nfmt; i++)
+    {
+        fmt_t *fmt = &args->fmt[i];
+        if ( fmt->type==T_FORMAT || fmt->type==T_GT || fmt->type==T_TGT ) init_format(args, line, fmt);
+        else fmt->ready = 0;
+    }
+    for (i=0; i<args->ncols; i++)
+    {
+        col_t *col = &args->cols[i];
+        if ( !col->fmt->is_gt_field ) add_cell(args, line, col, -1);
+        else
+            for (js=0; js<args->nsamples; js++) add_cell(args, line, col, args->samples[js]);
+        nbytes += col->data.l + sizeof(uint32_t)*col->noff;
+    }
+    args->nrows++;
+    if ( args->nrows >= args->row_group || nbytes >= COL_ROW_GROUP_BYTES ) flush_row_group(args);
+}
+
 static void query_vcf(args_t *args)
 {
     kstring_t str = {0,0,0};
 
     args->files->max_unpack |= BCF_UN_STR;
-    if ( args->print_header ) print_header(args, &str);
+    if ( args->columnar ) init_columnar(args);
+    else if ( args->print_header ) print_header(args, &str);
 
+    profile_mark_t prof;
+    PROFILE_START(prof);
     while ( bcf_sr_next_line(args->files) )
     {
+        PROFILE_LAP(PROF_READ, prof);
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = args->files->readers[0].buffer[0];
-        bcf_unpack(line, args->files->max_unpack);
 
+        // the filter unpacks only what it needs, the rest is done for the records which pass
         if ( args->filter )
         {
             int pass = filter_test(args->filter, line, NULL);
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            PROFILE_LAP(PROF_FILTER, prof);
             if ( !pass ) continue;
         }
+        bcf_unpack(line, args->files->max_unpack);
+        PROFILE_LAP(PROF_UNPACK, prof);
+
+        if ( args->cols )
+        {
+            columnar_add_record(args, line);
+            PROFILE_LAP(PROF_FORMAT, prof);
+            continue;
+        }
 
         int i, ir;
-        str.l = 0;
         for (i=0; i<args->nfmt; i++)
         {
             // Genotype fields
             if ( args->fmt[i].is_gt_field )
             {
-                int j = i, js, k;
-                while ( args->fmt[j].is_gt_field ) 
-                {
-                    args->fmt[j].ready = 0;
-                    j++;
-                }
-                for (js=0; js<args->nsamples; js++)
-                {
-                    int ks = args->samples[js];
-                    for (k=i; k<j; k++)
-                    {
-                        if ( args->fmt[k].type == T_MASK )
-                        {
-                            for (ir=0; ir<args->files->nreaders; ir++) 
-                                kputc(bcf_sr_has_line(args->files,ir)?'1':'0', &str);
-                        }
-                        else if ( args->fmt[k].handler )
-                            args->fmt[k].handler(args, line, &args->fmt[k], ks, &str);
-                    }
-                }
+                int j = i;
+                while ( args->fmt[j].is_gt_field ) j++;
+                process_gt_block(args, line, i, j, &str);
                 i = j-1;
                 continue;
             }
@@ -653,10 +1018,20 @@ static void query_vcf(args_t *args)
             else if ( args->fmt[i].handler )
                 args->fmt[i].handler(args, line, &args->fmt[i], -1, &str);
         }
-        if ( str.l )
+        PROFILE_LAP(PROF_FORMAT, prof);
+
+        // the output is written in large chunks rather than line by line
+        if ( str.l >= QUERY_BUFFER_SIZE )
+        {
             fwrite(str.s, str.l, 1, stdout);
+            str.l = 0;
+            PROFILE_LAPN(PROF_WRITE, prof, 0);
+        }
     }
+    if ( str.l )
+        fwrite(str.s, str.l, 1, stdout);
     if ( str.m ) free(str.s);
+    if ( args->cols ) destroy_columnar(args);
 }
 
 static void list_columns(args_t *args)
@@ -705,6 +1080,9 @@ static void usage(void)
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
 	fprintf(stderr, "    -v, --vcf-list <file>             process multiple VCFs listed in the file\n");
+    fprintf(stderr, "        --columnar                    write the fields as typed binary columns, see man page for details\n");
+    fprintf(stderr, "        --debug-filter                print the compiled -i/-e expression to stderr\n");
+    fprintf(stderr, "        --row-group <int>             with --columnar, the maximum number of sites per row group [65536]\n");
     fprintf(stderr, "\n");
 	fprintf(stderr, "Format expressions:\n");
     fprintf(stderr, "\t%%CHROM          The CHROM column (similarly also other columns, such as POS, ID, QUAL, etc.)\n");
@@ -751,6 +1129,9 @@ int main_vcfquery(int argc, char *argv[])
 		{"print-header",0,0,'H'},
 		{"collapse",1,0,'c'},
 		{"vcf-list",1,0,'v'},
+		{"debug-filter",0,0,1},
+		{"columnar",0,0,2},
+		{"row-group",1,0,3},
 		{0,0,0,0}
 	};
 	while ((c = getopt_long(argc, argv, "hlr:R:f:a:s:S:Ht:T:c:v:i:e:",loptions,NULL)) >= 0) {
@@ -793,6 +1174,12 @@ int main_vcfquery(int argc, char *argv[])
 			case 'l': args->list_columns = 1; break;
 			case 's': args->sample_list = optarg; break;
 			case 'S': args->sample_list = optarg; args->sample_is_file = 1; break;
+			case  1 : args->debug_filter = 1; break;
+			case  2 : args->columnar = 1; break;
+			case  3 : 
+				args->row_group = atoi(optarg); 
+				if ( args->row_group<1 ) error("Expected positive integer with --row-group: %s\n", optarg);
+				break;
 			case 'h': 
 			case '?': usage();
 			default: error("Unknown argument: %s\n", optarg);
@@ -818,6 +1205,8 @@ int main_vcfquery(int argc, char *argv[])
     }
 
     if ( !args->format ) usage();
+    if ( args->columnar && args->vcf_list ) error("The --columnar option cannot be combined with -v\n");
+    if ( !args->row_group ) args->row_group = 65536;
     if ( !args->vcf_list )
     {
         if ( !fname ) usage();
@@ -27,12 +27,17 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <math.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kstring.h>
 #include <htslib/kseq.h>
 #include "bcftools.h"
 #include "rbuf.h"
+#include "gtcache.h"
 
 /** Buffered sites, separate for each sample to allow missing genotypes */
 typedef struct
@@ -52,6 +57,17 @@ typedef struct
 }
 genmap_t;
 
+/** Chromosome of a binary genetic map, see convert_genmap() */
+typedef struct
+{
+    char *name;         // empty for a map used for all chromosomes
+    genmap_t *dat;      // points to the memory-mapped file
+    uint64_t n;
+}
+genmap_seq_t;
+
+#define GENMAP_MAGIC "GENMAP\1"
+
 /** Viterbi path element for two-state HMM */
 typedef struct
 {
@@ -70,6 +86,10 @@ typedef struct _args_t
 
     genmap_t *genmap;
     int ngenmap, mgenmap, igenmap;
+    genmap_seq_t *bgenmap;      // binary genetic map
+    int nbgenmap;
+    uint8_t *bgenmap_map;
+    size_t bgenmap_size;
 
     int nsmpl, *ismpl, *als;
     int mwin;
@@ -79,11 +99,20 @@ typedef struct _args_t
     double pl2p[256], *pdg;
     int mPLs, mAFs, mAN, mACs, mpdg;
     int ntot, nused;
+
+    // batched HMM, site-major arrays of --win sites and per-sample states
+    int batch, log_space, nbsites, *bsites;
+    uint32_t *bpos, *blast;
+    uint8_t *bmiss, *bnew;
+    double *boaz, *bohw, *bprob, *bprob2;
+    double *bstate, *bla, *blh, *bla_new, *blh_new;
+    char *bptr;
     int prev_rid, skip_rid;
     double unseen_PL;
 
     char **argv, *targets_list, *regions_list, *samples_list, *af_fname, *af_tag;
-    char *genmap_fname;
+    char *genmap_fname, *cache_fname;
+    gtcache_t *cache;
     int argc, counts_only, fwd_bwd, fake_PLs, biallelic_only, snps_only, estimate_AF;
     int sample_is_file;
 }
@@ -100,7 +129,7 @@ static void init_data(args_t *args)
 {
     args->prev_rid = args->skip_rid = -1;
     args->hdr = args->files->readers[0].header;
-    if ( args->samples_list && args->estimate_AF!=1 && !args->files->readers[0].file->is_bin )
+    if ( args->samples_list && args->estimate_AF!=1 && !args->files->readers[0].file->is_bin && !args->cache_fname )
     {
         // speedup: reading from VCF + only some samples are needed + we do not need to recalculate AC,AN
         // this speeds up the parsing 3x (1.1k samples, 148MB vcf.gz, 38,010 sites)
@@ -133,10 +162,30 @@ static void init_data(args_t *args)
     {
         smpl_t *smpl = &args->smpl[i];
         rbuf_init(&smpl->rbuf, args->mwin);
+        smpl->last_az = -1;
+        if ( args->batch ) { smpl->ohw = smpl->oaz = NULL; smpl->pos = NULL; continue; }
         smpl->ohw = (double*) smalloc(sizeof(double)*args->mwin);
         smpl->oaz = (double*) smalloc(sizeof(double)*args->mwin);
         smpl->pos = (uint32_t*) smalloc(sizeof(uint32_t)*args->mwin);
-        smpl->last_az = -1;
+    }
+    if ( args->batch )
+    {
+        size_t n = args->nsmpl, nwin = args->mwin;
+        args->bsites = (int*) smalloc(sizeof(int)*nwin);
+        args->bpos   = (uint32_t*) smalloc(sizeof(uint32_t)*nwin);
+        args->bmiss  = (uint8_t*) smalloc(sizeof(uint8_t)*nwin*n);
+        args->boaz   = (double*) smalloc(sizeof(double)*nwin*n);
+        args->bohw   = (double*) smalloc(sizeof(double)*nwin*n);
+        args->bprob  = (double*) smalloc(sizeof(double)*(nwin+1)*n);
+        if ( args->fwd_bwd ) args->bprob2 = (double*) smalloc(sizeof(double)*(nwin+1)*n);
+        else args->bptr = (char*) smalloc(sizeof(char)*nwin*n);
+        args->blast  = (uint32_t*) smalloc(sizeof(uint32_t)*n);
+        args->bnew   = (uint8_t*) smalloc(sizeof(uint8_t)*n);
+        args->bstate = (double*) smalloc(sizeof(double)*n);
+        args->bla    = (double*) smalloc(sizeof(double)*n);
+        args->blh    = (double*) smalloc(sizeof(double)*n);
+        args->bla_new = (double*) smalloc(sizeof(double)*n);
+        args->blh_new = (double*) smalloc(sizeof(double)*n);
     }
     for (i=0; i<256; i++)
         args->pl2p[i] = pow(10., -i/10.);
@@ -169,22 +218,137 @@ static void destroy_data(args_t *args)
     free(args->fwd); free(args->bwd); free(args->viterbi);
     free(args->PLs); free(args->AFs); free(args->pdg);
     free(args->AN); free(args->ACs);
+    if ( args->bgenmap_map )
+    {
+        for (i=0; i<args->nbgenmap; i++) free(args->bgenmap[i].name);
+        free(args->bgenmap);
+        munmap(args->bgenmap_map, args->bgenmap_size);
+        args->genmap = NULL;
+    }
     free(args->genmap);
+    free(args->bsites); free(args->bpos); free(args->bmiss); free(args->boaz); free(args->bohw);
+    free(args->bprob); free(args->bprob2); free(args->bptr); free(args->blast); free(args->bnew);
+    free(args->bstate); free(args->bla); free(args->blh); free(args->bla_new); free(args->blh_new);
+}
+
+/*
+ *  Binary genetic map: the maps of all chromosomes, scaled as by load_genmap(),
+ *  in a single memory-mapped file in the native byte order:
+ *      char     magic[8]
+ *      uint32_t nseq, unused
+ *      uint64_t index_offset
+ *      genmap_t data[]
+ *      index:   nseq x { uint64_t offset, n; uint32_t len; char name[len] }
+ */
+static int open_bin_genmap(args_t *args)
+{
+    if ( strstr(args->genmap_fname,"{CHROM}") ) return 0;
+    int fd = open(args->genmap_fname, O_RDONLY);
+    if ( fd<0 ) return 0;
+    char magic[8];
+    struct stat st;
+    if ( read(fd, magic, 8)!=8 || memcmp(magic, GENMAP_MAGIC, 8) || fstat(fd, &st) ) { close(fd); return 0; }
+    args->bgenmap_size = st.st_size;
+    args->bgenmap_map  = (uint8_t*) mmap(NULL, args->bgenmap_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( args->bgenmap_map==MAP_FAILED ) error("Failed to map %s\n", args->genmap_fname);
+
+    uint32_t nseq;
+    uint64_t offset, n;
+    memcpy(&nseq, args->bgenmap_map + 8, sizeof(nseq));
+    memcpy(&offset, args->bgenmap_map + 16, sizeof(offset));
+    args->nbgenmap = nseq;
+    args->bgenmap  = (genmap_seq_t*) calloc(nseq, sizeof(genmap_seq_t));
+    int i;
+    for (i=0; i<args->nbgenmap; i++)
+    {
+        uint32_t len;
+        if ( offset + 2*sizeof(uint64_t) + sizeof(len) > args->bgenmap_size ) error("Corrupted genetic map: %s\n", args->genmap_fname);
+        uint8_t *ptr = args->bgenmap_map + offset;
+        memcpy(&offset, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+        memcpy(&n, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+        memcpy(&len, ptr, sizeof(len)); ptr += sizeof(len);
+        if ( offset + n*sizeof(genmap_t) > args->bgenmap_size || ptr + len > args->bgenmap_map + args->bgenmap_size ) 
+            error("Corrupted genetic map: %s\n", args->genmap_fname);
+        args->bgenmap[i].dat  = (genmap_t*) (args->bgenmap_map + offset);
+        args->bgenmap[i].n    = n;
+        args->bgenmap[i].name = (char*) malloc(len+1);
+        memcpy(args->bgenmap[i].name, ptr, len);
+        args->bgenmap[i].name[len] = 0;
+        offset = ptr + len - args->bgenmap_map;
+    }
+    return 1;
+}
+
+static int load_genmap(args_t *args, int rid);
+
+// Convert the text genetic map(s) given by -m to the binary format
+static void convert_genmap(args_t *args, const char *fname)
+{
+    FILE *fp = fopen(fname, "w");
+    if ( !fp ) error("Failed to create %s\n", fname);
+    uint32_t nseq = 0, pad = 0;
+    uint64_t offset = 0;
+    fwrite(GENMAP_MAGIC, 1, 8, fp);
+    fwrite(&nseq, sizeof(nseq), 1, fp);
+    fwrite(&pad, sizeof(pad), 1, fp);
+    fwrite(&offset, sizeof(offset), 1, fp);
+
+    // with the {CHROM} mask, the maps of all sequences in the VCF header are read
+    int i, is_mask = strstr(args->genmap_fname,"{CHROM}") ? 1 : 0;
+    int n = is_mask ? args->hdr->n[BCF_DT_CTG] : 1;
+    uint64_t *offsets = (uint64_t*) calloc(n, sizeof(uint64_t)), *counts = (uint64_t*) calloc(n, sizeof(uint64_t));
+    for (i=0; i<n; i++)
+    {
+        if ( load_genmap(args, i) ) continue;   // no map for this sequence
+        offsets[i] = ftell(fp);
+        counts[i]  = args->ngenmap;
+        if ( fwrite(args->genmap, sizeof(genmap_t), args->ngenmap, fp)!=args->ngenmap ) error("Failed to write %s\n", fname);
+        nseq++;
+    }
+    offset = ftell(fp);
+    for (i=0; i<n; i++)
+    {
+        if ( !counts[i] ) continue;
+        const char *name = is_mask ? bcf_hdr_id2name(args->hdr,i) : "";
+        uint32_t len = strlen(name);
+        fwrite(&offsets[i], sizeof(uint64_t), 1, fp);
+        fwrite(&counts[i],sizeof(uint64_t), 1, fp);
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(name, 1, len, fp);
+    }
+    if ( fseek(fp, 8, SEEK_SET) || fwrite(&nseq, sizeof(nseq), 1, fp)!=1 ) error("Failed to write %s\n", fname);
+    if ( fseek(fp, 16, SEEK_SET) || fwrite(&offset, sizeof(offset), 1, fp)!=1 ) error("Failed to write %s\n", fname);
+    if ( fclose(fp) ) error("Failed to close %s\n", fname);
+    fprintf(stderr, "Converted the genetic map of %u sequence(s) to %s\n", nseq, fname);
+    free(offsets);
+    free(counts);
 }
 
-static int load_genmap(args_t *args, bcf1_t *line)
+static int load_genmap(args_t *args, int rid)
 {
     int i;
     for (i=0; i<args->nsmpl; i++) args->smpl[i].last_az = -1;   // let viterbi know about new chromosome
 
     if ( !args->genmap_fname ) { args->ngenmap = 0; return 0; }
+    if ( args->bgenmap_map )
+    {
+        const char *chr = bcf_hdr_id2name(args->hdr,rid);
+        args->ngenmap = args->igenmap = 0;
+        for (i=0; i<args->nbgenmap; i++)
+            if ( !args->bgenmap[i].name[0] || !strcmp(chr,args->bgenmap[i].name) ) break;
+        if ( i==args->nbgenmap ) return -1;
+        args->genmap  = args->bgenmap[i].dat;
+        args->ngenmap = args->bgenmap[i].n;
+        return 0;
+    }
 
     kstring_t str = {0,0,0};
     char *fname = strstr(args->genmap_fname,"{CHROM}");
     if ( fname )
     {
         kputsn(args->genmap_fname, fname - args->genmap_fname, &str);
-        kputs(bcf_seqname(args->hdr,line), &str);
+        kputs(bcf_hdr_id2name(args->hdr,rid), &str);
         kputs(fname+7,&str);
         fname = str.s;
     }
@@ -228,21 +392,44 @@ static int load_genmap(args_t *args, bcf1_t *line)
     return 0;
 }
 
+// Index of the first map position not smaller than pos, n if there is none
+static inline int genmap_bound(args_t *args, int pos, int i)
+{
+    genmap_t *gm = args->genmap;
+    int n = args->ngenmap;
+    if ( i<n && gm[i].pos >= pos && (i==0 || gm[i-1].pos < pos) ) return i;   // the same interval as last time
+    int lo = 0, hi = n;
+    while ( lo < hi )
+    {
+        int mid = (lo + hi) / 2;
+        if ( gm[mid].pos < pos ) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
 static double get_genmap_rate(args_t *args, int start, int end)
 {
-    // position i to be equal to or smaller than start
-    int i = args->igenmap;
+    // position i to be equal to or smaller than start. The lookup is the same as
+    // the original linear walk from the previous site: the walk down stops at the
+    // first position not bigger than start, the walk up at the last one smaller
+    // than start, so a site exactly at a map point falls into the preceding interval
+    int i = args->igenmap, n = args->ngenmap;
     if ( args->genmap[i].pos > start )
     {
-        while ( i>0 && args->genmap[i].pos > start ) i--;
+        i = genmap_bound(args, start+1, i) - 1;
+        if ( i<0 ) i = 0;
     }
     else
     {
-        while ( i+1<args->ngenmap && args->genmap[i+1].pos < start ) i++;
+        int k = genmap_bound(args, start, i+1) - 1;
+        if ( k > i ) i = k;
     }
+
     // position j to be equal or larger than end
-    int j = i;
-    while ( j+1<args->ngenmap && args->genmap[j].pos < end ) j++;
+    int j = genmap_bound(args, end, i+1);
+    if ( j >= n ) j = n - 1;
+    if ( j < i ) j = i;
 
     if ( i==j ) 
     {
@@ -361,7 +548,8 @@ static void flush_buffer_fwd_bwd(args_t *args, int ismpl, int n)
         //printf("bwd\ti=%d ir=%d  %d\t oaz=%e ohw=%e \t pAZ=%e  pHW=%e  bwd=%e\n", i,ir,smpl->pos[ir]+1, smpl->oaz[ir],smpl->ohw[ir],pAZ,pHW,args->bwd[i]);
     }
 
-    for (i=1; i<=n; i++)
+    // as in flush_buffer_viterbi(), the n-th site has no rbuf_kth(n) entry to print
+    for (i=1; i<n; i++)
     {
         ir = rbuf_kth(&smpl->rbuf, i);
         printf("%s\t%s\t%d\t%f\n", args->hdr->samples[args->ismpl[ismpl]], args->hdr->id[BCF_DT_CTG][args->prev_rid].key, smpl->pos[ir]+1, args->fwd[i]*args->bwd[i]);
@@ -371,6 +559,18 @@ static void flush_buffer_fwd_bwd(args_t *args, int ismpl, int n)
     rbuf_shift_n(&smpl->rbuf, n);
 }
 
+// traceback: set ptr to 0 for AZ or 1 for HW
+static void viterbi_traceback(args_t *args, int n)
+{
+    int i, mask = args->viterbi[n].pAZ > 0.5 ? 1 : 2;
+    for (i=n-1; i>0; i--)
+    {
+        int ptr = mask & args->viterbi[i+1].ptr;
+        args->viterbi[i+1].ptr = ptr;
+        mask = args->viterbi[i].ptr & mask ? 2 : 1;
+    }
+}
+
 static void flush_buffer_viterbi(args_t *args, int ismpl, int n)
 {
     smpl_t *smpl = &args->smpl[ismpl];
@@ -423,14 +623,7 @@ static void flush_buffer_viterbi(args_t *args, int ismpl, int n)
         args->viterbi[i].pAZ = pAZ / (pAZ+pHW);
         //printf("viterbi\ti=%d ir=%d  %d\t oaz=%e ohw=%e \t pAZ=%e  pHW=%e  fwd=%e \t ci=%e\n", i,ir,smpl->pos[ir]+1, smpl->oaz[ir],smpl->ohw[ir],pAZ,pHW,args->viterbi[i].pAZ, ci);
     }
-    // traceback: set ptr to 0 for AZ or 1 for HW
-    int mask = args->viterbi[n].pAZ > 0.5 ? 1 : 2;
-    for (i=n-1; i>0; i--)
-    {
-        int ptr = mask & args->viterbi[i+1].ptr;
-        args->viterbi[i+1].ptr = ptr;
-        mask = args->viterbi[i].ptr & mask ? 2 : 1;
-    }
+    viterbi_traceback(args, n);
     for (i=1; i<n; i++)
     {
         int AZ = args->viterbi[i].ptr ? 0 : 1;
@@ -450,6 +643,251 @@ static void flush_buffer(args_t *args, int ismpl, int n)
     else flush_buffer_viterbi(args, ismpl, n);
 }
 
+/*
+ *  Batched HMM: the emissions of all samples at a site are stored next to
+ *  each other and the recursions advance all samples at once, with the
+ *  transition probabilities computed once per site. A sample whose previous
+ *  site was missing is recomputed with its own transitions afterwards. The
+ *  results are the same as with flush_buffer_*(), except that the window of
+ *  --win sites is shared by all samples.
+ *
+ *  In log space, the states are kept as log P(AZ) and log P(HW) normalised
+ *  to P(AZ)+P(HW)=1.
+ */
+// Transitions (1-tHW)*(1-ci), tAZ*ci, (1-tAZ)*(1-ci) and tHW*ci, or their logs
+static inline void set_trans(args_t *args, double *t, double ci)
+{
+    t[0] = (1-args->tHW) * (1-ci);
+    t[1] = args->tAZ * ci;
+    t[2] = (1-args->tAZ) * (1-ci);
+    t[3] = args->tHW * ci;
+    if ( args->log_space )
+    {
+        int i;
+        for (i=0; i<4; i++) t[i] = log(t[i]);
+    }
+}
+static inline double logsumexp2(double a, double b)
+{
+    if ( a==-HUGE_VAL ) return b;
+    if ( b==-HUGE_VAL ) return a;
+    return a>b ? a + log1p(exp(b-a)) : b + log1p(exp(a-b));
+}
+static inline double fwd_step(const double *t, double p, double oaz, double ohw)
+{
+    double pAZ = oaz * ( t[0] * p + t[1] * (1-p) );
+    double pHW = ohw * ( t[2] * (1-p) + t[3] * p );
+    return pAZ / (pAZ+pHW);
+}
+static inline void fwd_step_log(const double *t, double *la, double *lh, double oaz, double ohw)
+{
+    double a = oaz + logsumexp2(t[0] + *la, t[1] + *lh);
+    double h = ohw + logsumexp2(t[2] + *lh, t[3] + *la);
+    double m = logsumexp2(a, h);
+    *la = a - m;
+    *lh = h - m;
+}
+static inline double viterbi_step(const double *t, double p, double oaz, double ohw, char *ptr)
+{
+    double fromAZ = t[0] * p, fromHW = t[1] * (1-p);
+    double pAZ = oaz * (fromAZ > fromHW ? fromAZ : fromHW);
+    *ptr = fromAZ > fromHW ? 0 : 1;
+    fromHW = t[2] * (1-p);
+    fromAZ = t[3] * p;
+    double pHW = ohw * (fromAZ > fromHW ? fromAZ : fromHW);
+    *ptr |= fromAZ > fromHW ? 0 : 2;
+    return pAZ / (pAZ+pHW);
+}
+static inline void viterbi_step_log(const double *t, double *la, double *lh, double oaz, double ohw, char *ptr)
+{
+    double fromAZ = t[0] + *la, fromHW = t[1] + *lh;
+    double a = oaz + (fromAZ > fromHW ? fromAZ : fromHW);
+    *ptr = fromAZ > fromHW ? 0 : 1;
+    fromHW = t[2] + *lh;
+    fromAZ = t[3] + *la;
+    double h = ohw + (fromAZ > fromHW ? fromAZ : fromHW);
+    *ptr |= fromAZ > fromHW ? 0 : 2;
+    double m = logsumexp2(a, h);
+    *la = a - m;
+    *lh = h - m;
+}
+
+// One site of the forward (dir=1) or backward (dir=-1) recursion for all samples
+static void batch_step(args_t *args, int isite, int dir, double *prob, char *ptr)
+{
+    int i, n = args->nsmpl;
+    uint32_t pos = args->bpos[isite];
+    const double *oaz = args->boaz + (size_t)isite*n, *ohw = args->bohw + (size_t)isite*n;
+    const uint8_t *miss = args->bmiss + (size_t)isite*n;
+    double *la = args->bla, *lh = args->blh, *na = args->bla_new, *nh = args->blh_new, *p = args->bstate;
+    uint32_t *last = args->blast;
+
+    // the transitions shared by the samples which are not missing at the previous site
+    int shared = isite!=(dir>0 ? 0 : args->nbsites-1) ? 1 : 0;
+    uint32_t prev = shared ? args->bpos[isite-dir] : 0;
+    if ( shared )
+    {
+        double ci, t[4];
+        if ( dir>0 ) ci = args->ngenmap ? get_genmap_rate(args, prev, pos) : (pos - prev + 1)*1e-8;
+        else ci = args->ngenmap ? get_genmap_rate(args, pos, prev) : (prev - pos + 1)*1e-8;
+        set_trans(args, t, ci);
+
+        // branch-free loops over the samples
+        if ( args->log_space && args->fwd_bwd )
+            for (i=0; i<n; i++)
+            {
+                double a = la[i], h = lh[i];
+                fwd_step_log(t, &a, &h, oaz[i], ohw[i]);
+                na[i] = miss[i] ? la[i] : a;
+                nh[i] = miss[i] ? lh[i] : h;
+            }
+        else if ( args->log_space )
+            for (i=0; i<n; i++)
+            {
+                double a = la[i], h = lh[i];
+                viterbi_step_log(t, &a, &h, oaz[i], ohw[i], &ptr[i]);
+                na[i] = miss[i] ? la[i] : a;
+                nh[i] = miss[i] ? lh[i] : h;
+            }
+        else if ( args->fwd_bwd )
+            for (i=0; i<n; i++)
+            {
+                double val = fwd_step(t, p[i], oaz[i], ohw[i]);
+                prob[i] = miss[i] ? p[i] : val;
+            }
+        else
+            for (i=0; i<n; i++)
+            {
+                double val = viterbi_step(t, p[i], oaz[i], ohw[i], &ptr[i]);
+                prob[i] = miss[i] ? p[i] : val;
+            }
+    }
+    else if ( args->log_space )
+    {
+        memcpy(na, la, sizeof(double)*n);
+        memcpy(nh, lh, sizeof(double)*n);
+    }
+    else
+        memcpy(prob, p, sizeof(double)*n);
+
+    // samples missing at the previous site or starting a new chromosome need their own transitions
+    for (i=0; i<n; i++)
+    {
+        if ( miss[i] ) continue;
+        if ( shared && !args->bnew[i] && last[i]==prev ) { last[i] = pos; continue; }
+        if ( args->bnew[i] ) { last[i] = pos - 1; args->bnew[i] = 0; }
+        double ci, t[4];
+        if ( dir>0 ) ci = args->ngenmap ? get_genmap_rate(args, last[i], pos) : (pos - last[i] + 1)*1e-8;
+        else ci = args->ngenmap ? get_genmap_rate(args, pos, last[i]) : (last[i] - pos + 1)*1e-8;
+        last[i] = pos;
+        set_trans(args, t, ci);
+        if ( args->log_space ) { na[i] = la[i]; nh[i] = lh[i]; }
+        if ( args->log_space && args->fwd_bwd ) fwd_step_log(t, &na[i], &nh[i], oaz[i], ohw[i]);
+        else if ( args->log_space ) viterbi_step_log(t, &na[i], &nh[i], oaz[i], ohw[i], &ptr[i]);
+        else if ( args->fwd_bwd ) prob[i] = fwd_step(t, p[i], oaz[i], ohw[i]);
+        else prob[i] = viterbi_step(t, p[i], oaz[i], ohw[i], &ptr[i]);
+    }
+
+    if ( args->log_space )
+    {
+        double *tmp;
+        tmp = args->bla; args->bla = args->bla_new; args->bla_new = tmp;
+        tmp = args->blh; args->blh = args->blh_new; args->blh_new = tmp;
+        for (i=0; i<n; i++) prob[i] = exp(args->bla[i]);
+    }
+    memcpy(p, prob, sizeof(double)*n);
+}
+
+static void batch_init_state(args_t *args, double *init)
+{
+    int i;
+    for (i=0; i<args->nsmpl; i++)
+    {
+        args->bstate[i] = init[i];
+        if ( !args->log_space ) continue;
+        args->bla[i] = log(init[i]);
+        args->blh[i] = log(1-init[i]);
+    }
+}
+
+static void flush_batch(args_t *args)
+{
+    int i, j, k, n = args->nbsites, nsmpl = args->nsmpl;
+    if ( !n ) return;
+
+    // forward or viterbi recursion
+    for (i=0; i<nsmpl; i++)
+    {
+        args->bnew[i] = args->smpl[i].last_az < 0 ? 1 : 0;
+        args->blast[i] = args->smpl[i].last_pos;
+        args->bprob[i] = args->bnew[i] ? 0.5 : args->smpl[i].last_az;
+    }
+    batch_init_state(args, args->bprob);
+    for (j=0; j<n; j++)
+        batch_step(args, j, 1, args->bprob + (size_t)(j+1)*nsmpl, args->bptr ? args->bptr + (size_t)j*nsmpl : NULL);
+
+    // backward recursion, starts from the last site of each sample
+    if ( args->fwd_bwd )
+    {
+        double *init = args->bprob2 + (size_t)n*nsmpl;
+        for (i=0; i<nsmpl; i++) { init[i] = 0.5; args->smpl[i].last_pos = args->blast[i]; }
+        batch_init_state(args, init);
+        for (j=n-1; j>=0; j--)
+            batch_step(args, j, -1, args->bprob2 + (size_t)j*nsmpl, NULL);
+    }
+
+    // the output of each sample, its sites without missing data are laid out as in flush_buffer_*()
+    for (i=0; i<nsmpl; i++)
+    {
+        int nk = 0;
+        if ( args->fwd_bwd ) args->fwd[0] = args->bprob[i];
+        else args->viterbi[0].pAZ = args->bprob[i];
+        for (j=0; j<n; j++)
+        {
+            if ( args->bmiss[(size_t)j*nsmpl+i] ) continue;
+            args->bsites[nk++] = j;
+            if ( args->fwd_bwd ) args->fwd[nk] = args->bprob[(size_t)(j+1)*nsmpl+i];
+            else
+            {
+                args->viterbi[nk].pAZ = args->bprob[(size_t)(j+1)*nsmpl+i];
+                args->viterbi[nk].ptr = args->bptr[(size_t)j*nsmpl+i];
+            }
+        }
+        if ( !nk ) continue;
+        const char *smpl_name = args->hdr->samples[args->ismpl[i]], *chr = args->hdr->id[BCF_DT_CTG][args->prev_rid].key;
+        if ( args->fwd_bwd )
+        {
+            args->bwd[0] = 0.5;
+            for (k=1; k<=nk; k++) args->bwd[k] = args->bprob2[(size_t)args->bsites[nk-k]*nsmpl+i];
+            for (k=1; k<nk; k++)
+                printf("%s\t%s\t%d\t%f\n", smpl_name, chr, args->bpos[args->bsites[k]]+1, args->fwd[k]*args->bwd[k]);
+            args->smpl[i].last_az = args->fwd[nk]*args->bwd[nk];
+        }
+        else
+        {
+            viterbi_traceback(args, nk);
+            for (k=1; k<nk; k++)
+            {
+                int AZ = args->viterbi[k].ptr ? 0 : 1;
+                double pAZ = AZ ? args->viterbi[k].pAZ : 1 - args->viterbi[k].pAZ;
+                printf("%s\t%s\t%d\t%f\t%d\n", smpl_name, chr, args->bpos[args->bsites[k]]+1, pAZ,AZ);
+            }
+            args->smpl[i].last_az = args->viterbi[nk].pAZ;
+        }
+        if ( !args->fwd_bwd ) args->smpl[i].last_pos = args->blast[i];
+    }
+    args->nbsites = 0;
+}
+
+static void flush_all(args_t *args)
+{
+    int i;
+    if ( args->batch ) flush_batch(args);
+    else
+        for (i=0; i<args->nsmpl; i++)
+            flush_buffer(args, i, args->smpl[i].rbuf.n);
+}
+
 // returns 0 on success or positive value if AF could not be set
 static int set_AF(args_t *args, bcf1_t *line, int32_t *GTs, int nGTs)
 {
@@ -671,54 +1109,125 @@ int set_pdg_from_GTs(args_t *args, bcf1_t *line)
     return set_AF(args, line, args->PLs, nGTs);
 }
 
-static void vcfroh(args_t *args, bcf1_t *line)
+// Sets AFs and pdg of a site from the genotype cache, the same as set_pdg_from_*() and set_AF()
+static int set_pdg_from_cache(args_t *args, const gtcache_rec_t *rec)
 {
+    gtcache_t *cache = args->cache;
     int i;
-    if ( !line )
-    { 
+    if ( args->fake_PLs )
+    {
+        if ( !(rec->flags & GTCREC_GT) ) return -1;
         for (i=0; i<args->nsmpl; i++)
-            flush_buffer(args, i, args->smpl[i].rbuf.n); 
-        return; 
+        {
+            double *pdg = &args->pdg[i*3];
+            int gt = gtcache_gt(cache, rec, args->ismpl[i]);
+            if ( gt==GTCACHE_GT_MISSING ) { pdg[0] = -1; continue; }
+            pdg[0] = pdg[1] = pdg[2] = args->unseen_PL;
+            pdg[gt] = 1 - 2*args->unseen_PL;
+            args->als[i] = 1;
+        }
+    }
+    else
+    {
+        if ( !(rec->flags & GTCREC_PL) ) return -1;
+        const uint8_t *pls = gtcache_pl(cache, rec);
+        for (i=0; i<args->nsmpl; i++)
+        {
+            const uint8_t *pl = &pls[args->ismpl[i]*3];
+            double *pdg = &args->pdg[i*3];
+            if ( pl[0]==GTCACHE_PL_MISSING || pl[1]==GTCACHE_PL_MISSING || pl[2]==GTCACHE_PL_MISSING ) { pdg[0] = -1; continue; }
+            if ( !(pl[1]+pl[2]) ) { pdg[0] = -1; continue; }   // missing data, the first PL does not count as in set_pdg_from_PLs()
+            double sum = args->pl2p[pl[0]] + args->pl2p[pl[1]] + args->pl2p[pl[2]];
+            pdg[0] = args->pl2p[ pl[0] ] / sum;
+            pdg[1] = args->pl2p[ pl[1] ] / sum;
+            pdg[2] = args->pl2p[ pl[2] ] / sum;
+            args->als[i] = 1;
+        }
     }
-    if ( line->rid == args->skip_rid ) return;
-    if ( line->n_allele==1 ) return;    // no ALT allele
-    if ( args->biallelic_only && line->n_allele!=2 ) return;
-    if ( args->snps_only && !bcf_is_snp(line) ) return;
+
+    hts_expand(float, 2, args->mAFs, args->AFs);
+    if ( !args->estimate_AF )
+    {
+        if ( !(rec->flags & GTCREC_AF) ) return -2;
+        args->AFs[0] = rec->af[0];
+        args->AFs[1] = rec->af[1];
+        return 0;
+    }
+    if ( !(rec->flags & GTCREC_GT) ) return -3;
+
+    // as in set_AF(), the subset option counts the first allele twice; the
+    // order of alleles is not kept in the cache, heterozygous genotypes count as REF
+    hts_expand(int32_t, 2, args->mACs, args->ACs);
+    args->ACs[0] = args->ACs[1] = 0;
+    int n = args->estimate_AF==1 ? cache->nsmpl : args->nsmpl;
+    for (i=0; i<n; i++)
+    {
+        int gt = gtcache_gt(cache, rec, args->estimate_AF==1 ? i : args->ismpl[i]);
+        if ( gt==GTCACHE_GT_MISSING ) continue;
+        if ( args->estimate_AF==1 ) { args->ACs[0] += 2-gt; args->ACs[1] += gt; }
+        else args->ACs[gt==2 ? 1 : 0] += 2;
+    }
+    int ntot = args->ACs[0] + args->ACs[1];
+    for (i=0; i<2; i++) args->AFs[i] = (float)args->ACs[i] / ntot;
+    return 0;
+}
+
+// Flushes the buffers on a new chromosome, returns 1 if the site should be skipped
+static int roh_new_site(args_t *args, int rid, int nals, int is_snp)
+{
+    if ( rid == args->skip_rid ) return 1;
+    if ( nals==1 ) return 1;    // no ALT allele
+    if ( args->biallelic_only && nals!=2 ) return 1;
+    if ( args->snps_only && !is_snp ) return 1;
 
     int skip_rid = 0;
     if ( args->prev_rid<0 ) 
     {
-        args->prev_rid = line->rid;
-        skip_rid = load_genmap(args, line);
+        args->prev_rid = rid;
+        skip_rid = load_genmap(args, rid);
     }
-    if ( args->prev_rid!=line->rid )
+    if ( args->prev_rid!=rid )
     {
-        for (i=0; i<args->nsmpl; i++)
-            flush_buffer(args, i, args->smpl[i].rbuf.n);
-        skip_rid = load_genmap(args, line);
+        flush_all(args);
+        skip_rid = load_genmap(args, rid);
     }
     if ( skip_rid )
     {
-        fprintf(stderr,"Skipping the sequence: %s\n", bcf_seqname(args->hdr,line));
-        args->skip_rid = line->rid;
-        return;
+        fprintf(stderr,"Skipping the sequence: %s\n", bcf_hdr_id2name(args->hdr,rid));
+        args->skip_rid = rid;
+        return 1;
     }
-    args->prev_rid = line->rid;
+    args->prev_rid = rid;
     args->ntot++;
-    
-    int ret;
-    if ( !args->fake_PLs ) 
-        ret = set_pdg_from_PLs(args, line);
-    else
-        ret = set_pdg_from_GTs(args, line);
+    return 0;
+}
 
-    if ( ret )
+// Adds the site with pdg, als and AFs set
+static void roh_add_site(args_t *args, int pos)
+{
+    int i;
+    args->nused++;
+
+    if ( args->batch )
     {
-        if ( ret>0 ) return;    // AF could not be determined, but it is a non-critical error
-        if ( !args->fake_PLs ) error("Could not parse PL field at %s:%d, please run with -G option\n", bcf_seqname(args->hdr,line), line->pos+1);
-        error("Could not parse GT field at %s:%d\n", bcf_seqname(args->hdr,line), line->pos+1);
+        size_t n = args->nsmpl, isite = args->nbsites++;
+        args->bpos[isite] = pos;
+        double *oaz = args->boaz + isite*n, *ohw = args->bohw + isite*n;
+        uint8_t *miss = args->bmiss + isite*n;
+        for (i=0; i<args->nsmpl; i++)
+        {
+            double *pdg = &args->pdg[i*3];
+            miss[i] = pdg[0]<0 ? 1 : 0;
+            if ( miss[i] ) { oaz[i] = ohw[i] = 0; continue; }
+            float raf = args->AFs[args->als[i]>>4];
+            float aaf = args->AFs[args->als[i]&0xf];
+            oaz[i] = pdg[0]*raf + pdg[2]*aaf;
+            ohw[i] = pdg[0]*raf*raf + pdg[2]*aaf*aaf + pdg[1]*raf*aaf*2;
+            if ( args->log_space ) { oaz[i] = log(oaz[i]); ohw[i] = log(ohw[i]); }
+        }
+        if ( args->nbsites >= args->mwin ) flush_batch(args);
+        return;
     }
-    args->nused++;
 
     // Calculate emission probabilities P(D|AZ) and P(D|HW)
     for (i=0; i<args->nsmpl; i++)
@@ -736,13 +1245,62 @@ static void vcfroh(args_t *args, bcf1_t *line)
         float aaf = args->AFs[irb];
         smpl->oaz[idx] = pdg[0]*raf + pdg[2]*aaf;
         smpl->ohw[idx] = pdg[0]*raf*raf + pdg[2]*aaf*aaf + pdg[1]*raf*aaf*2;
-        smpl->pos[idx] = line->pos;
-        //printf("%d .. als:%d,%d  oaz=%e ohw=%e  raf=%e aaf=%e pdg=%e,%e,%e\n", line->pos+1,ira,irb,smpl->oaz[idx],smpl->ohw[idx],raf,aaf,pdg[0],pdg[1],pdg[2]);
-        //printf("%s\t%d\toaz=%e\tohw=%e\t%d\n", args->hdr->id[BCF_DT_CTG][args->prev_rid].key, line->pos+1,smpl->oaz[idx],smpl->ohw[idx], idx);
+        smpl->pos[idx] = pos;
         if ( smpl->rbuf.n >= args->mwin ) flush_buffer(args, i, smpl->rbuf.n);
     }
 }
 
+static void vcfroh(args_t *args, bcf1_t *line)
+{
+    if ( !line )
+    { 
+        flush_all(args);
+        return; 
+    }
+    if ( roh_new_site(args, line->rid, line->n_allele, bcf_is_snp(line)) ) return;
+    
+    int ret;
+    if ( !args->fake_PLs ) 
+        ret = set_pdg_from_PLs(args, line);
+    else
+        ret = set_pdg_from_GTs(args, line);
+
+    if ( ret )
+    {
+        if ( ret>0 ) return;    // AF could not be determined, but it is a non-critical error
+        if ( !args->fake_PLs ) error("Could not parse PL field at %s:%d, please run with -G option\n", bcf_seqname(args->hdr,line), line->pos+1);
+        error("Could not parse GT field at %s:%d\n", bcf_seqname(args->hdr,line), line->pos+1);
+    }
+    roh_add_site(args, line->pos);
+}
+
+static void vcfroh_cache(args_t *args)
+{
+    gtcache_t *cache = args->cache;
+    int i;
+    for (i=0; i<cache->nseq; i++)
+    {
+        gtcache_seq_t *seq = &cache->seq[i];
+        if ( seq->rid<0 ) error("The sequence %s from the genotype cache is not in the VCF header\n", seq->name);
+        uint64_t isite;
+        for (isite=seq->beg; isite<seq->beg+seq->n; isite++)
+        {
+            const gtcache_rec_t *rec = gtcache_rec(cache, isite);
+            if ( roh_new_site(args, seq->rid, 2, rec->flags & GTCREC_SNP) ) continue;
+            int ret = set_pdg_from_cache(args, rec);
+            if ( ret==-1 )
+            {
+                if ( !args->fake_PLs ) error("Could not parse PL field at %s:%d, please run with -G option\n", seq->name, rec->pos+1);
+                error("Could not parse GT field at %s:%d\n", seq->name, rec->pos+1);
+            }
+            if ( ret==-2 ) error("No AC,AN tag at %s:%d? Use -e to calculate AC,AN on the fly.\n", seq->name, rec->pos+1);
+            if ( ret==-3 ) error("Cannot recalculate AC,AN, GT is not present at %s:%d\n", seq->name, rec->pos+1);
+            roh_add_site(args, rec->pos);
+        }
+    }
+    vcfroh(args, NULL);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -751,12 +1309,15 @@ static void usage(args_t *args)
     fprintf(stderr, "\n");
     fprintf(stderr, "General Options:\n");
     fprintf(stderr, "    -b, --biallelic-sites              consider only bi-allelic sites\n");
+    fprintf(stderr, "        --cache <file>                 read genotypes from <file>, create it from the VCF if it does not exist\n");
     fprintf(stderr, "    -e, --estimate-AF <all|subset>     calculate AC,AN counts on the fly, using either all samples or samples given via -s\n");
     fprintf(stderr, "    -F, --AF-tag <TAG|:file>           use TAG for allele frequency or read from file (CHR\\tPOS\\tREF,ALT\\tAF) if prefixed with ':'\n");
     fprintf(stderr, "    -f, --fwd-bwd                      run forward-backward algorithm instead of Viterbi\n");
     fprintf(stderr, "    -G, --GTs-only <float>             use GTs, ignore PLs, set PL of unseen genotypes to <float>. Safe value to use is 30 to account for GT errors.\n");
     fprintf(stderr, "    -I, --skip-indels                  skip indels as their genotypes are enriched for errors\n");
     fprintf(stderr, "    -m, --genetic-map <file>           genetic map in IMPUTE2 format, single file or mask, where string \"{CHROM}\" is replaced with chromosome name\n");
+    fprintf(stderr, "                                       or a binary map created with --convert-genmap\n");
+    fprintf(stderr, "        --convert-genmap <file>        convert the -m map of all sequences in the VCF header to a binary <file> and exit\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --samples <list>               list of samples to include\n");
@@ -768,6 +1329,8 @@ static void usage(args_t *args)
     fprintf(stderr, "HMM Options:\n");
     fprintf(stderr, "    -a, --hw-to-az <float>             P(AZ|HW) transition probability from AZ (autozygous) to HW (Hardy-Weinberg) state [1e-4]\n");
     fprintf(stderr, "    -H, --az-to-hw <float>             P(HW|AZ) transition probability from HW to AZ state [1e-3]\n");
+    fprintf(stderr, "        --batch-samples                run the HMM for all samples at once, the window is shared\n");
+    fprintf(stderr, "        --log-space                    batched HMM in log space, implies --batch-samples\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -782,6 +1345,7 @@ int main_vcfroh(int argc, char *argv[])
     args->tHW     = 1e-3;
     args->mwin    = (int)1e5;   // maximum number of sites that can be processed in one go
     int regions_is_file = 0, targets_is_file = 0;
+    char *convert_fname = NULL;
 
     static struct option loptions[] = 
     {
@@ -802,6 +1366,10 @@ int main_vcfroh(int argc, char *argv[])
         {"fwd-bwd",1,0,'f'},
         {"biallelic-sites",0,0,'b'},
         {"skip-indels",0,0,'I'},
+        {"cache",1,0,1},
+        {"batch-samples",0,0,2},
+        {"log-space",0,0,3},
+        {"convert-genmap",1,0,4},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "h?r:R:t:T:H:a:w:s:S:cm:fG:bIa:e:F:",loptions,NULL)) >= 0) {
@@ -830,6 +1398,10 @@ int main_vcfroh(int argc, char *argv[])
             case 'T': args->targets_list = optarg; targets_is_file = 1; break;
             case 'r': args->regions_list = optarg; break;
             case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case  1 : args->cache_fname = optarg; break;
+            case  2 : args->batch = 1; break;
+            case  3 : args->batch = args->log_space = 1; break;
+            case  4 : convert_fname = optarg; break;
             case 'h': 
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -838,6 +1410,8 @@ int main_vcfroh(int argc, char *argv[])
 
     if ( (args->af_fname || args->af_tag) && args->estimate_AF ) error("Error: The options -F and -e are mutually exclusive\n");
     if ( args->af_fname && args->targets_list ) error("Error: The options -F and -t are mutually exclusive\n");
+    if ( args->batch && args->counts_only ) error("Error: The options -c and --batch-samples are mutually exclusive\n");
+    if ( args->fwd_bwd && args->genmap_fname && !convert_fname ) error("Error: The options -f and -m are mutually exclusive, the forward-backward algorithm does not support genetic maps\n");
     if ( argc<optind+1 ) usage(args);
     if ( args->regions_list )
     {
@@ -855,13 +1429,41 @@ int main_vcfroh(int argc, char *argv[])
             error("Failed to read the targets: %s\n", args->af_fname);
     }
     if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open or the file not indexed: %s\n", argv[optind]);
+    if ( convert_fname )
+    {
+        if ( !args->genmap_fname ) error("Error: The --convert-genmap option requires -m\n");
+        args->hdr = args->files->readers[0].header;
+        convert_genmap(args, convert_fname);
+        free(args->genmap);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
+    if ( args->genmap_fname ) open_bin_genmap(args);
     
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->cache_fname )
+    {
+        if ( args->af_fname || args->af_tag ) error("Error: The option -F cannot be used with --cache\n");
+        if ( !(args->cache = gtcache_open(args->cache_fname, args->files->readers[0].fname, args->hdr)) )
+        {
+            uint64_t nsites = gtcache_build(args->cache_fname, args->files);
+            fprintf(stderr,"Created the genotype cache %s with %"PRIu64" sites\n", args->cache_fname, nsites);
+            args->cache = gtcache_open(args->cache_fname, args->files->readers[0].fname, args->hdr);
+        }
+        else if ( args->regions_list || args->targets_list ) 
+            error("The -r/-t options are applied when the cache is created, remove them or the cache %s\n", args->cache_fname);
+        vcfroh_cache(args);
+        gtcache_destroy(args->cache);
+    }
+    else
     {
-        vcfroh(args, args->files->readers[0].buffer[0]);
+        while ( bcf_sr_next_line(args->files) )
+        {
+            vcfroh(args, args->files->readers[0].buffer[0]);
+        }
+        vcfroh(args, NULL);
     }
-    vcfroh(args, NULL);
     fprintf(stderr,"Number of lines: total/processed: %d/%d\n", args->ntot,args->nused);
     destroy_data(args);
     free(args);
@@ -38,11 +38,19 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <inttypes.h>
+#include <pthread.h>
+#if defined(SOM_SIMD) && defined(__AVX__)
+#include <immintrin.h>
+#elif defined(SOM_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "bcftools.h"
 
 #define SOM_TRAIN    1
 #define SOM_CLASSIFY 2
 
+#define CLASSIFY_CHUNK 16384    // number of sites scored at once with --threads
+
 typedef struct
 {
     int ndim;       // dimension of the map (2D, 3D, ...)
@@ -76,7 +84,7 @@ typedef struct
     double *train_dat;
     int *train_class, mtrain_class, mtrain_dat;
 
-    int rand_seed, good_class, bad_class;
+    int rand_seed, good_class, bad_class, nthreads;
 	char **argv, *fname, *prefix;
 	int argc, action, train_bad, merge;
 }
@@ -240,6 +248,42 @@ static void som_create_plot(som_t *som, char *prefix)
     fclose(fp);
     free(fname);
 }
+/*
+ *  Squared euclidean distance between the input vector and a node. The default
+ *  scalar loop sums in the original order; compiling with -DSOM_SIMD enables
+ *  the AVX/SSE2 kernel, which sums in a different order, so the scores and the
+ *  choice between equidistant nodes may differ in the last bits.
+ */
+static inline double som_dist2(const double *vec, const double *ptr, int kdim)
+{
+    int k = 0;
+    double dist = 0;
+#if defined(SOM_SIMD) && defined(__AVX__)
+    __m256d sum = _mm256_setzero_pd();
+    for (; k+4<=kdim; k+=4)
+    {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(vec+k), _mm256_loadu_pd(ptr+k));
+        sum = _mm256_add_pd(sum, _mm256_mul_pd(d,d));
+    }
+    double tmp[4];
+    _mm256_storeu_pd(tmp, sum);
+    dist = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+#elif defined(SOM_SIMD) && defined(__SSE2__)
+    __m128d sum = _mm_setzero_pd();
+    for (; k+2<=kdim; k+=2)
+    {
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(vec+k), _mm_loadu_pd(ptr+k));
+        sum = _mm_add_pd(sum, _mm_mul_pd(d,d));
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, sum);
+    dist = tmp[0] + tmp[1];
+#endif
+    for (; k<kdim; k++)
+        dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+    return dist;
+}
+
 // Find the best matching unit: the node with minimum distance from the input vector
 static inline int som_find_bmu(som_t *som, double *vec, double *dist)
 {
@@ -247,12 +291,10 @@ static inline int som_find_bmu(som_t *som, double *vec, double *dist)
     double min_dist = HUGE_VAL;
     int min_idx = 0;
 
-    int i, k;
+    int i;
     for (i=0; i<som->size; i++)
     {
-        double dist = 0;
-        for (k=0; k<som->kdim; k++)
-            dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+        double dist = som_dist2(vec, ptr, som->kdim);
         if ( dist < min_dist )
         {
             min_dist = dist;
@@ -269,14 +311,12 @@ static inline double som_get_score(som_t *som, double *vec, double bmu_th)
     double *ptr = som->w;
     double min_dist = HUGE_VAL;
 
-    int i, k;
+    int i;
     for (i=0; i<som->size; i++)
     {
         if ( som->c[i] >= bmu_th )
         {
-            double dist = 0;
-            for (k=0; k<som->kdim; k++)
-                dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
+            double dist = som_dist2(vec, ptr, som->kdim);
             if ( dist < min_dist ) min_dist = dist;
         }
         ptr += som->kdim;
@@ -399,42 +439,114 @@ static void destroy_data(args_t *args)
 #define MERGE_MIN 0
 #define MERGE_MAX 1
 #define MERGE_AVG 2
-static double get_min_score(args_t *args, int iskip)
+static double get_min_score(args_t *args, double *vec, int iskip)
 {
     int i;
     double score, min_score = HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vec, args->bmu_th);
         if ( i==0 || score < min_score ) min_score = score;
     }
     return min_score;
 }
-static double get_max_score(args_t *args, int iskip)
+static double get_max_score(args_t *args, double *vec, int iskip)
 {
     int i;
     double score, max_score = -HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vec, args->bmu_th);
         if ( i==0 || max_score < score ) max_score = score;
     }
     return max_score;
 }
-static double get_avg_score(args_t *args, int iskip)
+static double get_avg_score(args_t *args, double *vec, int iskip)
 {
     int i, n = 0;
     double score = 0;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score += som_get_score(args->som[i], args->vals, args->bmu_th);
+        score += som_get_score(args->som[i], vec, args->bmu_th);
         n++;
     }
     return score/n;
 }
+static double get_score(args_t *args, double *vec, int iskip)
+{
+    switch (args->merge)
+    {
+        case MERGE_MIN: return get_min_score(args, vec, iskip);
+        case MERGE_MAX: return get_max_score(args, vec, iskip);
+    }
+    return get_avg_score(args, vec, iskip);
+}
+
+// The maps are independent, with --threads each is trained and the sites scored in a separate thread
+typedef struct
+{
+    args_t *args;
+    int ithread, nthreads;
+    int nsites, *isom;          // classify: number of sites and the SOM to skip for each site, NULL for none
+    double *vals, *score;       // nsites*mvals values and the output scores
+}
+som_job_t;
+
+static void *train_worker(void *arg)
+{
+    som_job_t *job = (som_job_t*) arg;
+    args_t *args = job->args;
+    int i, j;
+    for (j=job->ithread; j<args->nfold; j+=job->nthreads)
+    {
+        for (i=0; i<job->nsites; i++)
+        {
+            int is_good = args->train_class[i] & 1;
+            int isom    = args->train_class[i] >> 1; 
+            if ( isom!=j ) continue;
+            if ( is_good || args->train_bad ) 
+                som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+        }
+    }
+    return NULL;
+}
+
+static void *score_worker(void *arg)
+{
+    som_job_t *job = (som_job_t*) arg;
+    args_t *args = job->args;
+    int i, n = (job->nsites + job->nthreads - 1) / job->nthreads;
+    int beg = job->ithread*n, end = beg+n < job->nsites ? beg+n : job->nsites;
+    for (i=beg; i<end; i++)
+        job->score[i] = get_score(args, job->vals+i*args->mvals, job->isom ? job->isom[i] : -1);
+    return NULL;
+}
+
+static void run_jobs(args_t *args, void *(*func)(void*), int nsites, int *isom, double *vals, double *score)
+{
+    int i, nthreads = args->nthreads > 1 ? args->nthreads : 1;
+    som_job_t *jobs = (som_job_t*) calloc(nthreads, sizeof(som_job_t));
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        jobs[i].args = args;
+        jobs[i].ithread  = i;
+        jobs[i].nthreads = nthreads;
+        jobs[i].nsites = nsites;
+        jobs[i].isom   = isom;
+        jobs[i].vals   = vals;
+        jobs[i].score  = score;
+        if ( i==0 ) continue;
+        if ( pthread_create(&tid[i], NULL, func, &jobs[i]) ) error("Could not create a thread\n");
+    }
+    func(&jobs[0]);
+    for (i=1; i<nthreads; i++) pthread_join(tid[i], NULL);
+    free(tid);
+    free(jobs);
+}
 static int cmpfloat_desc(const void *a, const void *b)
 {
     float fa = *((float*)a);
@@ -508,19 +620,15 @@ static void do_train(args_t *args)
     annots_reader_close(args);
 
     // init maps
+    int nthreads = args->nthreads;
     if ( !args->ntrain ) args->ntrain = ngood/args->nfold;
     srandom(args->rand_seed);
     args->som = (som_t**) malloc(sizeof(som_t*)*args->nfold);
     for (i=0; i<args->nfold; i++) args->som[i] = som_init(args);
 
     // train
-    for (i=0; i<ntrain; i++)
-    {
-        int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1; 
-        if ( is_good || args->train_bad ) 
-            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
-    }
+    if ( args->nthreads > args->nfold ) args->nthreads = args->nfold;
+    run_jobs(args, train_worker, ntrain, NULL, NULL, NULL);
 
     // norm and create plots
     for (i=0; i<args->nfold; i++) 
@@ -539,20 +647,16 @@ static void do_train(args_t *args)
     float *bad  = (float*) malloc(sizeof(float)*nbad); assert(bad);
     igood = ibad = 0;
     double max_score = sqrt(args->som[0]->kdim);
+    int *skip = (int*) malloc(sizeof(int)*ntrain);
+    double *scores = (double*) malloc(sizeof(double)*ntrain);
+    for (i=0; i<ntrain; i++)
+        skip[i] = args->nfold==1 ? -1 : args->train_class[i] >> 1;     // this vector was used for training isom-th SOM, skip
+    args->nthreads = nthreads;
+    run_jobs(args, score_worker, ntrain, skip, args->train_dat, scores);
     for (i=0; i<ntrain; i++)
     {
-        double score = 0;
         int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
-        if ( args->nfold==1 ) isom = -1;
-        memcpy(args->vals, args->train_dat+i*args->mvals, args->mvals*sizeof(double));
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, isom); break;
-            case MERGE_MAX: score = get_max_score(args, isom); break;
-            case MERGE_AVG: score = get_avg_score(args, isom); break;
-        }
-        score = 1.0 - score/max_score;
+        double score = 1.0 - scores[i]/max_score;
         if ( is_good )
             good[igood++] = score;
         else
@@ -590,6 +694,8 @@ static void do_train(args_t *args)
         som_write_map(args->prefix, args->som, args->nfold);
     }
 
+    free(skip);
+    free(scores);
     free(good);
     free(bad);
 }
@@ -598,17 +704,31 @@ static void do_classify(args_t *args)
 {
     annots_reader_reset(args);
     double max_score = sqrt(args->som[0]->kdim);
-    while ( annots_reader_next(args) )
+    if ( args->nthreads < 2 )
+    {
+        while ( annots_reader_next(args) )
+            printf("%e\n", 1.0 - get_score(args, args->vals, -1)/max_score);
+        annots_reader_close(args);
+        return;
+    }
+
+    // read the sites in chunks, score the chunk in threads and print in the original order
+    double *vals  = (double*) malloc(sizeof(double)*CLASSIFY_CHUNK*args->mvals);
+    double *score = (double*) malloc(sizeof(double)*CLASSIFY_CHUNK);
+    int i, n, eof = 0;
+    while ( !eof )
     {
-        double score = 0;
-        switch (args->merge)
+        for (n=0; n<CLASSIFY_CHUNK; n++)
         {
-            case MERGE_MIN: score = get_min_score(args, -1); break;
-            case MERGE_MAX: score = get_max_score(args, -1); break;
-            case MERGE_AVG: score = get_avg_score(args, -1); break;
+            if ( !annots_reader_next(args) ) { eof = 1; break; }
+            memcpy(vals+n*args->mvals, args->vals, args->mvals*sizeof(double));
         }
-        printf("%e\n", 1.0 - score/max_score);
+        if ( !n ) break;
+        run_jobs(args, score_worker, n, NULL, vals, score);
+        for (i=0; i<n; i++) printf("%e\n", 1.0 - score[i]/max_score);
     }
+    free(vals);
+    free(score);
     annots_reader_close(args);
 }
 
@@ -637,6 +757,9 @@ static void usage(void)
 	fprintf(stderr, "    -n, --ntrain-sites <int>           effective number of training sites [number of good sites]\n");
 	fprintf(stderr, "    -r, --random-seed <int>            random seed, 0 for time() [1]\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "Other options:\n");
+	fprintf(stderr, "        --threads <int>                train the maps and score the sites in <int> threads [0]\n");
+	fprintf(stderr, "\n");
 	exit(1);
 }
 
@@ -671,6 +794,7 @@ int main_vcfsom(int argc, char *argv[])
 		{"merge",1,0,'m'},
 		{"train",0,0,'t'},
 		{"classify",0,0,'c'},
+		{"threads",1,0,1},
 		{0,0,0,0}
 	};
 	while ((c = getopt_long(argc, argv, "htcp:n:r:b:l:s:f:d:m:e",loptions,NULL)) >= 0) {
@@ -696,6 +820,7 @@ int main_vcfsom(int argc, char *argv[])
                 break;
             case 't': args->action = SOM_TRAIN; break;
             case 'c': args->action = SOM_CLASSIFY; break;
+            case  1 : args->nthreads = atoi(optarg); break;
 			case 'h': 
 			case '?': usage();
 			default: error("Unknown argument: %s\n", optarg);
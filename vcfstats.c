@@ -30,6 +30,7 @@
 */
 #include <stdio.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <math.h>
@@ -38,13 +39,19 @@
 #include <htslib/vcfutils.h>
 #include <htslib/faidx.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "bcftools.h"
+#include "gtkern.h"
+#include "statsidx.h"
 
 #define HWE_STATS 1
 #define QUAL_STATS 1
 #define IRC_STATS 1
 #define IRC_RLEN 10
 
+// With --threads, the input is split into chunks of this size (in bp)
+#define CHUNK_SIZE 1000000
+
 typedef struct
 {
     char *tag;
@@ -64,7 +71,7 @@ idist_t;
 
 typedef struct
 {
-    int n_snps, n_indels, n_mnps, n_others, n_mals, n_snp_mals;
+    int n_records, n_snps, n_indels, n_mnps, n_others, n_mals, n_snp_mals;  // n_records is filled only from the sidecar
     int *af_ts, *af_tv, *af_snps;   // first bin of af_* stats are singletons
     #if HWE_STATS
         int *af_hwe;
@@ -111,10 +118,36 @@ typedef struct
 indel_ctx_t;
 
 typedef struct
+{
+    float r2;
+    int iaf, is_snp;
+}
+r2val_t;
+
+typedef struct
+{
+    const char *seq;
+    int beg, end;           // 0-based, inclusive
+    r2val_t *r2vals;        // r2 values of the chunk, added up in genomic order by the main thread
+    int nr2vals, mr2vals;
+}
+chunk_t;
+
+// A region counted in the stats, the chromosome "*" stands for the whole input
+typedef struct
+{
+    char *chr;
+    int beg, end;   // 0-based, inclusive
+}
+ckpt_reg_t;
+
+typedef struct _args_t
 {
     // stats
     stats_t stats[3];
     int *tmp_iaf, ntmp_iaf, m_af, m_qual, naf_hwe;
+    uint8_t *gt_type, *gt_ial;      // per-sample GT types and first ALT alleles of the current record
+    int mgt_type, mgt_ial, *tmp_tstv, mtmp_tstv;
     int dp_min, dp_max, dp_step;
     gtcmp_t *af_gts_snps, *af_gts_indels, *smpl_gts_snps, *smpl_gts_indels; // first bin of af_* stats are singletons
 
@@ -131,10 +164,38 @@ typedef struct
     bcf_sr_regions_t *exons;
     char **argv, *exons_fname, *regions_list, *samples_list, *targets_list;
     int argc, debug, first_allele_only, samples_is_file;
-    int split_by_id, nstats;
+    int split_by_id, nstats, regions_is_file, targets_is_file, sidecar;
+
+    // the files and samples described in the output, from the readers or from a checkpoint
+    int nfiles, nfile_smpl[2], n_smpl, do_fs_stats, do_irc_stats;
+    const char *set_fnames[2];
+    char **samples;
+
+    // checkpoints
+    char *save_checkpoint, **load_checkpoints;
+    int nload_checkpoints;
+    ckpt_reg_t *cov;        // the regions counted by this run and the loaded checkpoints
+    int ncov, mcov;
+
+    // multi-threading: the chunk queue lives in the main context, each worker
+    // has a private copy of args_t pointing to the main context via master
+    int nthreads;
+    struct _args_t *master;
+    chunk_t *chunks;
+    int nchunks, mchunks, ichunk_next;
+    pthread_mutex_t lock;
+    r2val_t *r2vals;        // in workers, r2 values of the current chunk
+    int nr2vals, mr2vals;
 }
 args_t;
 
+typedef struct
+{
+    args_t args;
+    pthread_t tid;
+}
+worker_t;
+
 
 static void idist_init(idist_t *d, int min, int max, int step)
 {
@@ -358,13 +419,14 @@ static void init_user_stats(args_t *args, bcf_hdr_t *hdr, stats_t *stats)
         user_stats_t *usr = &stats->usr[i];
         usr->vals_ts = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
         usr->vals_tv = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
+        if ( !hdr ) continue;   // the type was read from a checkpoint
         int id = bcf_hdr_id2int(hdr,BCF_DT_ID,usr->tag);
         if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,id) ) error("The INFO tag \"%s\" is not defined in the header\n", usr->tag);
         usr->type = bcf_hdr_id2type(hdr,BCF_HL_INFO,id);
         if ( usr->type!=BCF_HT_REAL && usr->type!=BCF_HT_INT ) error("The INFO tag \"%s\" is not of Float or Integer type (%d)\n", usr->type);
     }
 }
-static void init_stats(args_t *args)
+static void init_sets(args_t *args)
 {
     int i;
     args->nstats = args->files->nreaders==1 ? 1 : 3;
@@ -394,10 +456,36 @@ static void init_stats(args_t *args)
             else
                 error("Unable to parse the samples: \"%s\"\n", args->samples_list);
         }
+    }
+
+    args->nfiles = args->files->nreaders;
+    for (i=0; i<args->nfiles && i<2; i++)
+    {
+        args->set_fnames[i] = strcmp("-",args->files->readers[i].fname) ? args->files->readers[i].fname : "<STDIN>";
+        args->nfile_smpl[i] = bcf_hdr_nsamples(args->files->readers[i].header);
+    }
+    args->n_smpl  = args->files->n_smpl;
+    args->samples = args->files->samples;
+    args->do_fs_stats = args->exons_fname ? 1 : 0;
+    #if IRC_STATS
+        args->do_irc_stats = args->ref_fname ? 1 : 0;
+    #endif
+}
+
+/*
+ *  Allocates the accumulators. The sets, samples and binning are set by
+ *  init_sets() from the readers or by checkpoint_read_layout().
+ */
+static void init_stats(args_t *args)
+{
+    int i;
+    if ( args->files->nreaders ) init_sets(args);
+    if ( args->n_smpl )
+    {
         args->af_gts_snps     = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
         args->af_gts_indels   = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
-        args->smpl_gts_snps   = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
-        args->smpl_gts_indels = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
+        args->smpl_gts_snps   = (gtcmp_t *) calloc(args->n_smpl,sizeof(gtcmp_t));
+        args->smpl_gts_indels = (gtcmp_t *) calloc(args->n_smpl,sizeof(gtcmp_t));
     }
     for (i=0; i<args->nstats; i++)
     {
@@ -416,24 +504,28 @@ static void init_stats(args_t *args)
             stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
             stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
         #endif
-        if ( args->files->n_smpl )
+        if ( args->n_smpl )
         {
-            stats->smpl_hets   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homAA  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homRR  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_ts     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_tv     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indels = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_dp     = (unsigned long int *) calloc(args->files->n_smpl,sizeof(unsigned long int));
-            stats->smpl_ndp    = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_sngl   = (int *) calloc(args->files->n_smpl,sizeof(int));
+            stats->smpl_hets   = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_homAA  = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_homRR  = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_ts     = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_tv     = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_indels = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_dp     = (unsigned long int *) calloc(args->n_smpl,sizeof(unsigned long int));
+            stats->smpl_ndp    = (int *) calloc(args->n_smpl,sizeof(int));
+            stats->smpl_sngl   = (int *) calloc(args->n_smpl,sizeof(int));
             #if HWE_STATS
                 stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
             #endif
         }
         idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
-        init_user_stats(args, i!=1 ? args->files->readers[0].header : args->files->readers[1].header, stats);
+        if ( !args->files->nreaders )
+            init_user_stats(args, NULL, stats);
+        else
+            init_user_stats(args, i!=1 ? args->files->readers[0].header : args->files->readers[1].header, stats);
     }
+    if ( !args->files->nreaders ) return;
 
     if ( args->exons_fname )
     {
@@ -491,6 +583,9 @@ static void destroy_stats(args_t *args)
     for (j=0; j<args->nusr; j++) free(args->usr[j].tag);
     free(args->usr);
     if (args->tmp_iaf) free(args->tmp_iaf);
+    free(args->gt_type);
+    free(args->gt_ial);
+    free(args->tmp_tstv);
     if (args->exons) bcf_sr_regions_destroy(args->exons);
     if (args->af_gts_snps) free(args->af_gts_snps);
     if (args->af_gts_indels) free(args->af_gts_indels);
@@ -723,61 +818,100 @@ static void do_snp_stats(args_t *args, stats_t *stats, bcf_sr_t *reader)
     }
 }
 
+typedef struct
+{
+    int n_nref, i_nref;                 // the number of non-ref samples and the last of them
+    int nref_tot, nhet_tot, nalt_tot;   // genotype counts for the HWE stats
+}
+smpl_gt_cnt_t;
+
+// Adds the genotype of a sample to the per-sample counters. Returns 1 if the
+// genotype is skipped. Note that the counters rely on the values GT_HOM_RR=0,
+// GT_HOM_AA=1, GT_HET_RA=2, GT_HET_AA=3
+static inline int smpl_gt_stats(args_t *args, stats_t *stats, int line_type, int is, int gt, int ial, smpl_gt_cnt_t *cnt)
+{
+    if ( gt==GT_UNKN || gt==GT_HAPL_R || gt==GT_HAPL_A ) return 1;
+    if ( gt != GT_HOM_RR ) { cnt->n_nref++; cnt->i_nref = is; }
+    #if HWE_STATS
+        if ( gt==GT_HOM_RR ) cnt->nref_tot++;
+        else if ( gt==GT_HET_RA ) cnt->nhet_tot++;
+        else cnt->nalt_tot++;
+    #endif
+    if ( line_type&VCF_SNP )
+    {
+        stats->smpl_hets[is]  += gt>>1;
+        stats->smpl_homRR[is] += gt==GT_HOM_RR;
+        stats->smpl_homAA[is] += gt==GT_HOM_AA;
+        if ( gt != GT_HOM_RR )
+        {
+            int tstv = args->tmp_tstv[ial];
+            if ( tstv<0 ) return 0;     // unknown base, the indel counter is not updated either
+            if ( tstv==1 ) stats->smpl_ts[is]++;
+            else if ( tstv==2 ) stats->smpl_tv[is]++;
+        }
+    }
+    if ( line_type&VCF_INDEL ) stats->smpl_indels[is] += gt!=GT_HOM_RR;
+    return 0;
+}
+
 static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int matched)
 {
     bcf_srs_t *files = args->files;
     bcf1_t *line = reader->buffer[0];
     bcf_fmt_t *fmt_ptr;
-    int nref_tot = 0, nhet_tot = 0, nalt_tot = 0;
+    smpl_gt_cnt_t cnt;
+    memset(&cnt, 0, sizeof(cnt));
     int line_type = bcf_get_variant_types(line);
 
     if ( (fmt_ptr = bcf_get_fmt(reader->header,reader->buffer[0],"GT")) )
     {
         int ref = bcf_acgt2int(*line->d.allele[0]);
-        int is, n_nref = 0, i_nref = 0;
-        for (is=0; is<args->files->n_smpl; is++)
+        int is;
+
+        // Transitions (1) and transversions (2) by allele, 0 for non-SNPs, -1 for SNPs with unknown base
+        if ( line_type&VCF_SNP )
         {
             int ial;
-            int gt = bcf_gt_type(fmt_ptr, reader->samples[is], &ial, NULL);
-            if ( gt==GT_UNKN || gt==GT_HAPL_R || gt==GT_HAPL_A ) continue;
-            if ( gt != GT_HOM_RR ) { n_nref++; i_nref = is; }
-            #if HWE_STATS
-                switch (gt)
-                {
-                    case GT_HOM_RR: nref_tot++; break;
-                    case GT_HET_RA: nhet_tot++; break;
-                    case GT_HET_AA:
-                    case GT_HOM_AA: nalt_tot++; break;
-                }
-            #endif
-            if ( line_type&VCF_SNP )
+            hts_expand(int, line->n_allele, args->mtmp_tstv, args->tmp_tstv);
+            for (ial=1; ial<line->n_allele; ial++)
             {
-                if ( gt == GT_HET_RA ) stats->smpl_hets[is]++;
-                else if ( gt == GT_HET_AA ) stats->smpl_hets[is]++;
-                else if ( gt == GT_HOM_RR ) stats->smpl_homRR[is]++;
-                else if ( gt == GT_HOM_AA ) stats->smpl_homAA[is]++;
-                if ( gt != GT_HOM_RR && line->d.var[ial].type&VCF_SNP ) // this is safe, bcf_get_variant_types has been already called
-                {
-                    int alt = bcf_acgt2int(*line->d.allele[ial]);
-                    if ( alt<0 ) continue;
-                    if ( abs(ref-alt)==2 ) 
-                        stats->smpl_ts[is]++;
-                    else
-                        stats->smpl_tv[is]++;
-                }
+                args->tmp_tstv[ial] = 0;
+                if ( !(line->d.var[ial].type&VCF_SNP) ) continue; // this is safe, bcf_get_variant_types has been already called
+                int alt = bcf_acgt2int(*line->d.allele[ial]);
+                if ( alt<0 ) args->tmp_tstv[ial] = -1;
+                else args->tmp_tstv[ial] = abs(ref-alt)==2 ? 1 : 2;
+            }
+        }
+
+        if ( fmt_ptr->type==BCF_BT_INT8 && fmt_ptr->n==2 )
+        {
+            // the common diploid case: classify the whole row at once, then accumulate
+            hts_expand(uint8_t, line->n_sample, args->mgt_type, args->gt_type);
+            hts_expand(uint8_t, line->n_sample, args->mgt_ial, args->gt_ial);
+            gtkern_classify_diploid8((int8_t*)fmt_ptr->p, line->n_sample, args->gt_type, args->gt_ial);
+            for (is=0; is<args->files->n_smpl; is++)
+            {
+                int gt  = args->gt_type[reader->samples[is]];
+                int ial = args->gt_ial[reader->samples[is]];
+                if ( smpl_gt_stats(args, stats, line_type, is, gt, ial, &cnt) ) continue;
             }
-            if ( line_type&VCF_INDEL )
+        }
+        else
+        {
+            // int16 rows (over 63 alleles), haploid and polyploid rows, one sample at a time
+            for (is=0; is<args->files->n_smpl; is++)
             {
-                if ( gt != GT_HOM_RR ) stats->smpl_indels[is]++;
+                int ial, gt = bcf_gt_type(fmt_ptr, reader->samples[is], &ial, NULL);
+                if ( smpl_gt_stats(args, stats, line_type, is, gt, ial, &cnt) ) continue;
             }
         }
-        if ( n_nref==1 ) stats->smpl_sngl[i_nref]++;
+        if ( cnt.n_nref==1 ) stats->smpl_sngl[cnt.i_nref]++;
     }
 
     #if HWE_STATS
-        if ( nhet_tot + nref_tot + nalt_tot )
+        if ( cnt.nhet_tot + cnt.nref_tot + cnt.nalt_tot )
         {
-            float het_frac = (float)nhet_tot/(nhet_tot + nref_tot + nalt_tot);
+            float het_frac = (float)cnt.nhet_tot/(cnt.nhet_tot + cnt.nref_tot + cnt.nalt_tot);
             int idx = het_frac*(args->naf_hwe - 1);
             if ( line->n_allele>1 ) idx += args->naf_hwe*args->tmp_iaf[1]; 
             stats->af_hwe[idx]++;
@@ -860,8 +994,21 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
         {
             float cov  = r2ab - r2a*r2b/r2n;
             float var2 = (r2a2 - r2a*r2a/r2n) * (r2b2 - r2b*r2b/r2n);
-            af_stats[iaf].r2sum += var2==0 ? 1 : cov*cov/var2;
-            af_stats[iaf].r2n++;
+            float r2 = var2==0 ? 1 : cov*cov/var2;
+            if ( args->master )
+            {
+                // floating point sums depend on the order, these are added up later by the main thread
+                args->nr2vals++;
+                hts_expand(r2val_t, args->nr2vals, args->mr2vals, args->r2vals);
+                args->r2vals[args->nr2vals-1].r2 = r2;
+                args->r2vals[args->nr2vals-1].iaf = iaf;
+                args->r2vals[args->nr2vals-1].is_snp = line_type&VCF_SNP ? 1 : 0;
+            }
+            else
+            {
+                af_stats[iaf].r2sum += r2;
+                af_stats[iaf].r2n++;
+            }
         }
 
         if ( args->debug )
@@ -882,48 +1029,786 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
     }
 }
 
+static void do_record_stats(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    bcf_sr_t *reader = NULL;
+    bcf1_t *line = NULL;
+    int ret = 0, i;
+    for (i=0; i<files->nreaders; i++)
+    {
+        if ( !bcf_sr_has_line(files,i) ) continue;
+        ret |= 1<<i;
+        if ( reader ) continue;
+        reader = &files->readers[i];
+        line = files->readers[i].buffer[0];
+    }
+    int line_type = bcf_get_variant_types(line);
+    init_iaf(args, reader);
+
+    stats_t *stats = &args->stats[ret-1];
+    if ( args->split_by_id && line->d.id[0]=='.' && !line->d.id[1] )
+        stats = &args->stats[1];
+
+    if ( line_type&VCF_SNP ) 
+        do_snp_stats(args, stats, reader);
+    if ( line_type&VCF_INDEL )
+        do_indel_stats(args, stats, reader);
+    if ( line_type&VCF_MNP )
+        do_mnp_stats(args, stats, reader);
+    if ( line_type&VCF_OTHER )
+        do_other_stats(args, stats, reader);
+
+    if ( line->n_allele>2 ) 
+    {
+        stats->n_mals++;
+        if ( line_type == VCF_SNP ) stats->n_snp_mals++;
+    }
+
+    if ( files->n_smpl )
+        do_sample_stats(args, stats, reader, ret);
+}
+
 static void do_vcf_stats(args_t *args)
 {
     bcf_srs_t *files = args->files;
     assert( sizeof(int)>files->nreaders );
+    while ( bcf_sr_next_line(files) )
+        do_record_stats(args);
+}
+
+static void add_chunks(args_t *args, const char *seq)
+{
+    // Contig length from the headers, sequences of unknown length are not split
+    int i, j, len = 0;
+    for (i=0; i<args->files->nreaders && !len; i++)
+    {
+        bcf_hdr_t *hdr = args->files->readers[i].header;
+        int rid = bcf_hdr_name2id(hdr, seq);
+        if ( rid<0 ) continue;
+        bcf_hrec_t *hrec = hdr->id[BCF_DT_CTG][rid].val->hrec[0];
+        for (j=0; hrec && j<hrec->nkeys; j++)
+            if ( !strcmp("length",hrec->keys[j]) ) len = atoi(hrec->vals[j]);
+    }
+
+    int beg = 0;
+    do
+    {
+        args->nchunks++;
+        hts_expand(chunk_t, args->nchunks, args->mchunks, args->chunks);
+        chunk_t *chunk = &args->chunks[args->nchunks-1];
+        memset(chunk, 0, sizeof(chunk_t));
+        chunk->seq = seq;
+        chunk->beg = beg;
+        chunk->end = len>0 && beg+CHUNK_SIZE < len ? beg + CHUNK_SIZE - 1 : INT_MAX;
+        beg += CHUNK_SIZE;
+    }
+    while ( len>0 && beg < len );
+}
+
+static void process_chunk(args_t *args, chunk_t *chunk)
+{
+    bcf_srs_t *files = args->files;
+    bcf_sr_seek(files, chunk->seq, chunk->beg);
     while ( bcf_sr_next_line(files) )
     {
-        bcf_sr_t *reader = NULL;
-        bcf1_t *line = NULL;
-        int ret = 0, i;
+        int i;
         for (i=0; i<files->nreaders; i++)
+            if ( bcf_sr_has_line(files,i) ) break;
+        bcf1_t *line = files->readers[i].buffer[0];
+        if ( strcmp(chunk->seq, bcf_seqname(files->readers[i].header,line)) || line->pos > chunk->end ) break;
+        if ( line->pos < chunk->beg ) continue;  // overlapping record owned by the previous chunk
+        do_record_stats(args);
+    }
+
+    // hand over the r2 values, the chunk's empty buffer is reused for the next one
+    r2val_t *tmp = chunk->r2vals;
+    chunk->r2vals  = args->r2vals;  args->r2vals  = tmp;
+    chunk->nr2vals = args->nr2vals; args->nr2vals = 0;
+    int mtmp = chunk->mr2vals;
+    chunk->mr2vals = args->mr2vals; args->mr2vals = mtmp;
+}
+
+static void *worker_run(void *data)
+{
+    args_t *args = &((worker_t*)data)->args;
+    args_t *master = args->master;
+    while (1)
+    {
+        pthread_mutex_lock(&master->lock);
+        int ichunk = master->ichunk_next < master->nchunks ? master->ichunk_next++ : -1;
+        pthread_mutex_unlock(&master->lock);
+        if ( ichunk<0 ) break;
+        process_chunk(args, &master->chunks[ichunk]);
+    }
+    return NULL;
+}
+
+static void init_stats(args_t *args);
+static void destroy_stats(args_t *args);
+
+static void init_worker(args_t *master, args_t *args)
+{
+    int i;
+    *args = *master;
+    args->master = master;
+    args->chunks = NULL;
+    args->nchunks = args->mchunks = 0;
+    args->tmp_iaf = NULL; args->ntmp_iaf = 0;
+    args->gt_type = args->gt_ial = NULL; args->mgt_type = args->mgt_ial = 0;
+    args->tmp_tstv = NULL; args->mtmp_tstv = 0;
+    args->r2vals = NULL; args->nr2vals = args->mr2vals = 0;
+
+    bcf_srs_t *files = bcf_sr_init();
+    files->require_index = 1;
+    files->collapse = master->files->collapse;
+    files->apply_filters = master->files->apply_filters;
+    files->max_unpack = master->files->max_unpack;
+    if ( args->targets_list && bcf_sr_set_targets(files, args->targets_list, args->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", args->targets_list);
+    if ( args->regions_list && bcf_sr_set_regions(files, args->regions_list, args->regions_is_file)<0 )
+        error("Failed to read the regions: %s\n", args->regions_list);
+    for (i=0; i<master->files->nreaders; i++)
+        if ( !bcf_sr_add_reader(files, master->files->readers[i].fname) ) 
+            error("Could not read the file or the file is not indexed: %s\n", master->files->readers[i].fname);
+    args->files = files;
+
+    init_stats(args);
+}
+
+static void destroy_worker(args_t *args)
+{
+    // user stats definitions are shared with the main context
+    args->usr = NULL;
+    args->nusr = 0;
+    destroy_stats(args);
+    free(args->r2vals);
+    bcf_sr_destroy(args->files);
+}
+
+#define MERGE_ARRAY(dst,src,n) { int _i; for (_i=0; _i<(n); _i++) (dst)[_i] += (src)[_i]; }
+
+static void merge_gtcmp(gtcmp_t *dst, gtcmp_t *src, int n)
+{
+    int i, j;
+    for (i=0; i<n; i++)
+        for (j=0; j<3; j++)
+        {
+            dst[i].m[j]  += src[i].m[j];
+            dst[i].mm[j] += src[i].mm[j];
+        }
+}
+
+// Add up the counters of a worker, r2 sums are kept in the chunks
+static void merge_stats(args_t *dst, args_t *src)
+{
+    int id, i, j;
+    int nsmpl = dst->files->n_smpl;
+    for (id=0; id<dst->nstats; id++)
+    {
+        stats_t *a = &dst->stats[id], *b = &src->stats[id];
+        a->n_snps += b->n_snps; a->n_indels += b->n_indels; a->n_mnps += b->n_mnps;
+        a->n_others += b->n_others; a->n_mals += b->n_mals; a->n_snp_mals += b->n_snp_mals;
+        MERGE_ARRAY(a->af_ts, b->af_ts, dst->m_af);
+        MERGE_ARRAY(a->af_tv, b->af_tv, dst->m_af);
+        MERGE_ARRAY(a->af_snps, b->af_snps, dst->m_af);
+        #if HWE_STATS
+            if ( nsmpl ) MERGE_ARRAY(a->af_hwe, b->af_hwe, dst->m_af*dst->naf_hwe);
+        #endif
+        #if IRC_STATS
+            for (i=0; i<IRC_RLEN; i++) MERGE_ARRAY(a->n_repeat[i], b->n_repeat[i], 4);
+            a->n_repeat_na += b->n_repeat_na;
+            for (i=0; i<3; i++) MERGE_ARRAY(a->af_repeats[i], b->af_repeats[i], dst->m_af);
+        #endif
+        a->ts_alt1 += b->ts_alt1; a->tv_alt1 += b->tv_alt1;
+        #if QUAL_STATS
+            MERGE_ARRAY(a->qual_ts, b->qual_ts, dst->m_qual);
+            MERGE_ARRAY(a->qual_tv, b->qual_tv, dst->m_qual);
+            MERGE_ARRAY(a->qual_snps, b->qual_snps, dst->m_qual);
+            MERGE_ARRAY(a->qual_indels, b->qual_indels, dst->m_qual);
+        #endif
+        MERGE_ARRAY(a->insertions, b->insertions, a->m_indel);
+        MERGE_ARRAY(a->deletions, b->deletions, a->m_indel);
+        a->in_frame += b->in_frame; a->out_frame += b->out_frame; a->na_frame += b->na_frame;
+        a->in_frame_alt1 += b->in_frame_alt1; a->out_frame_alt1 += b->out_frame_alt1; a->na_frame_alt1 += b->na_frame_alt1;
+        MERGE_ARRAY(a->subst, b->subst, 15);
+        if ( nsmpl )
         {
-            if ( !bcf_sr_has_line(files,i) ) continue;
-            ret |= 1<<i;
-            if ( reader ) continue;
-            reader = &files->readers[i];
-            line = files->readers[i].buffer[0];
+            MERGE_ARRAY(a->smpl_hets, b->smpl_hets, nsmpl);
+            MERGE_ARRAY(a->smpl_homRR, b->smpl_homRR, nsmpl);
+            MERGE_ARRAY(a->smpl_homAA, b->smpl_homAA, nsmpl);
+            MERGE_ARRAY(a->smpl_ts, b->smpl_ts, nsmpl);
+            MERGE_ARRAY(a->smpl_tv, b->smpl_tv, nsmpl);
+            MERGE_ARRAY(a->smpl_indels, b->smpl_indels, nsmpl);
+            MERGE_ARRAY(a->smpl_ndp, b->smpl_ndp, nsmpl);
+            MERGE_ARRAY(a->smpl_sngl, b->smpl_sngl, nsmpl);
+            MERGE_ARRAY(a->smpl_dp, b->smpl_dp, nsmpl);
         }
-        int line_type = bcf_get_variant_types(line);
-        init_iaf(args, reader);
-
-        stats_t *stats = &args->stats[ret-1];
-        if ( args->split_by_id && line->d.id[0]=='.' && !line->d.id[1] )
-            stats = &args->stats[1];
-
-        if ( line_type&VCF_SNP ) 
-            do_snp_stats(args, stats, reader);
-        if ( line_type&VCF_INDEL )
-            do_indel_stats(args, stats, reader);
-        if ( line_type&VCF_MNP )
-            do_mnp_stats(args, stats, reader);
-        if ( line_type&VCF_OTHER )
-            do_other_stats(args, stats, reader);
-
-        if ( line->n_allele>2 ) 
+        MERGE_ARRAY(a->dp.vals, b->dp.vals, a->dp.m_vals);
+        for (j=0; j<a->nusr; j++)
         {
-            stats->n_mals++;
-            if ( line_type == VCF_SNP ) stats->n_snp_mals++;
+            MERGE_ARRAY(a->usr[j].vals_ts, b->usr[j].vals_ts, a->usr[j].nbins);
+            MERGE_ARRAY(a->usr[j].vals_tv, b->usr[j].vals_tv, a->usr[j].nbins);
         }
+    }
+    if ( dst->af_gts_snps )
+    {
+        merge_gtcmp(dst->af_gts_snps, src->af_gts_snps, dst->m_af);
+        merge_gtcmp(dst->af_gts_indels, src->af_gts_indels, dst->m_af);
+        merge_gtcmp(dst->smpl_gts_snps, src->smpl_gts_snps, nsmpl);
+        merge_gtcmp(dst->smpl_gts_indels, src->smpl_gts_indels, nsmpl);
+    }
+}
+#undef MERGE_ARRAY
+
+/*
+    Checkpoints: the accumulators written with --save-checkpoint can be added
+    to a later run with --load-checkpoint, so that a growing release needs to
+    be scanned only in the new regions and shards can be processed
+    independently. The file is written in the native byte order:
+
+        magic       8 bytes, STATS_CKPT_MAGIC
+        layout      ckpt_layout_t, must match the run it is added to
+        strings     nfiles x file name, n_smpl x sample name, each uint32_t len; char str[len]
+        user stats  nusr x tag string; float min, max; int nbins, type
+        regions     uint32_t n; n x chromosome string; int32_t beg, end
+        data        the counters in the order of checkpoint_data()
+
+    The counters are added up, so the regions counted by the run and by each
+    checkpoint are recorded and a checkpoint overlapping regions counted
+    already is rejected. The regions are those of -r/-R, or -t/-T without
+    -r, or the whole input; with both -r and -t only -r is recorded, which
+    may reject checkpoints that would not overlap.
+*/
+
+#define STATS_CKPT_MAGIC "BCFSTCK\1"
+
+typedef struct
+{
+    int32_t nstats, nfiles, nfile_smpl[2], n_smpl, m_af, m_qual, naf_hwe, m_indel, dp_min, dp_max, dp_step;
+    int32_t split_by_id, do_fs_stats, do_irc_stats, nusr, sizeof_long;
+}
+ckpt_layout_t;
+
+#define CKPT_INT    0
+#define CKPT_U64    1
+#define CKPT_ULONG  2
+#define CKPT_GTCMP  3
 
-        if ( files->n_smpl )
-            do_sample_stats(args, stats, reader, ret);
+typedef struct
+{
+    FILE *fp;
+    const char *fname;
+    int write;
+    void *tmp;
+    size_t mtmp;
+}
+ckpt_io_t;
+
+static void ckpt_write(ckpt_io_t *io, const void *ptr, size_t size)
+{
+    if ( size && fwrite(ptr, 1, size, io->fp)!=size ) error("Failed to write %s\n", io->fname);
+}
+static void ckpt_read(ckpt_io_t *io, void *ptr, size_t size)
+{
+    if ( size && fread(ptr, 1, size, io->fp)!=size ) error("The checkpoint is truncated or corrupted: %s\n", io->fname);
+}
+static void ckpt_write_str(ckpt_io_t *io, const char *str)
+{
+    uint32_t len = strlen(str);
+    ckpt_write(io, &len, sizeof(len));
+    ckpt_write(io, str, len);
+}
+static char *ckpt_read_str(ckpt_io_t *io)
+{
+    uint32_t len;
+    ckpt_read(io, &len, sizeof(len));
+    char *str = (char*) malloc(len+1);
+    ckpt_read(io, str, len);
+    str[len] = 0;
+    return str;
+}
+
+// Writes n values or adds n values read from the checkpoint
+static void ckpt_array(ckpt_io_t *io, int type, void *ptr, size_t n)
+{
+    size_t i, size = 0;
+    switch (type)
+    {
+        case CKPT_INT:   size = sizeof(int); break;
+        case CKPT_U64:   size = sizeof(uint64_t); break;
+        case CKPT_ULONG: size = sizeof(unsigned long int); break;
+        case CKPT_GTCMP: size = sizeof(gtcmp_t); break;
+    }
+    if ( io->write ) { ckpt_write(io, ptr, size*n); return; }
+
+    if ( io->mtmp < size*n )
+    {
+        io->mtmp = size*n;
+        io->tmp  = realloc(io->tmp, io->mtmp);
+    }
+    ckpt_read(io, io->tmp, size*n);
+    if ( type==CKPT_INT )
+    {
+        int *dst = (int*) ptr, *src = (int*) io->tmp;
+        for (i=0; i<n; i++) dst[i] += src[i];
     }
+    else if ( type==CKPT_U64 )
+    {
+        uint64_t *dst = (uint64_t*) ptr, *src = (uint64_t*) io->tmp;
+        for (i=0; i<n; i++) dst[i] += src[i];
+    }
+    else if ( type==CKPT_ULONG )
+    {
+        unsigned long int *dst = (unsigned long int*) ptr, *src = (unsigned long int*) io->tmp;
+        for (i=0; i<n; i++) dst[i] += src[i];
+    }
+    else
+    {
+        gtcmp_t *dst = (gtcmp_t*) ptr, *src = (gtcmp_t*) io->tmp;
+        merge_gtcmp(dst, src, n);
+        for (i=0; i<n; i++)
+        {
+            dst[i].r2sum += src[i].r2sum;
+            dst[i].r2n   += src[i].r2n;
+        }
+    }
+}
+
+// All counters of stats_t and the genotype comparisons, read and written in this order
+static void checkpoint_data(args_t *args, ckpt_io_t *io)
+{
+    int id, i;
+    for (id=0; id<args->nstats; id++)
+    {
+        stats_t *stats = &args->stats[id];
+        ckpt_array(io, CKPT_INT, &stats->n_records, 1);
+        ckpt_array(io, CKPT_INT, &stats->n_snps, 1);
+        ckpt_array(io, CKPT_INT, &stats->n_indels, 1);
+        ckpt_array(io, CKPT_INT, &stats->n_mnps, 1);
+        ckpt_array(io, CKPT_INT, &stats->n_others, 1);
+        ckpt_array(io, CKPT_INT, &stats->n_mals, 1);
+        ckpt_array(io, CKPT_INT, &stats->n_snp_mals, 1);
+        ckpt_array(io, CKPT_INT, stats->af_ts, args->m_af);
+        ckpt_array(io, CKPT_INT, stats->af_tv, args->m_af);
+        ckpt_array(io, CKPT_INT, stats->af_snps, args->m_af);
+        #if HWE_STATS
+            if ( args->n_smpl ) ckpt_array(io, CKPT_INT, stats->af_hwe, args->m_af*args->naf_hwe);
+        #endif
+        #if IRC_STATS
+            for (i=0; i<IRC_RLEN; i++) ckpt_array(io, CKPT_INT, stats->n_repeat[i], 4);
+            ckpt_array(io, CKPT_INT, &stats->n_repeat_na, 1);
+            for (i=0; i<3; i++) ckpt_array(io, CKPT_INT, stats->af_repeats[i], args->m_af);
+        #endif
+        ckpt_array(io, CKPT_INT, &stats->ts_alt1, 1);
+        ckpt_array(io, CKPT_INT, &stats->tv_alt1, 1);
+        #if QUAL_STATS
+            ckpt_array(io, CKPT_INT, stats->qual_ts, args->m_qual);
+            ckpt_array(io, CKPT_INT, stats->qual_tv, args->m_qual);
+            ckpt_array(io, CKPT_INT, stats->qual_snps, args->m_qual);
+            ckpt_array(io, CKPT_INT, stats->qual_indels, args->m_qual);
+        #endif
+        ckpt_array(io, CKPT_INT, stats->insertions, stats->m_indel);
+        ckpt_array(io, CKPT_INT, stats->deletions, stats->m_indel);
+        ckpt_array(io, CKPT_INT, &stats->in_frame, 1);
+        ckpt_array(io, CKPT_INT, &stats->out_frame, 1);
+        ckpt_array(io, CKPT_INT, &stats->na_frame, 1);
+        ckpt_array(io, CKPT_INT, &stats->in_frame_alt1, 1);
+        ckpt_array(io, CKPT_INT, &stats->out_frame_alt1, 1);
+        ckpt_array(io, CKPT_INT, &stats->na_frame_alt1, 1);
+        ckpt_array(io, CKPT_INT, stats->subst, 15);
+        if ( args->n_smpl )
+        {
+            ckpt_array(io, CKPT_INT, stats->smpl_hets, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_homRR, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_homAA, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_ts, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_tv, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_indels, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_ndp, args->n_smpl);
+            ckpt_array(io, CKPT_INT, stats->smpl_sngl, args->n_smpl);
+            ckpt_array(io, CKPT_ULONG, stats->smpl_dp, args->n_smpl);
+        }
+        ckpt_array(io, CKPT_U64, stats->dp.vals, stats->dp.m_vals);
+        for (i=0; i<stats->nusr; i++)
+        {
+            ckpt_array(io, CKPT_U64, stats->usr[i].vals_ts, stats->usr[i].nbins);
+            ckpt_array(io, CKPT_U64, stats->usr[i].vals_tv, stats->usr[i].nbins);
+        }
+    }
+    if ( args->n_smpl )
+    {
+        ckpt_array(io, CKPT_GTCMP, args->af_gts_snps, args->m_af);
+        ckpt_array(io, CKPT_GTCMP, args->af_gts_indels, args->m_af);
+        ckpt_array(io, CKPT_GTCMP, args->smpl_gts_snps, args->n_smpl);
+        ckpt_array(io, CKPT_GTCMP, args->smpl_gts_indels, args->n_smpl);
+    }
+}
+
+static void ckpt_cover_add(args_t *args, const char *chr, int beg, int end)
+{
+    args->ncov++;
+    hts_expand(ckpt_reg_t, args->ncov, args->mcov, args->cov);
+    ckpt_reg_t *reg = &args->cov[args->ncov-1];
+    reg->chr = strdup(chr);
+    reg->beg = beg;
+    reg->end = end;
+}
+// Checks the region against the first n regions counted
+static int ckpt_cover_overlaps(args_t *args, int n, const char *chr, int beg, int end)
+{
+    int i;
+    for (i=0; i<n; i++)
+    {
+        ckpt_reg_t *reg = &args->cov[i];
+        if ( !strcmp(reg->chr,"*") || !strcmp(chr,"*") ) return 1;
+        if ( !strcmp(reg->chr,chr) && reg->beg<=end && beg<=reg->end ) return 1;
+    }
+    return 0;
+}
+// The regions read by this run, see the description of the checkpoints above
+static void checkpoint_init_cover(args_t *args)
+{
+    const char *list = args->regions_list ? args->regions_list : args->targets_list;
+    int is_file = args->regions_list ? args->regions_is_file : args->targets_is_file;
+    if ( !list ) { ckpt_cover_add(args, "*", 0, INT_MAX); return; }
+
+    bcf_sr_regions_t *reg = bcf_sr_regions_init(list, is_file, 0, 1, 2);
+    if ( !reg ) error("Failed to read the regions: %s\n", list);
+    while ( bcf_sr_regions_next(reg)>=0 )
+        ckpt_cover_add(args, reg->regs ? reg->seq_names[reg->iseq] : reg->seq_name, reg->start, reg->end);
+    bcf_sr_regions_destroy(reg);
+}
+
+static void checkpoint_layout(args_t *args, ckpt_layout_t *lay)
+{
+    memset(lay, 0, sizeof(*lay));
+    lay->nstats  = args->nstats;
+    lay->nfiles  = args->nfiles;
+    lay->nfile_smpl[0] = args->nfile_smpl[0];
+    lay->nfile_smpl[1] = args->nfile_smpl[1];
+    lay->n_smpl  = args->n_smpl;
+    lay->m_af    = args->m_af;
+    lay->m_qual  = args->m_qual;
+    lay->naf_hwe = args->naf_hwe;
+    lay->m_indel = args->stats[0].m_indel;
+    lay->dp_min  = args->dp_min;
+    lay->dp_max  = args->dp_max;
+    lay->dp_step = args->dp_step;
+    lay->split_by_id  = args->split_by_id;
+    lay->do_fs_stats  = args->do_fs_stats;
+    lay->do_irc_stats = args->do_irc_stats;
+    lay->nusr = args->nusr;
+    lay->sizeof_long = sizeof(unsigned long int);
+}
+
+// Written to <fname>.tmp and renamed, an interrupted run does not leave a truncated checkpoint
+static void checkpoint_save(args_t *args, const char *fname)
+{
+    kstring_t tmp = {0,0,0};
+    ksprintf(&tmp, "%s.tmp", fname);
+    ckpt_io_t io = { NULL, tmp.s, 1, NULL, 0 };
+    io.fp = fopen(tmp.s, "w");
+    if ( !io.fp ) error("Failed to create %s\n", tmp.s);
+
+    ckpt_layout_t lay;
+    checkpoint_layout(args, &lay);
+    ckpt_write(&io, STATS_CKPT_MAGIC, 8);
+    ckpt_write(&io, &lay, sizeof(lay));
+    int i;
+    for (i=0; i<args->nfiles; i++) ckpt_write_str(&io, args->set_fnames[i]);
+    for (i=0; i<args->n_smpl; i++) ckpt_write_str(&io, args->samples[i]);
+    for (i=0; i<args->nusr; i++)
+    {
+        user_stats_t *usr = &args->stats[0].usr[i];
+        ckpt_write_str(&io, usr->tag);
+        ckpt_write(&io, &usr->min, sizeof(usr->min));
+        ckpt_write(&io, &usr->max, sizeof(usr->max));
+        ckpt_write(&io, &usr->nbins, sizeof(usr->nbins));
+        ckpt_write(&io, &usr->type, sizeof(usr->type));
+    }
+    uint32_t ncov = args->ncov;
+    ckpt_write(&io, &ncov, sizeof(ncov));
+    for (i=0; i<args->ncov; i++)
+    {
+        int32_t beg = args->cov[i].beg, end = args->cov[i].end;
+        ckpt_write_str(&io, args->cov[i].chr);
+        ckpt_write(&io, &beg, sizeof(beg));
+        ckpt_write(&io, &end, sizeof(end));
+    }
+    checkpoint_data(args, &io);
+    if ( fclose(io.fp) ) error("Failed to close %s\n", tmp.s);
+    if ( rename(tmp.s, fname) ) error("Failed to rename %s to %s: %s\n", tmp.s, fname, strerror(errno));
+    free(tmp.s);
+}
+
+static FILE *checkpoint_open(const char *fname, ckpt_layout_t *lay)
+{
+    FILE *fp = fopen(fname, "r");
+    if ( !fp ) error("Failed to open %s\n", fname);
+    char magic[8];
+    if ( fread(magic, 1, 8, fp)!=8 || memcmp(magic, STATS_CKPT_MAGIC, 8) ) error("Not a stats checkpoint: %s\n", fname);
+    if ( fread(lay, sizeof(*lay), 1, fp)!=1 ) error("The checkpoint is truncated or corrupted: %s\n", fname);
+    if ( lay->sizeof_long!=sizeof(unsigned long int) ) error("The checkpoint was written on an incompatible platform: %s\n", fname);
+    return fp;
+}
+
+/*
+ *  Sets up the sets, samples and binning from the first checkpoint when
+ *  checkpoints are merged without reading any VCF
+ */
+static void checkpoint_read_layout(args_t *args, const char *fname)
+{
+    ckpt_layout_t lay;
+    ckpt_io_t io = { NULL, fname, 0, NULL, 0 };
+    io.fp = checkpoint_open(fname, &lay);
+    if ( lay.nfiles<1 || lay.nfiles>2 || lay.nstats<1 || lay.nstats>3 || lay.n_smpl<0 || lay.nusr<0 )
+        error("The checkpoint is truncated or corrupted: %s\n", fname);
+    args->nstats  = lay.nstats;
+    args->nfiles  = lay.nfiles;
+    args->nfile_smpl[0] = lay.nfile_smpl[0];
+    args->nfile_smpl[1] = lay.nfile_smpl[1];
+    args->n_smpl  = lay.n_smpl;
+    args->m_af    = lay.m_af;
+    args->m_qual  = lay.m_qual;
+    args->naf_hwe = lay.naf_hwe;
+    args->dp_min  = lay.dp_min;
+    args->dp_max  = lay.dp_max;
+    args->dp_step = lay.dp_step;
+    args->split_by_id  = lay.split_by_id;
+    args->do_fs_stats  = lay.do_fs_stats;
+    args->do_irc_stats = lay.do_irc_stats;
+
+    int i;
+    for (i=0; i<args->nfiles; i++) args->set_fnames[i] = ckpt_read_str(&io);
+    args->samples = (char**) malloc(sizeof(char*)*args->n_smpl);
+    for (i=0; i<args->n_smpl; i++) args->samples[i] = ckpt_read_str(&io);
+    args->nusr = lay.nusr;
+    args->usr  = (user_stats_t*) calloc(args->nusr, sizeof(user_stats_t));
+    for (i=0; i<args->nusr; i++)
+    {
+        user_stats_t *usr = &args->usr[i];
+        usr->tag = ckpt_read_str(&io);
+        ckpt_read(&io, &usr->min, sizeof(usr->min));
+        ckpt_read(&io, &usr->max, sizeof(usr->max));
+        ckpt_read(&io, &usr->nbins, sizeof(usr->nbins));
+        ckpt_read(&io, &usr->type, sizeof(usr->type));
+        if ( usr->nbins<=0 ) error("The checkpoint is truncated or corrupted: %s\n", fname);
+    }
+    fclose(io.fp);
+}
+
+// Adds the counters of a checkpoint, which must have been collected with the same options and samples
+static void checkpoint_load(args_t *args, const char *fname)
+{
+    ckpt_layout_t lay, exp;
+    ckpt_io_t io = { NULL, fname, 0, NULL, 0 };
+    io.fp = checkpoint_open(fname, &lay);
+    checkpoint_layout(args, &exp);
+    if ( memcmp(&lay, &exp, sizeof(lay)) )
+        error("The checkpoint %s is not compatible: the number of files and samples, and the -d, -e, -F, -i and -u options must be the same\n", fname);
+
+    int i;
+    for (i=0; i<args->nfiles; i++) free(ckpt_read_str(&io));
+    for (i=0; i<args->n_smpl; i++)
+    {
+        char *str = ckpt_read_str(&io);
+        if ( strcmp(str, args->samples[i]) ) error("The checkpoint %s has different samples: %s vs %s\n", fname, str, args->samples[i]);
+        free(str);
+    }
+    for (i=0; i<args->nusr; i++)
+    {
+        user_stats_t *usr = &args->stats[0].usr[i], tmp;
+        char *str = ckpt_read_str(&io);
+        ckpt_read(&io, &tmp.min, sizeof(tmp.min));
+        ckpt_read(&io, &tmp.max, sizeof(tmp.max));
+        ckpt_read(&io, &tmp.nbins, sizeof(tmp.nbins));
+        ckpt_read(&io, &tmp.type, sizeof(tmp.type));
+        if ( strcmp(str, usr->tag) || tmp.min!=usr->min || tmp.max!=usr->max || tmp.nbins!=usr->nbins || tmp.type!=usr->type )
+            error("The checkpoint %s has different -u stats: %s vs %s\n", fname, str, usr->tag);
+        free(str);
+    }
+
+    // the regions of the checkpoint are checked against those counted so far, then added
+    uint32_t ncov;
+    ckpt_read(&io, &ncov, sizeof(ncov));
+    int ncov0 = args->ncov;
+    for (i=0; i<ncov; i++)
+    {
+        int32_t beg, end;
+        char *chr = ckpt_read_str(&io);
+        ckpt_read(&io, &beg, sizeof(beg));
+        ckpt_read(&io, &end, sizeof(end));
+        if ( ckpt_cover_overlaps(args, ncov0, chr, beg, end) )
+            error("The checkpoint %s overlaps the regions counted by this run or by another checkpoint\n", fname);
+        ckpt_cover_add(args, chr, beg, end);
+        free(chr);
+    }
+    checkpoint_data(args, &io);
+    if ( fgetc(io.fp)!=EOF ) error("The checkpoint is truncated or corrupted: %s\n", fname);
+    free(io.tmp);
+    fclose(io.fp);
+}
+
+/*
+ *  Region-parallel stats: the sequences are split into chunks, each worker has
+ *  its own readers and stats_t accumulators which are added up at the end. The
+ *  output is identical to the single-threaded run.
+ */
+static void do_vcf_stats_threaded(args_t *args)
+{
+    int i, j;
+    bcf_sr_regions_t *reg = args->files->regions;
+    if ( !reg ) error("Failed to determine sequences from the index: %s\n", args->files->readers[0].fname);
+    for (i=0; i<reg->nseqs; i++) add_chunks(args, reg->seq_names[i]);
+
+    pthread_mutex_init(&args->lock, NULL);
+    worker_t *workers = (worker_t*) calloc(args->nthreads, sizeof(worker_t));
+    for (i=0; i<args->nthreads; i++)
+    {
+        init_worker(args, &workers[i].args);
+        if ( pthread_create(&workers[i].tid, NULL, worker_run, &workers[i]) )
+            error("Failed to create a thread\n");
+    }
+    for (i=0; i<args->nthreads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+        merge_stats(args, &workers[i].args);
+        destroy_worker(&workers[i].args);
+    }
+    free(workers);
+    pthread_mutex_destroy(&args->lock);
+
+    for (i=0; i<args->nchunks; i++)
+    {
+        chunk_t *chunk = &args->chunks[i];
+        for (j=0; j<chunk->nr2vals; j++)
+        {
+            gtcmp_t *af_stats = chunk->r2vals[j].is_snp ? args->af_gts_snps : args->af_gts_indels;
+            af_stats[chunk->r2vals[j].iaf].r2sum += chunk->r2vals[j].r2;
+            af_stats[chunk->r2vals[j].iaf].r2n++;
+        }
+        free(chunk->r2vals);
+    }
+    free(args->chunks);
+}
+
+static int cmp_region1(const void *aptr, const void *bptr)
+{
+    const region1_t *a = (const region1_t*) aptr, *b = (const region1_t*) bptr;
+    if ( a->start < b->start ) return -1;
+    if ( a->start > b->start ) return 1;
+    return 0;
+}
+
+// Add the records with POS in [beg,end] read through the index
+static void sidecar_stream(statsidx_sum_t *sum, htsFile *fp, hts_idx_t *idx, bcf1_t *rec, int rid, int64_t beg, int64_t end)
+{
+    if ( beg > end ) return;
+    hts_itr_t *itr = bcf_itr_queryi(idx, rid, beg, end+1);
+    if ( !itr ) return;
+    while ( bcf_itr_next(fp, itr, rec) >= 0 )
+    {
+        if ( rec->pos < beg ) continue;
+        if ( rec->pos > end ) break;
+        bcf_unpack(rec, BCF_UN_STR);
+        statsidx_add_record(sum, rec);
+    }
+    hts_itr_destroy(itr);
+}
+
+/*
+ *  The summary numbers, ts/tv and QUAL stats taken from the sidecar written by
+ *  "bcftools index --sidecar". Records are assigned to regions by POS, the bins
+ *  covered by a region only partially are completed by reading the records.
+ */
+static void do_vcf_stats_sidecar(args_t *args)
+{
+    bcf_sr_t *reader = &args->files->readers[0];
+    statsidx_t *sidx = statsidx_open(reader->fname);
+    if ( !sidx ) error("No stats sidecar for %s, please run \"bcftools index --sidecar\" first\n", reader->fname);
+    statsidx_sum_t *sum = (statsidx_sum_t*) calloc(1, sizeof(statsidx_sum_t));
+    int i, j;
+
+    bcf_sr_regions_t *reg = args->files->regions;
+    if ( !args->regions_list )
+    {
+        for (i=0; i<sidx->nseq; i++) statsidx_add_bins(sum, sidx, i, 0, UINT32_MAX);
+    }
+    else
+    {
+        htsFile *fp = hts_open(reader->fname, "rb");
+        hts_idx_t *idx = bcf_index_load(reader->fname);
+        if ( !fp || !idx ) error("Failed to open the indexed file %s\n", reader->fname);
+        bcf1_t *rec = bcf_init();
+        region1_t *regs = NULL;
+        int nregs = 0, mregs = 0;
+        for (i=0; i<reg->nseqs; i++)
+        {
+            int iseq = statsidx_seq(sidx, reg->seq_names[i]);
+            int rid  = bcf_hdr_name2id(reader->header, reg->seq_names[i]);
+            if ( iseq<0 || rid<0 ) continue;
+
+            // sort and merge so that each record is counted once
+            nregs = 0;
+            if ( bcf_sr_regions_seek(reg, reg->seq_names[i])!=0 ) continue;
+            while ( bcf_sr_regions_next(reg)==0 )
+            {
+                nregs++;
+                hts_expand(region1_t, nregs, mregs, regs);
+                regs[nregs-1].start = reg->start;
+                regs[nregs-1].end   = reg->end;
+            }
+            qsort(regs, nregs, sizeof(region1_t), cmp_region1);
+            for (j=0; j<nregs; j++)
+            {
+                int64_t beg = regs[j].start, end = regs[j].end;
+                while ( j+1<nregs && regs[j+1].start <= end+1 )
+                {
+                    if ( end < regs[j+1].end ) end = regs[j+1].end;
+                    j++;
+                }
+                int64_t bin_beg = (beg + (1<<sidx->min_shift) - 1) >> sidx->min_shift;   // bins fully within [beg,end]
+                int64_t bin_end = ((end + 1) >> sidx->min_shift) - 1;
+                if ( bin_beg > bin_end )
+                {
+                    sidecar_stream(sum, fp, idx, rec, rid, beg, end);
+                    continue;
+                }
+                statsidx_add_bins(sum, sidx, iseq, bin_beg, bin_end);
+                sidecar_stream(sum, fp, idx, rec, rid, beg, (bin_beg << sidx->min_shift) - 1);
+                sidecar_stream(sum, fp, idx, rec, rid, (bin_end + 1) << sidx->min_shift, end);
+            }
+        }
+        free(regs);
+        bcf_destroy(rec);
+        hts_idx_destroy(idx);
+        hts_close(fp);
+    }
+
+    stats_t *stats = &args->stats[0];
+    stats->n_records  = sum->cnt.n_records;
+    stats->n_snps     = sum->cnt.n_snps;
+    stats->n_mnps     = sum->cnt.n_mnps;
+    stats->n_indels   = sum->cnt.n_indels;
+    stats->n_others   = sum->cnt.n_others;
+    stats->n_mals     = sum->cnt.n_mals;
+    stats->n_snp_mals = sum->cnt.n_snp_mals;
+    stats->af_ts[0]   = sum->cnt.ts;
+    stats->af_tv[0]   = sum->cnt.tv;
+    stats->ts_alt1    = sum->cnt.ts_alt1;
+    stats->tv_alt1    = sum->cnt.tv_alt1;
+    #if QUAL_STATS
+        for (i=0; i<args->m_qual; i++)
+        {
+            stats->qual_snps[i]   = sum->qual_snps[i];
+            stats->qual_ts[i]     = sum->qual_ts[i];
+            stats->qual_tv[i]     = sum->qual_tv[i];
+            stats->qual_indels[i] = sum->qual_indels[i];
+        }
+    #endif
+    free(sum);
+    statsidx_destroy(sidx);
 }
 
 static void print_header(args_t *args)
@@ -936,9 +1821,9 @@ static void print_header(args_t *args)
     printf("\n#\n");
 
     printf("# Definition of sets:\n# ID\t[2]id\t[3]tab-separated file names\n");
-    if ( args->files->nreaders==1 )
+    if ( args->nfiles==1 )
     {
-        const char *fname = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
+        const char *fname = args->set_fnames[0];
         if ( args->split_by_id )
         {
             printf("ID\t0\t%s:known (sites with ID different from \".\")\n", fname);
@@ -949,23 +1834,41 @@ static void print_header(args_t *args)
     }
     else
     {
-        const char *fname0 = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
-        const char *fname1 = strcmp("-",args->files->readers[1].fname) ? args->files->readers[1].fname : "<STDIN>";
+        const char *fname0 = args->set_fnames[0];
+        const char *fname1 = args->set_fnames[1];
         printf("ID\t0\t%s\n", fname0);
         printf("ID\t1\t%s\n", fname1);
         printf("ID\t2\t%s\t%s\n", fname0,fname1);
     }
 }
 
+#if QUAL_STATS
+static void print_qual_stats(args_t *args)
+{
+    int i, id;
+    printf("# QUAL, Stats by quality:\n# QUAL\t[2]id\t[3]Quality\t[4]number of SNPs\t[5]number of transitions (1st ALT)\t[6]number of transversions (1st ALT)\t[7]number of indels\n");
+    for (id=0; id<args->nstats; id++)
+    {
+        stats_t *stats = &args->stats[id];
+        for (i=0; i<args->m_qual; i++)
+        {
+            if ( stats->qual_snps[i]+stats->qual_ts[i]+stats->qual_tv[i]+stats->qual_indels[i] == 0  ) continue;
+            printf("QUAL\t%d\t%d\t%d\t%d\t%d\t%d\n", id,i,stats->qual_snps[i],stats->qual_ts[i],stats->qual_tv[i],stats->qual_indels[i]);
+        }
+    }
+}
+#endif
+
 static void print_stats(args_t *args)
 {
     int i, id;
     printf("# SN, Summary numbers:\n# SN\t[2]id\t[3]key\t[4]value\n");
-    for (id=0; id<args->files->nreaders; id++)
-        printf("SN\t%d\tnumber of samples:\t%d\n", id, bcf_hdr_nsamples(args->files->readers[id].header));
+    for (id=0; id<args->nfiles; id++)
+        printf("SN\t%d\tnumber of samples:\t%d\n", id, args->nfile_smpl[id]);
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
+        if ( args->sidecar ) printf("SN\t%d\tnumber of records:\t%d\n", id, stats->n_records);
         printf("SN\t%d\tnumber of SNPs:\t%d\n", id, stats->n_snps);
         printf("SN\t%d\tnumber of MNPs:\t%d\n", id, stats->n_mnps);
         printf("SN\t%d\tnumber of indels:\t%d\n", id, stats->n_indels);
@@ -981,7 +1884,15 @@ static void print_stats(args_t *args)
         for (i=0; i<args->m_af; i++) { ts += stats->af_ts[i]; tv += stats->af_tv[i];  }
         printf("TSTV\t%d\t%d\t%d\t%.2f\t%d\t%d\t%.2f\n", id,ts,tv,tv?(float)ts/tv:0, stats->ts_alt1,stats->tv_alt1,stats->tv_alt1?(float)stats->ts_alt1/stats->tv_alt1:0);
     }
-    if ( args->exons_fname )
+    if ( args->sidecar )
+    {
+        // the sidecar has no other stats
+        #if QUAL_STATS
+            print_qual_stats(args);
+        #endif
+        return;
+    }
+    if ( args->do_fs_stats )
     {
         printf("# FS, Indel frameshifts:\n# FS\t[2]id\t[3]in-frame\t[4]out-frame\t[5]not applicable\t[6]out/(in+out) ratio\t[7]in-frame (1st ALT)\t[8]out-frame (1st ALT)\t[9]not applicable (1st ALT)\t[10]out/(in+out) ratio (1st ALT)\n");
         for (id=0; id<args->nstats; id++)
@@ -991,7 +1902,7 @@ static void print_stats(args_t *args)
             printf("FS\t%d\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%.2f\n", id, in,out,na,out?(float)out/(in+out):0,in1,out1,na1,out1?(float)out1/(in1+out1):0);
         }
     }
-    if ( args->indel_ctx )
+    if ( args->do_irc_stats )
     {
         printf("# ICS, Indel context summary:\n# ICS\t[2]id\t[3]repeat-consistent\t[4]repeat-inconsistent\t[5]not applicable\t[6]c/(c+i) ratio\n");
         for (id=0; id<args->nstats; id++)
@@ -1042,16 +1953,7 @@ static void print_stats(args_t *args)
         }
     }
     #if QUAL_STATS
-        printf("# QUAL, Stats by quality:\n# QUAL\t[2]id\t[3]Quality\t[4]number of SNPs\t[5]number of transitions (1st ALT)\t[6]number of transversions (1st ALT)\t[7]number of indels\n");
-        for (id=0; id<args->nstats; id++)
-        {
-            stats_t *stats = &args->stats[id];
-            for (i=0; i<args->m_qual; i++)
-            {
-                if ( stats->qual_snps[i]+stats->qual_ts[i]+stats->qual_tv[i]+stats->qual_indels[i] == 0  ) continue;
-                printf("QUAL\t%d\t%d\t%d\t%d\t%d\t%d\n", id,i,stats->qual_snps[i],stats->qual_ts[i],stats->qual_tv[i],stats->qual_indels[i]);
-            }
-        }
+        print_qual_stats(args);
     #endif
     for (i=0; i<args->nusr; i++)
     {
@@ -1089,9 +1991,9 @@ static void print_stats(args_t *args)
             printf("ST\t%d\t%c>%c\t%d\n", id, bcf_int2acgt(t>>2),bcf_int2acgt(t&3),args->stats[id].subst[t]);
         }
     }
-    if ( args->files->nreaders>1 && args->files->n_smpl )
+    if ( args->nfiles>1 && args->n_smpl )
     {
-        printf("SN\t%d\tNumber of samples:\t%d\n", 2, args->files->n_smpl);
+        printf("SN\t%d\tNumber of samples:\t%d\n", 2, args->n_smpl);
 
         int x;
         for (x=0; x<2; x++)
@@ -1151,27 +2053,27 @@ static void print_stats(args_t *args)
                 printf("# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\n");
                 stats = args->smpl_gts_indels;
             }
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->n_smpl; i++)
             {
                 int m  = stats[i].m[GT_HET_RA] + stats[i].m[GT_HOM_AA];
                 int mm = stats[i].mm[GT_HOM_RR] + stats[i].mm[GT_HET_RA] + stats[i].mm[GT_HOM_AA];
-                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->files->samples[i], m+mm ? mm*100.0/(m+mm) : 0);
+                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->samples[i], m+mm ? mm*100.0/(m+mm) : 0);
                 printf("\t%d\t%d\t%d", stats[i].m[GT_HOM_RR],stats[i].m[GT_HET_RA],stats[i].m[GT_HOM_AA]);
                 printf("\t%d\t%d\t%d\n", stats[i].mm[GT_HOM_RR],stats[i].mm[GT_HET_RA],stats[i].mm[GT_HOM_AA]);
             }
         }
     }
 
-    if ( args->files->n_smpl )
+    if ( args->n_smpl )
     {
         printf("# PSC, Per-sample counts\n# PSC\t[2]id\t[3]sample\t[4]nRefHom\t[5]nNonRefHom\t[6]nHets\t[7]nTransitions\t[8]nTransversions\t[9]nIndels\t[10]average depth\t[11]nSingletons\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->n_smpl; i++)
             {
                 float dp = stats->smpl_ndp[i] ? stats->smpl_dp[i]/(float)stats->smpl_ndp[i] : 0;
-                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\n", id,args->files->samples[i], 
+                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\n", id,args->samples[i], 
                     stats->smpl_homRR[i], stats->smpl_homAA[i], stats->smpl_hets[i], stats->smpl_ts[i], 
                     stats->smpl_tv[i], stats->smpl_indels[i],dp, stats->smpl_sngl[i]);
             }
@@ -1193,7 +2095,7 @@ static void print_stats(args_t *args)
                 printf("\t%"PRId64"\t%f\n", stats->dp.vals[i], stats->dp.vals[i]*100./sum);
             }
         }
-        #ifdef HWE_STATS
+        #if HWE_STATS
         printf("# HWE\n# HWE\t[2]id\t[3]1st ALT allele frequency\t[4]Number of observations\t[5]25th percentile\t[6]median\t[7]75th percentile\n");
         for (id=0; id<args->nstats; id++)
         {
@@ -1242,6 +2144,7 @@ static void usage(void)
     fprintf(stderr, "         When two files are given, the program generates separate stats for intersection\n");
     fprintf(stderr, "         and the complements.\n");
     fprintf(stderr, "Usage:   bcftools stats [options] <A.vcf.gz> [<B.vcf.gz>]\n");
+    fprintf(stderr, "         bcftools stats [options] --load-checkpoint <file> [--load-checkpoint <file> [...]]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -1, --1st-allele-only              include only 1st allele at multiallelic sites\n");
@@ -1252,12 +2155,16 @@ static void usage(void)
     fprintf(stderr, "    -f, --apply-filters <list>         require at least one of the listed FILTER strings (e.g. \"PASS,.\")\n");
     fprintf(stderr, "    -F, --fasta-ref <file>             faidx indexed reference sequence file to determine INDEL context\n");
     fprintf(stderr, "    -i, --split-by-ID                  collect stats for sites with ID separately (known vs novel)\n");
+    fprintf(stderr, "        --load-checkpoint <file>       add the stats saved with --save-checkpoint, can be given multiple times\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
+    fprintf(stderr, "        --sidecar                      summary numbers, ts/tv and QUAL stats from the sidecar of \"bcftools index --sidecar\"\n");
     fprintf(stderr, "    -s, --samples <list>               list of samples for sample stats, \"-\" to include all samples\n");
     fprintf(stderr, "    -S, --samples-file <file>          file of samples to include\n");
+    fprintf(stderr, "        --save-checkpoint <file>       save the stats to be added to a later run with --load-checkpoint\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>                number of worker threads, requires indexed input [0]\n");
     fprintf(stderr, "    -u, --user-tstv <TAG[:min:max:n]>  collect Ts/Tv stats for any tag using the given binning [0:1,100]\n");
     fprintf(stderr, "\n");
     exit(1);
@@ -1266,6 +2173,7 @@ static void usage(void)
 int main_vcfstats(int argc, char *argv[])
 {
     int c;
+    char *tmp;
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->files  = bcf_sr_init();
     args->argc   = argc; args->argv = argv;
@@ -1290,6 +2198,10 @@ int main_vcfstats(int argc, char *argv[])
         {"targets-file",1,0,'T'},
         {"fasta-ref",1,0,'F'},
         {"user-tstv",1,0,'u'},
+        {"threads",1,0,2},
+        {"sidecar",0,0,3},
+        {"save-checkpoint",1,0,4},
+        {"load-checkpoint",1,0,5},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:e:s:S:d:i1t:T:F:f:1u:",loptions,NULL)) >= 0) {
@@ -1309,6 +2221,16 @@ int main_vcfstats(int argc, char *argv[])
                 else error("The --collapse string \"%s\" not recognised.\n", optarg);
                 break;
             case  1 : args->debug = 1; break;
+            case  3 : args->sidecar = 1; break;
+            case  4 : args->save_checkpoint = optarg; break;
+            case  5 :
+                args->load_checkpoints = (char**) realloc(args->load_checkpoints, sizeof(char*)*(args->nload_checkpoints+1));
+                args->load_checkpoints[args->nload_checkpoints++] = optarg;
+                break;
+            case  2 : 
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nthreads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'd': 
                 if ( sscanf(optarg,"%d,%d,%d",&args->dp_min,&args->dp_max,&args->dp_step)!=3 )
                     error("Could not parse --depth %s\n", optarg); 
@@ -1330,7 +2252,8 @@ int main_vcfstats(int argc, char *argv[])
     char *fname = NULL;
     if ( optind==argc )
     {
-        if ( !isatty(fileno((FILE *)stdin)) ) fname = "-";  // reading from stdin
+        if ( args->nload_checkpoints ) fname = NULL;       // only adding up the checkpoints
+        else if ( !isatty(fileno((FILE *)stdin)) ) fname = "-";  // reading from stdin
         else usage();
     }
     else fname = argv[optind];
@@ -1341,6 +2264,25 @@ int main_vcfstats(int argc, char *argv[])
         args->files->require_index = 1;
         if ( args->split_by_id ) error("Only one file can be given with -i.\n");
     }
+    if ( args->nthreads )
+    {
+        if ( fname && !strcmp("-",fname) ) error("The --threads option requires indexed input, cannot stream from stdin\n");
+        if ( args->debug ) error("The --debug option is not supported with --threads\n");
+        args->files->require_index = 1;
+    }
+    if ( args->sidecar )
+    {
+        if ( !fname || !strcmp("-",fname) || argc-optind>1 ) error("The --sidecar option requires a single indexed BCF\n");
+        if ( args->first_allele_only || args->files->apply_filters || args->split_by_id || args->samples_list || args->exons_fname
+            || args->ref_fname || args->targets_list || args->nusr || args->files->collapse || args->nthreads || args->debug )
+            error("The --sidecar option can be combined only with -r and -R\n");
+        if ( args->regions_list ) args->files->require_index = 1;
+        if ( args->save_checkpoint || args->nload_checkpoints ) error("The --sidecar option cannot be combined with checkpoints\n");
+    }
+    if ( !fname && (args->regions_list || args->targets_list || args->samples_list || args->exons_fname || args->ref_fname || args->nusr || args->split_by_id || args->nthreads) )
+        error("The options -r, -t, -s, -e, -F, -u, -i and --threads require an input file, the checkpoints are added as they are\n");
+    args->regions_is_file = regions_is_file;
+    args->targets_is_file = targets_is_file;
     if ( !args->samples_list ) args->files->max_unpack = BCF_UN_INFO;
     if ( args->targets_list && bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
         error("Failed to read the targets: %s\n", args->targets_list);
@@ -1353,12 +2295,31 @@ int main_vcfstats(int argc, char *argv[])
         fname = ++optind < argc ? argv[optind] : NULL;
     }
 
+    if ( !args->files->nreaders ) checkpoint_read_layout(args, args->load_checkpoints[0]);
     init_stats(args);
     print_header(args);
-    do_vcf_stats(args);
+    if ( args->sidecar )
+        do_vcf_stats_sidecar(args);
+    else if ( args->nthreads )
+        do_vcf_stats_threaded(args);
+    else if ( args->files->nreaders )
+        do_vcf_stats(args);
+    int i;
+    if ( args->files->nreaders && (args->save_checkpoint || args->nload_checkpoints) ) checkpoint_init_cover(args);
+    for (i=0; i<args->nload_checkpoints; i++) checkpoint_load(args, args->load_checkpoints[i]);
+    if ( args->save_checkpoint ) checkpoint_save(args, args->save_checkpoint);
     print_stats(args);
+    if ( !args->files->nreaders )
+    {
+        for (i=0; i<args->nfiles; i++) free((char*)args->set_fnames[i]);
+        for (i=0; i<args->n_smpl; i++) free(args->samples[i]);
+        free(args->samples);
+    }
     destroy_stats(args);
     bcf_sr_destroy(args->files);
+    for (i=0; i<args->ncov; i++) free(args->cov[i].chr);
+    free(args->cov);
+    free(args->load_checkpoints);
     free(args);
     return 0;
 }
@@ -36,6 +36,8 @@
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
+#include "profile.h"
+#include "pipe.h"
 #include "filter.h"
 
 #define FLT_INCLUDE 1
@@ -57,6 +59,7 @@ typedef struct _args_t
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // one of FLT_INCLUDE/FLT_EXCLUDE (-i or -e)
+    int debug_filter;
 
     bcf_srs_t *files;
     bcf_hdr_t *hdr, *hnull, *hsub; // original header, sites-only header, subset header
@@ -70,14 +73,17 @@ typedef struct _args_t
     int sample_is_file;
     char *include_types, *exclude_types;
     int include, exclude;
+    int subset_in_reader;   // 1: the reader drops the other samples, 2: also in the requested order
     htsFile *out;
+    profile_mark_t prof;
+    pipe_stage_t *stage;    // set when running as a stage of bcftools pipe
 }
 args_t;
 
 static void init_data(args_t *args)
 {
     int i;
-    args->hdr = args->files->readers[0].header;
+    args->hdr = args->stage ? args->stage->hdr : args->files->readers[0].header;
     
     if (args->calc_ac && args->update_info)
     {
@@ -154,13 +160,17 @@ static void init_data(args_t *args)
     if (args->output_type==FT_BCF) strcat(modew, "bu");         // uncompressed BCF
     else if (args->output_type & FT_BCF) strcat(modew, "b");    // compressed BCF
     else if (args->output_type & FT_GZ) strcat(modew,"z");      // compressed VCF
-    args->out = hts_open(args->fn_out ? args->fn_out : "-", modew);
+    if ( !args->stage )
+        args->out = hts_open_mt(args->fn_out ? args->fn_out : "-", modew);
  
     // headers: hdr=full header, hsub=subset header, hnull=sites only header
     if (args->sites_only)
         args->hnull = bcf_hdr_subset(args->hdr, 0, 0, 0);
     if (args->n_samples > 0)
     {
+        // Unless the filter or -x/-X need all samples, the FORMAT fields of the others are never decoded
+        if ( !args->filter_str && !args->private_vars && !args->stage )
+            args->subset_in_reader = bcf_hdr_subset_reader(args->hdr, args->n_samples, args->samples, NULL) + 1;
         args->hsub = bcf_hdr_subset(args->hdr, args->n_samples, args->samples, args->imap);
         if ( args->n_samples != bcf_hdr_nsamples(args->hsub) )
         {
@@ -172,6 +182,8 @@ static void init_data(args_t *args)
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
+    if ( args->filter && args->debug_filter )
+        filter_debug(args->filter, stderr);
 }
 
 static void destroy_data(args_t *args)
@@ -186,7 +198,10 @@ static void destroy_data(args_t *args)
     if (args->hnull) bcf_hdr_destroy(args->hnull);
     if (args->hsub) bcf_hdr_destroy(args->hsub);
     if ( args->filter )
+    {
+        if ( args->debug_filter ) filter_stats(args->filter, stderr);
         filter_destroy(args->filter);
+    }
     free(args->ac);
 }
 
@@ -253,13 +268,14 @@ int subset_vcf(args_t *args, bcf1_t *line)
     if ( args->filter )
     {
         int ret = filter_test(args->filter, line, NULL);
+        PROFILE_LAP(PROF_FILTER, args->prof);
         if ( args->filter_logic==FLT_INCLUDE ) { if ( !ret ) return 0; }
         else if ( ret ) return 0;
     }
 
     hts_expand(int, line->n_allele, args->mac, args->ac);
     int i, an = 0, non_ref_ac = 0;
-    if (args->calc_ac) {
+    if (args->calc_ac && (!args->n_samples || args->private_vars)) {   // with -s, needed only to test for private sites
         bcf_calc_ac(args->hdr, line, args->ac, BCF_UN_INFO|BCF_UN_FMT); // get original AC and AN values from INFO field if available, otherwise calculate
         for (i=1; i<line->n_allele; i++)
             non_ref_ac += args->ac[i];
@@ -270,7 +286,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
     if (args->n_samples)
     {
         int non_ref_ac_sub = 0, *ac_sub = (int*) calloc(line->n_allele,sizeof(int));
-        bcf_subset(args->hdr, line, args->n_samples, args->imap);
+        if ( args->subset_in_reader!=2 ) bcf_subset(args->hdr, line, args->n_samples, args->imap);
         if (args->calc_ac) {
             bcf_calc_ac(args->hsub, line, ac_sub, BCF_UN_FMT); // recalculate AC and AN
             an = 0;
@@ -382,6 +398,22 @@ void set_allele_type (int *atype, char *atype_string)
     }                
 }
 
+static void stage_process(pipe_stage_t *stage, bcf1_t **line)
+{
+    args_t *args = (args_t*) stage->data;
+    if ( (*line)->errcode && stage->hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
+    PROFILE_START(args->prof);
+    if ( subset_vcf(args, *line) ) pipe_emit(stage, line);
+}
+
+static void stage_destroy(pipe_stage_t *stage)
+{
+    args_t *args = (args_t*) stage->data;
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+    free(args);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -417,6 +449,7 @@ static void usage(args_t *args)
     fprintf(stderr, "    -u/U, --uncalled/--exclude-uncalled         select/exclude sites without a called genotype\n");
     fprintf(stderr, "    -v/V, --types/--exclude-types <list>        select/exclude comma-separated list of variant types: snps,indels,mnps,other [null]\n");
     fprintf(stderr, "    -x/X, --private/--exclude-private           select/exclude sites where the non-reference alleles are exclusive (private) to the subset samples\n");
+    fprintf(stderr, "          --debug-filter                        print the compiled -i/-e expression to stderr\n");
     fprintf(stderr, "\n");
     filter_expression_info(stderr);
     fprintf(stderr, "\n");
@@ -471,6 +504,7 @@ int main_vcfview(int argc, char *argv[])
         {"max-af",1,0,'Q'},
         {"phased",0,0,'p'},
         {"exclude-phased",0,0,'P'},
+        {"debug-filter",0,0,1},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "l:t:T:r:R:o:O:s:S:Gf:knv:V:m:M:auUhHc:C:Ii:e:xXpPq:Q:g:",loptions,NULL)) >= 0)
@@ -489,6 +523,7 @@ int main_vcfview(int argc, char *argv[])
                 break;
             case 'l': args->clevel = atoi(optarg); args->output_type |= FT_GZ; break;
             case 'o': args->fn_out = optarg; break;
+            case  1 : args->debug_filter = 1; break;
             case 'H': args->print_header = 0; break;
             case 'h': args->header_only = 1; break;
             
@@ -578,6 +613,22 @@ int main_vcfview(int argc, char *argv[])
     if ( args->phased > FLT_EXCLUDE ) error("Only one of -p or -P can be given.\n");
 
     if ( args->sample_names && args->update_info) args->calc_ac = 1;
+
+    pipe_stage_t *stage = pipe_stage_init();
+    if ( stage )
+    {
+        if ( optind<argc || args->regions_list || args->targets_list )
+            error("Input files, regions and targets cannot be given to a pipe stage, use the options of bcftools pipe\n");
+        if ( args->files->apply_filters || args->fn_out || args->header_only || !args->print_header )
+            error("The options -f, -o, -h and -H cannot be used in a pipe stage\n");
+        args->stage = stage;
+        init_data(args);
+        stage->hdr     = args->hnull ? args->hnull : (args->hsub ? args->hsub : args->hdr);
+        stage->data    = args;
+        stage->process = stage_process;
+        stage->destroy = stage_destroy;
+        return 0;
+    }
     
     char *fname = NULL;
     if ( optind>=argc )
@@ -617,12 +668,19 @@ int main_vcfview(int argc, char *argv[])
         bcf_hdr_write(args->out, out_hdr);
     if (!args->header_only) 
     {
+        PROFILE_START(args->prof);
         while ( bcf_sr_next_line(args->files) )
         {
+            PROFILE_LAP(PROF_READ, args->prof);
             bcf1_t *line = args->files->readers[0].buffer[0];
             if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
-            if ( subset_vcf(args, line) )
+            int pass = subset_vcf(args, line);
+            PROFILE_LAP(PROF_SUBSET, args->prof);
+            if ( pass )
+            {
                 bcf_write1(args->out, out_hdr, line);
+                PROFILE_LAP(PROF_WRITE, args->prof);
+            }
         }
     }
     hts_close(args->out);